@@ -0,0 +1,475 @@
+/*
+ * archive
+ *
+ * Sequential reading of archive segments, and the archive writer and
+ * index. Index entries are in order of code digest, then of position.
+ *
+ * Author:
+ *  Jerry Lue
+ */
+#define _FILE_OFFSET_BITS 64
+#define _GNU_SOURCE
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+#include <limits.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <sys/file.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include "archive.h"
+
+/*
+ * Open a segment for reading from its first page.
+ *
+ * Returns:
+ *  0 on success, -1 on error
+ */
+int segment_open(struct segment *seg, const char *path) {
+    seg->path = path;
+    seg->offset = 0;
+    if (!(seg->fp = fopen(path, "rb")))
+        return -1;
+    // Pages are read once, front to back: read ahead, and keep our own
+    // buffer large enough that each read is a few MB
+    posix_fadvise(fileno(seg->fp), 0, 0, POSIX_FADV_SEQUENTIAL);
+    if ((seg->buf = malloc(ARCHIVE_BUFSIZE)))
+        setvbuf(seg->fp, seg->buf, _IOFBF, ARCHIVE_BUFSIZE);
+    return 0;
+}
+
+/*
+ * Read the next page of a segment.
+ *
+ * Params:
+ *  img     Image to fill, reused as in image_read_pgm()
+ *  offset  Set to the byte offset of the page in the segment
+ *
+ * Returns:
+ *  1 if a page was read, 0 at the end of the segment, -1 on error
+ */
+int segment_next(struct segment *seg, struct image *img, long long *offset) {
+    int c = getc(seg->fp);
+
+    if (c == EOF)
+        return ferror(seg->fp) ? -1 : 0;
+    ungetc(c, seg->fp);
+    *offset = seg->offset;
+    if (image_read_pgm(img, seg->fp, seg->path, 0))
+        return -1;
+    seg->offset = ftello(seg->fp);
+    return 1;
+}
+
+void segment_close(struct segment *seg) {
+    if (seg->fp)
+        fclose(seg->fp);
+    free(seg->buf);
+    seg->fp = NULL;
+    seg->buf = NULL;
+}
+
+/*
+ * Lock the index log of an archive, cutting off a partial final entry
+ * left by a crash mid-write.
+ *
+ * Returns:
+ *  Log file descriptor, or -1 on error
+ */
+static int open_log(const char *dir, int flags, off_t *entries) {
+    char path[PATH_MAX];
+    struct stat st;
+    int fd;
+
+    snprintf(path, sizeof(path), "%s/index.log", dir);
+    if ((fd = open(path, flags | O_CLOEXEC, 0644)) < 0)
+        return -1;
+    if (flock(fd, LOCK_EX) || fstat(fd, &st))
+        goto bad;
+    *entries = st.st_size / sizeof(struct archive_entry);
+    if (st.st_size % sizeof(struct archive_entry)) {
+        fprintf(stderr, "archive: discarding %d byte partial index entry\n",
+                (int) (st.st_size % sizeof(struct archive_entry)));
+        if (ftruncate(fd, *entries * sizeof(struct archive_entry)))
+            goto bad;
+    }
+    return fd;
+bad:
+    close(fd);
+    return -1;
+}
+
+/*
+ * Read the number of sealed segments from the sorted index.
+ */
+static uint32_t sealed(const char *dir) {
+    struct archive_header h;
+    char path[PATH_MAX];
+    int fd;
+
+    snprintf(path, sizeof(path), "%s/index", dir);
+    if ((fd = open(path, O_RDONLY | O_CLOEXEC)) < 0)
+        return 0;
+    if (pread(fd, &h, sizeof(h), 0) != sizeof(h) || memcmp(h.magic, ARCHIVE_MAGIC, sizeof(h.magic)))
+        h.segments = 0;
+    close(fd);
+    return h.segments;
+}
+
+static void sync_dir(const char *dir) {
+    int fd = open(dir, O_RDONLY | O_DIRECTORY | O_CLOEXEC);
+
+    if (fd >= 0) {
+        fsync(fd);
+        close(fd);
+    }
+}
+
+/*
+ * Append a code, null-terminated, to the code file of an archive.
+ *
+ * Params:
+ *  at      Set to the offset of the code
+ *
+ * Returns:
+ *  0 on success, -1 on error
+ */
+static int append_code(const char *dir, const char *code, size_t len, uint64_t *at) {
+    char path[PATH_MAX];
+    struct stat st;
+    int fd, err;
+
+    snprintf(path, sizeof(path), "%s/codes", dir);
+    if ((fd = open(path, O_WRONLY | O_CREAT | O_APPEND | O_CLOEXEC, 0644)) < 0)
+        return -1;
+    err = fstat(fd, &st) || write(fd, code, len + 1) != (ssize_t) (len + 1) || fdatasync(fd);
+    close(fd);
+    if (err)
+        return -1;
+    if (!st.st_size)
+        sync_dir(dir);
+    *at = st.st_size;
+    return 0;
+}
+
+/*
+ * Append a page to an archive and log its index entry. The page and its
+ * code are on disk before its entry, so a crash can leave a page without
+ * an entry, which the next append overwrites, but never an entry without
+ * its page.
+ *
+ * Params:
+ *  dir     Archive directory
+ *  code    Tracker code, of any length, or "" if none was read
+ *  page    PGM file bytes
+ *  size    Bytes
+ *
+ * Returns:
+ *  0 on success, -1 on error
+ */
+int archive_append(const char *dir, const char *code, const void *page, size_t size) {
+    struct archive_entry e = { { 0 } };
+    char path[PATH_MAX];
+    off_t n;
+    int log, fd = -1;
+
+    if ((log = open_log(dir, O_RDWR | O_CREAT | O_APPEND, &n)) < 0)
+        return -1;
+    // The newest segment ends after its last logged page; a segment with
+    // no logged page is new since the last close
+    if (n && pread(log, &e, sizeof(e), (n - 1) * sizeof(e)) == sizeof(e)) {
+        e.offset += e.size;
+    } else {
+        e.segment = sealed(dir);
+        e.offset = 0;
+    }
+    if (e.offset && e.offset + size > ARCHIVE_SEGSIZE) {
+        e.segment++;
+        e.offset = 0;
+    }
+    e.size = size;
+    e.reserved = 0;
+    memset(e.digest, 0, sizeof(e.digest));
+    e.code = 0;
+    e.codelen = strlen(code);
+    if (e.codelen) {
+        sha256(code, e.codelen, e.digest);
+        if (append_code(dir, code, e.codelen, &e.code)) {
+            close(log);
+            return -1;
+        }
+    }
+
+    snprintf(path, sizeof(path), "%s/%06u.seg", dir, e.segment);
+    if ((fd = open(path, O_WRONLY | O_CREAT | O_CLOEXEC, 0644)) < 0 ||
+            ftruncate(fd, e.offset) ||
+            pwrite(fd, page, size, e.offset) != (ssize_t) size || fdatasync(fd))
+        goto bad;
+    if (!e.offset)
+        sync_dir(dir);
+    if (write(log, &e, sizeof(e)) != sizeof(e) || fdatasync(log))
+        goto bad;
+    close(fd);
+    close(log);
+    return 0;
+bad:
+    if (fd >= 0)
+        close(fd);
+    close(log);
+    return -1;
+}
+
+static int cmp_entry(const void *a, const void *b) {
+    const struct archive_entry *x = a, *y = b;
+    int c = memcmp(x->digest, y->digest, SHA256_SIZE);
+
+    if (c)
+        return c;
+    if (x->segment != y->segment)
+        return x->segment < y->segment ? -1 : 1;
+    return x->offset < y->offset ? -1 : x->offset > y->offset;
+}
+
+/*
+ * Close an archive: sort the logged entries, merge them into the sorted
+ * index, and seal the newest segment. The new index is written beside the
+ * old one and renamed into place; entries merged twice, after a crash
+ * before the log is emptied, are dropped.
+ *
+ * Params:
+ *  dir     Archive directory
+ *  merged  Set to the number of entries merged
+ *
+ * Returns:
+ *  0 on success, -1 on error
+ */
+int archive_merge(const char *dir, int *merged) {
+    struct archive_header h = { ARCHIVE_MAGIC, ARCHIVE_VERSION, 0, 0 };
+    struct archive_entry *log = NULL;
+    struct archive old = { 0 };
+    char path[PATH_MAX], tmp[PATH_MAX];
+    const struct archive_entry *last = NULL;
+    size_t i = 0, j = 0, k;
+    FILE *fp = NULL;
+    off_t n;
+    int fd, err;
+
+    *merged = 0;
+    if ((fd = open_log(dir, O_RDWR | O_CREAT, &n)) < 0)
+        return -1;
+    if (!n) {
+        close(fd);
+        return 0;
+    }
+    if (!(log = malloc(n * sizeof(*log))) ||
+            pread(fd, log, n * sizeof(*log), 0) != (ssize_t) (n * sizeof(*log)))
+        goto bad;
+    for (k = 0; k < (size_t) n; k++)
+        if (log[k].segment + 1 > h.segments)
+            h.segments = log[k].segment + 1;
+    qsort(log, n, sizeof(*log), cmp_entry);
+
+    snprintf(path, sizeof(path), "%s/index", dir);
+    snprintf(tmp, sizeof(tmp), "%s/index.tmp", dir);
+    if (archive_open(&old, dir)) {
+        if (errno != ENOENT)
+            goto bad;
+    } else if (old.hdr->segments > h.segments) {
+        h.segments = old.hdr->segments;
+    }
+    if (!(fp = fopen(tmp, "wb")) || fwrite(&h, sizeof(h), 1, fp) != 1)
+        goto bad;
+    while (i < (old.hdr ? old.hdr->count : 0) || j < (size_t) n) {
+        const struct archive_entry *e;
+        if (j == (size_t) n || (old.hdr && i < old.hdr->count &&
+                cmp_entry(&old.entries[i], &log[j]) <= 0))
+            e = &old.entries[i++];
+        else
+            e = &log[j++];
+        if (last && !cmp_entry(last, e))
+            continue;
+        if (fwrite(e, sizeof(*e), 1, fp) != 1)
+            goto bad;
+        last = e;
+        h.count++;
+    }
+    err = fseek(fp, 0, SEEK_SET) || fwrite(&h, sizeof(h), 1, fp) != 1 ||
+            fflush(fp) || fsync(fileno(fp));
+    if (fclose(fp) || err || rename(tmp, path))
+        goto bad_closed;
+    sync_dir(dir);
+    if (ftruncate(fd, 0) || fsync(fd))
+        goto bad_closed;
+    *merged = h.count - (old.hdr ? old.hdr->count : 0);
+    archive_close(&old);
+    free(log);
+    close(fd);
+    return 0;
+bad:
+    if (fp)
+        fclose(fp);
+bad_closed:
+    archive_close(&old);
+    free(log);
+    close(fd);
+    return -1;
+}
+
+/*
+ * Map the sorted index of an archive for lookups.
+ *
+ * Returns:
+ *  0 on success, -1 on error
+ */
+int archive_open(struct archive *ar, const char *dir) {
+    const struct archive_header *h;
+    char path[PATH_MAX];
+    struct stat st;
+    void *base;
+    int fd;
+
+    memset(ar, 0, sizeof(*ar));
+    snprintf(path, sizeof(path), "%s/index", dir);
+    if ((fd = open(path, O_RDONLY | O_CLOEXEC)) < 0)
+        return -1;
+    if (fstat(fd, &st) || st.st_size < (off_t) sizeof(*h)) {
+        close(fd);
+        fprintf(stderr, "archive: %s: not an archive index\n", path);
+        errno = EINVAL;
+        return -1;
+    }
+    base = mmap(NULL, st.st_size, PROT_READ, MAP_SHARED, fd, 0);
+    close(fd);
+    if (base == MAP_FAILED)
+        return -1;
+    h = base;
+    if (memcmp(h->magic, ARCHIVE_MAGIC, sizeof(h->magic)) || h->version != ARCHIVE_VERSION ||
+            h->count != (st.st_size - sizeof(*h)) / sizeof(struct archive_entry) ||
+            (st.st_size - sizeof(*h)) % sizeof(struct archive_entry)) {
+        fprintf(stderr, "archive: %s: not an archive index, or damaged\n", path);
+        munmap(base, st.st_size);
+        errno = EINVAL;
+        return -1;
+    }
+    ar->dir = dir;
+    ar->base = base;
+    ar->size = st.st_size;
+    ar->hdr = h;
+    ar->entries = (const struct archive_entry *) (h + 1);
+
+    // No code file if no code has been read yet
+    snprintf(path, sizeof(path), "%s/codes", dir);
+    if ((fd = open(path, O_RDONLY | O_CLOEXEC)) < 0) {
+        if (errno == ENOENT)
+            return 0;
+        archive_close(ar);
+        return -1;
+    }
+    if (fstat(fd, &st)) {
+        close(fd);
+        archive_close(ar);
+        return -1;
+    }
+    if (st.st_size) {
+        base = mmap(NULL, st.st_size, PROT_READ, MAP_SHARED, fd, 0);
+        if (base == MAP_FAILED) {
+            close(fd);
+            archive_close(ar);
+            return -1;
+        }
+        ar->codes = base;
+        ar->codesize = st.st_size;
+    }
+    close(fd);
+    return 0;
+}
+
+void archive_close(struct archive *ar) {
+    if (ar->base)
+        munmap((void *) ar->base, ar->size);
+    if (ar->codes)
+        munmap((void *) ar->codes, ar->codesize);
+    ar->base = NULL;
+    ar->hdr = NULL;
+    ar->codes = NULL;
+}
+
+/*
+ * Get the code of an index entry.
+ *
+ * Returns:
+ *  The code, "" if none was read, or NULL if the code file is damaged
+ */
+const char *archive_code(const struct archive *ar, const struct archive_entry *e) {
+    if (!e->codelen)
+        return "";
+    if (e->code >= ar->codesize || ar->codesize - e->code <= e->codelen ||
+            ar->codes[e->code + e->codelen])
+        return NULL;
+    return ar->codes + e->code;
+}
+
+/*
+ * Find the pages with a code. A code is normally on one page, but a
+ * ballot fed twice is archived twice.
+ *
+ * Params:
+ *  ar      Archive
+ *  code    Tracker code
+ *  n       Set to the number of pages found
+ *
+ * Returns:
+ *  First of n consecutive entries, or NULL if none
+ */
+const struct archive_entry *archive_find(const struct archive *ar, const char *code, size_t *n) {
+    unsigned char digest[SHA256_SIZE];
+    size_t lo = 0, hi = ar->hdr->count, end;
+
+    *n = 0;
+    if (!*code)
+        return NULL;
+    sha256(code, strlen(code), digest);
+    while (lo < hi) {
+        size_t mid = lo + (hi - lo) / 2;
+        if (memcmp(ar->entries[mid].digest, digest, SHA256_SIZE) < 0)
+            lo = mid + 1;
+        else
+            hi = mid;
+    }
+    for (end = lo; end < ar->hdr->count && !memcmp(ar->entries[end].digest, digest, SHA256_SIZE); end++) {
+        const char *stored = archive_code(ar, &ar->entries[end]);
+        if (!stored || strcmp(stored, code)) {
+            fprintf(stderr, "archive: %06u.seg:%llu: stored code does not match its digest\n",
+                    ar->entries[end].segment, (unsigned long long) ar->entries[end].offset);
+            break;
+        }
+    }
+    *n = end - lo;
+    return *n ? &ar->entries[lo] : NULL;
+}
+
+/*
+ * Read the bytes of an archived page, e->size of them, with one read.
+ *
+ * Returns:
+ *  0 on success, -1 on error
+ */
+int archive_read(const struct archive *ar, const struct archive_entry *e, void *buf) {
+    char path[PATH_MAX];
+    ssize_t got;
+    int fd;
+
+    snprintf(path, sizeof(path), "%s/%06u.seg", ar->dir, e->segment);
+    if ((fd = open(path, O_RDONLY | O_CLOEXEC)) < 0)
+        return -1;
+    got = pread(fd, buf, e->size, e->offset);
+    close(fd);
+    if (got != (ssize_t) e->size) {
+        if (got >= 0)
+            errno = EIO;
+        return -1;
+    }
+    return 0;
+}
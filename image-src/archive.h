@@ -0,0 +1,87 @@
+#ifndef ARCHIVE_H
+#define ARCHIVE_H
+
+/*
+ * archive
+ *
+ * Archived page images. A segment is a file of binary PGM pages stored
+ * back to back, as `cat` of the scanned pages or `scanimage --batch`
+ * output concatenated gives; a page is addressed by its segment and the
+ * byte offset of its header. Segments are read sequentially through a
+ * large buffer, with the kernel told to read ahead, so one reader keeps up
+ * with the disk.
+ *
+ * An archive is a directory of numbered segments (000000.seg, ...) with an
+ * index from tracker code to segment and offset, for pulling single
+ * ballots. Pages are appended to the newest segment, and each append adds
+ * an entry to an unsorted log (index.log) after the page is on disk.
+ * Closing the archive sorts the log and merges it into the sorted index
+ * (index), which is mapped for lookups: a lookup is a binary search of the
+ * mapped index, whose upper levels stay in the page cache, and reading the
+ * page is one read of its bytes. Closing also seals the newest segment;
+ * the next append starts a new one.
+ *
+ * Entries are fixed-size however long the code: an entry holds the
+ * SHA-256 of its code, by which the index is sorted, and the offset of
+ * the code itself in a file of null-terminated codes (codes), appended to
+ * before the entry is logged. A lookup checks the stored code as well as
+ * the digest.
+ */
+#include <stdio.h>
+#include <stdint.h>
+#include <stddef.h>
+#include "image.h"
+#include "sha256.h"
+
+#define ARCHIVE_BUFSIZE (4 << 20)
+#define ARCHIVE_SEGSIZE (1LL << 30)     // pages are appended to a segment up to this size
+#define ARCHIVE_MAGIC "VBARCIDX"
+#define ARCHIVE_VERSION 2
+
+struct archive_header {
+    char magic[8];
+    uint32_t version;
+    uint32_t segments;                  // sealed segments
+    uint64_t count;                     // entries following the header
+};
+
+struct archive_entry {
+    unsigned char digest[SHA256_SIZE];  // SHA-256 of the code, zero if no code was read
+    uint64_t code;                      // offset of the code in the code file
+    uint32_t codelen;                   // 0 if no code was read
+    uint32_t segment;
+    uint64_t offset;
+    uint32_t size;                      // page bytes
+    uint32_t reserved;
+};
+
+struct archive {
+    const char *dir;
+    const unsigned char *base;
+    size_t size;
+    const struct archive_header *hdr;
+    const struct archive_entry *entries;
+    const char *codes;                  // mapped code file
+    size_t codesize;
+};
+
+struct segment {
+    FILE *fp;
+    const char *path;
+    long long offset;       // offset of the next page
+    char *buf;
+};
+
+int segment_open(struct segment *seg, const char *path);
+int segment_next(struct segment *seg, struct image *img, long long *offset);
+void segment_close(struct segment *seg);
+
+int archive_append(const char *dir, const char *code, const void *page, size_t size);
+int archive_merge(const char *dir, int *merged);
+int archive_open(struct archive *ar, const char *dir);
+void archive_close(struct archive *ar);
+const struct archive_entry *archive_find(const struct archive *ar, const char *code, size_t *n);
+int archive_read(const struct archive *ar, const struct archive_entry *e, void *buf);
+const char *archive_code(const struct archive *ar, const struct archive_entry *e);
+
+#endif
@@ -0,0 +1,347 @@
+/*
+ * image
+ *
+ * Page image storage, PGM input and output, and the whole-image kernels:
+ * 2x downsampling, global threshold selection and binarization. The
+ * per-pixel loops use GCC vector extensions, which compile to NEON on the
+ * Pi and SSE2 on x86 without separate code paths.
+ *
+ * Author:
+ *  Jerry Lue
+ */
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <ctype.h>
+#include <time.h>
+#include "image.h"
+
+#define THRESHOLD_SAMPLES 262144
+
+/*
+ * Allocate an image, initialized to white.
+ *
+ * Returns:
+ *  0 on success, -1 on error
+ */
+int image_alloc(struct image *img, int width, int height) {
+    img->width = width;
+    img->height = height;
+    img->stride = (width + IMAGE_ALIGN - 1) / IMAGE_ALIGN * IMAGE_ALIGN;
+    if (width <= 0 || height <= 0 ||
+            posix_memalign((void **) &img->px, IMAGE_ALIGN, (size_t) img->stride * height)) {
+        img->px = NULL;
+        return -1;
+    }
+    memset(img->px, 255, (size_t) img->stride * height);
+    return 0;
+}
+
+void image_free(struct image *img) {
+    free(img->px);
+    img->px = NULL;
+}
+
+/*
+ * Read one header field of a PGM file, skipping whitespace and comments.
+ *
+ * Returns:
+ *  Field value, or -1 on error
+ */
+static int pgm_field(FILE *fp) {
+    int c, n = 0, digits = 0;
+
+    while ((c = getc(fp)) != EOF && (isspace(c) || c == '#'))
+        if (c == '#')
+            while ((c = getc(fp)) != EOF && c != '\n')
+                ;
+    while (c != EOF && isdigit(c)) {
+        if (n > 100000)
+            return -1;
+        n = n * 10 + c - '0';
+        digits++;
+        c = getc(fp);
+    }
+    // A single whitespace character separates the header from the pixels
+    return digits && (c == EOF || isspace(c)) ? n : -1;
+}
+
+/*
+ * Read a binary (P5) PGM image from a stream, stopping after the given
+ * number of rows. Images stored back to back, as in archive segments, are
+ * read one after another.
+ *
+ * Params:
+ *  img     Image to fill. Its pixels are reused if img->px holds an image
+ *          of the same size, and (re)allocated if not; NULL for a new one
+ *  fp      Stream positioned at the image
+ *  name    Name of the stream, for messages
+ *  rows    Number of rows to read, or 0 for all
+ *
+ * Returns:
+ *  0 on success, -1 on error
+ */
+int image_read_pgm(struct image *img, FILE *fp, const char *name, int rows) {
+    int width, height, maxval, y;
+
+    if (getc(fp) != 'P' || getc(fp) != '5' ||
+            (width = pgm_field(fp)) <= 0 || (height = pgm_field(fp)) <= 0 ||
+            (maxval = pgm_field(fp)) <= 0 || maxval > 255) {
+        fprintf(stderr, "image: %s: not an 8-bit binary PGM\n", name);
+        return -1;
+    }
+    if (rows > 0 && rows < height)
+        height = rows;
+    if (img->px && (img->width != width || img->height != height))
+        image_free(img);
+    if (!img->px && image_alloc(img, width, height))
+        return -1;
+    for (y = 0; y < height; y++)
+        if (fread(img->px + (size_t) y * img->stride, 1, width, fp) != (size_t) width) {
+            fprintf(stderr, "image: %s: truncated\n", name);
+            image_free(img);
+            return -1;
+        }
+    // Stretch to full range so thresholds do not depend on maxval
+    if (maxval < 255)
+        for (y = 0; y < height; y++) {
+            unsigned char *row = img->px + (size_t) y * img->stride;
+            int x;
+            for (x = 0; x < width; x++)
+                row[x] = row[x] * 255 / maxval;
+        }
+    return 0;
+}
+
+/*
+ * Load the first rows of a binary (P5) PGM image. Reading stops after
+ * them, so a page can be checked while the scanner is still sending it.
+ *
+ * Params:
+ *  img     Image to allocate and fill, no taller than rows
+ *  path    File path, or "-" for standard input
+ *  rows    Number of rows to read, or 0 for all
+ *
+ * Returns:
+ *  0 on success, -1 on error
+ */
+int image_load_band(struct image *img, const char *path, int rows) {
+    FILE *fp = strcmp(path, "-") ? fopen(path, "rb") : stdin;
+    int err;
+
+    if (!fp)
+        return -1;
+    img->px = NULL;
+    err = image_read_pgm(img, fp, path, rows);
+    if (fp != stdin)
+        fclose(fp);
+    return err;
+}
+
+/*
+ * Load a binary (P5) PGM image.
+ *
+ * Params:
+ *  img     Image to allocate and fill
+ *  path    File path, or "-" for standard input
+ *
+ * Returns:
+ *  0 on success, -1 on error
+ */
+int image_load_pgm(struct image *img, const char *path) {
+    return image_load_band(img, path, 0);
+}
+
+/*
+ * Save an image as binary PGM, e.g. for inspecting intermediate images.
+ *
+ * Returns:
+ *  0 on success, -1 on error
+ */
+int image_save_pgm(const struct image *img, const char *path) {
+    FILE *fp = fopen(path, "wb");
+    int y;
+
+    if (!fp)
+        return -1;
+    fprintf(fp, "P5\n%d %d\n255\n", img->width, img->height);
+    for (y = 0; y < img->height; y++)
+        fwrite(img->px + (size_t) y * img->stride, 1, img->width, fp);
+    return fclose(fp) ? -1 : 0;
+}
+
+/*
+ * Halve an image in both directions, averaging each 2x2 block. Sixteen
+ * source bytes of two rows are summed pairwise in 16-bit lanes, giving
+ * eight output pixels per step.
+ *
+ * Params:
+ *  src     Source image
+ *  dst     Image to allocate for the result
+ */
+void image_downsample(const struct image *src, struct image *dst) {
+    const u16x8 lo = { 255, 255, 255, 255, 255, 255, 255, 255 };
+    int x, y;
+
+    if (image_alloc(dst, src->width / 2 > 0 ? src->width / 2 : 1,
+                src->height / 2 > 0 ? src->height / 2 : 1))
+        return;
+    for (y = 0; y < dst->height; y++) {
+        const unsigned char *r0 = src->px + (size_t) 2 * y * src->stride;
+        const unsigned char *r1 = 2 * y + 1 < src->height ? r0 + src->stride : r0;
+        unsigned char *out = dst->px + (size_t) y * dst->stride;
+        // Source rows are at least twice as long as destination rows, and
+        // both are padded to IMAGE_ALIGN, so whole vectors are always in bounds
+        for (x = 0; x < dst->width; x += 8) {
+            u16x8 a, b, sum;
+            memcpy(&a, r0 + 2 * x, 16);
+            memcpy(&b, r1 + 2 * x, 16);
+            sum = (a & lo) + (a >> 8) + (b & lo) + (b >> 8) + 2;
+            sum >>= 2;
+            unsigned char v[8] __attribute__((aligned(8)));
+            int i;
+            for (i = 0; i < 8; i++)
+                v[i] = sum[i];
+            memcpy(out + x, v, 8);
+        }
+    }
+}
+
+/*
+ * Choose a global black/white threshold by Otsu's method, maximizing the
+ * variance between the two classes. The histogram is taken from evenly
+ * spaced rows, about THRESHOLD_SAMPLES pixels in all, which is plenty for
+ * a page of paper and ink.
+ *
+ * Returns:
+ *  Threshold; pixels below it are ink
+ */
+int image_threshold(const struct image *img) {
+    unsigned long hist[256] = { 0 };
+    double total = 0, sum = 0, sumb = 0, wb = 0, best = -1;
+    int x, y, i, thr = 128;
+    int step = (int) ((long long) img->width * img->height / THRESHOLD_SAMPLES) + 1;
+
+    for (y = 0; y < img->height; y += step) {
+        const unsigned char *row = img->px + (size_t) y * img->stride;
+        for (x = 0; x < img->width; x++)
+            hist[row[x]]++;
+    }
+    for (i = 0; i < 256; i++) {
+        total += hist[i];
+        sum += (double) i * hist[i];
+    }
+    for (i = 0; i < 256; i++) {
+        double wf, mb, mf, between;
+        wb += hist[i];
+        if (!wb)
+            continue;
+        wf = total - wb;
+        if (!wf)
+            break;
+        sumb += (double) i * hist[i];
+        mb = sumb / wb;
+        mf = (sum - sumb) / wf;
+        between = wb * wf * (mb - mf) * (mb - mf);
+        if (between > best) {
+            best = between;
+            thr = i + 1;
+        }
+    }
+    return thr;
+}
+
+/*
+ * Binarize an image: 0 (ink) where the source is below the threshold, 255
+ * elsewhere.
+ *
+ * Params:
+ *  src     Source image
+ *  dst     Image to allocate for the result
+ *  thr     Threshold from image_threshold()
+ */
+void image_binarize(const struct image *src, struct image *dst, int thr) {
+    u8x16 t;
+    int x, y;
+
+    if (image_alloc(dst, src->width, src->height))
+        return;
+    memset(&t, thr, sizeof(t));
+    for (y = 0; y < src->height; y++) {
+        const unsigned char *in = src->px + (size_t) y * src->stride;
+        unsigned char *out = dst->px + (size_t) y * dst->stride;
+        for (x = 0; x < src->width; x += 16) {
+            u8x16 v;
+            memcpy(&v, in + x, 16);
+            v = (u8x16) (v >= t);
+            memcpy(out + x, &v, 16);
+        }
+        // Padding is white in the source, so it stays white
+    }
+}
+
+/*
+ * Halve an image until it is no wider than maxwidth, keeping only the
+ * last level of the pyramid.
+ *
+ * Params:
+ *  src         Source image
+ *  maxwidth    Largest width of the result
+ *  dst         Image to allocate for the result (a copy if src is narrow);
+ *              dst->px is NULL on error
+ */
+void image_pyramid(const struct image *src, int maxwidth, struct image *dst) {
+    struct image level = *src, next;
+
+    if (src->width <= maxwidth) {
+        if (!image_alloc(dst, src->width, src->height))
+            memcpy(dst->px, src->px, (size_t) src->stride * src->height);
+        return;
+    }
+    while (level.width > maxwidth) {
+        image_downsample(&level, &next);
+        if (level.px != src->px)
+            image_free(&level);
+        if (!next.px) {
+            dst->px = NULL;
+            return;
+        }
+        level = next;
+    }
+    *dst = level;
+}
+
+/*
+ * Compute the integral image (summed area table): entry (x, y) of the
+ * (width + 1) x (height + 1) table is the sum of all pixels above and to
+ * the left of pixel (x, y), so the sum over any rectangle takes four
+ * lookups.
+ *
+ * Returns:
+ *  Newly allocated table, or NULL on error
+ */
+unsigned int *image_integral(const struct image *img) {
+    int w = img->width + 1, x, y;
+    unsigned int *sum = calloc((size_t) w * (img->height + 1), sizeof(*sum));
+
+    if (!sum)
+        return NULL;
+    for (y = 0; y < img->height; y++) {
+        const unsigned char *row = img->px + (size_t) y * img->stride;
+        unsigned int *above = sum + (size_t) y * w, *out = above + w, run = 0;
+        for (x = 0; x < img->width; x++) {
+            run += row[x];
+            out[x + 1] = above[x + 1] + run;
+        }
+    }
+    return sum;
+}
+
+/*
+ * Get current monotonic time in nanoseconds, for timing page stages.
+ */
+long long image_clock(void) {
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return ts.tv_sec * 1000000000LL + ts.tv_nsec;
+}
@@ -0,0 +1,39 @@
+#ifndef IMAGE_H
+#define IMAGE_H
+
+/*
+ * image
+ *
+ * 8-bit grayscale page images as scanned by the DS-510 (scanimage
+ * --format=pnm), and the whole-image kernels shared by the page programs.
+ * Rows are padded to a multiple of IMAGE_ALIGN bytes so the kernels can
+ * work a vector at a time without tail loops; padding is kept white.
+ */
+
+#include <stdio.h>
+
+#define IMAGE_ALIGN 32
+
+typedef unsigned char u8x16 __attribute__((vector_size(16)));
+typedef unsigned short u16x8 __attribute__((vector_size(16)));
+
+struct image {
+    int width, height;
+    int stride;             // bytes per row, multiple of IMAGE_ALIGN
+    unsigned char *px;      // 0 black to 255 white
+};
+
+int image_alloc(struct image *img, int width, int height);
+void image_free(struct image *img);
+int image_read_pgm(struct image *img, FILE *fp, const char *name, int rows);
+int image_load_pgm(struct image *img, const char *path);
+int image_load_band(struct image *img, const char *path, int rows);
+int image_save_pgm(const struct image *img, const char *path);
+void image_downsample(const struct image *src, struct image *dst);
+int image_threshold(const struct image *img);
+void image_binarize(const struct image *src, struct image *dst, int thr);
+void image_pyramid(const struct image *src, int maxwidth, struct image *dst);
+unsigned int *image_integral(const struct image *img);
+long long image_clock(void);
+
+#endif
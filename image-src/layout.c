@@ -0,0 +1,205 @@
+/*
+ * layout
+ *
+ * Compiled layout access. Opening a layout maps the file and checks only
+ * the header and the bounds of the tables, which takes constant time; the
+ * checksum of the rest of the file is left to layout_verify(), for when
+ * the layout is installed rather than every start. Offsets read from the
+ * file are checked against its size before they are followed.
+ *
+ * Author:
+ *  Jerry Lue
+ */
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include "layout.h"
+
+uint32_t layout_crc32(const void *data, size_t len) {
+    const unsigned char *p = data;
+    uint32_t crc = 0xffffffff;
+    int k;
+
+    while (len--) {
+        crc ^= *p++;
+        for (k = 0; k < 8; k++)
+            crc = (crc >> 1) ^ (0xedb88320 & -(crc & 1));
+    }
+    return ~crc;
+}
+
+/*
+ * Check that a table lies within the file.
+ */
+static int table_ok(size_t size, uint32_t off, uint32_t n, size_t elem) {
+    return off % 8 == 0 && off <= size && n <= (size - off) / elem;
+}
+
+/*
+ * Map a compiled layout.
+ *
+ * Params:
+ *  lay     Layout to fill
+ *  path    Layout file
+ *
+ * Returns:
+ *  0 on success, -1 on error
+ */
+int layout_open(struct layout *lay, const char *path) {
+    const struct layout_header *h;
+    struct stat st;
+    void *base;
+    int fd = open(path, O_RDONLY | O_CLOEXEC);
+
+    if (fd < 0)
+        return -1;
+    if (fstat(fd, &st) || st.st_size < (off_t) sizeof(*h)) {
+        close(fd);
+        fprintf(stderr, "layout: %s: not a layout file\n", path);
+        errno = EINVAL;
+        return -1;
+    }
+    base = mmap(NULL, st.st_size, PROT_READ, MAP_SHARED, fd, 0);
+    close(fd);
+    if (base == MAP_FAILED)
+        return -1;
+    h = base;
+    if (memcmp(h->magic, LAYOUT_MAGIC, sizeof(h->magic)) ||
+            h->crc != layout_crc32(h, offsetof(struct layout_header, crc))) {
+        fprintf(stderr, "layout: %s: not a layout file\n", path);
+        goto bad;
+    }
+    if (h->version != LAYOUT_VERSION) {
+        fprintf(stderr, "layout: %s: version %u, expected %d\n", path, h->version, LAYOUT_VERSION);
+        goto bad;
+    }
+    if (h->size != (uint64_t) st.st_size ||
+            !table_ok(st.st_size, h->styles, h->nstyles, sizeof(struct layout_style)) ||
+            !table_ok(st.st_size, h->bubbles, h->nbubbles, sizeof(struct layout_bubble)) ||
+            !table_ok(st.st_size, h->rois, h->nrois, sizeof(struct layout_roi)) ||
+            !table_ok(st.st_size, h->masks, h->masksize, 1)) {
+        fprintf(stderr, "layout: %s: truncated or damaged\n", path);
+        goto bad;
+    }
+    lay->base = base;
+    lay->size = st.st_size;
+    lay->hdr = h;
+    return 0;
+bad:
+    munmap(base, st.st_size);
+    errno = EINVAL;
+    return -1;
+}
+
+void layout_close(struct layout *lay) {
+    if (lay->base)
+        munmap((void *) lay->base, lay->size);
+    lay->base = NULL;
+}
+
+/*
+ * Check the checksum of the whole layout.
+ *
+ * Returns:
+ *  0 if intact, -1 if not
+ */
+int layout_verify(const struct layout *lay) {
+    return lay->hdr->body_crc == layout_crc32(lay->base + sizeof(*lay->hdr),
+            lay->size - sizeof(*lay->hdr)) ? 0 : -1;
+}
+
+static int cmp_style(const void *key, const void *elem) {
+    return strncmp(key, ((const struct layout_style *) elem)->name, LAYOUT_NAME);
+}
+
+/*
+ * Find a style by name.
+ *
+ * Returns:
+ *  Style, or NULL if there is none by that name or its tables are out of
+ *  bounds
+ */
+const struct layout_style *layout_style(const struct layout *lay, const char *name) {
+    const struct layout_header *h = lay->hdr;
+    const struct layout_style *st = bsearch(name, lay->base + h->styles, h->nstyles,
+            sizeof(*st), cmp_style);
+
+    if (!st || st->bubble > h->nbubbles || st->nbubbles > h->nbubbles - st->bubble ||
+            st->roi > h->nrois || st->nrois > h->nrois - st->roi)
+        return NULL;
+    return st;
+}
+
+/*
+ * Get the bubbles of a style, st->nbubbles of them.
+ */
+const struct layout_bubble *layout_bubbles(const struct layout *lay, const struct layout_style *st) {
+    return (const struct layout_bubble *) (lay->base + lay->hdr->bubbles) + st->bubble;
+}
+
+/*
+ * Get the regions of a style, st->nrois of them.
+ */
+const struct layout_roi *layout_rois(const struct layout *lay, const struct layout_style *st) {
+    return (const struct layout_roi *) (lay->base + lay->hdr->rois) + st->roi;
+}
+
+/*
+ * Count the ink pixels under a bubble's mask. Rows are compared sixteen
+ * pixels at a time where the bubble lies within the page.
+ *
+ * Params:
+ *  lay     Layout
+ *  b       Bubble
+ *  page    Page image
+ *  thr     Threshold; pixels below it are ink
+ *  dx, dy  Offset of the page from the layout, pixels
+ *
+ * Returns:
+ *  Ink pixels (out of b->area), or -1 if the bubble is out of bounds
+ */
+int layout_ink(const struct layout *lay, const struct layout_bubble *b, const struct image *page,
+        int thr, int dx, int dy) {
+    const struct layout_header *h = lay->hdr;
+    const unsigned char *mask = lay->base + b->mask;
+    int x0 = (int) b->x + dx, r, i, k, n = 0;
+    u8x16 t;
+
+    if (b->w > LAYOUT_MAXSIZE || b->h > LAYOUT_MAXSIZE ||
+            b->mask < h->masks || (uint64_t) b->w * b->h > h->masksize ||
+            b->mask - h->masks > h->masksize - (uint64_t) b->w * b->h)
+        return -1;
+    memset(&t, thr, sizeof(t));
+    for (r = 0; r < (int) b->h; r++, mask += b->w) {
+        int y = (int) b->y + dy + r;
+        const unsigned char *row;
+        u8x16 cnt = { 0 };
+        if (y < 0 || y >= page->height)
+            continue;
+        row = page->px + (size_t) y * page->stride;
+        if (x0 < 0 || x0 + (int) b->w > page->width) {
+            for (i = 0; i < (int) b->w; i++)
+                if (x0 + i >= 0 && x0 + i < page->width)
+                    n += mask[i] && row[x0 + i] < thr;
+            continue;
+        }
+        // Bubbles are at most LAYOUT_MAXSIZE wide, so byte lanes cannot
+        // overflow within a row
+        for (i = 0; i + 16 <= (int) b->w; i += 16) {
+            u8x16 v, m;
+            memcpy(&v, row + x0 + i, 16);
+            memcpy(&m, mask + i, 16);
+            cnt += (u8x16) (v < t) & m & 1;
+        }
+        for (k = 0; k < 16; k++)
+            n += cnt[k];
+        for (; i < (int) b->w; i++)
+            n += mask[i] && row[x0 + i] < thr;
+    }
+    return n;
+}
@@ -0,0 +1,81 @@
+#ifndef LAYOUT_H
+#define LAYOUT_H
+
+/*
+ * layout
+ *
+ * Compiled ballot layouts: for each style, the bubbles (with a sampling
+ * mask of the pixels to read inside each) and named regions of interest
+ * such as the tracker code, in page pixels. Layouts are compiled offline
+ * by layoutc into a single file that the page programs map and use in
+ * place, so opening a layout costs the same however large the election.
+ *
+ * The file is position independent: tables refer to each other by byte
+ * offsets from the start of the file, never by pointers. All fields are
+ * little-endian, as on the Pi and x86. Sections start on 8-byte bounds.
+ *
+ *  layout_header       at offset 0
+ *  layout_style[]      sorted by name
+ *  layout_bubble[]     each style's bubbles contiguous
+ *  layout_roi[]        each style's regions contiguous
+ *  masks               w x h bytes per bubble, 255 where sampled
+ */
+#include <stdint.h>
+#include <stddef.h>
+#include "image.h"
+
+#define LAYOUT_MAGIC "VBLAYOUT"
+#define LAYOUT_VERSION 1
+#define LAYOUT_NAME 32
+#define LAYOUT_ROINAME 16
+#define LAYOUT_MAXSIZE 1024        // largest bubble side, pixels
+
+struct layout_header {
+    char magic[8];
+    uint32_t version;
+    uint32_t size;                  // file size
+    char election[LAYOUT_NAME];
+    uint32_t nstyles, styles;       // count and offset of each table
+    uint32_t nbubbles, bubbles;
+    uint32_t nrois, rois;
+    uint32_t masksize, masks;
+    uint32_t body_crc;              // CRC-32 of the file after the header
+    uint32_t crc;                   // CRC-32 of the header fields above
+};
+
+struct layout_style {
+    char name[LAYOUT_NAME];
+    uint32_t width, height;         // page size the layout was drawn for
+    uint32_t bubble, nbubbles;      // first bubble index and count
+    uint32_t roi, nrois;            // first region index and count
+};
+
+struct layout_bubble {
+    uint16_t contest, option;
+    uint32_t x, y, w, h;
+    uint32_t mask;                  // offset of w x h mask
+    uint32_t area;                  // sampled pixels in mask
+};
+
+struct layout_roi {
+    char name[LAYOUT_ROINAME];
+    uint32_t x, y, w, h;
+};
+
+struct layout {
+    const unsigned char *base;
+    size_t size;
+    const struct layout_header *hdr;
+};
+
+int layout_open(struct layout *lay, const char *path);
+void layout_close(struct layout *lay);
+int layout_verify(const struct layout *lay);
+const struct layout_style *layout_style(const struct layout *lay, const char *name);
+const struct layout_bubble *layout_bubbles(const struct layout *lay, const struct layout_style *st);
+const struct layout_roi *layout_rois(const struct layout *lay, const struct layout_style *st);
+int layout_ink(const struct layout *lay, const struct layout_bubble *b, const struct image *page,
+        int thr, int dx, int dy);
+uint32_t layout_crc32(const void *data, size_t len);
+
+#endif
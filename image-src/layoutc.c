@@ -0,0 +1,368 @@
+/*
+ * Usage:
+ *  layoutc [-v] -o election.lay election.layout
+ *  layoutc -d election.lay
+ *
+ * Examples:
+ *  Compile the layouts of an election
+ *      ./image-src/layoutc -o election.lay election.layout
+ *  Check a compiled layout and list its styles
+ *      ./image-src/layoutc -d election.lay
+ *
+ * Description:
+ *  Compiles ballot layout definitions into the binary layout file that the
+ *  page programs map at run time (see layout.h), so that no definitions
+ *  are parsed on the box. The definition file has one item per line, with
+ *  '#' starting a comment; coordinates are in pixels of the scanned page:
+ *
+ *   election NAME                      name of the election
+ *   style NAME WIDTH HEIGHT            start a ballot style
+ *   bubble CONTEST OPTION X Y W H [oval|box]
+ *                                      a bubble of the current style
+ *   roi NAME X Y W H                   a named region of the current style,
+ *                                      e.g. code for the tracker code
+ *
+ *  Each bubble gets a sampling mask covering its inside, inset from the
+ *  printed outline; bubbles of the same size and shape share a mask. The
+ *  file is written beside the output and renamed into place, so a running
+ *  program never maps a half-written layout.
+ *
+ *  With -d, a compiled layout is opened as at run time, its checksum is
+ *  verified, and its styles are listed with the time taken to open it.
+ *
+ * Author:
+ *  Jerry Lue
+ */
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <limits.h>
+#include <unistd.h>
+#include "layout.h"
+
+#define LINE 256
+#define INSET 0.2           // part of the bubble left out of the mask on each side
+
+struct defbubble {
+    int contest, option, x, y, w, h, oval;
+    int mask;               // index of shared mask
+};
+
+struct defstyle {
+    char name[LAYOUT_NAME];
+    int width, height;
+    int bubble, nbubbles, roi, nrois;
+};
+
+struct defmask {
+    int w, h, oval;
+    uint32_t off, area;
+};
+
+static struct defstyle *styles;
+static struct defbubble *bubbles;
+static struct layout_roi *rois;
+static struct defmask *masks;
+static int nstyles, nbubbles, nrois, nmasks;
+static char election[LAYOUT_NAME];
+
+/*
+ * Grow an array by one element.
+ *
+ * Returns:
+ *  Pointer to the new element, zeroed
+ */
+static void *push(void *arrayp, int *n, size_t elem) {
+    void **array = arrayp;
+    char *grown;
+
+    if (!(*n & (*n - 1))) {
+        if (!(grown = realloc(*array, (size_t) (*n ? 2 * *n : 1) * elem))) {
+            perror("layoutc");
+            exit(1);
+        }
+        *array = grown;
+    }
+    grown = (char *) *array + (size_t) (*n)++ * elem;
+    memset(grown, 0, elem);
+    return grown;
+}
+
+/*
+ * Read a definition file.
+ *
+ * Returns:
+ *  0 on success, -1 on error
+ */
+static int parse(const char *path) {
+    FILE *fp = fopen(path, "r");
+    char line[LINE], word[LINE], name[LINE], shape[LINE];
+    int lineno = 0, n;
+
+    if (!fp) {
+        perror(path);
+        return -1;
+    }
+    while (fgets(line, sizeof(line), fp)) {
+        struct defstyle *st = nstyles ? &styles[nstyles - 1] : NULL;
+        lineno++;
+        line[strcspn(line, "#\n")] = '\0';
+        if (sscanf(line, "%s", word) != 1)
+            continue;
+        if (!strcmp(word, "election")) {
+            if (sscanf(line, "%*s %s", name) != 1 || strlen(name) >= LAYOUT_NAME)
+                goto bad;
+            strcpy(election, name);
+        } else if (!strcmp(word, "style")) {
+            st = push(&styles, &nstyles, sizeof(*st));
+            if (sscanf(line, "%*s %s %d %d", name, &st->width, &st->height) != 3 ||
+                    strlen(name) >= LAYOUT_NAME || st->width <= 0 || st->height <= 0)
+                goto bad;
+            strcpy(st->name, name);
+            st->bubble = nbubbles;
+            st->roi = nrois;
+        } else if (!strcmp(word, "bubble") && st) {
+            struct defbubble *b = push(&bubbles, &nbubbles, sizeof(*b));
+            n = sscanf(line, "%*s %d %d %d %d %d %d %s", &b->contest, &b->option,
+                    &b->x, &b->y, &b->w, &b->h, shape);
+            if (n < 6 || (n == 7 && strcmp(shape, "oval") && strcmp(shape, "box")) ||
+                    b->contest < 0 || b->contest > 65535 || b->option < 0 || b->option > 65535 ||
+                    b->w <= 0 || b->h <= 0 || b->w > LAYOUT_MAXSIZE || b->h > LAYOUT_MAXSIZE ||
+                    b->x < 0 || b->y < 0 || b->x + b->w > st->width || b->y + b->h > st->height)
+                goto bad;
+            b->oval = n < 7 || !strcmp(shape, "oval");
+            st->nbubbles++;
+        } else if (!strcmp(word, "roi") && st) {
+            struct layout_roi *r = push(&rois, &nrois, sizeof(*r));
+            int x, y, w, h;
+            if (sscanf(line, "%*s %s %d %d %d %d", name, &x, &y, &w, &h) != 5 ||
+                    strlen(name) >= LAYOUT_ROINAME || x < 0 || y < 0 || w <= 0 || h <= 0 ||
+                    x + w > st->width || y + h > st->height)
+                goto bad;
+            strcpy(r->name, name);
+            r->x = x;
+            r->y = y;
+            r->w = w;
+            r->h = h;
+            st->nrois++;
+        } else {
+            goto bad;
+        }
+    }
+    fclose(fp);
+    return 0;
+bad:
+    fprintf(stderr, "%s:%d: bad definition\n", path, lineno);
+    fclose(fp);
+    return -1;
+}
+
+static int cmp_defstyle(const void *a, const void *b) {
+    return strncmp(((const struct defstyle *) a)->name, ((const struct defstyle *) b)->name,
+            LAYOUT_NAME);
+}
+
+/*
+ * Find or add the mask for a bubble size and shape.
+ */
+static int mask_for(const struct defbubble *b) {
+    struct defmask *m;
+    int i;
+
+    for (i = 0; i < nmasks; i++)
+        if (masks[i].w == b->w && masks[i].h == b->h && masks[i].oval == b->oval)
+            return i;
+    m = push(&masks, &nmasks, sizeof(*m));
+    m->w = b->w;
+    m->h = b->h;
+    m->oval = b->oval;
+    return i;
+}
+
+/*
+ * Draw a mask: the inside of the bubble, inset from its outline.
+ *
+ * Returns:
+ *  Number of pixels sampled
+ */
+static uint32_t draw_mask(const struct defmask *m, unsigned char *out) {
+    double cx = m->w / 2.0, cy = m->h / 2.0, rx = cx * (1 - 2 * INSET), ry = cy * (1 - 2 * INSET);
+    uint32_t area = 0;
+    int x, y;
+
+    for (y = 0; y < m->h; y++)
+        for (x = 0; x < m->w; x++) {
+            double u = (x + 0.5 - cx) / rx, v = (y + 0.5 - cy) / ry;
+            int in = m->oval ? u * u + v * v <= 1 : u >= -1 && u <= 1 && v >= -1 && v <= 1;
+            out[y * m->w + x] = in ? 255 : 0;
+            area += in;
+        }
+    return area;
+}
+
+static uint32_t align8(uint64_t off) {
+    return (uint32_t) ((off + 7) & ~7ULL);
+}
+
+/*
+ * Lay out and write the compiled file.
+ *
+ * Returns:
+ *  0 on success, -1 on error
+ */
+static int compile(const char *out, int verbose) {
+    struct layout_header *h;
+    struct layout_style *ost;
+    struct layout_bubble *ob;
+    unsigned char *buf;
+    uint64_t off;
+    char tmp[PATH_MAX];
+    FILE *fp;
+    int i, j, k;
+
+    qsort(styles, nstyles, sizeof(*styles), cmp_defstyle);
+    for (i = 1; i < nstyles; i++)
+        if (!strcmp(styles[i - 1].name, styles[i].name)) {
+            fprintf(stderr, "layoutc: style %s defined twice\n", styles[i].name);
+            return -1;
+        }
+    for (i = 0; i < nbubbles; i++)
+        bubbles[i].mask = mask_for(&bubbles[i]);
+
+    // Place the tables, then the masks
+    off = align8(sizeof(*h));
+    off = align8(off + (uint64_t) nstyles * sizeof(struct layout_style));
+    off = align8(off + (uint64_t) nbubbles * sizeof(struct layout_bubble));
+    off = align8(off + (uint64_t) nrois * sizeof(struct layout_roi));
+    for (i = 0; i < nmasks; i++) {
+        masks[i].off = off;
+        off += (uint64_t) masks[i].w * masks[i].h;
+    }
+    if (off > 0xffffffffULL || !(buf = calloc(align8(off), 1))) {
+        fprintf(stderr, "layoutc: layout too large\n");
+        return -1;
+    }
+    h = (struct layout_header *) buf;
+    memcpy(h->magic, LAYOUT_MAGIC, sizeof(h->magic));
+    h->version = LAYOUT_VERSION;
+    h->size = align8(off);
+    strcpy(h->election, election);
+    h->nstyles = nstyles;
+    h->styles = align8(sizeof(*h));
+    h->nbubbles = nbubbles;
+    h->bubbles = align8(h->styles + (uint64_t) nstyles * sizeof(struct layout_style));
+    h->nrois = nrois;
+    h->rois = align8(h->bubbles + (uint64_t) nbubbles * sizeof(struct layout_bubble));
+    h->masks = align8(h->rois + (uint64_t) nrois * sizeof(struct layout_roi));
+    h->masksize = h->size - h->masks;
+
+    // Styles in name order, each with its bubbles and regions contiguous
+    ost = (struct layout_style *) (buf + h->styles);
+    ob = (struct layout_bubble *) (buf + h->bubbles);
+    for (i = 0, j = 0, k = 0; i < nstyles; i++) {
+        const struct defstyle *st = &styles[i];
+        int b;
+        memcpy(ost[i].name, st->name, LAYOUT_NAME);
+        ost[i].width = st->width;
+        ost[i].height = st->height;
+        ost[i].bubble = j;
+        ost[i].nbubbles = st->nbubbles;
+        ost[i].roi = k;
+        ost[i].nrois = st->nrois;
+        for (b = st->bubble; b < st->bubble + st->nbubbles; b++, j++) {
+            ob[j].contest = bubbles[b].contest;
+            ob[j].option = bubbles[b].option;
+            ob[j].x = bubbles[b].x;
+            ob[j].y = bubbles[b].y;
+            ob[j].w = bubbles[b].w;
+            ob[j].h = bubbles[b].h;
+            ob[j].mask = masks[bubbles[b].mask].off;
+        }
+        memcpy(buf + h->rois + (size_t) k * sizeof(struct layout_roi), rois + st->roi,
+                (size_t) st->nrois * sizeof(struct layout_roi));
+        k += st->nrois;
+    }
+    for (i = 0; i < nmasks; i++)
+        masks[i].area = draw_mask(&masks[i], buf + masks[i].off);
+    for (i = 0; i < nbubbles; i++)
+        for (j = 0; j < nmasks; j++)
+            if (ob[i].mask == masks[j].off)
+                ob[i].area = masks[j].area;
+
+    h->body_crc = layout_crc32(buf + sizeof(*h), h->size - sizeof(*h));
+    h->crc = layout_crc32(h, offsetof(struct layout_header, crc));
+
+    if (snprintf(tmp, sizeof(tmp), "%s.tmp", out) >= (int) sizeof(tmp) ||
+            !(fp = fopen(tmp, "wb")) || fwrite(buf, h->size, 1, fp) != 1 || fclose(fp) ||
+            rename(tmp, out)) {
+        perror(out);
+        free(buf);
+        return -1;
+    }
+    if (verbose)
+        fprintf(stderr, "layoutc: %d styles, %d bubbles, %d regions, %d masks, %u bytes\n",
+                nstyles, nbubbles, nrois, nmasks, h->size);
+    free(buf);
+    return 0;
+}
+
+/*
+ * Open a compiled layout as at run time, verify it and list its styles.
+ */
+static int dump(const char *path) {
+    struct layout lay;
+    const struct layout_style *st;
+    long long t0, t1, t2;
+    uint32_t i;
+
+    t0 = image_clock();
+    if (layout_open(&lay, path)) {
+        perror(path);
+        return 1;
+    }
+    t1 = image_clock();
+    if (layout_verify(&lay)) {
+        fprintf(stderr, "layoutc: %s: checksum mismatch\n", path);
+        return 1;
+    }
+    t2 = image_clock();
+    st = (const struct layout_style *) (lay.base + lay.hdr->styles);
+    printf("election %.*s, version %u, %u bytes\n", LAYOUT_NAME, lay.hdr->election,
+            lay.hdr->version, lay.hdr->size);
+    for (i = 0; i < lay.hdr->nstyles; i++)
+        printf("style %.*s %ux%u, %u bubbles, %u regions\n", LAYOUT_NAME, st[i].name,
+                st[i].width, st[i].height, st[i].nbubbles, st[i].nrois);
+    fprintf(stderr, "layoutc: open %.3f ms, verify %.2f ms\n", (t1 - t0) / 1e6, (t2 - t1) / 1e6);
+    layout_close(&lay);
+    return 0;
+}
+
+int main(int argc, char *argv[]) {
+    const char *out = NULL;
+    int opt, verbose = 0;
+
+    while ((opt = getopt(argc, argv, "vo:d:")) != -1) {
+        switch (opt) {
+            case 'v':
+                verbose = 1;
+                break;
+            case 'o':
+                out = optarg;
+                break;
+            case 'd':
+                return dump(optarg);
+            default:
+                goto usage;
+        }
+    }
+    if (!out || optind != argc - 1)
+        goto usage;
+    if (parse(argv[optind]) || compile(out, verbose))
+        return 1;
+    return 0;
+
+usage:
+    fprintf(stderr, "Usage: layoutc [-v] -o election.lay election.layout\n"
+            "       layoutc -d election.lay\n");
+    return 1;
+}
@@ -0,0 +1,358 @@
+/*
+ * Usage:
+ *  pagearchive [-v] [-s halvings] [-k code] archive [page.pgm]
+ *  pagearchive -c archive
+ *  pagearchive -g code [-o page.pgm] archive
+ *  pagearchive -n count [-r seed] [-d dir] archive
+ *
+ * Examples:
+ *  Archive a page as it is scanned, reading its code
+ *      scanimage --format=pnm --mode Gray --resolution 300 | ./image-src/pagearchive /archive
+ *  Close the archive at the end of the day
+ *      ./image-src/pagearchive -c /archive
+ *  Pull the page of one ballot
+ *      ./image-src/pagearchive -g VB-2016-0042-7F3A9C2E81D4 -o ballot.pgm /archive
+ *  Draw 50 ballots at random for an audit, from a public seed
+ *      ./image-src/pagearchive -n 50 -r 8675309 -d sample /archive
+ *
+ * Description:
+ *  Keeps an archive of page images (a directory of segment files) with an
+ *  index by tracker code, for audits that pull specific ballots.
+ *
+ *  By default the page is appended to the archive and indexed under its
+ *  code, which is read as pagecode does (-s as for pagecode) unless given
+ *  with -k. The code is printed to standard output followed by a newline,
+ *  and nothing is printed if no code is read; the page is archived either
+ *  way. The archive directory must exist.
+ *
+ *  With -c the archive is closed: pages appended since the last close are
+ *  merged into the sorted index, and the next page starts a new segment.
+ *  Pages can be pulled and sampled only once merged.
+ *
+ *  With -g the page with the given code is written to the file given by
+ *  -o, or standard output. If the code was archived more than once, every
+ *  copy is listed to standard error as "<segment>:<offset>", the first is
+ *  written, and the exit status is 2. If it was not archived the exit
+ *  status is 1.
+ *
+ *  With -n the given number of ballots is drawn at random, without
+ *  replacement, from all archived pages (including those whose code was
+ *  not read). The draw is reproducible from the seed given by -r; without
+ *  -r the seed is taken from the clock and printed to standard error. Each
+ *  drawn page is listed to standard output as "<draw> <code> <segment>:<offset>",
+ *  with "-" for a code not read, and with -d it is written to <dir>/<draw>.pgm.
+ *
+ *  With -v the time taken is printed to standard error.
+ *
+ * Notes:
+ *  Drawn pages are read in archive order, so a sample costs one seek and
+ *  one read per page rather than a scan of the archive.
+ *
+ * Author:
+ *  Jerry Lue
+ */
+#define _GNU_SOURCE
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <stdint.h>
+#include <limits.h>
+#include <time.h>
+#include <unistd.h>
+#include "image.h"
+#include "archive.h"
+#include "qr.h"
+
+struct draw {
+    uint64_t entry;             // index entry
+    int n;                      // draw number, from 1
+};
+
+/*
+ * Read all of a file into memory.
+ *
+ * Returns:
+ *  Buffer to free, or NULL on error
+ */
+static unsigned char *slurp(const char *path, size_t *len) {
+    FILE *fp = strcmp(path, "-") ? fopen(path, "rb") : stdin;
+    unsigned char *buf = NULL, *p;
+    size_t cap = 0, got;
+
+    if (!fp)
+        return NULL;
+    *len = 0;
+    do {
+        if (*len == cap) {
+            cap = cap ? cap * 2 : 1 << 24;
+            if (!(p = realloc(buf, cap))) {
+                free(buf);
+                buf = NULL;
+                break;
+            }
+            buf = p;
+        }
+        got = fread(buf + *len, 1, cap - *len, fp);
+        *len += got;
+    } while (got);
+    if (buf && ferror(fp)) {
+        free(buf);
+        buf = NULL;
+    }
+    if (fp != stdin)
+        fclose(fp);
+    return buf;
+}
+
+static int add(const char *dir, const char *path, const char *code, int halvings, int verbose) {
+    struct image page = { 0 };
+    struct qrcode qr;
+    struct qrtiming timing;
+    unsigned char *buf;
+    size_t len, size;
+    long long t = image_clock();
+    FILE *fp;
+    int err;
+
+    if (!(buf = slurp(path, &len))) {
+        perror(path);
+        return 1;
+    }
+    // Archive the first page of the input exactly as scanned
+    if (!(fp = fmemopen(buf, len, "rb"))) {
+        perror(path);
+        free(buf);
+        return 1;
+    }
+    err = image_read_pgm(&page, fp, path, 0);
+    size = ftell(fp);
+    fclose(fp);
+    if (err) {
+        free(buf);
+        return 1;
+    }
+    if (!code) {
+        code = "";
+        if (qr_scan(&page, halvings, &qr, &timing)) {
+            qr_printable(&qr);
+            code = qr.text;
+        }
+    }
+    if (archive_append(dir, code, buf, size)) {
+        perror(dir);
+        free(buf);
+        image_free(&page);
+        return 1;
+    }
+    if (*code)
+        printf("%s\n", code);
+    if (verbose)
+        fprintf(stderr, "pagearchive: %zu byte page archived in %.1f ms\n",
+                size, (image_clock() - t) / 1e6);
+    free(buf);
+    image_free(&page);
+    return 0;
+}
+
+static int get(const struct archive *ar, const char *code, const char *out) {
+    const struct archive_entry *e;
+    unsigned char *buf;
+    size_t n, i;
+    FILE *fp;
+
+    if (!(e = archive_find(ar, code, &n))) {
+        fprintf(stderr, "pagearchive: %s not archived\n", code);
+        return 1;
+    }
+    if (n > 1)
+        for (i = 0; i < n; i++)
+            fprintf(stderr, "pagearchive: %s at %06u.seg:%llu\n", code, e[i].segment,
+                    (unsigned long long) e[i].offset);
+    if (!(buf = malloc(e->size)) || archive_read(ar, e, buf)) {
+        perror(ar->dir);
+        free(buf);
+        return 1;
+    }
+    fp = out ? fopen(out, "wb") : stdout;
+    if (!fp || fwrite(buf, e->size, 1, fp) != 1 || (out && fclose(fp))) {
+        perror(out ? out : "stdout");
+        free(buf);
+        return 1;
+    }
+    free(buf);
+    return n > 1 ? 2 : 0;
+}
+
+/*
+ * splitmix64, so that a draw from a published seed can be repeated on any
+ * machine.
+ */
+static uint64_t next_random(uint64_t *state) {
+    uint64_t z = (*state += 0x9e3779b97f4a7c15ULL);
+
+    z = (z ^ (z >> 30)) * 0xbf58476d1ce4e5b9ULL;
+    z = (z ^ (z >> 27)) * 0x94d049bb133111ebULL;
+    return z ^ (z >> 31);
+}
+
+static int cmp_draw(const void *a, const void *b) {
+    const struct draw *x = a, *y = b;
+
+    return x->entry < y->entry ? -1 : x->entry > y->entry;
+}
+
+static int cmp_position(const void *a, const void *b, void *arg) {
+    const struct archive_entry *e = arg;
+    const struct archive_entry *x = &e[((const struct draw *) a)->entry];
+    const struct archive_entry *y = &e[((const struct draw *) b)->entry];
+
+    if (x->segment != y->segment)
+        return x->segment < y->segment ? -1 : 1;
+    return x->offset < y->offset ? -1 : x->offset > y->offset;
+}
+
+static int sample(const struct archive *ar, uint64_t count, uint64_t seed, const char *dir) {
+    uint64_t total = ar->hdr->count, j, state = seed;
+    struct draw *d, *found;
+    unsigned char *buf = NULL;
+    uint32_t maxsize = 0;
+    int k = 0, err = 0;
+
+    if (count > total) {
+        fprintf(stderr, "pagearchive: only %llu pages archived\n", (unsigned long long) total);
+        return 1;
+    }
+    if (!(d = malloc(count * sizeof(*d) + 1)))
+        return 1;
+    // Floyd's algorithm: count distinct entries in count draws, however
+    // large the archive, kept sorted for the membership test
+    for (j = total - count; j < total; j++) {
+        struct draw key = { next_random(&state) % (j + 1), 0 };
+        if (bsearch(&key, d, k, sizeof(*d), cmp_draw))
+            key.entry = j;
+        key.n = k + 1;
+        for (found = d + k; found > d && found[-1].entry > key.entry; found--)
+            found[0] = found[-1];
+        *found = key;
+        k++;
+    }
+
+    qsort_r(d, count, sizeof(*d), cmp_position, (void *) ar->entries);
+    for (j = 0; j < count; j++)
+        if (ar->entries[d[j].entry].size > maxsize)
+            maxsize = ar->entries[d[j].entry].size;
+    if (dir && !(buf = malloc(maxsize))) {
+        free(d);
+        return 1;
+    }
+    for (j = 0; j < count; j++) {
+        const struct archive_entry *e = &ar->entries[d[j].entry];
+        const char *code = archive_code(ar, e);
+        char path[PATH_MAX];
+        FILE *fp;
+
+        printf("%d %s %06u.seg:%llu\n", d[j].n, !code ? "?" : *code ? code : "-", e->segment,
+                (unsigned long long) e->offset);
+        if (!dir)
+            continue;
+        snprintf(path, sizeof(path), "%s/%d.pgm", dir, d[j].n);
+        if (archive_read(ar, e, buf) || !(fp = fopen(path, "wb")) ||
+                fwrite(buf, e->size, 1, fp) != 1 || fclose(fp)) {
+            perror(path);
+            err = 1;
+        }
+    }
+    free(buf);
+    free(d);
+    return err;
+}
+
+int main(int argc, char *argv[]) {
+    struct archive ar;
+    const char *code = NULL, *get_code = NULL, *out = NULL, *dir = NULL;
+    uint64_t count = 0, seed = 0;
+    int opt, verbose = 0, halvings = 1, close_archive = 0, seeded = 0, merged, ret;
+    long long t;
+
+    while ((opt = getopt(argc, argv, "vs:k:cg:o:n:r:d:")) != -1) {
+        switch (opt) {
+            case 'v':
+                verbose = 1;
+                break;
+            case 's':
+                halvings = atoi(optarg);
+                if (halvings < 0 || halvings > 4) {
+                    fprintf(stderr, "Halvings must be between 0 and 4\n");
+                    return 1;
+                }
+                break;
+            case 'k':
+                code = optarg;
+                break;
+            case 'c':
+                close_archive = 1;
+                break;
+            case 'g':
+                get_code = optarg;
+                break;
+            case 'o':
+                out = optarg;
+                break;
+            case 'n':
+                count = strtoull(optarg, NULL, 10);
+                break;
+            case 'r':
+                seed = strtoull(optarg, NULL, 10);
+                seeded = 1;
+                break;
+            case 'd':
+                dir = optarg;
+                break;
+            default:
+                goto usage;
+        }
+    }
+    if (optind >= argc)
+        goto usage;
+
+    t = image_clock();
+    if (close_archive) {
+        if (archive_merge(argv[optind], &merged)) {
+            perror(argv[optind]);
+            return 1;
+        }
+        if (verbose)
+            fprintf(stderr, "pagearchive: %d pages merged in %.1f ms\n", merged,
+                    (image_clock() - t) / 1e6);
+        return 0;
+    }
+    if (!get_code && !count)
+        return add(argv[optind], optind + 1 < argc ? argv[optind + 1] : "-", code,
+                halvings, verbose);
+
+    if (archive_open(&ar, argv[optind])) {
+        perror(argv[optind]);
+        return 1;
+    }
+    if (get_code) {
+        ret = get(&ar, get_code, out);
+    } else {
+        if (!seeded) {
+            seed = time(NULL);
+            fprintf(stderr, "pagearchive: seed %llu\n", (unsigned long long) seed);
+        }
+        ret = sample(&ar, count, seed, dir);
+    }
+    if (verbose)
+        fprintf(stderr, "pagearchive: %llu pages indexed, done in %.2f ms\n",
+                (unsigned long long) ar.hdr->count, (image_clock() - t) / 1e6);
+    archive_close(&ar);
+    return ret;
+
+usage:
+    fprintf(stderr, "Usage: pagearchive [-v] [-s halvings] [-k code] archive [page.pgm]\n"
+            "       pagearchive -c archive\n"
+            "       pagearchive -g code [-o page.pgm] archive\n"
+            "       pagearchive -n count [-r seed] [-d dir] archive\n");
+    return 1;
+}
@@ -0,0 +1,396 @@
+/*
+ * Usage:
+ *  pageaudit [-v] [-j threads] [-s halvings] [-o audit.journal]
+ *      [-m marks.txt -l election.lay -S styles.db [-f fill]] segment...
+ *
+ * Examples:
+ *  Read the codes of every archived page again, on all cores
+ *      ./image-src/pageaudit -o audit.journal /archive/box*.seg
+ *  Also identify each page's style and read its marks
+ *      ./image-src/pageaudit -o audit.journal -m marks.txt -l election.lay -S styles.db /archive/box*.seg
+ *
+ * Description:
+ *  Re-processes archived page images for an audit. Each segment (a file of
+ *  binary PGM pages stored back to back) is streamed in order by one
+ *  reader thread while worker threads, by default one per core, decode the
+ *  pages with the same code reader as pagecode (-s as for pagecode).
+ *
+ *  Results are written in archive order. Each page whose code is read adds
+ *  a line "<sequence number> <code>" to the journal given by -o (standard
+ *  output by default), in the format of the intake journal, so it can be
+ *  compared with the journals written at intake. Characters that are not
+ *  printable are written as '?'.
+ *
+ *  With -m, the style of each page is identified against the style
+ *  database given by -S and its marks are read with the layout given by
+ *  -l, as pagestyle and pagemarks do (-f as for pagemarks). The marks file
+ *  gets one line per page: "<segment>:<offset> <code> <style> <contest>:<option>...",
+ *  with "-" for a code or style not read.
+ *
+ *  At the end the pages and bytes processed, pages per second and MB per
+ *  second are printed to standard error, with the time the reader waited
+ *  for the workers and the workers waited for the reader: a reader that
+ *  waited means the audit was limited by the CPU, idle workers mean it was
+ *  limited by the disk. With -v, each page whose code is not read is also
+ *  printed to standard error.
+ *
+ * Notes:
+ *  A page that cannot be read ends its segment, since the following pages
+ *  cannot be found; the exit status is then 1.
+ *
+ * Author:
+ *  Jerry Lue
+ */
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <pthread.h>
+#include "image.h"
+#include "archive.h"
+#include "qr.h"
+#include "style.h"
+#include "layout.h"
+
+#define FILL 0.35
+#define SLOTS_PER_THREAD 2
+
+enum { SLOT_FREE, SLOT_LOADED, SLOT_DONE };
+
+struct slot {
+    int state;
+    long long seq;              // page number in the archive
+    struct image page;
+    int segment;
+    long long offset, bytes;
+    struct qrcode qr;
+    int found;
+    int style;                  // index in the style database, -1 if none
+    int nmarks;
+    uint16_t (*marks)[2];       // contest and option of each marked bubble
+};
+
+struct audit {
+    pthread_mutex_t lock;
+    pthread_cond_t loaded, freed, done;
+    struct slot *slots;
+    int nslots;
+    long long loads, claims;    // pages loaded by the reader and taken by workers
+    int eof;
+
+    char **segments;
+    int nsegments;
+    int halvings;
+    int errors;
+
+    struct stylesig *styles;
+    int nstyles;
+    struct layout lay;
+    int marks;
+    double fill;
+
+    long long reader_wait, worker_wait;     // ns
+};
+
+/*
+ * Stream the segments into free slots, in order.
+ */
+static void *reader(void *arg) {
+    struct audit *a = arg;
+    int i;
+
+    for (i = 0; i < a->nsegments; i++) {
+        struct segment seg;
+        struct slot *s;
+        int ret;
+
+        if (segment_open(&seg, a->segments[i])) {
+            perror(a->segments[i]);
+            a->errors++;
+            continue;
+        }
+        for (;;) {
+            long long t = image_clock();
+            pthread_mutex_lock(&a->lock);
+            s = &a->slots[a->loads % a->nslots];
+            while (s->state != SLOT_FREE)
+                pthread_cond_wait(&a->freed, &a->lock);
+            pthread_mutex_unlock(&a->lock);
+            a->reader_wait += image_clock() - t;
+
+            // The slot is ours until it is marked loaded
+            ret = segment_next(&seg, &s->page, &s->offset);
+            if (ret <= 0)
+                break;
+            s->segment = i;
+            s->bytes = seg.offset - s->offset;
+            pthread_mutex_lock(&a->lock);
+            s->seq = a->loads++;
+            s->state = SLOT_LOADED;
+            pthread_cond_broadcast(&a->loaded);
+            pthread_mutex_unlock(&a->lock);
+        }
+        if (ret < 0) {
+            fprintf(stderr, "pageaudit: %s: unreadable page at offset %lld, "
+                    "rest of segment skipped\n", a->segments[i], seg.offset);
+            a->errors++;
+        }
+        segment_close(&seg);
+    }
+    pthread_mutex_lock(&a->lock);
+    a->eof = 1;
+    pthread_cond_broadcast(&a->loaded);
+    pthread_cond_broadcast(&a->done);
+    pthread_mutex_unlock(&a->lock);
+    return NULL;
+}
+
+/*
+ * Identify the style of a page and read its marks.
+ */
+static void read_marks(struct audit *a, struct slot *s, struct pagesig *sig) {
+    const struct layout_style *st;
+    const struct layout_bubble *b;
+    struct stylematch match;
+    uint32_t i;
+    int thr;
+
+    s->style = -1;
+    s->nmarks = 0;
+    if (style_signature(&s->page, sig))
+        return;
+    style_match(a->styles, a->nstyles, sig, &match);
+    if ((s->style = match.style) < 0 ||
+            !(st = layout_style(&a->lay, a->styles[s->style].name)))
+        return;
+    thr = image_threshold(&s->page);
+    b = layout_bubbles(&a->lay, st);
+    for (i = 0; i < st->nbubbles; i++) {
+        int ink = layout_ink(&a->lay, &b[i], &s->page, thr, 0, 0);
+        if (ink > 0 && b[i].area && (double) ink / b[i].area >= a->fill) {
+            s->marks[s->nmarks][0] = b[i].contest;
+            s->marks[s->nmarks][1] = b[i].option;
+            s->nmarks++;
+        }
+    }
+}
+
+/*
+ * Decode loaded pages, taking them in order.
+ */
+static void *worker(void *arg) {
+    struct audit *a = arg;
+    struct pagesig *sig = NULL;
+    struct qrtiming timing;
+    struct slot *s;
+    long long t;
+
+    if (a->marks && !(sig = malloc(sizeof(*sig)))) {
+        perror("pageaudit");
+        exit(1);
+    }
+    for (;;) {
+        t = image_clock();
+        pthread_mutex_lock(&a->lock);
+        for (;;) {
+            s = &a->slots[a->claims % a->nslots];
+            if (s->state == SLOT_LOADED && s->seq == a->claims)
+                break;
+            if (a->eof && a->claims == a->loads) {
+                pthread_mutex_unlock(&a->lock);
+                free(sig);
+                return NULL;
+            }
+            pthread_cond_wait(&a->loaded, &a->lock);
+        }
+        a->claims++;
+        a->worker_wait += image_clock() - t;
+        pthread_mutex_unlock(&a->lock);
+
+        if ((s->found = qr_scan(&s->page, a->halvings, &s->qr, &timing)))
+            qr_printable(&s->qr);
+        if (a->marks)
+            read_marks(a, s, sig);
+
+        pthread_mutex_lock(&a->lock);
+        s->state = SLOT_DONE;
+        pthread_cond_broadcast(&a->done);
+        pthread_mutex_unlock(&a->lock);
+    }
+}
+
+int main(int argc, char *argv[]) {
+    struct audit a = {
+        .lock = PTHREAD_MUTEX_INITIALIZER,
+        .loaded = PTHREAD_COND_INITIALIZER,
+        .freed = PTHREAD_COND_INITIALIZER,
+        .done = PTHREAD_COND_INITIALIZER,
+        .halvings = 1,
+        .fill = FILL,
+    };
+    const char *out = NULL, *marksout = NULL, *laypath = NULL, *stylepath = NULL;
+    FILE *journal = stdout, *marks = NULL;
+    pthread_t rd, *workers;
+    long long pages = 0, codes = 0, bytes = 0, written = 0, t;
+    int opt, verbose = 0, threads = sysconf(_SC_NPROCESSORS_ONLN), i;
+    double secs;
+
+    while ((opt = getopt(argc, argv, "vj:s:o:m:l:S:f:")) != -1) {
+        switch (opt) {
+            case 'v':
+                verbose = 1;
+                break;
+            case 'j':
+                threads = atoi(optarg);
+                break;
+            case 's':
+                a.halvings = atoi(optarg);
+                if (a.halvings < 0 || a.halvings > 4) {
+                    fprintf(stderr, "Halvings must be between 0 and 4\n");
+                    return 1;
+                }
+                break;
+            case 'o':
+                out = optarg;
+                break;
+            case 'm':
+                marksout = optarg;
+                break;
+            case 'l':
+                laypath = optarg;
+                break;
+            case 'S':
+                stylepath = optarg;
+                break;
+            case 'f':
+                a.fill = atof(optarg);
+                break;
+            default:
+                goto usage;
+        }
+    }
+    if (optind >= argc || (marksout && (!laypath || !stylepath)))
+        goto usage;
+    if (threads < 1)
+        threads = 1;
+    a.segments = argv + optind;
+    a.nsegments = argc - optind;
+
+    if (marksout) {
+        if ((a.nstyles = style_load(stylepath, &a.styles)) < 0) {
+            fprintf(stderr, "Cannot load style database %s\n", stylepath);
+            return 1;
+        }
+        if (layout_open(&a.lay, laypath)) {
+            perror(laypath);
+            return 1;
+        }
+        if (!(marks = fopen(marksout, "w"))) {
+            perror(marksout);
+            return 1;
+        }
+        a.marks = 1;
+    }
+    if (out && !(journal = fopen(out, "w"))) {
+        perror(out);
+        return 1;
+    }
+
+    a.nslots = threads * SLOTS_PER_THREAD;
+    if (!(a.slots = calloc(a.nslots, sizeof(*a.slots))) ||
+            !(workers = malloc(threads * sizeof(*workers)))) {
+        perror("pageaudit");
+        return 1;
+    }
+    for (i = 0; i < a.nslots; i++)
+        if (a.marks && !(a.slots[i].marks = malloc(a.lay.hdr->nbubbles * sizeof(*a.slots[i].marks)))) {
+            perror("pageaudit");
+            return 1;
+        }
+
+    t = image_clock();
+    if (pthread_create(&rd, NULL, reader, &a)) {
+        perror("pageaudit");
+        return 1;
+    }
+    for (i = 0; i < threads; i++)
+        if (pthread_create(&workers[i], NULL, worker, &a)) {
+            perror("pageaudit");
+            return 1;
+        }
+
+    // Write results in archive order as pages are done
+    for (;;) {
+        struct slot *s = &a.slots[written % a.nslots];
+        int j, ready;
+
+        pthread_mutex_lock(&a.lock);
+        while (!(ready = s->state == SLOT_DONE && s->seq == written) &&
+                !(a.eof && written == a.loads))
+            pthread_cond_wait(&a.done, &a.lock);
+        pthread_mutex_unlock(&a.lock);
+        if (!ready)
+            break;
+
+        pages++;
+        bytes += s->bytes;
+        if (s->found) {
+            fprintf(journal, "%lld %s\n", ++codes, s->qr.text);
+        } else if (verbose) {
+            fprintf(stderr, "pageaudit: %s:%lld: no code read\n", a.segments[s->segment], s->offset);
+        }
+        if (marks) {
+            fprintf(marks, "%s:%lld ", a.segments[s->segment], s->offset);
+            if (s->found)
+                fputs(s->qr.text, marks);
+            else
+                putc('-', marks);
+            fprintf(marks, " %s", s->style >= 0 ? a.styles[s->style].name : "-");
+            for (j = 0; j < s->nmarks; j++)
+                fprintf(marks, " %u:%u", s->marks[j][0], s->marks[j][1]);
+            putc('\n', marks);
+        }
+
+        pthread_mutex_lock(&a.lock);
+        s->state = SLOT_FREE;
+        written++;
+        pthread_cond_signal(&a.freed);
+        pthread_mutex_unlock(&a.lock);
+    }
+    pthread_join(rd, NULL);
+    for (i = 0; i < threads; i++)
+        pthread_join(workers[i], NULL);
+    secs = (image_clock() - t) / 1e9;
+
+    if (fflush(journal) || (out && fclose(journal))) {
+        perror(out ? out : "stdout");
+        return 1;
+    }
+    if (marks && fclose(marks)) {
+        perror(marksout);
+        return 1;
+    }
+    fprintf(stderr, "pageaudit: %lld pages, %lld codes read, %.1f MB in %.2f s: "
+            "%.1f pages/s, %.1f MB/s\n", pages, codes, bytes / 1e6, secs,
+            secs > 0 ? pages / secs : 0, secs > 0 ? bytes / 1e6 / secs : 0);
+    fprintf(stderr, "pageaudit: %d threads, reader waited %.2f s for workers (CPU bound), "
+            "workers waited %.2f s for reader (disk bound)\n",
+            threads, a.reader_wait / 1e9, a.worker_wait / 1e9 / threads);
+
+    for (i = 0; i < a.nslots; i++) {
+        image_free(&a.slots[i].page);
+        free(a.slots[i].marks);
+    }
+    free(a.slots);
+    free(workers);
+    if (a.marks) {
+        layout_close(&a.lay);
+        free(a.styles);
+    }
+    return a.errors ? 1 : 0;
+
+usage:
+    fprintf(stderr, "Usage: pageaudit [-v] [-j threads] [-s halvings] [-o audit.journal]\n"
+            "    [-m marks.txt -l election.lay -S styles.db [-f fill]] segment...\n");
+    return 1;
+}
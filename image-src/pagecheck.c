@@ -0,0 +1,153 @@
+/*
+ * Usage:
+ *  pagecheck [-v] [-r rows] [-c contrast] [-e edge] [-k skew] [-i scanner]
+ *            [-t trends.csv] [page.pgm]
+ *
+ * Examples:
+ *  Check a page as it is scanned, while saving the whole page
+ *      scanimage --format=pnm --mode Gray --resolution 300 | tee -p page.pgm | ./image-src/pagecheck
+ *  Check a saved page and record its measures for scanner ds510-a
+ *      ./image-src/pagecheck -i ds510-a -t quality.csv page.pgm
+ *
+ * Description:
+ *  Checks the scan quality of a page from its first rows (600 by default,
+ *  2 inches at 300 dpi, or as given by -r), so a bad scan can be caught
+ *  while the sheet is still in the feeder, rather than surfacing later as
+ *  an unreadable code. Reading stops after those rows. Prints "ok"
+ *  followed by a newline to standard output if the page passes, or
+ *  "rescan" and the failed checks if not, with exit status 2:
+ *
+ *   contrast   paper and ink levels closer than -c (default 80)
+ *   blur       ink edges wider than -e pixels on average (default 4.0)
+ *   skew       printed lines turned more than -k degrees (default 2.0)
+ *   streak     dark lines down the page from dirt on the scanner glass
+ *
+ *  With -t, the measures are also appended to a CSV file, one line per
+ *  page with the time and the scanner name given by -i, for following the
+ *  quality of each scanner over time.
+ *
+ *  With -v, the measures and the time taken are printed to standard error.
+ *
+ * Notes:
+ *  Skew is estimated from lines of print in the band, within 5 degrees;
+ *  a band of blank paper reads as no skew.
+ *
+ * Author:
+ *  Jerry Lue
+ */
+#include <stdio.h>
+#include <stdlib.h>
+#include <time.h>
+#include <unistd.h>
+#include "image.h"
+#include "quality.h"
+
+#define ROWS 600
+#define CONTRAST 80
+#define EDGE 4.0
+#define SKEW 2.0
+
+/*
+ * Append the measures of a page to the trends file, writing the column
+ * names first if the file is new.
+ *
+ * Returns:
+ *  0 on success, -1 on error
+ */
+static int record(const char *path, const char *scanner, const struct quality *q, int ok) {
+    FILE *fp = fopen(path, "a");
+
+    if (!fp)
+        return -1;
+    if (ftell(fp) == 0)
+        fprintf(fp, "time,scanner,paper,ink,contrast,edge,skew,streaks,ok\n");
+    fprintf(fp, "%ld,%s,%d,%d,%d,%.2f,%.2f,%d,%d\n", (long) time(NULL), scanner,
+            q->paper, q->ink, q->contrast, q->edge, q->skew, q->streaks, ok);
+    return fclose(fp) ? -1 : 0;
+}
+
+int main(int argc, char *argv[]) {
+    struct quality q;
+    struct image band;
+    const char *path = "-", *scanner = "scanner", *trends = NULL;
+    int opt, verbose = 0, rows = ROWS, mincontrast = CONTRAST, ok, i;
+    double maxedge = EDGE, maxskew = SKEW;
+    long long t0, t1, t2;
+
+    while ((opt = getopt(argc, argv, "vr:c:e:k:i:t:")) != -1) {
+        switch (opt) {
+            case 'v':
+                verbose = 1;
+                break;
+            case 'r':
+                rows = atoi(optarg);
+                break;
+            case 'c':
+                mincontrast = atoi(optarg);
+                break;
+            case 'e':
+                maxedge = atof(optarg);
+                break;
+            case 'k':
+                maxskew = atof(optarg);
+                break;
+            case 'i':
+                scanner = optarg;
+                break;
+            case 't':
+                trends = optarg;
+                break;
+            default:
+                goto usage;
+        }
+    }
+    if (rows <= 0)
+        goto usage;
+    if (optind < argc)
+        path = argv[optind];
+
+    t0 = image_clock();
+    if (image_load_band(&band, path, rows)) {
+        perror(path);
+        return 1;
+    }
+    t1 = image_clock();
+    quality_check(&band, &q);
+    t2 = image_clock();
+
+    ok = q.contrast >= mincontrast && q.edge <= maxedge &&
+        q.skew <= maxskew && q.skew >= -maxskew && !q.streaks;
+    if (ok) {
+        printf("ok\n");
+    } else {
+        printf("rescan");
+        if (q.contrast < mincontrast)
+            printf(" contrast");
+        if (q.edge > maxedge)
+            printf(" blur");
+        if (q.skew > maxskew || q.skew < -maxskew)
+            printf(" skew");
+        if (q.streaks)
+            printf(" streak");
+        printf("\n");
+    }
+    fflush(stdout);
+
+    if (verbose) {
+        fprintf(stderr, "pagecheck: %d rows, paper %d, ink %d, contrast %d, edge %.2f px, "
+                "skew %.2f deg, %d streaks", band.height, q.paper, q.ink, q.contrast,
+                q.edge, q.skew, q.streaks);
+        for (i = 0; i < q.streaks && i < QUALITY_STREAKS; i++)
+            fprintf(stderr, "%s%d", i ? "," : " at x=", q.streak_x[i]);
+        fprintf(stderr, ", load %.1f ms, check %.2f ms\n", (t1 - t0) / 1e6, (t2 - t1) / 1e6);
+    }
+    if (trends && record(trends, scanner, &q, ok))
+        perror(trends);
+    image_free(&band);
+    return ok ? 0 : 2;
+
+usage:
+    fprintf(stderr, "Usage: pagecheck [-v] [-r rows] [-c contrast] [-e edge] [-k skew] "
+            "[-i scanner] [-t trends.csv] [page.pgm]\n");
+    return 1;
+}
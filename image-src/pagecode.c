@@ -0,0 +1,88 @@
+/*
+ * Usage:
+ *  pagecode [-s halvings] [-v] [page.pgm]
+ *
+ * Examples:
+ *  Read the ballot code from a scanned page
+ *      scanimage --format=pnm --mode Gray --resolution 300 | ./image-src/pagecode
+ *  Read the code from a saved page, with location and timing
+ *      ./image-src/pagecode -v page.pgm
+ *
+ * Description:
+ *  Reads a QR code from a page image scanned by the DS-510, for ballots
+ *  whose tracker is a 2D code that the laser scanner cannot read. The code
+ *  is printed to standard output followed by a newline, as the scan
+ *  program does; nothing is printed if no code is read. Characters other
+ *  than printable ASCII, which a byte-mode code may hold, are printed as
+ *  '?', so the code is always one line.
+ *
+ *  Finder patterns are searched for on the page halved -s times (1 by
+ *  default, enough for modules of 4 pixels or more at 300 dpi; use 0 for
+ *  small codes and 2 for large ones). With -v the symbol version, error
+ *  correction level, corrected codewords, location and the time spent
+ *  locating and decoding are printed to standard error.
+ *
+ * Author:
+ *  Jerry Lue
+ */
+#include <stdio.h>
+#include <stdlib.h>
+#include <unistd.h>
+#include "image.h"
+#include "qr.h"
+
+int main(int argc, char *argv[]) {
+    struct image page;
+    struct qrcode qr;
+    struct qrtiming timing;
+    const char *path = "-";
+    int opt, halvings = 1, verbose = 0, found;
+    long long t;
+
+    while ((opt = getopt(argc, argv, "s:v")) != -1) {
+        switch (opt) {
+            case 's':
+                halvings = atoi(optarg);
+                if (halvings < 0 || halvings > 4) {
+                    fprintf(stderr, "Halvings must be between 0 and 4\n");
+                    return 1;
+                }
+                break;
+            case 'v':
+                verbose = 1;
+                break;
+            default:
+                fprintf(stderr, "Usage: pagecode [-s halvings] [-v] [page.pgm]\n");
+                return 1;
+        }
+    }
+    if (optind < argc)
+        path = argv[optind];
+    t = image_clock();
+    if (image_load_pgm(&page, path)) {
+        perror(path);
+        return 1;
+    }
+    t = image_clock() - t;
+
+    found = qr_scan(&page, halvings, &qr, &timing);
+    if (found) {
+        qr_printable(&qr);
+        printf("%s\n", qr.text);
+    }
+    if (verbose) {
+        if (found)
+            fprintf(stderr, "pagecode: version %d-%c, %d codewords corrected, "
+                    "module %.1f px, finders (%.0f,%.0f) (%.0f,%.0f) (%.0f,%.0f)\n",
+                    qr.version, qr.level, qr.corrected, qr.module,
+                    qr.x[0], qr.y[0], qr.x[1], qr.y[1], qr.x[2], qr.y[2]);
+        else
+            fprintf(stderr, "pagecode: no code read (%d finder candidates)\n",
+                    timing.candidates);
+        fprintf(stderr, "pagecode: %dx%d page, load %.1f ms, locate %.1f ms, decode %.1f ms\n",
+                page.width, page.height, t / 1e6, timing.locate_ns / 1e6,
+                timing.decode_ns / 1e6);
+    }
+    image_free(&page);
+    return 0;
+}
@@ -0,0 +1,126 @@
+/*
+ * Usage:
+ *  pagehash [-v] [-n] [-d distance] [-r x,y,w,h] [-l label] index [page.pgm]
+ *
+ * Examples:
+ *  Hash a scanned page, flag it if it looks like one already seen, and add
+ *  it to the index
+ *      ./image-src/pagehash -l 2W7D4 pages.phash page.pgm
+ *  Check the top half of a page against the index without adding it
+ *      ./image-src/pagehash -n -r 0,0,2550,1650 pages.phash page.pgm
+ *
+ * Description:
+ *  Catches physically duplicated ballots, such as a photocopy of a ballot
+ *  that was rejected and fed again, which deduplicating by tracker code
+ *  cannot. Computes a 64-bit perceptual hash of the page (or of a region
+ *  of it with -r) and prints it to standard output in hex followed by a
+ *  newline. The hash is then looked up in the index: if an entry is within
+ *  the Hamming distance given by -d (default 8 bits), its label and
+ *  distance are printed to standard error and the exit status is 2.
+ *
+ *  Unless -n is given, the hash is then added to the index under the label
+ *  given by -l (default the page file name).
+ *
+ *  With -v, the distance to the nearest entry and the time taken are
+ *  printed to standard error.
+ *
+ * Notes:
+ *  The hash keeps only the coarse shape of a page, so a few changed marks
+ *  do not hide a copy, but blank or lightly marked ballots of one style
+ *  hash alike too. A flag is therefore a suspicion to check, e.g. against
+ *  the sheets rejected earlier, rather than grounds to reject a ballot.
+ *
+ * Author:
+ *  Jerry Lue
+ */
+#include <stdio.h>
+#include <stdlib.h>
+#include <unistd.h>
+#include "image.h"
+#include "phash.h"
+
+#define DISTANCE 8
+
+int main(int argc, char *argv[]) {
+    struct phashindex idx;
+    struct image page;
+    const char *path = "-", *label = NULL;
+    unsigned long long hash;
+    int opt, verbose = 0, add = 1, maxdist = DISTANCE, near, dist, err = 0;
+    int x = 0, y = 0, w = -1, h = -1;
+    long long t0, t1, t2, t3;
+
+    while ((opt = getopt(argc, argv, "vnd:r:l:")) != -1) {
+        switch (opt) {
+            case 'v':
+                verbose = 1;
+                break;
+            case 'n':
+                add = 0;
+                break;
+            case 'd':
+                maxdist = atoi(optarg);
+                break;
+            case 'r':
+                if (sscanf(optarg, "%d,%d,%d,%d", &x, &y, &w, &h) != 4)
+                    goto usage;
+                break;
+            case 'l':
+                label = optarg;
+                break;
+            default:
+                goto usage;
+        }
+    }
+    if (optind >= argc)
+        goto usage;
+    if (phash_open(&idx, argv[optind])) {
+        perror(argv[optind]);
+        return 1;
+    }
+    if (++optind < argc)
+        path = argv[optind];
+    if (!label)
+        label = path;
+
+    t0 = image_clock();
+    if (image_load_pgm(&page, path)) {
+        perror(path);
+        return 1;
+    }
+    t1 = image_clock();
+    if (w < 0) {
+        w = page.width;
+        h = page.height;
+    }
+    if (!(hash = phash_region(&page, x, y, w, h))) {
+        fprintf(stderr, "Cannot hash page region\n");
+        return 1;
+    }
+    t2 = image_clock();
+    near = phash_nearest(&idx, hash, &dist);
+    t3 = image_clock();
+    printf("%016llx\n", hash);
+    fflush(stdout);
+
+    if (near >= 0 && dist <= maxdist) {
+        fprintf(stderr, "pagehash: looks like %s (distance %d)\n", idx.labels[near], dist);
+        err = 2;
+    }
+    if (verbose)
+        fprintf(stderr, "pagehash: %d indexed, nearest %d, load %.1f ms, "
+                "hash %.2f ms, lookup %.3f ms\n", idx.n, near >= 0 ? dist : -1,
+                (t1 - t0) / 1e6, (t2 - t1) / 1e6, (t3 - t2) / 1e6);
+    if (add && phash_add(&idx, hash, label)) {
+        perror("pagehash: cannot add to index");
+        err = 1;
+    }
+    image_free(&page);
+    phash_close(&idx);
+    return err;
+
+usage:
+    fprintf(stderr, "Usage: pagehash [-v] [-n] [-d distance] [-r x,y,w,h] [-l label] "
+            "index [page.pgm]\n");
+    return 1;
+}
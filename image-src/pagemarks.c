@@ -0,0 +1,100 @@
+/*
+ * Usage:
+ *  pagemarks [-v] [-f fill] election.lay style [page.pgm]
+ *
+ * Examples:
+ *  Read the marks on a page of style p101
+ *      ./image-src/pagemarks election.lay p101 page.pgm
+ *  Read the marks after identifying the style
+ *      ./image-src/pagemarks election.lay $(./image-src/pagestyle styles.db page.pgm) page.pgm
+ *
+ * Description:
+ *  Reads which bubbles are marked on a page, using a layout compiled by
+ *  layoutc. For each marked bubble, its contest and option numbers are
+ *  printed to standard output separated by a space and followed by a
+ *  newline. A bubble is marked if at least the fraction given by -f
+ *  (default 0.35) of the pixels in its mask are ink.
+ *
+ *  With -v, the fill of every bubble and the time taken are printed to
+ *  standard error.
+ *
+ * Notes:
+ *  Bubbles are read at their layout position; the mask is inset from the
+ *  printed outline, which allows for a few pixels of feed misalignment.
+ *
+ * Author:
+ *  Jerry Lue
+ */
+#include <stdio.h>
+#include <stdlib.h>
+#include <unistd.h>
+#include "image.h"
+#include "layout.h"
+
+#define FILL 0.35
+
+int main(int argc, char *argv[]) {
+    const struct layout_bubble *b;
+    const struct layout_style *st;
+    struct layout lay;
+    struct image page;
+    const char *path = "-";
+    double fill = FILL;
+    int opt, verbose = 0, thr;
+    uint32_t i;
+    long long t0, t1, t2, t3;
+
+    while ((opt = getopt(argc, argv, "vf:")) != -1) {
+        switch (opt) {
+            case 'v':
+                verbose = 1;
+                break;
+            case 'f':
+                fill = atof(optarg);
+                break;
+            default:
+                goto usage;
+        }
+    }
+    if (argc - optind < 2)
+        goto usage;
+    if (argc - optind > 2)
+        path = argv[optind + 2];
+
+    t0 = image_clock();
+    if (layout_open(&lay, argv[optind])) {
+        perror(argv[optind]);
+        return 1;
+    }
+    if (!(st = layout_style(&lay, argv[optind + 1]))) {
+        fprintf(stderr, "No style %s in %s\n", argv[optind + 1], argv[optind]);
+        return 1;
+    }
+    t1 = image_clock();
+    if (image_load_pgm(&page, path)) {
+        perror(path);
+        return 1;
+    }
+    t2 = image_clock();
+    thr = image_threshold(&page);
+    b = layout_bubbles(&lay, st);
+    for (i = 0; i < st->nbubbles; i++) {
+        int ink = layout_ink(&lay, &b[i], &page, thr, 0, 0);
+        double f = ink > 0 && b[i].area ? (double) ink / b[i].area : 0;
+        if (f >= fill)
+            printf("%u %u\n", b[i].contest, b[i].option);
+        if (verbose)
+            fprintf(stderr, "pagemarks: %u %u fill %.2f\n", b[i].contest, b[i].option, f);
+    }
+    t3 = image_clock();
+    if (verbose)
+        fprintf(stderr, "pagemarks: %u bubbles, open %.3f ms, load %.1f ms, read %.2f ms\n",
+                st->nbubbles, (t1 - t0) / 1e6, (t2 - t1) / 1e6, (t3 - t2) / 1e6);
+    image_free(&page);
+    layout_close(&lay);
+    return 0;
+
+usage:
+    fprintf(stderr, "Usage: pagemarks [-v] [-f fill] election.lay style [page.pgm]\n");
+    return 1;
+}
@@ -0,0 +1,131 @@
+/*
+ * Usage:
+ *  pagestyle -c styles.db name=reference.pgm...
+ *  pagestyle [-v] styles.db [page.pgm]
+ *
+ * Examples:
+ *  Build the style database from blank reference ballots
+ *      ./image-src/pagestyle -c styles.db p101=p101.pgm p102=p102.pgm
+ *  Identify the style of a scanned page, with scores and timing
+ *      ./image-src/pagestyle -v styles.db page.pgm
+ *
+ * Description:
+ *  Identifies which ballot style (layout) a scanned page is, so it can be
+ *  routed or checked by style. Style signatures are compiled offline from
+ *  one blank reference scan per style with -c; at run time the database
+ *  is loaded and each page is matched against it. The name of the closest
+ *  style is printed to standard output followed by a newline.
+ *
+ *  With -v, the distance to the best style and to the runner-up (the
+ *  larger the gap, the surer the match) and the time taken are printed to
+ *  standard error.
+ *
+ * Author:
+ *  Jerry Lue
+ */
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include "image.h"
+#include "style.h"
+
+/*
+ * Compile reference pages into a style database.
+ */
+static int compile(const char *db, int n, char *refs[]) {
+    struct stylesig *styles = calloc(n ? n : 1, sizeof(*styles));
+    struct pagesig sig;
+    struct image page;
+    int i;
+
+    if (!styles)
+        return 1;
+    for (i = 0; i < n; i++) {
+        char *eq = strchr(refs[i], '=');
+        if (!eq || eq == refs[i] || eq - refs[i] >= STYLE_NAME) {
+            fprintf(stderr, "Expected name=reference.pgm, got %s\n", refs[i]);
+            return 1;
+        }
+        *eq = '\0';
+        if (image_load_pgm(&page, eq + 1)) {
+            perror(eq + 1);
+            return 1;
+        }
+        if (style_signature(&page, &sig)) {
+            fprintf(stderr, "Cannot compute signature of %s\n", eq + 1);
+            return 1;
+        }
+        style_reference(&sig, refs[i], &styles[i]);
+        image_free(&page);
+    }
+    if (style_save(db, styles, n)) {
+        perror(db);
+        return 1;
+    }
+    fprintf(stderr, "pagestyle: %d styles written to %s\n", n, db);
+    free(styles);
+    return 0;
+}
+
+int main(int argc, char *argv[]) {
+    struct stylesig *styles;
+    struct stylematch match;
+    struct pagesig sig;
+    struct image page;
+    const char *db = NULL, *path = "-";
+    int opt, nstyles, verbose = 0;
+    long long t0, t1, t2;
+
+    while ((opt = getopt(argc, argv, "c:v")) != -1) {
+        switch (opt) {
+            case 'c':
+                db = optarg;
+                break;
+            case 'v':
+                verbose = 1;
+                break;
+            default:
+                goto usage;
+        }
+    }
+    if (db)
+        return compile(db, argc - optind, argv + optind);
+    if (optind >= argc)
+        goto usage;
+    db = argv[optind++];
+    if (optind < argc)
+        path = argv[optind];
+
+    t0 = image_clock();
+    if ((nstyles = style_load(db, &styles)) < 0) {
+        fprintf(stderr, "Cannot load style database %s\n", db);
+        return 1;
+    }
+    if (image_load_pgm(&page, path)) {
+        perror(path);
+        return 1;
+    }
+    t1 = image_clock();
+    if (style_signature(&page, &sig)) {
+        fprintf(stderr, "Cannot compute page signature\n");
+        return 1;
+    }
+    t2 = image_clock();
+    style_match(styles, nstyles, &sig, &match);
+    if (match.style >= 0)
+        printf("%s\n", styles[match.style].name);
+    if (verbose)
+        fprintf(stderr, "pagestyle: %d styles, distance %d, runner-up %d, "
+                "load %.1f ms, signature %.2f ms, match %.3f ms\n",
+                nstyles, match.score, match.runnerup, (t1 - t0) / 1e6,
+                (t2 - t1) / 1e6, (image_clock() - t2) / 1e6);
+    image_free(&page);
+    free(styles);
+    return 0;
+
+usage:
+    fprintf(stderr, "Usage: pagestyle -c styles.db name=reference.pgm...\n"
+            "       pagestyle [-v] styles.db [page.pgm]\n");
+    return 1;
+}
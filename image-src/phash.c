@@ -0,0 +1,271 @@
+/*
+ * phash
+ *
+ * DCT perceptual hash and the hash index.
+ *
+ * The hashed region is averaged down to PHASH_SIZE x PHASH_SIZE cells
+ * through an integral image of a pyramid level where it is still at least
+ * twice that size. The lowest 8x8 frequencies of its 2D DCT,
+ * leaving out the first row and column (the page's overall brightness and
+ * straight gradients across it), are compared with their median to give
+ * the 64 bits. Low frequencies survive photocopying, rescanning, small
+ * shifts and brightness changes, and the median makes the hash independent
+ * of contrast. The DCT is two small matrix products worked four floats at
+ * a time with vector extensions.
+ *
+ * Author:
+ *  Jerry Lue
+ */
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <math.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <sys/stat.h>
+#include "phash.h"
+
+#define PHASH_FREQS 8
+#define PHASH_VECS (PHASH_SIZE / 4)
+
+typedef float f32x4 __attribute__((vector_size(16)));
+
+// DCT basis rows for frequencies 1 to PHASH_FREQS
+static f32x4 basis[PHASH_FREQS][PHASH_VECS];
+static int basis_ready;
+
+static void init_basis(void) {
+    int u, x;
+
+    for (u = 0; u < PHASH_FREQS; u++)
+        for (x = 0; x < PHASH_SIZE; x++)
+            basis[u][x / 4][x % 4] = cos(M_PI * (u + 1) * (2 * x + 1) / (2 * PHASH_SIZE));
+    basis_ready = 1;
+}
+
+static int cmp_float(const void *a, const void *b) {
+    float x = *(const float *) a, y = *(const float *) b;
+    return (x > y) - (x < y);
+}
+
+/*
+ * Hash a region of a page.
+ *
+ * Params:
+ *  page        Page image
+ *  x, y, w, h  Region in page pixels, clipped to the page
+ *
+ * Returns:
+ *  64-bit hash, or 0 on error or if the region is under PHASH_SIZE pixels
+ */
+unsigned long long phash_region(const struct image *page, int x, int y, int w, int h) {
+    f32x4 cells[PHASH_SIZE][PHASH_VECS], rows[PHASH_FREQS][PHASH_VECS];
+    float coef[PHASH_FREQS * PHASH_FREQS], sorted[PHASH_FREQS * PHASH_FREQS], median;
+    struct image crop, small;
+    unsigned long long hash = 0;
+    unsigned int *sum;
+    int k = 0, i, j, u, v, sw;
+
+    if (!basis_ready)
+        init_basis();
+    if (x < 0) {
+        w += x;
+        x = 0;
+    }
+    if (y < 0) {
+        h += y;
+        y = 0;
+    }
+    w = x + w > page->width ? page->width - x : w;
+    h = y + h > page->height ? page->height - y : h;
+    if (w < PHASH_SIZE || h < PHASH_SIZE)
+        return 0;
+
+    // Work on a copy of a part of the page, halved while it stays at least
+    // twice the cell grid
+    crop = *page;
+    if (w < page->width || h < page->height) {
+        if (image_alloc(&crop, w, h))
+            return 0;
+        for (j = 0; j < h; j++)
+            memcpy(crop.px + (size_t) j * crop.stride,
+                    page->px + (size_t) (y + j) * page->stride + x, w);
+    }
+    while ((w >> (k + 1)) >= 2 * PHASH_SIZE && (h >> (k + 1)) >= 2 * PHASH_SIZE)
+        k++;
+    image_pyramid(&crop, w >> k, &small);
+    if (crop.px != page->px)
+        image_free(&crop);
+    if (!small.px)
+        return 0;
+    sum = image_integral(&small);
+    if (!sum) {
+        image_free(&small);
+        return 0;
+    }
+    sw = small.width + 1;
+    w = small.width;
+    h = small.height;
+    for (j = 0; j < PHASH_SIZE; j++) {
+        int y0 = h * j / PHASH_SIZE, y1 = h * (j + 1) / PHASH_SIZE;
+        for (i = 0; i < PHASH_SIZE; i++) {
+            int x0 = w * i / PHASH_SIZE, x1 = w * (i + 1) / PHASH_SIZE;
+            unsigned int s = sum[(size_t) y1 * sw + x1] - sum[(size_t) y0 * sw + x1] -
+                sum[(size_t) y1 * sw + x0] + sum[(size_t) y0 * sw + x0];
+            cells[j][i / 4][i % 4] = (float) s / ((x1 - x0) * (y1 - y0));
+        }
+    }
+    free(sum);
+    image_free(&small);
+
+    // Columns: rows[u] = sum over j of basis[u][j] * cells[j]
+    memset(rows, 0, sizeof(rows));
+    for (j = 0; j < PHASH_SIZE; j++)
+        for (u = 0; u < PHASH_FREQS; u++) {
+            float c = basis[u][j / 4][j % 4];
+            f32x4 b = { c, c, c, c };
+            for (i = 0; i < PHASH_VECS; i++)
+                rows[u][i] += b * cells[j][i];
+        }
+    // Rows: coef[u][v] = rows[u] . basis[v]
+    for (u = 0; u < PHASH_FREQS; u++)
+        for (v = 0; v < PHASH_FREQS; v++) {
+            f32x4 acc = { 0, 0, 0, 0 };
+            for (i = 0; i < PHASH_VECS; i++)
+                acc += rows[u][i] * basis[v][i];
+            coef[u * PHASH_FREQS + v] = acc[0] + acc[1] + acc[2] + acc[3];
+        }
+
+    memcpy(sorted, coef, sizeof(sorted));
+    qsort(sorted, PHASH_FREQS * PHASH_FREQS, sizeof(float), cmp_float);
+    median = (sorted[PHASH_FREQS * PHASH_FREQS / 2 - 1] + sorted[PHASH_FREQS * PHASH_FREQS / 2]) / 2;
+    for (i = 0; i < PHASH_FREQS * PHASH_FREQS; i++)
+        if (coef[i] > median)
+            hash |= 1ULL << i;
+    return hash;
+}
+
+/*
+ * Make room for a number of hashes in the index.
+ *
+ * Returns:
+ *  0 on success, -1 on error
+ */
+static int grow(struct phashindex *idx, int need) {
+    unsigned long long *hashes;
+    char (*labels)[PHASH_LABEL];
+    int cap = idx->cap ? idx->cap : 1024;
+
+    while (cap < need)
+        cap *= 2;
+    if (cap == idx->cap)
+        return 0;
+    if (!(hashes = realloc(idx->hashes, (size_t) cap * sizeof(*hashes))))
+        return -1;
+    idx->hashes = hashes;
+    if (!(labels = realloc(idx->labels, (size_t) cap * sizeof(*labels))))
+        return -1;
+    idx->labels = labels;
+    idx->cap = cap;
+    return 0;
+}
+
+/*
+ * Open a hash index, creating it if needed, and load it into memory. A
+ * partial final record left by a crash mid-write is cut off.
+ *
+ * Returns:
+ *  0 on success, -1 on error
+ */
+int phash_open(struct phashindex *idx, const char *path) {
+    unsigned char *buf;
+    struct stat st;
+    int i, n;
+
+    memset(idx, 0, sizeof(*idx));
+    idx->fd = open(path, O_RDWR | O_CREAT | O_APPEND | O_CLOEXEC, 0644);
+    if (idx->fd < 0 || fstat(idx->fd, &st))
+        return -1;
+    n = st.st_size / PHASH_RECORD;
+    if (st.st_size % PHASH_RECORD) {
+        fprintf(stderr, "phash: discarding %d byte partial record\n",
+                (int) (st.st_size % PHASH_RECORD));
+        if (ftruncate(idx->fd, (off_t) n * PHASH_RECORD))
+            return -1;
+    }
+    if (grow(idx, n) || !(buf = malloc((size_t) n * PHASH_RECORD + 1)))
+        return -1;
+    if (pread(idx->fd, buf, (size_t) n * PHASH_RECORD, 0) != (ssize_t) n * PHASH_RECORD) {
+        free(buf);
+        return -1;
+    }
+    for (i = 0; i < n; i++) {
+        memcpy(&idx->hashes[i], buf + (size_t) i * PHASH_RECORD, 8);
+        memcpy(idx->labels[i], buf + (size_t) i * PHASH_RECORD + 8, PHASH_LABEL);
+        idx->labels[i][PHASH_LABEL - 1] = '\0';
+    }
+    free(buf);
+    idx->n = n;
+    return 0;
+}
+
+/*
+ * Add a hash to the index and flush it to disk.
+ *
+ * Params:
+ *  idx     Index
+ *  hash    Page hash
+ *  label   What was hashed, truncated to PHASH_LABEL - 1 characters
+ *
+ * Returns:
+ *  0 on success, -1 on error
+ */
+int phash_add(struct phashindex *idx, unsigned long long hash, const char *label) {
+    unsigned char rec[PHASH_RECORD] = { 0 };
+
+    if (grow(idx, idx->n + 1))
+        return -1;
+    memcpy(rec, &hash, 8);
+    strncpy((char *) rec + 8, label, PHASH_LABEL - 1);
+    if (write(idx->fd, rec, sizeof(rec)) != sizeof(rec) || fdatasync(idx->fd))
+        return -1;
+    idx->hashes[idx->n] = hash;
+    memcpy(idx->labels[idx->n], rec + 8, PHASH_LABEL);
+    idx->n++;
+    return 0;
+}
+
+/*
+ * Find the indexed hash nearest to a hash. The hashes are contiguous, so
+ * the scan is one XOR and population count per entry.
+ *
+ * Params:
+ *  idx     Index
+ *  hash    Hash to look up
+ *  dist    Set to the Hamming distance of the nearest entry
+ *
+ * Returns:
+ *  Index of the nearest entry, or -1 if the index is empty
+ */
+int phash_nearest(const struct phashindex *idx, unsigned long long hash, int *dist) {
+    int i, best = -1, d = 65;
+
+    for (i = 0; i < idx->n; i++) {
+        int di = phash_distance(idx->hashes[i], hash);
+        if (di < d) {
+            d = di;
+            best = i;
+        }
+    }
+    *dist = d;
+    return best;
+}
+
+void phash_close(struct phashindex *idx) {
+    if (idx->fd >= 0)
+        close(idx->fd);
+    free(idx->hashes);
+    free(idx->labels);
+    memset(idx, 0, sizeof(*idx));
+    idx->fd = -1;
+}
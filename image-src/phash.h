@@ -0,0 +1,36 @@
+#ifndef PHASH_H
+#define PHASH_H
+
+/*
+ * phash
+ *
+ * Perceptual hashes of scanned pages, for catching physically duplicated
+ * ballots. Photocopies and rescans of a page hash within a few bits of
+ * each other, while unrelated images differ in about half the bits. Hashes
+ * are kept in an append-only index file of fixed size records, held in
+ * memory as a flat array that is searched by Hamming distance.
+ */
+#include "image.h"
+
+#define PHASH_SIZE 32           // hashed image is reduced to PHASH_SIZE square
+#define PHASH_LABEL 24
+#define PHASH_RECORD (8 + PHASH_LABEL)
+
+struct phashindex {
+    int fd;
+    int n, cap;
+    unsigned long long *hashes;
+    char (*labels)[PHASH_LABEL];    // e.g. ballot code or page file
+};
+
+unsigned long long phash_region(const struct image *page, int x, int y, int w, int h);
+int phash_open(struct phashindex *idx, const char *path);
+int phash_add(struct phashindex *idx, unsigned long long hash, const char *label);
+int phash_nearest(const struct phashindex *idx, unsigned long long hash, int *dist);
+void phash_close(struct phashindex *idx);
+
+static inline int phash_distance(unsigned long long a, unsigned long long b) {
+    return __builtin_popcountll(a ^ b);
+}
+
+#endif
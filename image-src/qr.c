@@ -0,0 +1,865 @@
+/*
+ * qr
+ *
+ * QR code locator and decoder for scanned pages.
+ *
+ * The page is halved one or more times and binarized with a global
+ * threshold, then every row of the small image is run-length scanned for
+ * the 1:1:3:1:1 ink/paper/ink/paper/ink profile of a finder pattern. Most
+ * of a page is blank paper, so runs are extended a vector (16 pixels) at a
+ * time while the pixels match. Each hit is cross-checked vertically, and
+ * hits on neighbouring rows are merged. The three finders forming the best
+ * right isosceles triangle are refined on the full resolution page, and
+ * the module grid between them is sampled there, touching only the symbol
+ * region. Pages from a sheet-fed scanner are flat, so the grid is affine.
+ *
+ * Author:
+ *  Jerry Lue
+ */
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <math.h>
+#include "qr.h"
+
+#define MAXFINDERS 64
+#define MAXVERSION 10
+#define MAXDIM (17 + 4 * MAXVERSION)
+#define MAXCODEWORDS 346    // total codewords of version 10
+#define MAXBLOCKS 8
+
+struct finder {
+    double x, y;
+    double module;          // module size
+    int count;              // rows the pattern was seen on
+};
+
+struct grid {
+    int dim;
+    unsigned char m[MAXDIM][MAXDIM];    // 1 for dark modules, [row][col]
+    unsigned char fn[MAXDIM][MAXDIM];   // 1 for function pattern modules
+};
+
+/*
+ * Error correction blocks per version and level (L, M, Q, H): codewords
+ * per block for error correction, then count and data codewords of the
+ * short blocks and of the long blocks.
+ */
+static const unsigned char ecblocks[MAXVERSION][4][5] = {
+    { { 7, 1, 19, 0, 0 }, { 10, 1, 16, 0, 0 }, { 13, 1, 13, 0, 0 }, { 17, 1, 9, 0, 0 } },
+    { { 10, 1, 34, 0, 0 }, { 16, 1, 28, 0, 0 }, { 22, 1, 22, 0, 0 }, { 28, 1, 16, 0, 0 } },
+    { { 15, 1, 55, 0, 0 }, { 26, 1, 44, 0, 0 }, { 18, 2, 17, 0, 0 }, { 22, 2, 13, 0, 0 } },
+    { { 20, 1, 80, 0, 0 }, { 18, 2, 32, 0, 0 }, { 26, 2, 24, 0, 0 }, { 16, 4, 9, 0, 0 } },
+    { { 26, 1, 108, 0, 0 }, { 24, 2, 43, 0, 0 }, { 18, 2, 15, 2, 16 }, { 22, 2, 11, 2, 12 } },
+    { { 18, 2, 68, 0, 0 }, { 16, 4, 27, 0, 0 }, { 24, 4, 19, 0, 0 }, { 28, 4, 15, 0, 0 } },
+    { { 20, 2, 78, 0, 0 }, { 18, 4, 31, 0, 0 }, { 18, 2, 14, 4, 15 }, { 26, 4, 13, 1, 14 } },
+    { { 24, 2, 97, 0, 0 }, { 22, 2, 38, 2, 39 }, { 22, 4, 18, 2, 19 }, { 26, 4, 14, 2, 15 } },
+    { { 30, 2, 116, 0, 0 }, { 22, 3, 36, 2, 37 }, { 20, 4, 16, 4, 17 }, { 24, 4, 12, 4, 13 } },
+    { { 18, 2, 68, 2, 69 }, { 26, 4, 43, 1, 44 }, { 24, 6, 19, 2, 20 }, { 28, 6, 15, 2, 16 } },
+};
+
+// Alignment pattern center coordinates per version (0 terminated)
+static const unsigned char alignpos[MAXVERSION][4] = {
+    { 0 }, { 6, 18 }, { 6, 22 }, { 6, 26 }, { 6, 30 }, { 6, 34 },
+    { 6, 22, 38 }, { 6, 24, 42 }, { 6, 26, 46 }, { 6, 28, 50 },
+};
+
+static const char levels[] = "MLHQ"; // indexed by the 2 format bits
+static const int levelrow[] = { 1, 0, 3, 2 }; // format bits to ecblocks row
+static const char alnum[] = "0123456789ABCDEFGHIJKLMNOPQRSTUVWXYZ $%*+-./:";
+
+/*
+ * Finder pattern location
+ */
+
+/*
+ * Check run lengths against the 1:1:3:1:1 finder profile.
+ */
+static int finder_ratio(const int c[5]) {
+    int total = c[0] + c[1] + c[2] + c[3] + c[4];
+    double m, v;
+
+    if (total < 7)
+        return 0;
+    m = total / 7.0;
+    v = m / 2;
+    return fabs(m - c[0]) < v && fabs(m - c[1]) < v && fabs(3 * m - c[2]) < 3 * v &&
+        fabs(m - c[3]) < v && fabs(m - c[4]) < v;
+}
+
+/*
+ * Measure a finder profile through a point along one axis.
+ *
+ * Params:
+ *  img     Image
+ *  thr     Pixels below thr are ink
+ *  x, y    Point inside the center square
+ *  dx, dy  Axis (1, 0) or (0, 1)
+ *  maxrun  Longest acceptable run
+ *  center  Set to the center coordinate along the axis, in pixel edge
+ *          coordinates (pixel i spans i to i + 1)
+ *
+ * Returns:
+ *  Total profile length, or 0 if there is no finder profile
+ */
+static int cross_check(const struct image *img, int thr, int x, int y,
+        int dx, int dy, int maxrun, double *center) {
+    int c[5] = { 0 }, s, px, py;
+#define INK(u, v) (img->px[(size_t) (v) * img->stride + (u)] < thr)
+#define INSIDE(u, v) ((u) >= 0 && (v) >= 0 && (u) < img->width && (v) < img->height)
+
+    if (!INSIDE(x, y) || !INK(x, y))
+        return 0;
+    // Backward from the center: center square, paper ring, outer ring
+    px = x;
+    py = y;
+    for (s = 2; s >= 0; s--) {
+        while (INSIDE(px, py) && INK(px, py) == !(s & 1) && c[s] <= maxrun) {
+            c[s]++;
+            px -= dx;
+            py -= dy;
+        }
+        if (!c[s] || c[s] > maxrun || (s && !INSIDE(px, py)))
+            return 0;
+    }
+    // Forward from the center
+    px = x + dx;
+    py = y + dy;
+    for (s = 2; s <= 4; s++) {
+        while (INSIDE(px, py) && INK(px, py) == !(s & 1) && c[s] <= maxrun) {
+            c[s]++;
+            px += dx;
+            py += dy;
+        }
+        if (!c[s] || c[s] > maxrun || (s < 4 && !INSIDE(px, py)))
+            return 0;
+    }
+#undef INK
+#undef INSIDE
+    if (!finder_ratio(c))
+        return 0;
+    *center = (dx ? px : py) - c[4] - c[3] - c[2] / 2.0;
+    return c[0] + c[1] + c[2] + c[3] + c[4];
+}
+
+/*
+ * Record a finder pattern hit, merging it with a nearby earlier one.
+ */
+static void add_finder(struct finder *f, int *n, double x, double y, double module) {
+    int i;
+
+    for (i = 0; i < *n; i++) {
+        if (fabs(x - f[i].x) <= f[i].module * 2 && fabs(y - f[i].y) <= f[i].module * 2 &&
+                fabs(module - f[i].module) <= f[i].module) {
+            f[i].x = (f[i].x * f[i].count + x) / (f[i].count + 1);
+            f[i].y = (f[i].y * f[i].count + y) / (f[i].count + 1);
+            f[i].module = (f[i].module * f[i].count + module) / (f[i].count + 1);
+            f[i].count++;
+            return;
+        }
+    }
+    if (*n < MAXFINDERS) {
+        f[*n].x = x;
+        f[*n].y = y;
+        f[*n].module = module;
+        f[*n].count = 1;
+        (*n)++;
+    }
+}
+
+/*
+ * Find the end of the run of pixels starting at x. Runs are extended a
+ * vector at a time while all sixteen pixels match, which skips blank paper
+ * at a fraction of the cost of a pixel loop.
+ */
+static int run_end(const unsigned char *row, int x, int width) {
+    unsigned char v = row[x];
+    u8x16 splat, w;
+    unsigned long long lanes[2];
+
+    memset(&splat, v, sizeof(splat));
+    x++;
+    while ((x & 15) && x < width && row[x] == v)
+        x++;
+    if (!(x & 15)) {
+        // Rows are padded to IMAGE_ALIGN, so aligned vectors stay in bounds
+        while (x < width) {
+            memcpy(&w, row + x, 16);
+            w = (u8x16) (w == splat);
+            memcpy(lanes, &w, 16);
+            if ((lanes[0] & lanes[1]) != ~0ULL)
+                break;
+            x += 16;
+        }
+        while (x < width && row[x] == v)
+            x++;
+    }
+    return x < width ? x : width;
+}
+
+/*
+ * Scan a binarized image for finder patterns.
+ *
+ * Returns:
+ *  Number of finder candidates
+ */
+static int find_finders(const struct image *bin, struct finder *f) {
+    int x, y, n = 0;
+
+    for (y = 0; y < bin->height; y++) {
+        const unsigned char *row = bin->px + (size_t) y * bin->stride;
+        int c[5] = { 0 }, runs = 0, end;
+        for (x = 0; x < bin->width; x = end) {
+            end = run_end(row, x, bin->width);
+            // Keep the last five runs, starting from the first ink run
+            if (row[x] && !runs)
+                continue;
+            memmove(c, c + 1, 4 * sizeof(c[0]));
+            c[4] = end - x;
+            runs++;
+            if (!row[x] && runs >= 5 && finder_ratio(c)) {
+                double cx = end - c[4] - c[3] - c[2] / 2.0, cy;
+                int total = c[0] + c[1] + c[2] + c[3] + c[4], vtotal;
+                vtotal = cross_check(bin, 128, (int) cx, y, 0, 1, total, &cy);
+                // Vertical profile must be about as long as the horizontal one
+                if (vtotal && 5 * abs(vtotal - total) < 2 * total &&
+                        cross_check(bin, 128, (int) cx, (int) cy, 1, 0, total * 2, &cx))
+                    add_finder(f, &n, cx, cy, (total + vtotal) / 14.0);
+            }
+        }
+    }
+    return n;
+}
+
+static double dist2(const struct finder *a, const struct finder *b) {
+    return (a->x - b->x) * (a->x - b->x) + (a->y - b->y) * (a->y - b->y);
+}
+
+/*
+ * Choose the three finders most like the corners of one symbol, ordered
+ * top left, top right, bottom left.
+ *
+ * Returns:
+ *  0 on success, -1 if no three finders fit
+ */
+static int choose_finders(struct finder *f, int n, struct finder *out) {
+    double best = 1;
+    int i, j, k, mincount = 2, found = -1;
+
+    // Prefer patterns seen on several rows; noise rarely is
+    for (i = 0, k = 0; i < n; i++)
+        k += f[i].count >= mincount;
+    if (k < 3)
+        mincount = 1;
+    for (i = 0; i < n; i++)
+        for (j = i + 1; j < n; j++)
+            for (k = j + 1; k < n; k++) {
+                struct finder *p[3] = { &f[i], &f[j], &f[k] }, *t;
+                double d[3], legs, score, msize;
+                int c;
+                if (f[i].count < mincount || f[j].count < mincount || f[k].count < mincount)
+                    continue;
+                msize = (f[i].module + f[j].module + f[k].module) / 3;
+                if (fabs(f[i].module - msize) > msize * 0.4 ||
+                        fabs(f[j].module - msize) > msize * 0.4 ||
+                        fabs(f[k].module - msize) > msize * 0.4)
+                    continue;
+                // Put the right angle corner first: opposite the longest side
+                d[0] = dist2(p[1], p[2]);
+                d[1] = dist2(p[0], p[2]);
+                d[2] = dist2(p[0], p[1]);
+                c = d[0] >= d[1] && d[0] >= d[2] ? 0 : d[1] >= d[2] ? 1 : 2;
+                t = p[0];
+                p[0] = p[c];
+                p[c] = t;
+                d[c] = d[0];
+                legs = sqrt(dist2(p[0], p[1])) + sqrt(dist2(p[0], p[2]));
+                // Legs span dim - 7 modules: 14 for version 1, 50 for version 10
+                if (legs / 2 < 12 * msize || legs / 2 > 54 * msize)
+                    continue;
+                score = fabs(sqrt(dist2(p[0], p[1])) - sqrt(dist2(p[0], p[2]))) / legs +
+                    fabs(dist2(p[1], p[2]) - dist2(p[0], p[1]) - dist2(p[0], p[2])) /
+                    dist2(p[1], p[2]);
+                if (score < best && score < 0.2) {
+                    best = score;
+                    // Top right is clockwise from top left (y grows down)
+                    if ((p[1]->x - p[0]->x) * (p[2]->y - p[0]->y) -
+                            (p[1]->y - p[0]->y) * (p[2]->x - p[0]->x) < 0) {
+                        t = p[1];
+                        p[1] = p[2];
+                        p[2] = t;
+                    }
+                    out[0] = *p[0];
+                    out[1] = *p[1];
+                    out[2] = *p[2];
+                    found = 0;
+                }
+            }
+    return found;
+}
+
+/*
+ * Refine a finder center found on the downsampled image on the full
+ * resolution page.
+ */
+static void refine_finder(const struct image *page, int thr, struct finder *f) {
+    int maxrun = (int) (f->module * 4) + 2, h, v;
+    double x = f->x, y = f->y;
+
+    if ((h = cross_check(page, thr, (int) x, (int) y, 1, 0, maxrun, &x)) &&
+            (v = cross_check(page, thr, (int) x, (int) y, 0, 1, maxrun, &y)) &&
+            (h = cross_check(page, thr, (int) x, (int) y, 1, 0, maxrun, &x))) {
+        f->x = x;
+        f->y = y;
+        f->module = (h + v) / 14.0;
+    }
+}
+
+/*
+ * Grid sampling
+ */
+
+/*
+ * Mark the function pattern modules of a version.
+ */
+static void mark_functions(struct grid *g, int version) {
+    const unsigned char *ap = alignpos[version - 1];
+    int dim = g->dim, i, j, r, c;
+
+    memset(g->fn, 0, sizeof(g->fn));
+    // Finders with separators and format information
+    for (r = 0; r < 9; r++)
+        for (c = 0; c < 9; c++)
+            g->fn[r][c] = 1;
+    for (r = 0; r < 9; r++)
+        for (c = dim - 8; c < dim; c++)
+            g->fn[r][c] = 1;
+    for (r = dim - 8; r < dim; r++)
+        for (c = 0; c < 9; c++)
+            g->fn[r][c] = 1;
+    // Timing patterns
+    for (i = 0; i < dim; i++)
+        g->fn[6][i] = g->fn[i][6] = 1;
+    // Alignment patterns, except where they would overlap finders
+    for (i = 0; i < 4 && ap[i]; i++)
+        for (j = 0; j < 4 && ap[j]; j++) {
+            if ((ap[i] == 6 && ap[j] == 6) || (ap[i] == 6 && ap[j] == dim - 7) ||
+                    (ap[i] == dim - 7 && ap[j] == 6))
+                continue;
+            for (r = ap[i] - 2; r <= ap[i] + 2; r++)
+                for (c = ap[j] - 2; c <= ap[j] + 2; c++)
+                    g->fn[r][c] = 1;
+        }
+    // Version information
+    if (version >= 7)
+        for (i = 0; i < 6; i++)
+            for (j = dim - 11; j < dim - 8; j++)
+                g->fn[i][j] = g->fn[j][i] = 1;
+}
+
+/*
+ * Sample the module grid of a symbol of the given dimension.
+ *
+ * Returns:
+ *  Number of timing pattern modules that do not alternate as they should
+ */
+static int sample_grid(const struct image *page, int thr, const struct finder *f,
+        int dim, struct grid *g) {
+    double exx = (f[1].x - f[0].x) / (dim - 7), exy = (f[1].y - f[0].y) / (dim - 7);
+    double eyx = (f[2].x - f[0].x) / (dim - 7), eyy = (f[2].y - f[0].y) / (dim - 7);
+    int r, c, i, errors = 0;
+    // Average over the middle half of a module, at least one pixel
+    int rad = (int) (sqrt(exx * exx + exy * exy) / 4);
+
+    g->dim = dim;
+    for (r = 0; r < dim; r++)
+        for (c = 0; c < dim; c++) {
+            // Module centers relative to the top left finder center (3.5, 3.5)
+            int x = (int) floor(f[0].x + (c - 3) * exx + (r - 3) * eyx);
+            int y = (int) floor(f[0].y + (c - 3) * exy + (r - 3) * eyy);
+            int sum = 0, n = 0, dx, dy;
+            for (dy = -rad; dy <= rad; dy++)
+                for (dx = -rad; dx <= rad; dx++)
+                    if (x + dx >= 0 && y + dy >= 0 && x + dx < page->width &&
+                            y + dy < page->height) {
+                        sum += page->px[(size_t) (y + dy) * page->stride + x + dx];
+                        n++;
+                    }
+            g->m[r][c] = n && sum < thr * n;
+        }
+    for (i = 8; i < dim - 8; i++)
+        errors += (g->m[6][i] != !(i & 1)) + (g->m[i][6] != !(i & 1));
+    return errors;
+}
+
+/*
+ * Decoding
+ */
+
+static unsigned char gf_exp[512], gf_log[256];
+static int gf_ready;
+
+/*
+ * Fill the field tables on first use. Pages may be decoded on several
+ * threads at once: the tables are published with a release store, and a
+ * thread that finds them not yet ready fills them again with the same
+ * values.
+ */
+static void gf_init(void) {
+    int i, x = 1;
+
+    if (__atomic_load_n(&gf_ready, __ATOMIC_ACQUIRE))
+        return;
+    for (i = 0; i < 255; i++) {
+        gf_exp[i] = gf_exp[i + 255] = x;
+        gf_log[x] = i;
+        x <<= 1;
+        if (x & 0x100)
+            x ^= 0x11d;
+    }
+    gf_exp[510] = gf_exp[0];
+    __atomic_store_n(&gf_ready, 1, __ATOMIC_RELEASE);
+}
+
+static unsigned char gf_mul(unsigned char a, unsigned char b) {
+    return a && b ? gf_exp[gf_log[a] + gf_log[b]] : 0;
+}
+
+static unsigned char gf_div(unsigned char a, unsigned char b) {
+    return a ? gf_exp[gf_log[a] + 255 - gf_log[b]] : 0;
+}
+
+/*
+ * Evaluate a polynomial, lowest degree coefficient first.
+ */
+static unsigned char poly_eval(const unsigned char *p, int n, unsigned char x) {
+    unsigned char v = 0;
+    while (n--)
+        v = gf_mul(v, x) ^ p[n];
+    return v;
+}
+
+/*
+ * Correct a Reed-Solomon block in place (Berlekamp-Massey, Chien search
+ * and Forney).
+ *
+ * Params:
+ *  cw      Codewords, data then error correction
+ *  n       Number of codewords
+ *  nec     Number of error correction codewords
+ *
+ * Returns:
+ *  Number of codewords corrected, or -1 if the block is uncorrectable
+ */
+static int rs_correct(unsigned char *cw, int n, int nec) {
+    unsigned char s[64], lambda[65] = { 1 }, prev[65] = { 1 }, t[65], omega[64];
+    unsigned char d, b = 1;
+    int i, j, r, len = 0, m = 1, errors = 0, any = 0;
+
+    for (i = 0; i < nec; i++) {
+        unsigned char v = 0;
+        for (j = 0; j < n; j++)
+            v = gf_mul(v, gf_exp[i]) ^ cw[j];
+        s[i] = v;
+        any |= v;
+    }
+    if (!any)
+        return 0;
+    for (r = 0; r < nec; r++) {
+        d = s[r];
+        for (i = 1; i <= len; i++)
+            d ^= gf_mul(lambda[i], s[r - i]);
+        if (!d) {
+            m++;
+            continue;
+        }
+        memcpy(t, lambda, sizeof(t));
+        for (i = 0; i + m <= nec; i++)
+            lambda[i + m] ^= gf_mul(gf_div(d, b), prev[i]);
+        if (2 * len <= r) {
+            len = r + 1 - len;
+            memcpy(prev, t, sizeof(prev));
+            b = d;
+            m = 1;
+        } else {
+            m++;
+        }
+    }
+    if (2 * len > nec)
+        return -1;
+    for (i = 0; i < nec; i++) {
+        omega[i] = 0;
+        for (j = 0; j <= i && j <= len; j++)
+            omega[i] ^= gf_mul(lambda[j], s[i - j]);
+    }
+    for (j = 0; j < n; j++) {
+        int power = n - 1 - j;
+        unsigned char xinv = gf_exp[(255 - power) % 255], dl = 0, xp = 1;
+        if (poly_eval(lambda, len + 1, xinv))
+            continue;
+        // Formal derivative of lambda: odd terms only
+        for (i = 1; i <= len; i += 2) {
+            dl ^= gf_mul(lambda[i], xp);
+            xp = gf_mul(xp, gf_mul(xinv, xinv));
+        }
+        if (!dl)
+            return -1;
+        cw[j] ^= gf_mul(gf_exp[power], gf_div(poly_eval(omega, nec, xinv), dl));
+        errors++;
+    }
+    return errors == len ? errors : -1;
+}
+
+/*
+ * Read the format information, trying both copies.
+ *
+ * Returns:
+ *  5 bit format (level and mask), or -1 if unreadable
+ */
+static int read_format(const struct grid *g) {
+    int a = 0, b = 0, i, best = -1, bestdist = 4, dim = g->dim;
+
+    // Copy around the top left finder
+    for (i = 0; i < 6; i++)
+        a = a << 1 | g->m[8][i];
+    a = a << 1 | g->m[8][7];
+    a = a << 1 | g->m[8][8];
+    a = a << 1 | g->m[7][8];
+    for (i = 5; i >= 0; i--)
+        a = a << 1 | g->m[i][8];
+    // Copy split between the other two finders
+    for (i = dim - 1; i >= dim - 7; i--)
+        b = b << 1 | g->m[i][8];
+    for (i = dim - 8; i < dim; i++)
+        b = b << 1 | g->m[8][i];
+    for (i = 0; i < 32; i++) {
+        // BCH(15,5) code word of i, masked
+        int code = i << 10, k, da, db;
+        for (k = 14; k >= 10; k--)
+            if (code & 1 << k)
+                code ^= 0x537 << (k - 10);
+        code = (i << 10 | code) ^ 0x5412;
+        da = __builtin_popcount(code ^ a);
+        db = __builtin_popcount(code ^ b);
+        if (da < bestdist || db < bestdist) {
+            bestdist = da < db ? da : db;
+            best = i;
+        }
+    }
+    return best;
+}
+
+static int mask_bit(int mask, int r, int c) {
+    switch (mask) {
+        case 0: return (r + c) % 2 == 0;
+        case 1: return r % 2 == 0;
+        case 2: return c % 3 == 0;
+        case 3: return (r + c) % 3 == 0;
+        case 4: return (r / 2 + c / 3) % 2 == 0;
+        case 5: return r * c % 2 + r * c % 3 == 0;
+        case 6: return (r * c % 2 + r * c % 3) % 2 == 0;
+        default: return ((r + c) % 2 + r * c % 3) % 2 == 0;
+    }
+}
+
+/*
+ * Read the codewords of a sampled symbol in placement order, unmasking
+ * them on the way.
+ *
+ * Returns:
+ *  Number of codewords read
+ */
+static int read_codewords(const struct grid *g, int mask, unsigned char *out, int max) {
+    int col, i, k, up = 1, bits = 0, n = 0, byte = 0;
+
+    for (col = g->dim - 1; col > 0; col -= 2) {
+        if (col == 6) // skip the vertical timing pattern
+            col--;
+        for (i = 0; i < g->dim; i++) {
+            int r = up ? g->dim - 1 - i : i;
+            for (k = 0; k < 2; k++) {
+                int c = col - k;
+                if (g->fn[r][c])
+                    continue;
+                byte = byte << 1 | (g->m[r][c] ^ mask_bit(mask, r, c));
+                if (++bits == 8) {
+                    if (n < max)
+                        out[n++] = byte;
+                    bits = byte = 0;
+                }
+            }
+        }
+        up = !up;
+    }
+    return n;
+}
+
+struct bitreader {
+    const unsigned char *p;
+    int n, pos;             // length and position in bits
+};
+
+static int get_bits(struct bitreader *br, int count) {
+    int v = 0;
+    if (br->pos + count > br->n)
+        return -1;
+    while (count--) {
+        v = v << 1 | (br->p[br->pos >> 3] >> (7 - (br->pos & 7)) & 1);
+        br->pos++;
+    }
+    return v;
+}
+
+/*
+ * Decode the data segments of a symbol.
+ *
+ * Returns:
+ *  0 on success, -1 on invalid or unsupported data
+ */
+static int parse_segments(const unsigned char *data, int ndata, int version,
+        struct qrcode *qr) {
+    struct bitreader br = { data, ndata * 8, 0 };
+    int big = version >= 10, mode, count, v;
+
+    qr->len = 0;
+    while ((mode = get_bits(&br, 4)) > 0) {
+        switch (mode) {
+            case 1: // numeric
+                count = get_bits(&br, big ? 12 : 10);
+                if (count < 0)
+                    return -1;
+                // Groups of three digits in 10 bits, the rest in 7 or 4
+                while (count > 0) {
+                    int digits = count >= 3 ? 3 : count, k;
+                    v = get_bits(&br, digits == 3 ? 10 : digits == 2 ? 7 : 4);
+                    if (v < 0 || qr->len + digits >= QR_MAXTEXT)
+                        return -1;
+                    for (k = digits - 1; k >= 0; k--) {
+                        qr->text[qr->len + k] = '0' + v % 10;
+                        v /= 10;
+                    }
+                    qr->len += digits;
+                    count -= digits;
+                }
+                break;
+            case 2: // alphanumeric
+                count = get_bits(&br, big ? 11 : 9);
+                if (count < 0)
+                    return -1;
+                for (; count >= 2; count -= 2) {
+                    v = get_bits(&br, 11);
+                    if (v < 0 || v >= 45 * 45 || qr->len + 2 >= QR_MAXTEXT)
+                        return -1;
+                    qr->text[qr->len++] = alnum[v / 45];
+                    qr->text[qr->len++] = alnum[v % 45];
+                }
+                if (count) {
+                    v = get_bits(&br, 6);
+                    if (v < 0 || v >= 45 || qr->len + 1 >= QR_MAXTEXT)
+                        return -1;
+                    qr->text[qr->len++] = alnum[v];
+                }
+                break;
+            case 4: // byte
+                count = get_bits(&br, big ? 16 : 8);
+                if (count < 0)
+                    return -1;
+                while (count--) {
+                    v = get_bits(&br, 8);
+                    if (v < 0 || qr->len + 1 >= QR_MAXTEXT)
+                        return -1;
+                    qr->text[qr->len++] = v;
+                }
+                break;
+            case 7: // ECI designator, text is passed through as bytes
+                v = get_bits(&br, 8);
+                if (v >= 0x80 && get_bits(&br, (v & 0xc0) == 0x80 ? 8 : 16) < 0)
+                    return -1;
+                break;
+            case 3: // structured append header
+                if (get_bits(&br, 16) < 0)
+                    return -1;
+                break;
+            case 5: // FNC1 markers carry no data
+                break;
+            case 9:
+                if (get_bits(&br, 8) < 0)
+                    return -1;
+                break;
+            default: // Kanji and reserved modes
+                return -1;
+        }
+    }
+    qr->text[qr->len] = '\0';
+    return 0;
+}
+
+/*
+ * Decode a sampled symbol.
+ *
+ * Returns:
+ *  0 on success, -1 on error
+ */
+static int decode_grid(struct grid *g, int version, struct qrcode *qr) {
+    unsigned char raw[MAXCODEWORDS], data[MAXCODEWORDS];
+    unsigned char block[MAXBLOCKS][160];
+    const unsigned char *eb;
+    int format, level, nblocks, ndata[MAXBLOCKS], nraw, b, k, pos, maxdata;
+    int datalen = 0, corrected = 0;
+
+    format = read_format(g);
+    if (format < 0)
+        return -1;
+    level = format >> 3;
+    mark_functions(g, version);
+    nraw = read_codewords(g, format & 7, raw, sizeof(raw));
+    eb = ecblocks[version - 1][levelrow[level]];
+    nblocks = eb[1] + eb[3];
+    maxdata = eb[3] ? eb[4] : eb[2];
+    for (b = 0; b < nblocks; b++)
+        ndata[b] = b < eb[1] ? eb[2] : eb[4];
+    if (nraw != eb[1] * (eb[2] + eb[0]) + eb[3] * (eb[4] + eb[0]))
+        return -1;
+    // De-interleave: data codewords column by column, then error correction
+    pos = 0;
+    for (k = 0; k < maxdata; k++)
+        for (b = 0; b < nblocks; b++)
+            if (k < ndata[b])
+                block[b][k] = raw[pos++];
+    for (k = 0; k < eb[0]; k++)
+        for (b = 0; b < nblocks; b++)
+            block[b][ndata[b] + k] = raw[pos++];
+    for (b = 0; b < nblocks; b++) {
+        int fixed = rs_correct(block[b], ndata[b] + eb[0], eb[0]);
+        if (fixed < 0)
+            return -1;
+        corrected += fixed;
+        memcpy(data + datalen, block[b], ndata[b]);
+        datalen += ndata[b];
+    }
+    if (parse_segments(data, datalen, version, qr))
+        return -1;
+    qr->version = version;
+    qr->level = levels[level];
+    qr->corrected = corrected;
+    return 0;
+}
+
+/*
+ * Sample and decode the symbol between three finders. The version is
+ * estimated from the finder spacing, and it and its neighbours are tried
+ * in order of how well their timing patterns line up.
+ *
+ * Returns:
+ *  0 on success, -1 on error
+ */
+static int decode_symbol(const struct image *page, int thr, const struct finder *f,
+        struct qrcode *qr) {
+    struct grid g;
+    int versions[3], errors[3], n = 0, i, j, est;
+    double module = (f[0].module + f[1].module + f[2].module) / 3;
+
+    est = (int) floor(((sqrt(dist2(&f[0], &f[1])) + sqrt(dist2(&f[0], &f[2]))) / 2 /
+            module + 7 - 17) / 4 + 0.5);
+    for (i = est - 1; i <= est + 1; i++) {
+        if (i < 1 || i > MAXVERSION)
+            continue;
+        versions[n] = i;
+        errors[n] = sample_grid(page, thr, f, 17 + 4 * i, &g);
+        // Insertion sort by timing pattern errors
+        for (j = n++; j > 0 && errors[j] < errors[j - 1]; j--) {
+            int t = errors[j];
+            errors[j] = errors[j - 1];
+            errors[j - 1] = t;
+            t = versions[j];
+            versions[j] = versions[j - 1];
+            versions[j - 1] = t;
+        }
+    }
+    for (i = 0; i < n; i++) {
+        sample_grid(page, thr, f, 17 + 4 * versions[i], &g);
+        if (!decode_grid(&g, versions[i], qr))
+            return 0;
+    }
+    return -1;
+}
+
+/*
+ * Find and decode a QR code on a page.
+ *
+ * Params:
+ *  page        Page image
+ *  halvings    Times to halve the page before searching for finders
+ *  qr          Decoded symbol
+ *  timing      Stage times, or NULL
+ *
+ * Returns:
+ *  1 if a code was decoded, 0 if none was found or it could not be read
+ */
+int qr_scan(const struct image *page, int halvings, struct qrcode *qr,
+        struct qrtiming *timing) {
+    struct image small, next, bin;
+    struct finder found[MAXFINDERS], f[3];
+    long long t0 = image_clock(), t1;
+    int thr, nfound, i, scale = 1 << halvings, ok = 0;
+
+    gf_init();
+    small = *page;
+    for (i = 0; i < halvings; i++) {
+        image_downsample(&small, &next);
+        if (i)
+            image_free(&small);
+        if (!next.px)
+            return 0;
+        small = next;
+    }
+    thr = image_threshold(&small);
+    image_binarize(&small, &bin, thr);
+    if (halvings)
+        image_free(&small);
+    if (!bin.px)
+        return 0;
+    nfound = find_finders(&bin, found);
+    image_free(&bin);
+    t1 = image_clock();
+    if (timing) {
+        timing->locate_ns = t1 - t0;
+        timing->candidates = nfound;
+    }
+    if (choose_finders(found, nfound, f))
+        goto out;
+
+    // Back to full resolution; coordinates are of pixel edges, so they
+    // scale directly
+    for (i = 0; i < 3; i++) {
+        f[i].x *= scale;
+        f[i].y *= scale;
+        f[i].module *= scale;
+        refine_finder(page, thr, &f[i]);
+    }
+    ok = !decode_symbol(page, thr, f, qr);
+    if (ok) {
+        for (i = 0; i < 3; i++) {
+            qr->x[i] = f[i].x;
+            qr->y[i] = f[i].y;
+        }
+        qr->module = (f[0].module + f[1].module + f[2].module) / 3;
+    }
+out:
+    if (timing)
+        timing->decode_ns = image_clock() - t1;
+    return ok;
+}
+
+/*
+ * Replace the characters of a code's text other than printable ASCII,
+ * which a byte-mode code may hold, with '?', so that the text is one line
+ * of its full length.
+ */
+void qr_printable(struct qrcode *qr) {
+    int i;
+
+    for (i = 0; i < qr->len; i++)
+        if (qr->text[i] < ' ' || qr->text[i] > '~')
+            qr->text[i] = '?';
+}
@@ -0,0 +1,37 @@
+#ifndef QR_H
+#define QR_H
+
+/*
+ * qr
+ *
+ * Locating and decoding a QR code on a scanned page. Finder patterns are
+ * found on a downsampled ink mask, then only the symbol region is sampled
+ * at full resolution. Versions 1 to 10 (up to 57x57 modules, 271 bytes)
+ * are decoded, with Reed-Solomon error correction and numeric,
+ * alphanumeric and byte segments.
+ */
+#include "image.h"
+
+#define QR_MAXTEXT 512
+
+struct qrcode {
+    int version;            // 1 to 10
+    char level;             // error correction level: L, M, Q or H
+    int corrected;          // codewords corrected
+    double x[3], y[3];      // finder centers: top left, top right, bottom left
+    double module;          // module size (pixels)
+    int len;                // length of text
+    char text[QR_MAXTEXT];  // decoded text, null terminated
+};
+
+struct qrtiming {
+    long long locate_ns;    // downsample, binarize and finder search
+    long long decode_ns;    // full resolution sampling and decoding
+    int candidates;         // finder pattern candidates
+};
+
+int qr_scan(const struct image *page, int halvings, struct qrcode *qr,
+        struct qrtiming *timing);
+void qr_printable(struct qrcode *qr);
+
+#endif
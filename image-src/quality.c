@@ -0,0 +1,283 @@
+/*
+ * quality
+ *
+ * Scan quality measures. The per-pixel passes (edges, column levels and
+ * ink counts) work sixteen pixels at a time with vector extensions.
+ *
+ * Contrast is the difference between the mean levels of the two classes
+ * split by the Otsu threshold.
+ *
+ * Edge width comes from the gradient energy: across an edge that rises by
+ * the contrast C over b pixels, the differences between neighbouring pixels
+ * sum to C and their squares to C * C / b, so b = C * sum |d| / sum d * d.
+ * Differences below C / 8 are left out as noise and paper texture.
+ *
+ * Skew is found from ink counts per row in vertical strips of a half size
+ * copy of the band: the strips are slid against each other as if the page
+ * were turned by each candidate angle, and the angle whose summed row
+ * profile is peakiest (largest sum of squares) lines the text up.
+ *
+ * Streaks from dirt on the glass of a sheet-fed scanner run down the whole
+ * page at a fixed column, through the blank top margin as well as the
+ * print. The band is cut into QUALITY_PARTS slices, and a slice with
+ * hardly any column darker than paper is blank margin. A streak is a
+ * narrow run of columns darker than the columns on both sides in every
+ * blank slice, and in every slice of print where the columns on both
+ * sides are paper; where print lies beside it, it cannot be told from the
+ * print and is not looked at. A printed rule (a frame or column line)
+ * does not run into the margin, however dark it is, so a band with no
+ * blank slice has no streaks found.
+ *
+ * Author:
+ *  Jerry Lue
+ */
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <math.h>
+#include "quality.h"
+
+#define QUALITY_PARTS 16    // slices of the band, 1/8 inch of 600 rows at 300 dpi
+#define STREAK_WIDTH 8      // widest streak, pixels
+#define STREAK_SIDE 12      // reach of the neighbouring columns, pixels
+#define SKEW_STRIPS 16
+#define SKEW_MAX 5.0        // degrees
+#define SKEW_STEP 0.05
+
+typedef unsigned int u32x4 __attribute__((vector_size(16)));
+
+/*
+ * Absolute differences of two vectors of pixels.
+ */
+static inline u8x16 absdiff(u8x16 a, u8x16 b) {
+    u8x16 gt = (u8x16) (a > b);
+    return ((a - b) & gt) | ((b - a) & ~gt);
+}
+
+/*
+ * Add the sixteen bytes of a vector into four 32-bit lanes: sum of the
+ * bytes, and sum of their squares.
+ */
+static inline void accumulate(u8x16 d, u32x4 *sum, u32x4 *sq) {
+    const u16x8 lo = { 255, 255, 255, 255, 255, 255, 255, 255 };
+    u16x8 even = (u16x8) d & lo, odd = (u16x8) d >> 8, s = even + odd;
+    u16x8 e2 = even * even, o2 = odd * odd;
+
+    *sum += ((u32x4) s & 0xffff) + ((u32x4) s >> 16);
+    *sq += ((u32x4) e2 & 0xffff) + ((u32x4) e2 >> 16) + ((u32x4) o2 & 0xffff) + ((u32x4) o2 >> 16);
+}
+
+/*
+ * Find the paper and ink levels.
+ */
+static void contrast(const struct image *band, struct quality *q) {
+    unsigned long hist[256] = { 0 };
+    double n[2] = { 0, 0 }, s[2] = { 0, 0 };
+    int thr = image_threshold(band), x, y;
+
+    for (y = 0; y < band->height; y++) {
+        const unsigned char *row = band->px + (size_t) y * band->stride;
+        for (x = 0; x < band->width; x++)
+            hist[row[x]]++;
+    }
+    for (x = 0; x < 256; x++) {
+        n[x >= thr] += hist[x];
+        s[x >= thr] += (double) x * hist[x];
+    }
+    q->ink = n[0] ? (int) (s[0] / n[0] + 0.5) : 0;
+    q->paper = n[1] ? (int) (s[1] / n[1] + 0.5) : 255;
+    q->contrast = n[0] && n[1] ? q->paper - q->ink : 0;
+}
+
+/*
+ * Measure the mean width of ink edges.
+ */
+static void sharpness(const struct image *band, struct quality *q) {
+    unsigned long long sum = 0, sq = 0;
+    u8x16 least;
+    int x, y, i;
+
+    memset(&least, q->contrast / 8 > 1 ? q->contrast / 8 : 1, sizeof(least));
+    for (y = 0; y + 1 < band->height; y++) {
+        const unsigned char *row = band->px + (size_t) y * band->stride;
+        u32x4 rsum = { 0, 0, 0, 0 }, rsq = { 0, 0, 0, 0 };
+        // Stop short of the right edge, where the white padding would
+        // make an edge of a dark scanner background
+        for (x = 0; x + 17 <= band->width; x += 16) {
+            u8x16 a, r, b, d;
+            memcpy(&a, row + x, 16);
+            memcpy(&r, row + x + 1, 16);
+            memcpy(&b, row + band->stride + x, 16);
+            d = absdiff(a, r);
+            accumulate(d & (u8x16) (d >= least), &rsum, &rsq);
+            d = absdiff(a, b);
+            accumulate(d & (u8x16) (d >= least), &rsum, &rsq);
+        }
+        for (i = 0; i < 4; i++) {
+            sum += rsum[i];
+            sq += rsq[i];
+        }
+    }
+    q->edge = sq ? (double) q->contrast * sum / sq : 0;
+}
+
+/*
+ * Find narrow columns that are darker than their neighbours through the
+ * blank margin and wherever paper lies on both sides of them.
+ */
+static void streaks(const struct image *band, struct quality *q) {
+    const u16x8 lo = { 255, 255, 255, 255, 255, 255, 255, 255 };
+    const int sidew = STREAK_SIDE - STREAK_WIDTH / 2;
+    int w = band->width, part = band->height / QUALITY_PARTS, least = q->contrast / 10;
+    unsigned int *col = malloc((size_t) band->stride * sizeof(*col)), light;
+    unsigned char *dark = malloc(w);
+    int p, x, y, run, dim, blank, blanks = 0;
+
+    q->streaks = 0;
+    if (!col || !dark || part < 1)
+        goto out;
+    least = least > 8 ? least : 8;
+    light = (unsigned int) (q->paper > least ? q->paper - least : 0) * part;
+    memset(dark, 1, w);
+    for (p = 0; p < QUALITY_PARTS; p++) {
+        // Column sums of the slice, even and odd columns in 16-bit lanes,
+        // spilled to 32 bits before they can overflow
+        memset(col, 0, (size_t) band->stride * sizeof(*col));
+        for (y = p * part; y < (p + 1) * part; ) {
+            int end = y + 256 < (p + 1) * part ? y + 256 : (p + 1) * part;
+            for (x = 0; x < w; x += 16) {
+                u16x8 even = { 0 }, odd = { 0 };
+                int yy, i;
+                for (yy = y; yy < end; yy++) {
+                    u16x8 v;
+                    memcpy(&v, band->px + (size_t) yy * band->stride + x, 16);
+                    even += v & lo;
+                    odd += v >> 8;
+                }
+                for (i = 0; i < 8; i++) {
+                    col[x + 2 * i] += even[i];
+                    col[x + 2 * i + 1] += odd[i];
+                }
+            }
+            y = end;
+        }
+        // Margin, unless more columns are dim than streaks would make
+        for (x = dim = 0; x < w; x++)
+            dim += col[x] < light;
+        blank = dim < w / 64;
+        blanks += blank;
+        for (x = STREAK_SIDE; x < w - STREAK_SIDE; x++) {
+            unsigned int left = 0, right = 0, side;
+            int i;
+            for (i = STREAK_WIDTH / 2; i < STREAK_SIDE; i++) {
+                left += col[x - i - 1];
+                right += col[x + i + 1];
+            }
+            left /= sidew;
+            right /= sidew;
+            // Print beside the column hides a streak there
+            if (!blank && (left < light || right < light))
+                continue;
+            side = left < right ? left : right;
+            if (side < col[x] + (unsigned int) least * part)
+                dark[x] = 0;
+        }
+    }
+    // Runs of dark columns too narrow to be print, if there was margin to
+    // tell them from printed rules
+    for (x = STREAK_SIDE, run = 0; blanks && x <= w - STREAK_SIDE; x++) {
+        if (x < w - STREAK_SIDE && dark[x]) {
+            run++;
+            continue;
+        }
+        if (run && run <= STREAK_WIDTH) {
+            if (q->streaks < QUALITY_STREAKS)
+                q->streak_x[q->streaks] = x - (run + 1) / 2;
+            q->streaks++;
+        }
+        run = 0;
+    }
+out:
+    free(col);
+    free(dark);
+}
+
+/*
+ * Estimate the skew of the printed lines.
+ */
+static void skew(const struct image *band, struct quality *q) {
+    struct image half;
+    int *prof = NULL, sw, h, s, x, y, best = 0;
+    long long bestscore = 0;
+    double a;
+    u8x16 t;
+
+    if (!q->contrast)
+        return;
+    image_downsample(band, &half);
+    if (!half.px)
+        return;
+    sw = half.width / SKEW_STRIPS / 16 * 16;
+    h = half.height;
+    if (sw < 16 || !(prof = calloc((size_t) SKEW_STRIPS * h, sizeof(*prof))))
+        goto out;
+
+    // Ink pixels per row of each strip
+    memset(&t, (q->paper + q->ink + 1) / 2, sizeof(t));
+    for (y = 0; y < h; y++) {
+        const unsigned char *row = half.px + (size_t) y * half.stride;
+        for (s = 0; s < SKEW_STRIPS; s++) {
+            u8x16 cnt = { 0 };
+            int n = 0, i;
+            for (x = s * sw; x < (s + 1) * sw; x += 16) {
+                u8x16 v;
+                memcpy(&v, row + x, 16);
+                cnt += (u8x16) (v < t) & 1;
+            }
+            for (i = 0; i < 16; i++)
+                n += cnt[i];
+            prof[s * h + y] = n;
+        }
+    }
+
+    // Peakiest profile over the candidate angles
+    for (a = -SKEW_MAX; a <= SKEW_MAX + 1e-9; a += SKEW_STEP) {
+        double tn = tan(a * M_PI / 180);
+        int off[SKEW_STRIPS];
+        long long score = 0;
+        for (s = 0; s < SKEW_STRIPS; s++)
+            off[s] = (int) lround((s - (SKEW_STRIPS - 1) / 2.0) * sw * tn);
+        for (y = 0; y < h; y++) {
+            long long p = 0;
+            for (s = 0; s < SKEW_STRIPS; s++) {
+                int yy = y + off[s];
+                if (yy >= 0 && yy < h)
+                    p += prof[s * h + yy];
+            }
+            score += p * p;
+        }
+        if (score > bestscore) {
+            bestscore = score;
+            best = (int) lround(a / SKEW_STEP);
+        }
+    }
+    q->skew = best * SKEW_STEP;
+out:
+    free(prof);
+    image_free(&half);
+}
+
+/*
+ * Measure the scan quality of the top band of a page.
+ *
+ * Params:
+ *  band    Top rows of the page
+ *  q       Measures
+ */
+void quality_check(const struct image *band, struct quality *q) {
+    memset(q, 0, sizeof(*q));
+    contrast(band, q);
+    sharpness(band, q);
+    streaks(band, q);
+    skew(band, q);
+}
@@ -0,0 +1,27 @@
+#ifndef QUALITY_H
+#define QUALITY_H
+
+/*
+ * quality
+ *
+ * Scan quality measures of the top band of a page, quick enough to decide
+ * whether a page needs rescanning before the scanner has finished sending
+ * it: contrast between paper and ink, sharpness as the width of ink edges,
+ * skew of the printed lines, and streaks left by dirt on the scanner glass.
+ */
+#include "image.h"
+
+#define QUALITY_STREAKS 8
+
+struct quality {
+    int paper, ink;             // mean levels of paper and of ink
+    int contrast;               // paper - ink
+    double edge;                // mean edge width in pixels, lower is sharper
+    double skew;                // degrees, positive is clockwise
+    int streaks;                // dark vertical lines running through the band
+    int streak_x[QUALITY_STREAKS];
+};
+
+void quality_check(const struct image *band, struct quality *q);
+
+#endif
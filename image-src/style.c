@@ -0,0 +1,217 @@
+/*
+ * style
+ *
+ * Ballot style signatures and matching.
+ *
+ * A page is reduced by a pyramid of 2x downsamples to at most STYLE_WIDTH
+ * pixels wide (about 40 dpi), and an integral image of it gives the ink in
+ * any grid cell with four lookups, so grids need not divide the image
+ * evenly and can be offset freely. Cell densities are normalized to zero
+ * mean and unit variance over the page, which cancels scanner brightness
+ * and contrast, and stored as bytes around 128. Distances are sums of
+ * absolute byte differences, which compile to vector SAD instructions.
+ *
+ * Author:
+ *  Jerry Lue
+ */
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <math.h>
+#include "style.h"
+
+#define STYLE_WIDTH 320     // pyramid width signatures are taken at
+#define STYLE_CANDIDATES 8  // styles compared on the fine grid
+
+/*
+ * Compute normalized cell densities on a grid.
+ *
+ * Params:
+ *  sum     Integral image
+ *  w, h    Image size
+ *  gw, gh  Grid size
+ *  ox, oy  Grid offset (pixels)
+ *  out     gw * gh densities
+ */
+static void grid_signature(const unsigned int *sum, int w, int h, int gw, int gh,
+        double ox, double oy, unsigned char *out) {
+    double d[STYLE_FINE], mean = 0, var = 0, sd;
+    int i, j, n = gw * gh;
+
+    for (j = 0; j < gh; j++)
+        for (i = 0; i < gw; i++) {
+            int x0 = (int) (ox + (double) w * i / gw), x1 = (int) (ox + (double) w * (i + 1) / gw);
+            int y0 = (int) (oy + (double) h * j / gh), y1 = (int) (oy + (double) h * (j + 1) / gh);
+            x0 = x0 < 0 ? 0 : x0 > w ? w : x0;
+            x1 = x1 < 0 ? 0 : x1 > w ? w : x1;
+            y0 = y0 < 0 ? 0 : y0 > h ? h : y0;
+            y1 = y1 < 0 ? 0 : y1 > h ? h : y1;
+            if (x1 > x0 && y1 > y0) {
+                unsigned int s = sum[(size_t) y1 * (w + 1) + x1] - sum[(size_t) y0 * (w + 1) + x1] -
+                    sum[(size_t) y1 * (w + 1) + x0] + sum[(size_t) y0 * (w + 1) + x0];
+                d[j * gw + i] = 255 - (double) s / ((x1 - x0) * (y1 - y0));
+            } else {
+                d[j * gw + i] = 0; // off the page: paper
+            }
+            mean += d[j * gw + i];
+        }
+    mean /= n;
+    for (i = 0; i < n; i++)
+        var += (d[i] - mean) * (d[i] - mean);
+    sd = sqrt(var / n);
+    for (i = 0; i < n; i++) {
+        double q = 128 + (sd > 0 ? (d[i] - mean) / sd * 32 : 0);
+        out[i] = q < 0 ? 0 : q > 255 ? 255 : (unsigned char) (q + 0.5);
+    }
+}
+
+/*
+ * Compute the signatures of a page: the coarse grid, and the fine grid at
+ * each offset.
+ *
+ * Returns:
+ *  0 on success, -1 on error
+ */
+int style_signature(const struct image *page, struct pagesig *sig) {
+    struct image small;
+    unsigned int *sum;
+    int i, j;
+
+    image_pyramid(page, STYLE_WIDTH, &small);
+    if (!small.px)
+        return -1;
+    sum = image_integral(&small);
+    if (!sum) {
+        image_free(&small);
+        return -1;
+    }
+    grid_signature(sum, small.width, small.height, STYLE_COARSE_W, STYLE_COARSE_H,
+            0, 0, sig->coarse);
+    for (j = 0; j < STYLE_SHIFTS; j++)
+        for (i = 0; i < STYLE_SHIFTS; i++)
+            grid_signature(sum, small.width, small.height, STYLE_FINE_W, STYLE_FINE_H,
+                    (i - STYLE_SHIFTS / 2) * small.width / (4.0 * STYLE_FINE_W),
+                    (j - STYLE_SHIFTS / 2) * small.height / (4.0 * STYLE_FINE_H),
+                    sig->fine[j * STYLE_SHIFTS + i]);
+    free(sum);
+    image_free(&small);
+    return 0;
+}
+
+/*
+ * Make a style from the signature of its blank reference page.
+ */
+void style_reference(const struct pagesig *sig, const char *name, struct stylesig *style) {
+    memset(style->name, 0, sizeof(style->name));
+    strncpy(style->name, name, sizeof(style->name) - 1);
+    memcpy(style->coarse, sig->coarse, sizeof(style->coarse));
+    memcpy(style->fine, sig->fine[STYLE_SHIFTS * STYLE_SHIFTS / 2], sizeof(style->fine));
+}
+
+/*
+ * Sum of absolute differences.
+ */
+static int sad(const unsigned char *a, const unsigned char *b, int n) {
+    int i, s = 0;
+    for (i = 0; i < n; i++)
+        s += abs(a[i] - b[i]);
+    return s;
+}
+
+/*
+ * Find the style closest to a page.
+ *
+ * Params:
+ *  styles  Style database
+ *  n       Number of styles
+ *  sig     Page signature
+ *  match   Best match
+ */
+void style_match(const struct stylesig *styles, int n, const struct pagesig *sig,
+        struct stylematch *match) {
+    int best[STYLE_CANDIDATES], dist[STYLE_CANDIDATES], nbest = 0, i, j, k;
+
+    // Coarse: keep the closest few styles, insertion sorted
+    for (i = 0; i < n; i++) {
+        int d = sad(styles[i].coarse, sig->coarse, STYLE_COARSE);
+        if (nbest == STYLE_CANDIDATES && d >= dist[nbest - 1])
+            continue;
+        if (nbest < STYLE_CANDIDATES)
+            nbest++;
+        for (j = nbest - 1; j > 0 && dist[j - 1] > d; j--) {
+            dist[j] = dist[j - 1];
+            best[j] = best[j - 1];
+        }
+        dist[j] = d;
+        best[j] = i;
+    }
+    // Fine: each candidate at its best offset
+    match->style = -1;
+    match->score = match->runnerup = STYLE_FINE * 255;
+    for (k = 0; k < nbest; k++) {
+        int d = STYLE_FINE * 255;
+        for (j = 0; j < STYLE_SHIFTS * STYLE_SHIFTS; j++) {
+            int s = sad(styles[best[k]].fine, sig->fine[j], STYLE_FINE);
+            if (s < d)
+                d = s;
+        }
+        if (d < match->score) {
+            match->runnerup = match->score;
+            match->score = d;
+            match->style = best[k];
+        } else if (d < match->runnerup) {
+            match->runnerup = d;
+        }
+    }
+}
+
+/*
+ * Load a style database.
+ *
+ * Params:
+ *  path    Database file
+ *  styles  Set to the newly allocated styles
+ *
+ * Returns:
+ *  Number of styles, or -1 on error
+ */
+int style_load(const char *path, struct stylesig **styles) {
+    FILE *fp = fopen(path, "rb");
+    char magic[sizeof(STYLE_MAGIC)];
+    int n;
+
+    if (!fp)
+        return -1;
+    if (fread(magic, sizeof(magic), 1, fp) != 1 || memcmp(magic, STYLE_MAGIC, sizeof(magic)) ||
+            fread(&n, sizeof(n), 1, fp) != 1 || n < 0 || n > 100000 ||
+            !(*styles = malloc((size_t) (n ? n : 1) * sizeof(**styles)))) {
+        fclose(fp);
+        return -1;
+    }
+    if (fread(*styles, sizeof(**styles), n, fp) != (size_t) n) {
+        free(*styles);
+        n = -1;
+    }
+    fclose(fp);
+    return n;
+}
+
+/*
+ * Save a style database.
+ *
+ * Returns:
+ *  0 on success, -1 on error
+ */
+int style_save(const char *path, const struct stylesig *styles, int n) {
+    FILE *fp = fopen(path, "wb");
+
+    if (!fp)
+        return -1;
+    if (fwrite(STYLE_MAGIC, sizeof(STYLE_MAGIC), 1, fp) != 1 ||
+            fwrite(&n, sizeof(n), 1, fp) != 1 ||
+            fwrite(styles, sizeof(*styles), n, fp) != (size_t) n) {
+        fclose(fp);
+        return -1;
+    }
+    return fclose(fp) ? -1 : 0;
+}
@@ -0,0 +1,51 @@
+#ifndef STYLE_H
+#define STYLE_H
+
+/*
+ * style
+ *
+ * Ballot style identification. Each style is described by a signature of
+ * ink density on a coarse and a fine grid over the page, computed offline
+ * from a blank reference ballot and stored in a style database. A scanned
+ * page is reduced to the same signatures and matched coarse to fine: the
+ * coarse grid ranks every style, and only the best few are compared on
+ * the fine grid, at several small offsets to allow for feed misalignment.
+ */
+#include "image.h"
+
+#define STYLE_NAME 32
+#define STYLE_COARSE_W 8
+#define STYLE_COARSE_H 10
+#define STYLE_FINE_W 32
+#define STYLE_FINE_H 40
+#define STYLE_COARSE (STYLE_COARSE_W * STYLE_COARSE_H)
+#define STYLE_FINE (STYLE_FINE_W * STYLE_FINE_H)
+#define STYLE_SHIFTS 5      // fine offsets per axis, a quarter cell apart
+
+#define STYLE_MAGIC "VBSTYLE1"
+
+struct stylesig {
+    char name[STYLE_NAME];
+    unsigned char coarse[STYLE_COARSE];
+    unsigned char fine[STYLE_FINE];
+};
+
+struct pagesig {
+    unsigned char coarse[STYLE_COARSE];
+    unsigned char fine[STYLE_SHIFTS * STYLE_SHIFTS][STYLE_FINE];
+};
+
+struct stylematch {
+    int style;              // index of best style, -1 if none
+    int score;              // fine distance of best style, lower is closer
+    int runnerup;           // fine distance of second best style
+};
+
+int style_signature(const struct image *page, struct pagesig *sig);
+void style_reference(const struct pagesig *sig, const char *name, struct stylesig *style);
+void style_match(const struct stylesig *styles, int n, const struct pagesig *sig,
+        struct stylematch *match);
+int style_load(const char *path, struct stylesig **styles);
+int style_save(const char *path, const struct stylesig *styles, int n);
+
+#endif
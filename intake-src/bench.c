@@ -0,0 +1,535 @@
+/*
+ * Usage:
+ *  bench [-c] [name]
+ *
+ * Examples:
+ *  Run all benchmarks
+ *      ./intake-src/bench
+ *  Run benchmarks whose name contains "status", CSV output
+ *      ./intake-src/bench -c status
+ *
+ * Description:
+ *  Microbenchmarks of the kernels on the intake hot path. Each benchmark
+ *  is calibrated to run for at least 10 ms per sample, then sampled
+ *  SAMPLES times on a single pinned CPU. The median and minimum time per
+ *  operation are reported, along with the median CPU cycles per operation
+ *  where the kernel allows access to the cycle counter (perf events).
+ *  Medians of pinned runs are stable enough to compare between builds on
+ *  the same host.
+ *
+ * Author:
+ *  Jerry Lue
+ */
+#define _GNU_SOURCE
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <sched.h>
+#include <unistd.h>
+#include <sys/ioctl.h>
+#include <sys/syscall.h>
+#include <linux/perf_event.h>
+#include "decode.h"
+#include "status.h"
+#include "heartbeat.h"
+#include "intakestate.h"
+#include "manifest.h"
+#include "binlog.h"
+#include "merkle.h"
+#include "journal.h"
+#include "peers.h"
+
+#define SAMPLES 15
+#define MIN_SAMPLE_NS 10000000LL
+
+struct bench {
+    const char *name;
+    const char *op;         // what one operation is
+    void (*setup)(void);
+    void (*run)(long n);
+    long long *untimed;     // ns of run() spent outside the kernel, if any
+};
+
+static volatile long sink;
+static int cyclefd = -1;
+
+static long long now_ns(void) {
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return ts.tv_sec * 1000000000LL + ts.tv_nsec;
+}
+
+/*
+ * Kernels
+ */
+static int keycodes[256];
+
+static void setup_keymap(void) {
+    int i, n = 0, code;
+    for (code = 0; n < 256; code = (code + 1) % KEY_MAX)
+        if (keymap(code, 0))
+            keycodes[n++] = code;
+    for (i = 255; i > 0; i--) { // shuffle
+        int j = rand() % (i + 1), t = keycodes[i];
+        keycodes[i] = keycodes[j];
+        keycodes[j] = t;
+    }
+}
+
+static void run_keymap(long n) {
+    long i, sum = 0;
+    for (i = 0; i < n; i++)
+        sum += keymap(keycodes[i & 255], i & 1);
+    sink = sum;
+}
+
+#define BENCHCODE "VB-2016-0042-7F3A9C2E81D4"
+#define LONGCODE 1000 // characters in a 2D code payload
+
+static struct input_event events[8 * (LONGCODE + 1)];
+static int nevents;
+
+static void add_event(int type, int code, int value) {
+    events[nevents].type = type;
+    events[nevents].code = code;
+    events[nevents++].value = value;
+}
+
+/*
+ * Build the events a scanner sends for a code: key down, key up and sync
+ * for each character, with shift around uppercase, then ENTER.
+ */
+static void build_events(const char *text) {
+    const char *p;
+    int code, shift;
+
+    nevents = 0;
+    for (p = text; *p; p++) {
+        for (shift = 0; shift < 2; shift++)
+            for (code = 0; code < KEY_MAX; code++)
+                if (keymap(code, shift) == *p)
+                    goto found;
+        continue;
+found:
+        if (shift)
+            add_event(EV_KEY, KEY_LEFTSHIFT, 1);
+        add_event(EV_KEY, code, 1);
+        add_event(EV_SYN, SYN_REPORT, 0);
+        add_event(EV_KEY, code, 0);
+        if (shift)
+            add_event(EV_KEY, KEY_LEFTSHIFT, 0);
+        add_event(EV_SYN, SYN_REPORT, 0);
+    }
+    add_event(EV_KEY, KEY_ENTER, 1);
+}
+
+static void setup_decode(void) {
+    build_events(BENCHCODE);
+}
+
+/*
+ * A code long enough to spill out of the decoder's inline buffer.
+ */
+static void setup_decode_long(void) {
+    static char text[LONGCODE + 1];
+    int i;
+    for (i = 0; i < LONGCODE; i++)
+        text[i] = BENCHCODE[i % (sizeof(BENCHCODE) - 1)];
+    build_events(text);
+}
+
+static void run_decode(long n) {
+    struct decoder dec;
+    long i, sum = 0;
+    decoder_init(&dec, CODE_LIMIT, 50000);
+    for (i = 0; i < n; i++) {
+        decoder_reset(&dec);
+        sum += decode_events(&dec, events, nevents);
+    }
+    sink = sum + dec.len;
+    decoder_free(&dec);
+}
+
+static struct boxstatus benchstatus;
+
+static void run_status_write(long n) {
+    long i;
+    for (i = 0; i < n; i++)
+        status_set(&benchstatus, i & 1 ? "accept" : "pending");
+}
+
+static void run_status_read(long n) {
+    struct boxstatus copy;
+    long i, sum = 0;
+    for (i = 0; i < n; i++) {
+        status_read(&benchstatus, &copy);
+        sum += copy.sheets;
+    }
+    sink = sum;
+}
+
+static struct hbslot benchslot;
+
+static void run_heartbeat(long n) {
+    long i;
+    for (i = 0; i < n; i++)
+        hb_beat(&benchslot);
+}
+
+static struct intakestate benchstate;
+
+static void setup_state(void) {
+    char path[] = "/tmp/votebox-bench-XXXXXX";
+    int fd = mkstemp(path);
+    if (fd < 0 || state_open(path, &benchstate)) {
+        perror("Cannot open state file");
+        exit(1);
+    }
+    close(fd);
+    unlink(path);
+    state_set_code(&benchstate, BENCHCODE);
+}
+
+static void run_state(long n) {
+    long i;
+    for (i = 0; i < n; i++) {
+        benchstate.phase = i % 5;
+        state_commit(&benchstate);
+    }
+}
+
+#define MANIFEST_CODES 1000000
+#define MANIFEST_DELTA 1000
+
+static const struct manifest *benchmanifest;
+static char probes[4096][16];
+
+/*
+ * A manifest of a million codes plus a delta, looked up half hits and
+ * half misses.
+ */
+static void setup_manifest(void) {
+    char path[] = "/tmp/votebox-bench-XXXXXX", delta[sizeof(path) + 6];
+    FILE *f;
+    int fd = mkstemp(path), i;
+
+    snprintf(delta, sizeof(delta), "%s.delta", path);
+    if (fd < 0 || !(f = fdopen(fd, "w"))) {
+        perror("Cannot write manifest");
+        exit(1);
+    }
+    for (i = 0; i < MANIFEST_CODES; i++)
+        fprintf(f, "VB%08ld\n", i * 7919L % MANIFEST_CODES * 2);
+    fclose(f);
+    if (!(f = fopen(delta, "w"))) {
+        perror("Cannot write manifest delta");
+        exit(1);
+    }
+    for (i = 0; i < MANIFEST_DELTA; i++)
+        fprintf(f, "VB%08d\n", 2 * MANIFEST_CODES + 2 * i);
+    fclose(f);
+    if (manifest_init(path, 0)) {
+        fprintf(stderr, "Cannot load manifest\n");
+        exit(1);
+    }
+    unlink(path);
+    unlink(delta);
+    benchmanifest = manifest_get();
+    for (i = 0; i < 4096; i++)
+        snprintf(probes[i], sizeof(probes[i]), "VB%08ld", i * 2654435761L % (MANIFEST_CODES * 2));
+}
+
+static void run_manifest(long n) {
+    long i;
+    for (i = 0; i < n; i++)
+        sink += manifest_contains(benchmanifest, probes[i & 4095]);
+}
+
+#define LOG_BURST 512       // records per burst, well under half a ring
+
+static long long log_untimed;
+static FILE *devnull;
+
+/*
+ * Log lines like "Barcode read: %s\n", to /dev/null. The bench thread's
+ * records are flushed after each burst; for "binlog write" the flush is
+ * not counted, for "binlog write+format" it is.
+ */
+static void setup_binlog(void) {
+    static int started;
+    cpu_set_t set, others;
+    long ncpu = sysconf(_SC_NPROCESSORS_ONLN), i;
+
+    if (started++)
+        return;
+    for (i = 0; i < 4096; i++)
+        snprintf(probes[i], sizeof(probes[i]), "VB%08ld", i * 2654435761L % 2000000);
+    if (!(devnull = fopen("/dev/null", "w"))) {
+        perror("Cannot open /dev/null");
+        exit(1);
+    }
+    // Keep the drain thread off the bench CPU where there is another
+    sched_getaffinity(0, sizeof(set), &set);
+    CPU_ZERO(&others);
+    for (i = 0; i < ncpu - 1; i++)
+        CPU_SET(i, &others);
+    if (ncpu > 1)
+        sched_setaffinity(0, sizeof(others), &others);
+    if (binlog_start(devnull)) {
+        fprintf(stderr, "Cannot start log thread\n");
+        exit(1);
+    }
+    sched_setaffinity(0, sizeof(set), &set);
+}
+
+static void run_binlog(long n) {
+    long i;
+    for (i = 0; i < n; i++) {
+        BINLOG("Barcode read: %s\n", probes[i & 4095]);
+        if (i % LOG_BURST == LOG_BURST - 1) {
+            long long t = now_ns();
+            binlog_flush();
+            log_untimed += now_ns() - t;
+        }
+    }
+}
+
+static void setup_fprintf(void) {
+    setup_binlog();
+    setvbuf(devnull, NULL, _IONBF, 0); // like stderr
+}
+
+static void run_fprintf(long n) {
+    long i;
+    for (i = 0; i < n; i++)
+        fprintf(devnull, "Barcode read: %s\n", probes[i & 4095]);
+}
+
+static struct merkle benchtree;
+
+/*
+ * Hash journal records into a Merkle tree, as each accepted sheet does.
+ */
+static void setup_merkle(void) {
+    int i;
+
+    merkle_init(&benchtree);
+    for (i = 0; i < 4096; i++)
+        snprintf(probes[i], sizeof(probes[i]), "%d VB%08ld", i + 1, i * 2654435761L % 2000000);
+}
+
+static void run_merkle(long n) {
+    unsigned char leaf[MERKLE_HASH];
+    long i;
+
+    for (i = 0; i < n; i++) {
+        merkle_leaf(probes[i & 4095], strlen(probes[i & 4095]), leaf);
+        merkle_add(&benchtree, leaf);
+    }
+    sink += benchtree.frontier[0][0];
+}
+
+static unsigned char benchchain[SHA256_SIZE];
+
+/*
+ * Advance the journal's hash chain over records, as each accepted sheet
+ * does after its Merkle leaf.
+ */
+static void setup_chain(void) {
+    setup_merkle();
+    memset(benchchain, 0, sizeof(benchchain));
+}
+
+static void run_chain(long n) {
+    long i;
+
+    for (i = 0; i < n; i++)
+        journal_chain(benchchain, probes[i & 4095], strlen(probes[i & 4095]));
+    sink += benchchain[0];
+}
+
+#define PEERS_CODES 65536   // codes heard from the other boxes of a site
+
+static struct peers benchpeers;
+static char (*heard)[16];
+static long heardnext;
+static long long peers_untimed;
+
+/*
+ * A seen set of the codes heard at a site, as the receiver thread fills
+ * it and each sheet looks it up (half hits and half misses). Inserts
+ * start over on a cleared set once it holds PEERS_CODES; clearing is not
+ * counted.
+ */
+static void setup_peers(void) {
+    long i;
+
+    if (heard)
+        return;
+    benchpeers.set = calloc(1, sizeof(struct peerset) + PEERS_MINSET * sizeof(struct peerslot));
+    heard = malloc(PEERS_CODES * sizeof(*heard));
+    if (!benchpeers.set || !heard) {
+        fprintf(stderr, "Cannot allocate seen set\n");
+        exit(1);
+    }
+    benchpeers.set->mask = PEERS_MINSET - 1;
+    for (i = 0; i < PEERS_CODES; i++) {
+        snprintf(heard[i], sizeof(heard[i]), "VB%08ld", i * 7919L % PEERS_CODES * 2);
+        peers_heard(&benchpeers, heard[i]);
+    }
+    heardnext = PEERS_CODES; // inserts start on a cleared set
+    for (i = 0; i < 4096; i++)
+        snprintf(probes[i], sizeof(probes[i]), "VB%08ld", i * 2654435761L % (PEERS_CODES * 2));
+}
+
+static void run_peers_seen(long n) {
+    long i;
+    for (i = 0; i < n; i++)
+        sink += peers_seen(&benchpeers, probes[i & 4095]);
+}
+
+static void run_peers_insert(long n) {
+    struct peerset *s;
+    long i;
+
+    for (i = 0; i < n; i++) {
+        if (heardnext == PEERS_CODES) {
+            long long t = now_ns();
+            s = benchpeers.set;
+            memset(s->slots, 0, (s->mask + 1) * sizeof(s->slots[0]));
+            s->count = 0;
+            peers_quiescent(&benchpeers);
+            heardnext = 0;
+            peers_untimed += now_ns() - t;
+        }
+        sink += peers_heard(&benchpeers, heard[heardnext++]);
+    }
+}
+
+static const struct bench benches[] = {
+    { "keymap lookup", "key", setup_keymap, run_keymap },
+    { "event batch decode", "code", setup_decode, run_decode },
+    { "long code decode", "code", setup_decode_long, run_decode },
+    { "status seqlock write", "update", NULL, run_status_write },
+    { "status seqlock read", "read", NULL, run_status_read },
+    { "heartbeat beat", "beat", NULL, run_heartbeat },
+    { "state commit", "commit", setup_state, run_state },
+    { "manifest lookup", "code", setup_manifest, run_manifest },
+    { "binlog write", "line", setup_binlog, run_binlog, &log_untimed },
+    { "binlog write+format", "line", setup_binlog, run_binlog },
+    { "fprintf log line", "line", setup_fprintf, run_fprintf },
+    { "merkle append", "record", setup_merkle, run_merkle },
+    { "journal chain step", "record", setup_chain, run_chain },
+    { "peers seen lookup", "code", setup_peers, run_peers_seen },
+    { "peers seen insert", "code", setup_peers, run_peers_insert, &peers_untimed },
+};
+
+/*
+ * Harness
+ */
+static long long cycles(void) {
+    long long count;
+    if (cyclefd < 0 || read(cyclefd, &count, sizeof(count)) != sizeof(count))
+        return 0;
+    return count;
+}
+
+/*
+ * Open the CPU cycle counter for this thread, if available.
+ */
+static void open_cycles(void) {
+    struct perf_event_attr attr;
+
+    memset(&attr, 0, sizeof(attr));
+    attr.type = PERF_TYPE_HARDWARE;
+    attr.size = sizeof(attr);
+    attr.config = PERF_COUNT_HW_CPU_CYCLES;
+    attr.exclude_kernel = 1;
+    attr.exclude_hv = 1;
+    cyclefd = syscall(SYS_perf_event_open, &attr, 0, -1, -1, 0);
+}
+
+/*
+ * Pin to the last CPU, away from CPU 0 where most interrupts land.
+ */
+static void pin_cpu(void) {
+    cpu_set_t set;
+    long ncpu = sysconf(_SC_NPROCESSORS_ONLN);
+
+    CPU_ZERO(&set);
+    CPU_SET(ncpu > 0 ? ncpu - 1 : 0, &set);
+    sched_setaffinity(0, sizeof(set), &set);
+}
+
+static int cmp_double(const void *a, const void *b) {
+    double x = *(const double *) a, y = *(const double *) b;
+    return x < y ? -1 : x > y;
+}
+
+static void run_bench(const struct bench *b, int csv) {
+    double ns[SAMPLES], cyc[SAMPLES];
+    long n = 1;
+    int i;
+
+    if (b->setup)
+        b->setup();
+    // Calibrate, which also warms up caches and branch predictors
+    for (;;) {
+        long long t = now_ns();
+        if (b->untimed)
+            *b->untimed = 0;
+        b->run(n);
+        if (now_ns() - t - (b->untimed ? *b->untimed : 0) >= MIN_SAMPLE_NS)
+            break;
+        n *= 2;
+    }
+    for (i = 0; i < SAMPLES; i++) {
+        long long t, c;
+        if (b->untimed)
+            *b->untimed = 0;
+        t = now_ns();
+        c = cycles();
+        b->run(n);
+        cyc[i] = (double) (cycles() - c) / n;
+        ns[i] = (double) (now_ns() - t - (b->untimed ? *b->untimed : 0)) / n;
+    }
+    qsort(ns, SAMPLES, sizeof(ns[0]), cmp_double);
+    qsort(cyc, SAMPLES, sizeof(cyc[0]), cmp_double);
+
+    if (csv) {
+        printf("%s,%s,%.3f,%.3f,", b->name, b->op, ns[SAMPLES / 2], ns[0]);
+        if (cyclefd >= 0 && !b->untimed)
+            printf("%.1f", cyc[SAMPLES / 2]);
+        printf("\n");
+    } else {
+        printf("%-22s %10.2f ns/%-7s (min %.2f)", b->name, ns[SAMPLES / 2], b->op, ns[0]);
+        if (cyclefd >= 0 && !b->untimed) // cycles would include the untimed part
+            printf(" %10.1f cycles", cyc[SAMPLES / 2]);
+        printf("\n");
+    }
+}
+
+int main(int argc, char *argv[]) {
+    const char *filter = NULL;
+    int csv = 0, i;
+
+    for (i = 1; i < argc; i++) {
+        if (!strcmp(argv[i], "-c"))
+            csv = 1;
+        else
+            filter = argv[i];
+    }
+    srand(1);
+    pin_cpu();
+    open_cycles();
+    if (csv)
+        printf("benchmark,op,median_ns,min_ns,median_cycles\n");
+    else if (cyclefd < 0)
+        printf("(cycle counter not available, reporting time only)\n");
+
+    for (i = 0; i < (int) (sizeof(benches) / sizeof(benches[0])); i++)
+        if (!filter || strstr(benches[i].name, filter))
+            run_bench(&benches[i], csv);
+    return 0;
+}
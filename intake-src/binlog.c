@@ -0,0 +1,384 @@
+/*
+ * binlog
+ *
+ * Each thread's ring has one writer (the thread) and one reader (whoever
+ * holds the drain lock), so records are published by storing the head and
+ * handed back by storing the tail, with no lock on the writing side.
+ * Records are padded to 8 bytes and may wrap around the end of the ring.
+ *
+ * The drain thread sleeps on a futex. While records are coming in it
+ * wakes every BINLOG_DRAIN_MS, or sooner if a ring is half full; once a
+ * pass finds nothing it sleeps until the next record, so an idle program
+ * has no logging wakeups. A pass merges the rings by timestamp.
+ *
+ * Author:
+ *  Jerry Lue
+ */
+#define _GNU_SOURCE
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <stdarg.h>
+#include <stddef.h>
+#include <limits.h>
+#include <time.h>
+#include <unistd.h>
+#include <pthread.h>
+#include <sys/syscall.h>
+#include <linux/futex.h>
+#include "binlog.h"
+
+#define MAXREC (sizeof(struct binlogrec) + BINLOG_MAXARGS * (16 + BINLOG_MAXSTR))
+#define MAXSPEC 32
+
+enum { T_INT, T_LONG, T_LLONG, T_SIZE, T_DOUBLE, T_STR, T_PTR };
+enum { S_NEW, S_PARSING, S_PARSED, S_DIRECT };
+enum { AWAKE, DRAINING, IDLE };     // drain thread state
+
+struct binlogrec {
+    uint32_t size;                  // bytes, multiple of 8
+    uint32_t reserved;
+    const struct binlogsite *site;
+    int64_t time_ns;
+    // arguments: 8 bytes each; strings 8 bytes of length, then the
+    // null-terminated text padded to 8 bytes
+};
+
+static FILE *out;
+static struct binlogring *rings;    // all rings, pushed by CAS
+static __thread struct binlogring *ring;
+static pthread_mutex_t drainlock = PTHREAD_MUTEX_INITIALIZER;
+static int sleeping;                // drain thread state
+static unsigned int wakeword;       // futex word, bumped to wake the drain
+static unsigned long reported;      // drops already reported
+
+static long long now_ns(void) {
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return ts.tv_sec * 1000000000LL + ts.tv_nsec;
+}
+
+/*
+ * Read one conversion specification of a format.
+ *
+ * Params:
+ *  p       The '%' starting it
+ *  spec    Set to the specification, null-terminated
+ *  type    Set to the argument type, -2 for "%%", or -1 if unsupported
+ *
+ * Returns:
+ *  Pointer past the specification
+ */
+static const char *next_spec(const char *p, char *spec, int *type) {
+    const char *q = p + 1;
+    int longs = 0, size = 0, ldouble = 0;
+
+    *type = -1;
+    if (*q == '%') {
+        *type = -2;
+        return q + 1;
+    }
+    q += strspn(q, "-+ #0'");
+    q += strspn(q, "0123456789");
+    if (*q == '.') {
+        q++;
+        q += strspn(q, "0123456789");
+    }
+    for (; *q && strchr("hlqLjzt", *q); q++) {
+        longs += *q == 'l' ? 1 : *q == 'q' || *q == 'j' ? 2 : 0;
+        size |= *q == 'z' || *q == 't';
+        ldouble |= *q == 'L';
+    }
+    if (!*q)
+        return q;
+    if (strchr("diouxXc", *q))
+        *type = size ? T_SIZE : longs >= 2 ? T_LLONG : longs ? T_LONG : T_INT;
+    else if (strchr("feEgGaA", *q) && !ldouble)
+        *type = T_DOUBLE;
+    else if (*q == 's' && !longs)
+        *type = T_STR;
+    else if (*q == 'p')
+        *type = T_PTR;
+    q++;
+    if (q - p >= MAXSPEC)
+        *type = -1;
+    else
+        memcpy(spec, p, q - p), spec[q - p] = '\0';
+    return q;
+}
+
+/*
+ * Find the argument types of a call site's format.
+ */
+static void parse(struct binlogsite *site, const char *fmt) {
+    char spec[MAXSPEC];
+    const char *p = fmt;
+    int type;
+
+    site->fmt = fmt;
+    site->nargs = 0;
+    while ((p = strchr(p, '%'))) {
+        p = next_spec(p, spec, &type);
+        if (type == -2)
+            continue;
+        if (type == -1 || site->nargs == BINLOG_MAXARGS) {
+            site->nargs = -1;
+            return;
+        }
+        site->types[site->nargs++] = type;
+    }
+}
+
+static void ring_copy_in(struct binlogring *r, uint32_t pos, const void *data, size_t len) {
+    size_t at = pos & (BINLOG_RING - 1), first = BINLOG_RING - at < len ? BINLOG_RING - at : len;
+
+    memcpy(r->buf + at, data, first);
+    memcpy(r->buf, (const char *) data + first, len - first);
+}
+
+static void ring_copy_out(const struct binlogring *r, uint32_t pos, void *data, size_t len) {
+    size_t at = pos & (BINLOG_RING - 1), first = BINLOG_RING - at < len ? BINLOG_RING - at : len;
+
+    memcpy(data, r->buf + at, first);
+    memcpy((char *) data + first, r->buf, len - first);
+}
+
+static struct binlogring *new_ring(void) {
+    struct binlogring *r = aligned_alloc(64, sizeof(*r));
+
+    if (!r)
+        return NULL;
+    r->head = r->tail = 0;
+    r->dropped = 0;
+    r->next = __atomic_load_n(&rings, __ATOMIC_RELAXED);
+    while (!__atomic_compare_exchange_n(&rings, &r->next, r, 1,
+                __ATOMIC_RELEASE, __ATOMIC_RELAXED))
+        ;
+    return r;
+}
+
+/*
+ * Write a log record; see BINLOG().
+ */
+void binlog_write(struct binlogsite *site, const char *fmt, ...) {
+    unsigned char rec[MAXREC] __attribute__((aligned(8)));
+    struct binlogrec *h = (struct binlogrec *) rec;
+    struct binlogsite local;
+    const struct binlogsite *s = site;
+    uint32_t head, tail, size = sizeof(*h);
+    int state = __atomic_load_n(&site->state, __ATOMIC_ACQUIRE), i;
+    va_list ap;
+
+    va_start(ap, fmt);
+    if (state < S_PARSED) {
+        state = S_NEW;
+        if (__atomic_compare_exchange_n(&site->state, &state, S_PARSING, 0,
+                    __ATOMIC_ACQUIRE, __ATOMIC_RELAXED)) {
+            parse(site, fmt);
+            __atomic_store_n(&site->state, site->nargs < 0 ? S_DIRECT : S_PARSED,
+                    __ATOMIC_RELEASE);
+        } else {
+            parse(&local, fmt); // another thread is parsing it
+            s = &local;
+        }
+        state = s->nargs < 0 ? S_DIRECT : S_PARSED;
+    }
+    if (state == S_DIRECT || !out || (!ring && !(ring = new_ring()))) {
+        vfprintf(out ? out : stderr, fmt, ap);
+        va_end(ap);
+        return;
+    }
+
+    h->site = site;
+    h->time_ns = now_ns();
+    for (i = 0; i < s->nargs; i++) {
+        union { long long i; double f; const void *p; } v = { 0 };
+        const char *str;
+        uint64_t len;
+        switch (s->types[i]) {
+            case T_INT: v.i = va_arg(ap, int); break;
+            case T_LONG: v.i = va_arg(ap, long); break;
+            case T_LLONG: v.i = va_arg(ap, long long); break;
+            case T_SIZE: v.i = va_arg(ap, size_t); break;
+            case T_DOUBLE: v.f = va_arg(ap, double); break;
+            case T_PTR: v.p = va_arg(ap, void *); break;
+            case T_STR:
+                if (!(str = va_arg(ap, const char *)))
+                    str = "(null)";
+                len = strnlen(str, BINLOG_MAXSTR);
+                memcpy(rec + size, &len, 8);
+                memcpy(rec + size + 8, str, len);
+                rec[size + 8 + len] = '\0';
+                size += 8 + ((len + 8) & ~7);
+                continue;
+        }
+        memcpy(rec + size, &v, 8);
+        size += 8;
+    }
+    va_end(ap);
+    h->size = size;
+
+    head = ring->head;
+    tail = __atomic_load_n(&ring->tail, __ATOMIC_ACQUIRE);
+    if (BINLOG_RING - (head - tail) < size) {
+        ring->dropped++;
+        return;
+    }
+    ring_copy_in(ring, head, rec, size);
+    __atomic_store_n(&ring->head, head + size, __ATOMIC_SEQ_CST);
+    // Wake the drain if it is idle, or if it is waiting and this ring is filling
+    state = __atomic_load_n(&sleeping, __ATOMIC_SEQ_CST);
+    if ((state == IDLE || (state == DRAINING && head + size - tail > BINLOG_RING / 2)) &&
+            __atomic_compare_exchange_n(&sleeping, &state, AWAKE, 0,
+                __ATOMIC_RELAXED, __ATOMIC_RELAXED)) {
+        __atomic_fetch_add(&wakeword, 1, __ATOMIC_RELEASE);
+        syscall(SYS_futex, &wakeword, FUTEX_WAKE_PRIVATE, 1, NULL, NULL, 0);
+    }
+}
+
+/*
+ * Format a record to the log stream.
+ */
+static void format(const unsigned char *rec) {
+    const struct binlogrec *h = (const struct binlogrec *) rec;
+    const char *p = h->site->fmt, *q;
+    const unsigned char *arg = rec + sizeof(*h);
+    char spec[MAXSPEC];
+    int type, i = 0;
+
+    while ((q = strchr(p, '%'))) {
+        union { long long i; double f; void *p; } v;
+        uint64_t len;
+        fwrite(p, 1, q - p, out);
+        p = next_spec(q, spec, &type);
+        if (type == -2) {
+            fputc('%', out);
+            continue;
+        }
+        type = h->site->types[i++];
+        if (type == T_STR) {
+            memcpy(&len, arg, 8);
+            fprintf(out, spec, (const char *) arg + 8);
+            arg += 8 + ((len + 8) & ~7);
+            continue;
+        }
+        memcpy(&v, arg, 8);
+        arg += 8;
+        switch (type) {
+            case T_INT: fprintf(out, spec, (int) v.i); break;
+            case T_LONG: fprintf(out, spec, (long) v.i); break;
+            case T_LLONG: fprintf(out, spec, v.i); break;
+            case T_SIZE: fprintf(out, spec, (size_t) v.i); break;
+            case T_DOUBLE: fprintf(out, spec, v.f); break;
+            case T_PTR: fprintf(out, spec, v.p); break;
+        }
+    }
+    fputs(p, out);
+}
+
+/*
+ * Format all records in the rings, oldest first. Call with the drain lock.
+ *
+ * Returns:
+ *  Number of records formatted
+ */
+static int drain(void) {
+    unsigned char rec[MAXREC] __attribute__((aligned(8)));
+    struct binlogrec *h = (struct binlogrec *) rec;
+    int n = 0;
+
+    for (;;) {
+        struct binlogring *r, *best = NULL;
+        struct binlogrec next;
+        int64_t oldest = 0;
+        for (r = __atomic_load_n(&rings, __ATOMIC_ACQUIRE); r; r = r->next) {
+            if (r->tail == __atomic_load_n(&r->head, __ATOMIC_ACQUIRE))
+                continue;
+            ring_copy_out(r, r->tail, &next, sizeof(next));
+            if (!best || next.time_ns < oldest) {
+                best = r;
+                oldest = next.time_ns;
+            }
+        }
+        if (!best)
+            break;
+        ring_copy_out(best, best->tail, h, sizeof(*h));
+        ring_copy_out(best, best->tail, rec, h->size);
+        __atomic_store_n(&best->tail, best->tail + h->size, __ATOMIC_RELEASE);
+        format(rec);
+        n++;
+    }
+    if (n)
+        fflush(out);
+    return n;
+}
+
+static int pending(void) {
+    struct binlogring *r;
+
+    for (r = __atomic_load_n(&rings, __ATOMIC_ACQUIRE); r; r = r->next)
+        if (r->tail != __atomic_load_n(&r->head, __ATOMIC_SEQ_CST))
+            return 1;
+    return 0;
+}
+
+static void *drain_thread(void *arg) {
+    struct timespec interval = { 0, BINLOG_DRAIN_MS * 1000000L };
+
+    for (;;) {
+        unsigned int wake = __atomic_load_n(&wakeword, __ATOMIC_ACQUIRE);
+        int n, state;
+        pthread_mutex_lock(&drainlock);
+        n = drain();
+        pthread_mutex_unlock(&drainlock);
+        state = n ? DRAINING : IDLE;
+        __atomic_store_n(&sleeping, state, __ATOMIC_SEQ_CST);
+        if (!pending())
+            syscall(SYS_futex, &wakeword, FUTEX_WAIT_PRIVATE, wake,
+                    state == DRAINING ? &interval : NULL, NULL, 0);
+        __atomic_store_n(&sleeping, AWAKE, __ATOMIC_RELAXED);
+    }
+    return NULL;
+}
+
+/*
+ * Start formatting records in the background.
+ *
+ * Params:
+ *  stream  Log stream, e.g. stderr
+ *
+ * Returns:
+ *  0 on success, -1 on error
+ */
+int binlog_start(FILE *stream) {
+    pthread_t thread;
+
+    out = stream;
+    if (pthread_create(&thread, NULL, drain_thread, NULL)) {
+        out = NULL;
+        return -1;
+    }
+    pthread_detach(thread);
+    return 0;
+}
+
+/*
+ * Format all records written so far, and report any dropped.
+ */
+void binlog_flush(void) {
+    struct binlogring *r;
+    unsigned long dropped = 0;
+
+    if (!out)
+        return;
+    pthread_mutex_lock(&drainlock);
+    drain();
+    for (r = __atomic_load_n(&rings, __ATOMIC_ACQUIRE); r; r = r->next)
+        dropped += r->dropped;
+    if (dropped != reported) {
+        fprintf(out, "binlog: %lu records dropped\n", dropped - reported);
+        fflush(out);
+        reported = dropped;
+    }
+    pthread_mutex_unlock(&drainlock);
+}
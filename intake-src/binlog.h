@@ -0,0 +1,61 @@
+#ifndef BINLOG_H
+#define BINLOG_H
+
+/*
+ * binlog
+ *
+ * Logging off the hot path. BINLOG() takes a printf format and arguments
+ * like fprintf(stderr, ...), but only copies a binary record (the call
+ * site, a timestamp and the raw arguments, strings included) into a ring
+ * buffer of the calling thread. A background thread takes the records and
+ * formats them to the log stream.
+ *
+ * Each call site parses its format once, on first use, for the types of
+ * its arguments. Formats with more than BINLOG_MAXARGS arguments, '*'
+ * widths or long doubles are written directly, as are all records before
+ * binlog_start(). A record that does not fit in its thread's ring is
+ * dropped and counted. Strings are cut to BINLOG_MAXSTR bytes.
+ *
+ * Records are variable-size rather than fixed: strings have to be copied,
+ * since callers log buffers they reuse, and a fixed size that held them
+ * would make every record about 2 KB where a code line takes 48 bytes.
+ *
+ * Records of one thread come out in order; records of different threads
+ * are merged by timestamp only as far as they are drained together. They
+ * are not ordered with direct writes to the stream: call binlog_flush()
+ * before writing directly, and before exit.
+ */
+#include <stdio.h>
+#include <stdint.h>
+
+#define BINLOG_RING 65536           // bytes per thread, power of two
+#define BINLOG_MAXARGS 8
+#define BINLOG_MAXSTR 256
+#define BINLOG_DRAIN_MS 50          // drain interval while records come in
+
+struct binlogsite {
+    const char *fmt;
+    int state;                      // 0 new, 1 being parsed, 2 parsed, 3 written directly
+    int nargs;
+    unsigned char types[BINLOG_MAXARGS];
+};
+
+struct binlogring {
+    uint32_t head __attribute__((aligned(64)));     // written by the owner thread
+    uint32_t tail __attribute__((aligned(64)));     // written by the drain
+    unsigned long dropped;
+    struct binlogring *next;        // list of all rings
+    unsigned char buf[BINLOG_RING];
+};
+
+#define BINLOG(...) do { \
+        static struct binlogsite binlog_site_; \
+        binlog_write(&binlog_site_, __VA_ARGS__); \
+    } while (0)
+
+int binlog_start(FILE *out);
+void binlog_write(struct binlogsite *site, const char *fmt, ...)
+    __attribute__((format(printf, 2, 3)));
+void binlog_flush(void);
+
+#endif
@@ -0,0 +1,17 @@
+#ifndef BOOTPROF_H
+#define BOOTPROF_H
+
+/*
+ * bootprof
+ *
+ * Startup profile. Records the start and end of each init stage so the
+ * time from boot and from service start to ready can be measured. Stages
+ * may be recorded from several threads at once.
+ */
+
+void bootprof_enable(void);
+long long bootprof_clock(void);
+void bootprof_stage(const char *stage, long long start);
+void bootprof_report(const char *prog);
+
+#endif
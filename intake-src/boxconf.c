@@ -0,0 +1,330 @@
+/*
+ * boxconf
+ *
+ * Loads the intake config file (same KEY = value syntax as config.py and
+ * diverter_config.py) and hot reloads it when it changes on disk.
+ *
+ * Reloading follows a quiescent-state RCU scheme. A watcher thread waits
+ * on inotify, builds and validates a complete new snapshot, then publishes
+ * it with a single atomic pointer store. The old snapshot is pushed onto a
+ * retired list rather than freed. The intake thread, the only reader,
+ * loads the current pointer once per sheet and calls boxconf_quiescent()
+ * between sheets, at which point it holds no snapshot and frees everything
+ * retired so far. A config file that fails to parse or validate is
+ * rejected and the running snapshot stays in place.
+ *
+ * Author:
+ *  Jerry Lue
+ */
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <stddef.h>
+#include <ctype.h>
+#include <errno.h>
+#include <limits.h>
+#include <unistd.h>
+#include <libgen.h>
+#include <pthread.h>
+#include <sys/inotify.h>
+#include "boxconf.h"
+
+// Raw hardware PWM ticks per millisecond of pulse (19.2 MHz / clock 375)
+#define PWM_TICKS_PER_MS 51.2
+// Servo pulse range, as in rpi_servodriver.py
+#define MIN_PULSE 0.4
+#define MAX_PULSE 2.2
+
+static const char *models[] = { "6001HB", "S3003" };
+
+// Diverter angles (0 = full CW, 1 = full CCW), as in diverter.py
+static const double servmap[][2] = {
+    { 0.4, 1.0 },   // 6001HB: up, down
+    { 0.0, 0.7 },   // S3003: up, down
+};
+
+struct intkey {
+    const char *name;
+    size_t offset;
+    int min, max, def;
+};
+
+static const struct intkey intkeys[] = {
+    { "DIVERT_SETTLE_MS", offsetof(struct boxconf, divert_settle_ms), 0, 5000, 1000 },
+    { "EMPTY_TRAY_MS", offsetof(struct boxconf, empty_tray_ms), 100, 60000, 1000 },
+    { "REVERSE_PAUSE_MS", offsetof(struct boxconf, reverse_pause_ms), 0, 5000, 100 },
+    { "FEED_DUTY", offsetof(struct boxconf, feed_duty), 0, 100, 100 },
+    { "SLOW_DUTY", offsetof(struct boxconf, slow_duty), 0, 100, 25 },
+    { "SCAN_TIMEOUT", offsetof(struct boxconf, scan_timeout_s), 1, 3600, 5 },
+    { "SCAN_GAP_MS", offsetof(struct boxconf, scan_gap_ms), 0, 1000, 50 },
+    { "REJECT_EJECT_MS", offsetof(struct boxconf, reject_eject_ms), 0, 10000, 1000 },
+    { "REJECT_HOLD_MS", offsetof(struct boxconf, reject_hold_ms), 0, 60000, 10000 },
+    { "IDLE_PROBE_MS", offsetof(struct boxconf, idle_probe_ms), 500, 600000, 5000 },
+};
+
+#define NINTKEYS (sizeof(intkeys) / sizeof(intkeys[0]))
+
+static char confpath[PATH_MAX];
+static struct boxconf *current;     // published snapshot
+static struct boxconf *retired;     // snapshots awaiting reader quiescence
+static unsigned long generation;
+
+/*
+ * Convert a diverter angle to a raw hardware PWM value.
+ */
+static int angle_to_pwm(double angle) {
+    return (int) (((MAX_PULSE - MIN_PULSE) * angle + MIN_PULSE) *
+            PWM_TICKS_PER_MS + 0.5);
+}
+
+/*
+ * Strip a trailing comment and whitespace from a value, and remove
+ * surrounding quotes.
+ *
+ * Returns:
+ *  Pointer to the start of the value within line
+ */
+static char *clean_value(char *value) {
+    char *end;
+    while (isspace((unsigned char) *value))
+        value++;
+    if (*value == '"' || *value == '\'') {
+        char quote = *value++;
+        end = strchr(value, quote);
+        if (end)
+            *end = '\0';
+        return value;
+    }
+    end = strchr(value, '#');
+    if (end)
+        *end = '\0';
+    end = value + strlen(value);
+    while (end > value && isspace((unsigned char) end[-1]))
+        *--end = '\0';
+    return value;
+}
+
+/*
+ * Parse and validate a config file into a new snapshot.
+ *
+ * Params:
+ *  path    Config file path
+ *
+ * Returns:
+ *  Newly allocated snapshot, or NULL if the file is unreadable or invalid
+ */
+static struct boxconf *boxconf_load(const char *path) {
+    struct boxconf *conf;
+    double up = -1, down = -1;
+    char line[256];
+    int lineno = 0, err = 0;
+    size_t i;
+    FILE *fp = fopen(path, "r");
+
+    if (!fp) {
+        fprintf(stderr, "config: cannot open %s: %s\n", path, strerror(errno));
+        return NULL;
+    }
+    conf = calloc(1, sizeof(*conf));
+    if (!conf) {
+        fclose(fp);
+        return NULL;
+    }
+    conf->servo_model = SERVO_6001HB;
+    for (i = 0; i < NINTKEYS; i++)
+        *(int *) ((char *) conf + intkeys[i].offset) = intkeys[i].def;
+
+    while (fgets(line, sizeof(line), fp)) {
+        char *key = line, *eq, *value, *end;
+        lineno++;
+        while (isspace((unsigned char) *key))
+            key++;
+        if (*key == '\0' || *key == '#')
+            continue;
+        eq = strchr(key, '=');
+        if (!eq) {
+            fprintf(stderr, "config: %s:%d: expected KEY = value\n", path, lineno);
+            err = 1;
+            continue;
+        }
+        end = eq;
+        while (end > key && isspace((unsigned char) end[-1]))
+            end--;
+        *end = '\0';
+        value = clean_value(eq + 1);
+
+        if (!strcmp(key, "SERVO_MODEL")) {
+            for (i = 0; i < sizeof(models) / sizeof(models[0]); i++)
+                if (!strcmp(value, models[i]))
+                    break;
+            if (i == sizeof(models) / sizeof(models[0])) {
+                fprintf(stderr, "config: %s:%d: unknown servo model %s\n",
+                        path, lineno, value);
+                err = 1;
+            }
+            conf->servo_model = i;
+        } else if (!strcmp(key, "DIVERT_UP") || !strcmp(key, "DIVERT_DOWN")) {
+            double angle = strtod(value, &end);
+            if (end == value || *end != '\0' || angle < 0 || angle > 1) {
+                fprintf(stderr, "config: %s:%d: %s must be between 0 and 1\n",
+                        path, lineno, key);
+                err = 1;
+            }
+            if (key[7] == 'U')
+                up = angle;
+            else
+                down = angle;
+        } else {
+            for (i = 0; i < NINTKEYS; i++)
+                if (!strcmp(key, intkeys[i].name))
+                    break;
+            if (i == NINTKEYS) {
+                fprintf(stderr, "config: %s:%d: unknown key %s\n", path, lineno, key);
+                err = 1;
+                continue;
+            }
+            long n = strtol(value, &end, 10);
+            if (end == value || *end != '\0' ||
+                    n < intkeys[i].min || n > intkeys[i].max) {
+                fprintf(stderr, "config: %s:%d: %s must be between %d and %d\n",
+                        path, lineno, key, intkeys[i].min, intkeys[i].max);
+                err = 1;
+                continue;
+            }
+            *(int *) ((char *) conf + intkeys[i].offset) = (int) n;
+        }
+    }
+    fclose(fp);
+    if (err) {
+        free(conf);
+        return NULL;
+    }
+
+    // Precompute raw servo positions so the hot path does no arithmetic
+    conf->divert_up = angle_to_pwm(up >= 0 ? up : servmap[conf->servo_model][0]);
+    conf->divert_down = angle_to_pwm(down >= 0 ? down : servmap[conf->servo_model][1]);
+    return conf;
+}
+
+/*
+ * Publish a snapshot, retiring the previous one.
+ */
+static void boxconf_publish(struct boxconf *conf) {
+    struct boxconf *old;
+
+    conf->generation = ++generation;
+    old = __atomic_exchange_n(&current, conf, __ATOMIC_ACQ_REL);
+    if (!old)
+        return;
+    old->next = __atomic_load_n(&retired, __ATOMIC_RELAXED);
+    while (!__atomic_compare_exchange_n(&retired, &old->next, old, 1,
+                __ATOMIC_RELEASE, __ATOMIC_RELAXED))
+        ;
+}
+
+/*
+ * Get the current config snapshot. The returned pointer stays valid until
+ * the caller's next call to boxconf_quiescent().
+ */
+const struct boxconf *boxconf_get(void) {
+    return __atomic_load_n(&current, __ATOMIC_ACQUIRE);
+}
+
+/*
+ * Declare that the reader holds no snapshot pointer, e.g. between sheets.
+ * Frees all snapshots retired since the last quiescent state.
+ */
+void boxconf_quiescent(void) {
+    struct boxconf *conf = __atomic_exchange_n(&retired, NULL, __ATOMIC_ACQUIRE);
+    while (conf) {
+        struct boxconf *next = conf->next;
+        free(conf);
+        conf = next;
+    }
+}
+
+/*
+ * Load the initial config snapshot.
+ *
+ * Params:
+ *  path    Config file path
+ *
+ * Returns:
+ *  0 on success, -1 if the file is unreadable or invalid
+ */
+int boxconf_init(const char *path) {
+    struct boxconf *conf;
+
+    if (strlen(path) >= sizeof(confpath))
+        return -1;
+    strcpy(confpath, path);
+    conf = boxconf_load(confpath);
+    if (!conf)
+        return -1;
+    boxconf_publish(conf);
+    return 0;
+}
+
+/*
+ * Watcher thread. Reloads the config whenever the file is rewritten or
+ * replaced by rename (as most editors do).
+ */
+static void *boxconf_watcher(void *arg) {
+    int fd = (int) (long) arg;
+    char buf[4096] __attribute__((aligned(__alignof__(struct inotify_event))));
+    char namebuf[PATH_MAX];
+    const char *name;
+    ssize_t len;
+
+    strcpy(namebuf, confpath);
+    name = basename(namebuf);
+    while ((len = read(fd, buf, sizeof(buf))) > 0 || (len < 0 && errno == EINTR)) {
+        char *p;
+        int changed = 0;
+        for (p = buf; p < buf + len; ) {
+            struct inotify_event *ev = (struct inotify_event *) p;
+            if (ev->len && !strcmp(ev->name, name))
+                changed = 1;
+            p += sizeof(*ev) + ev->len;
+        }
+        if (changed) {
+            struct boxconf *conf = boxconf_load(confpath);
+            if (conf) {
+                boxconf_publish(conf);
+                fprintf(stderr, "config: reloaded %s (generation %lu)\n",
+                        confpath, conf->generation);
+            } else {
+                fprintf(stderr, "config: keeping generation %lu\n", generation);
+            }
+        }
+    }
+    fprintf(stderr, "config: watcher stopped: %s\n", strerror(errno));
+    close(fd);
+    return NULL;
+}
+
+/*
+ * Start watching the config file for changes. Must be called after
+ * boxconf_init().
+ *
+ * Returns:
+ *  0 on success, -1 on error
+ */
+int boxconf_watch(void) {
+    char dirbuf[PATH_MAX];
+    pthread_t thread;
+    int fd;
+
+    strcpy(dirbuf, confpath);
+    fd = inotify_init1(IN_CLOEXEC);
+    if (fd < 0)
+        return -1;
+    // Watch the directory so that replacement by rename is seen too
+    if (inotify_add_watch(fd, dirname(dirbuf), IN_CLOSE_WRITE | IN_MOVED_TO) < 0 ||
+            pthread_create(&thread, NULL, boxconf_watcher, (void *) (long) fd)) {
+        close(fd);
+        return -1;
+    }
+    pthread_detach(thread);
+    return 0;
+}
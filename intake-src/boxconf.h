@@ -0,0 +1,40 @@
+#ifndef BOXCONF_H
+#define BOXCONF_H
+
+/*
+ * boxconf
+ *
+ * Calibration and timing configuration for the native intake controller.
+ * The config file is parsed and validated into an immutable snapshot with
+ * all derived values (raw servo PWM positions) precomputed. Snapshots are
+ * published by pointer swap; the intake thread picks up the current
+ * snapshot at the start of each sheet without taking any lock.
+ */
+
+#define SERVO_6001HB 0
+#define SERVO_S3003 1
+
+struct boxconf {
+    int servo_model;        // SERVO_6001HB or SERVO_S3003
+    int divert_up;          // raw hardware PWM value, diverter up (reject)
+    int divert_down;        // raw hardware PWM value, diverter down (accept)
+    int divert_settle_ms;   // time for diverter servo to reach position
+    int empty_tray_ms;      // feed time without trigger before tray is empty
+    int reverse_pause_ms;   // pause between feed direction changes
+    int feed_duty;          // motor duty cycle (percent) while feeding
+    int slow_duty;          // motor duty cycle (percent) while scanning
+    int scan_timeout_s;     // scanner timeout passed to scan program
+    int scan_gap_ms;        // inter-key gap that ends a code, passed to scan
+    int reject_eject_ms;    // full speed eject time for rejected sheet
+    int reject_hold_ms;     // pause after reject for message to play
+    int idle_probe_ms;      // tray probe interval when idle without sensor
+    unsigned long generation; // incremented on every successful reload
+    struct boxconf *next;   // retired snapshot list link
+};
+
+int boxconf_init(const char *path);
+int boxconf_watch(void);
+const struct boxconf *boxconf_get(void);
+void boxconf_quiescent(void);
+
+#endif
@@ -0,0 +1,160 @@
+/*
+ * bus
+ *
+ * Positions are 32-bit and wrap; BUS_SLOTS divides 2^32, so the turn for a
+ * position stays consistent across the wrap. See bus.h.
+ *
+ * Author:
+ *  Jerry Lue
+ */
+#include <stdio.h>
+#include <string.h>
+#include <fcntl.h>
+#include <time.h>
+#include <unistd.h>
+#include <sys/mman.h>
+#include "heartbeat.h"
+#include "bus.h"
+
+static const char *typenames[] = { "none", "status", "accept", "reject", "test" };
+static int pid;
+
+static long long now_ns(void) {
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return ts.tv_sec * 1000000000LL + ts.tv_nsec;
+}
+
+/*
+ * Turn at which the slot for a position is free to fill.
+ */
+static uint32_t free_turn(uint32_t pos) {
+    return pos / BUS_SLOTS * 2;
+}
+
+/*
+ * Map the bus region, creating it if needed. A new region is all zeroes,
+ * which is an empty bus.
+ *
+ * Returns:
+ *  Bus region, or NULL on error
+ */
+struct busregion *bus_open(void) {
+    struct busregion *bus;
+    int fd = shm_open(BUS_SHM, O_RDWR | O_CREAT, 0666);
+
+    if (fd < 0)
+        return NULL;
+    if (ftruncate(fd, sizeof(*bus))) {
+        close(fd);
+        return NULL;
+    }
+    bus = mmap(NULL, sizeof(*bus), PROT_READ | PROT_WRITE, MAP_SHARED, fd, 0);
+    close(fd);
+    return bus == MAP_FAILED ? NULL : bus;
+}
+
+/*
+ * Post an event. Never blocks.
+ *
+ * Params:
+ *  bus     Bus region; NULL posts nothing
+ *  type    Event type
+ *  data    Event data, cut to BUS_DATA bytes
+ *  len     Bytes of data
+ *
+ * Returns:
+ *  0 on success, -1 if the bus is full or missing
+ */
+int bus_post(struct busregion *bus, int type, const void *data, int len) {
+    struct busslot *s;
+    uint32_t pos, turn;
+
+    if (!bus)
+        return -1;
+    if (!pid)
+        pid = getpid(); // components fork only to exec
+    pos = __atomic_load_n(&bus->tail, __ATOMIC_RELAXED);
+    for (;;) {
+        s = &bus->slot[pos & (BUS_SLOTS - 1)];
+        if (__atomic_load_n(&s->turn, __ATOMIC_ACQUIRE) == free_turn(pos)) {
+            if (__atomic_compare_exchange_n(&bus->tail, &pos, pos + 1, 1,
+                        __ATOMIC_RELAXED, __ATOMIC_RELAXED))
+                break;
+        } else {
+            // Slot not yet taken from the last lap: full, unless tail moved
+            uint32_t tail = __atomic_load_n(&bus->tail, __ATOMIC_RELAXED);
+            if (tail == pos) {
+                __atomic_fetch_add(&bus->dropped, 1, __ATOMIC_RELAXED);
+                return -1;
+            }
+            pos = tail;
+        }
+    }
+    s->ev.type = type;
+    s->ev.len = len < BUS_DATA ? len : BUS_DATA;
+    s->ev.pid = pid;
+    s->ev.time_ns = now_ns();
+    memcpy(s->ev.data, data, s->ev.len);
+    // Fails only if the consumer gave up on this slot as stuck
+    turn = free_turn(pos);
+    if (!__atomic_compare_exchange_n(&s->turn, &turn, turn + 1, 0,
+            __ATOMIC_RELEASE, __ATOMIC_RELAXED))
+        return -1;
+    // The supervisor may be asleep with every component idle
+    hb_notify();
+    return 0;
+}
+
+/*
+ * Take up to max events, in order. Only one process may take.
+ *
+ * Params:
+ *  bus     Bus region
+ *  rd      Reader state, zeroed before the first call
+ *  ev      Set to the events taken
+ *  max     Most events to take
+ *
+ * Returns:
+ *  Number of events taken
+ */
+int bus_take(struct busregion *bus, struct busreader *rd, struct busevent *ev, int max) {
+    uint32_t head = __atomic_load_n(&bus->head, __ATOMIC_RELAXED);
+    int n = 0;
+
+    while (n < max) {
+        struct busslot *s = &bus->slot[head & (BUS_SLOTS - 1)];
+        uint32_t turn = __atomic_load_n(&s->turn, __ATOMIC_ACQUIRE);
+        if (turn != free_turn(head) + 1) {
+            long long now;
+            if (turn != free_turn(head) ||
+                    (int32_t) (__atomic_load_n(&bus->tail, __ATOMIC_RELAXED) - head) <= 0)
+                break; // empty
+            // Claimed but not yet published
+            now = now_ns() / 1000000;
+            if (rd->stuck != head || !rd->stuck_since_ms) {
+                rd->stuck = head;
+                rd->stuck_since_ms = now;
+                break;
+            }
+            if (now - rd->stuck_since_ms < BUS_STUCK_MS ||
+                    !__atomic_compare_exchange_n(&s->turn, &turn, free_turn(head + BUS_SLOTS), 0,
+                        __ATOMIC_RELAXED, __ATOMIC_RELAXED))
+                break;
+            bus->skipped++;
+            rd->stuck_since_ms = 0;
+            head++;
+            continue;
+        }
+        ev[n++] = s->ev;
+        __atomic_store_n(&s->turn, free_turn(head + BUS_SLOTS), __ATOMIC_RELEASE);
+        head++;
+    }
+    __atomic_store_n(&bus->head, head, __ATOMIC_RELAXED);
+    return n;
+}
+
+const char *bus_typename(int type) {
+    return type > 0 && type < (int) (sizeof(typenames) / sizeof(typenames[0])) ?
+        typenames[type] : "unknown";
+}
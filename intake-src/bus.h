@@ -0,0 +1,71 @@
+#ifndef BUS_H
+#define BUS_H
+
+/*
+ * bus
+ *
+ * Event bus from the native components to the supervisor: a bounded
+ * multi-producer, single-consumer queue of typed fixed-size events in
+ * shared memory, with no locks.
+ *
+ * Producers claim a position by compare-and-swap on the tail, fill the
+ * slot at that position and publish it by setting the slot's turn; the
+ * consumer takes published slots in order and hands them back by setting
+ * the turn for the next lap. Each slot, and each of the tail and head,
+ * has a cache line of its own, so producers on different cores only
+ * contend on the tail. A full bus drops the event and counts it.
+ *
+ * Turns are derived from positions so that a zeroed region is an empty
+ * bus: at lap L a slot is free to fill at turn 2L and ready to take at
+ * 2L + 1. A producer that dies between claiming and publishing leaves a
+ * hole; the consumer skips a slot left claimed for BUS_STUCK_MS.
+ *
+ * Posting wakes the supervisor through the heartbeat region (see
+ * heartbeat.h), so a poster must have mapped it, e.g. by registering.
+ */
+#include <stdint.h>
+
+#define BUS_SHM "/votebox-bus"
+#define BUS_SLOTS 1024              // power of two
+#define BUS_DATA 40
+#define BUS_STUCK_MS 1000
+
+enum bus_type {
+    BUS_STATUS = 1,                 // data: status text
+    BUS_ACCEPT,                     // data: code
+    BUS_REJECT,                     // data: code, empty if unread
+    BUS_TEST,                       // data: anything, for benchmarks
+};
+
+struct busevent {
+    uint16_t type;
+    uint16_t len;                   // bytes of data
+    int32_t pid;                    // sender
+    int64_t time_ns;                // CLOCK_MONOTONIC when posted
+    char data[BUS_DATA];
+};
+
+struct busslot {
+    uint32_t turn;
+    struct busevent ev;
+} __attribute__((aligned(64)));
+
+struct busregion {
+    uint32_t tail __attribute__((aligned(64)));     // next position to claim
+    uint32_t head __attribute__((aligned(64)));     // next position to take
+    uint32_t dropped;               // events posted to a full bus
+    uint32_t skipped;               // slots claimed but never published
+    struct busslot slot[BUS_SLOTS];
+};
+
+struct busreader {
+    uint32_t stuck;                 // position found claimed but unpublished
+    long long stuck_since_ms;
+};
+
+struct busregion *bus_open(void);
+int bus_post(struct busregion *bus, int type, const void *data, int len);
+int bus_take(struct busregion *bus, struct busreader *rd, struct busevent *ev, int max);
+const char *bus_typename(int type);
+
+#endif
@@ -0,0 +1,177 @@
+/*
+ * Usage:
+ *  busbench [-p producers] [-n events] [-b batch]
+ *
+ * Examples:
+ *  Measure the event bus with 1 to 3 producers
+ *      ./intake-src/busbench
+ *
+ * Description:
+ *  Measures the event bus (see bus.h) under contention. The consumer runs
+ *  on the first CPU and each producer on a CPU of its own; with 1 up to -p
+ *  producers (default: one fewer than the CPUs, 1 to 3), each posts -n
+ *  events (default 1000000) as fast as it can, retrying while the bus is
+ *  full. The consumer takes events one at a time and in batches of -b
+ *  (default 32). For each run, the throughput, the latency from post to
+ *  take (median, 99th percentile and worst, over every 16th event) and the
+ *  posts that found the bus full are printed.
+ *
+ *  The bus used is private to the process, not the shared region.
+ *
+ * Author:
+ *  Jerry Lue
+ */
+#define _GNU_SOURCE
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sched.h>
+#include <time.h>
+#include <unistd.h>
+#include <pthread.h>
+#include "bus.h"
+
+#define EVENTS 1000000
+#define BATCH 32
+#define MAXPRODUCERS 3
+#define SAMPLE 16           // latency of every SAMPLE-th event
+
+struct producer {
+    pthread_t thread;
+    struct busregion *bus;
+    int cpu;
+    long events;
+    long full;
+};
+
+static volatile int go;
+static int shared;          // fewer CPUs than threads: yield instead of spinning
+
+static long long now_ns(void) {
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return ts.tv_sec * 1000000000LL + ts.tv_nsec;
+}
+
+static void pin(int cpu) {
+    cpu_set_t set;
+    CPU_ZERO(&set);
+    CPU_SET(cpu, &set);
+    sched_setaffinity(0, sizeof(set), &set);
+}
+
+static int cmp_ll(const void *a, const void *b) {
+    long long x = *(const long long *) a, y = *(const long long *) b;
+    return x < y ? -1 : x > y;
+}
+
+static void *produce(void *arg) {
+    struct producer *p = arg;
+    long i;
+
+    pin(p->cpu);
+    while (!__atomic_load_n(&go, __ATOMIC_ACQUIRE))
+        ;
+    for (i = 0; i < p->events; i++) {
+        while (bus_post(p->bus, BUS_TEST, &i, sizeof(i))) {
+            p->full++;
+            if (shared)
+                sched_yield();
+        }
+    }
+    return NULL;
+}
+
+/*
+ * Run producers against one consumer taking batch events at a time.
+ */
+static void run(int producers, long events, int batch, int cpus) {
+    struct busregion *bus = aligned_alloc(64, sizeof(*bus));
+    struct producer prod[MAXPRODUCERS];
+    struct busreader rd;
+    struct busevent ev[BATCH * 8];
+    long long *lat = malloc((producers * events / SAMPLE + 1) * sizeof(*lat));
+    long long t0, t1, full = 0;
+    long taken = 0, total = producers * events, nlat = 0;
+    int i;
+
+    memset(bus, 0, sizeof(*bus));
+    memset(&rd, 0, sizeof(rd));
+    go = 0;
+    for (i = 0; i < producers; i++) {
+        prod[i].bus = bus;
+        prod[i].cpu = (i + 1) % cpus;
+        prod[i].events = events;
+        prod[i].full = 0;
+        pthread_create(&prod[i].thread, NULL, produce, &prod[i]);
+    }
+    t0 = now_ns();
+    __atomic_store_n(&go, 1, __ATOMIC_RELEASE);
+    while (taken < total) {
+        int n = bus_take(bus, &rd, ev, batch), k;
+        if (!n) {
+            if (shared)
+                sched_yield();
+            continue;
+        }
+        if ((taken + n) / SAMPLE != taken / SAMPLE) {
+            long long now = now_ns();
+            for (k = 0; k < n; k++)
+                if ((taken + k) % SAMPLE == 0)
+                    lat[nlat++] = now - ev[k].time_ns;
+        }
+        taken += n;
+    }
+    t1 = now_ns();
+    for (i = 0; i < producers; i++) {
+        pthread_join(prod[i].thread, NULL);
+        full += prod[i].full;
+    }
+    qsort(lat, nlat, sizeof(*lat), cmp_ll);
+    printf("%d producer%s, batch %2d: %6.2f M events/s, latency median %7.2f us, "
+            "p99 %8.2f us, worst %9.2f us, %lld posts found it full\n",
+            producers, producers > 1 ? "s" : " ", batch, total * 1e3 / (t1 - t0),
+            lat[nlat / 2] / 1e3, lat[nlat * 99 / 100] / 1e3, lat[nlat - 1] / 1e3, full);
+    free(lat);
+    free(bus);
+}
+
+int main(int argc, char *argv[]) {
+    long cpus = sysconf(_SC_NPROCESSORS_ONLN), events = EVENTS;
+    int opt, producers = cpus - 1 < 1 ? 1 : cpus - 1 < MAXPRODUCERS ? cpus - 1 : MAXPRODUCERS;
+    int batch = BATCH, p;
+
+    while ((opt = getopt(argc, argv, "p:n:b:")) != -1) {
+        switch (opt) {
+            case 'p':
+                producers = atoi(optarg);
+                break;
+            case 'n':
+                events = atol(optarg);
+                break;
+            case 'b':
+                batch = atoi(optarg);
+                break;
+            default:
+                goto usage;
+        }
+    }
+    if (producers < 1 || producers > MAXPRODUCERS || events < SAMPLE || batch < 1 ||
+            batch > BATCH * 8 || optind != argc)
+        goto usage;
+    if ((shared = producers >= cpus))
+        fprintf(stderr, "busbench: %ld CPUs: producers share CPUs with the consumer\n", cpus);
+
+    pin(0);
+    for (p = 1; p <= producers; p++) {
+        run(p, events, 1, cpus);
+        if (batch > 1)
+            run(p, events, batch, cpus);
+    }
+    return 0;
+
+usage:
+    fprintf(stderr, "Usage: busbench [-p producers (1-%d)] [-n events] [-b batch (1-%d)]\n",
+            MAXPRODUCERS, BATCH * 8);
+    return 1;
+}
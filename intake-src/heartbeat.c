@@ -0,0 +1,141 @@
+/*
+ * heartbeat
+ *
+ * Slots are claimed by compare-and-swap on the owner pid, so components
+ * can register concurrently without a lock. A component that cannot map
+ * the region (e.g. run by hand without permission) gets a private dummy
+ * slot, so beating is always safe.
+ *
+ * Author:
+ *  Jerry Lue
+ */
+#include <stdio.h>
+#include <string.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <limits.h>
+#include <sys/mman.h>
+#include <sys/syscall.h>
+#include <linux/futex.h>
+#include "heartbeat.h"
+
+static struct hbregion *region;
+static struct hbslot dummy;
+
+/*
+ * Map the heartbeat region, creating it if needed.
+ *
+ * Returns:
+ *  Heartbeat region, or NULL on error
+ */
+struct hbregion *hb_open(void) {
+    struct hbregion *r;
+    int fd = shm_open(HB_SHM, O_RDWR | O_CREAT, 0666);
+
+    if (fd < 0)
+        return NULL;
+    if (ftruncate(fd, sizeof(*r))) {
+        close(fd);
+        return NULL;
+    }
+    r = mmap(NULL, sizeof(*r), PROT_READ | PROT_WRITE, MAP_SHARED, fd, 0);
+    close(fd);
+    if (r == MAP_FAILED)
+        return NULL;
+    if (!region)
+        region = r;
+    return r;
+}
+
+/*
+ * Bump the wake word and wake a supervisor sleeping in hb_wait().
+ */
+static void hb_wake(void) {
+    __atomic_fetch_add(&region->wake, 1, __ATOMIC_RELEASE);
+    syscall(SYS_futex, &region->wake, FUTEX_WAKE, INT_MAX, NULL, NULL, 0);
+}
+
+/*
+ * Claim a heartbeat slot for this process.
+ *
+ * Params:
+ *  name        Component name
+ *  timeout_ms  Longest time the component may go without beating
+ *
+ * Returns:
+ *  Slot to beat; never NULL
+ */
+struct hbslot *hb_register(const char *name, int timeout_ms) {
+    struct hbslot *slots;
+    int i, pid = getpid();
+
+    if (!region && !(region = hb_open()))
+        return &dummy;
+    slots = region->slot;
+    for (i = 0; i < HB_SLOTS; i++) {
+        int free = 0;
+        if (__atomic_compare_exchange_n(&slots[i].pid, &free, pid, 0,
+                    __ATOMIC_ACQUIRE, __ATOMIC_RELAXED)) {
+            strncpy(slots[i].name, name, HB_NAMELEN - 1);
+            slots[i].beats = 0;
+            slots[i].idle = 0;
+            // Publish timeout last: the supervisor ignores slots without one
+            __atomic_store_n(&slots[i].timeout_ms, timeout_ms, __ATOMIC_RELEASE);
+            hb_wake();
+            return &slots[i];
+        }
+    }
+    fprintf(stderr, "heartbeat: no free slot for %s\n", name);
+    return &dummy;
+}
+
+/*
+ * Release a slot on clean exit, so the supervisor does not report a stall.
+ */
+void hb_release(struct hbslot *slot) {
+    if (slot == &dummy)
+        return;
+    __atomic_store_n(&slot->timeout_ms, 0, __ATOMIC_RELAXED);
+    memset(slot->name, 0, HB_NAMELEN);
+    __atomic_store_n(&slot->pid, 0, __ATOMIC_RELEASE);
+}
+
+/*
+ * Mark the component idle before blocking on external events with no
+ * timeout.
+ */
+void hb_idle(struct hbslot *slot) {
+    __atomic_store_n(&slot->idle, 1, __ATOMIC_RELEASE);
+}
+
+/*
+ * Mark the component busy again after an idle wait. The stall timeout
+ * restarts from here.
+ */
+void hb_busy(struct hbslot *slot) {
+    hb_beat(slot);
+    __atomic_store_n(&slot->idle, 0, __ATOMIC_RELEASE);
+    if (slot != &dummy)
+        hb_wake();
+}
+
+/*
+ * Wake a supervisor sleeping in hb_wait(), e.g. after posting it an event.
+ * Does nothing if the region was never mapped. Safe in a signal handler.
+ */
+void hb_notify(void) {
+    if (region)
+        hb_wake();
+}
+
+/*
+ * Sleep until a slot leaves idle or is registered, hb_notify() is called
+ * or a signal arrives.
+ *
+ * Params:
+ *  wake    Value of region->wake read before checking that all slots
+ *          were idle; returns at once if it has changed since
+ */
+void hb_wait(struct hbregion *r, unsigned int wake) {
+    syscall(SYS_futex, &r->wake, FUTEX_WAIT, wake, NULL, NULL, 0);
+}
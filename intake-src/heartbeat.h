@@ -0,0 +1,51 @@
+#ifndef HEARTBEAT_H
+#define HEARTBEAT_H
+
+/*
+ * heartbeat
+ *
+ * Liveness counters in shared memory. Each component claims a slot and
+ * bumps its counter from its main loop; the supervisor restarts any
+ * component whose counter stops moving for longer than the timeout the
+ * component declared.
+ *
+ * A component that blocks with no timeout waiting for an external event
+ * (a sensor edge, a client connection) marks its slot idle instead of
+ * waking up just to beat. Idle slots are not checked for stalls, and when
+ * every slot is idle the supervisor sleeps until one becomes busy or is
+ * notified, e.g. of an event posted on the bus.
+ */
+
+#define HB_SHM "/votebox-heartbeat"
+#define HB_SLOTS 16
+#define HB_NAMELEN 16
+
+struct hbslot {
+    unsigned long beats;    // bumped by the component
+    int pid;                // owner, 0 if free
+    int timeout_ms;         // stall threshold, 0 until slot is ready
+    int idle;               // blocked on external events, not monitored
+    char name[HB_NAMELEN];
+} __attribute__((aligned(64)));   // one slot per cache line
+
+struct hbregion {
+    unsigned int wake;      // futex word, bumped when a slot leaves idle
+    struct hbslot slot[HB_SLOTS];
+};
+
+struct hbregion *hb_open(void);
+struct hbslot *hb_register(const char *name, int timeout_ms);
+void hb_release(struct hbslot *slot);
+void hb_idle(struct hbslot *slot);
+void hb_busy(struct hbslot *slot);
+void hb_wait(struct hbregion *region, unsigned int wake);
+void hb_notify(void);
+
+/*
+ * Signal that the component is alive. Cheap enough for tight loops.
+ */
+static inline void hb_beat(struct hbslot *slot) {
+    __atomic_fetch_add(&slot->beats, 1, __ATOMIC_RELAXED);
+}
+
+#endif
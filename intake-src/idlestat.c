@@ -0,0 +1,69 @@
+/*
+ * idlestat
+ *
+ * Wakeups are counted as context switches of the process. A process
+ * blocked without timeouts for a whole idle period shows one: the wakeup
+ * that ends the period.
+ *
+ * Author:
+ *  Jerry Lue
+ */
+#include <stdio.h>
+#include <time.h>
+#include <sys/resource.h>
+#include "idlestat.h"
+
+static long long mono_ns(void) {
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return ts.tv_sec * 1000000000LL + ts.tv_nsec;
+}
+
+static void sample(long *wakeups, long long *cpu_us) {
+    struct rusage ru;
+    getrusage(RUSAGE_SELF, &ru);
+    *wakeups = ru.ru_nvcsw + ru.ru_nivcsw;
+    *cpu_us = (ru.ru_utime.tv_sec + ru.ru_stime.tv_sec) * 1000000LL +
+            ru.ru_utime.tv_usec + ru.ru_stime.tv_usec;
+}
+
+static void print(const char *prog, const char *what, long long ns,
+        long wakeups, long long cpu_us) {
+    double min = ns / 60e9;
+    fprintf(stderr, "%s: %s %.1f s, %ld wakeups (%.2f/min), CPU %.3f ms (%.4f%%)\n",
+            prog, what, ns / 1e9, wakeups, min > 0 ? wakeups / min : 0,
+            cpu_us / 1e3, ns > 0 ? cpu_us * 1e5 / ns : 0);
+}
+
+void idlestat_begin(struct idlestat *st) {
+    st->start_ns = mono_ns();
+    sample(&st->start_wakeups, &st->start_cpu_us);
+}
+
+/*
+ * End an idle period and add it to the totals.
+ *
+ * Params:
+ *  prog    Program name for report
+ *  verbose Print the period's statistics
+ */
+void idlestat_end(struct idlestat *st, const char *prog, int verbose) {
+    long long ns = mono_ns() - st->start_ns, cpu_us;
+    long wakeups;
+
+    sample(&wakeups, &cpu_us);
+    wakeups -= st->start_wakeups;
+    cpu_us -= st->start_cpu_us;
+    st->total_ns += ns;
+    st->total_wakeups += wakeups;
+    st->total_cpu_us += cpu_us;
+    if (verbose)
+        print(prog, "idle", ns, wakeups, cpu_us);
+}
+
+/*
+ * Print statistics over all idle periods.
+ */
+void idlestat_report(const struct idlestat *st, const char *prog) {
+    print(prog, "total idle", st->total_ns, st->total_wakeups, st->total_cpu_us);
+}
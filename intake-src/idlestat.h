@@ -0,0 +1,22 @@
+#ifndef IDLESTAT_H
+#define IDLESTAT_H
+
+/*
+ * idlestat
+ *
+ * Measures wakeups and CPU time of the whole process (all threads) while
+ * it is idle, to check that idle really means no periodic activity.
+ */
+
+struct idlestat {
+    long long start_ns, start_cpu_us;   // at start of current idle period
+    long start_wakeups;
+    long long total_ns, total_cpu_us;   // over all idle periods
+    long total_wakeups;
+};
+
+void idlestat_begin(struct idlestat *st);
+void idlestat_end(struct idlestat *st, const char *prog, int verbose);
+void idlestat_report(const struct idlestat *st, const char *prog);
+
+#endif
@@ -0,0 +1,776 @@
+/*
+ * Usage:
+ *  intake [-p] [-c] [-t tray pin] [-s state file] [-j journal] [-m manifest]
+ *         [-M manifest KiB] [-P group:port[:interface]] [-r recording] [config file]
+ *  intake -R recording
+ *
+ * Examples:
+ *  Take in ballots using the default config file
+ *      sudo ./intake-src/intake
+ *  Take in ballots using another config file
+ *      sudo ./intake-src/intake /etc/votebox/intake.conf
+ *  Print a startup profile of each init stage
+ *      sudo ./intake-src/intake -p
+ *  Stay resident, waking on a tray sensor on BCM pin 24
+ *      sudo ./intake-src/intake -c -t 24
+ *  Accept only codes listed in a manifest
+ *      sudo ./intake-src/intake -m /etc/votebox/codes.manifest
+ *  Same, from a manifest compiled by manifestc, in 512 KiB of memory
+ *      sudo ./intake-src/intake -m /etc/votebox/codes.vbm -M 512
+ *  Reject codes already accepted by other boxes at the site
+ *      sudo ./intake-src/intake -P 239.255.86.66:8666
+ *  Record everything the box senses and does during the day
+ *      sudo ./intake-src/intake -c -t 24 -r /var/log/votebox/intake.rec
+ *  Replay a recording through the control logic, e.g. under perf
+ *      ./intake-src/intake -R intake.rec
+ *
+ * Description:
+ *  Native port of take_in.py. Takes in all ballots placed in the tray,
+ *  scanning each one and moving the diverter to accept or reject it.
+ *  Stops when the tray is empty, unless in continuous mode (-c): then the
+ *  feeder idles with the motor off and resumes on the next sheet. With a
+ *  tray sensor (-t, active low) it wakes on the sensor edge; without one
+ *  it probes the tray every IDLE_PROBE_MS. Pickup latency, from wakeup to
+ *  the sheet reaching the halfway trigger, is reported on exit.
+ *
+ *  Idling with a tray sensor uses no periodic timers at all; wakeups and
+ *  CPU time are reported for each idle period.
+ *
+ *  Calibration and timing are read from the config file (intake.conf by
+ *  default), which is watched for changes. Edits take effect at the start
+ *  of the next sheet without restarting the program.
+ *
+ *  Status is published to shared memory and served by statusd. Hardware
+ *  setup, config loading and status mapping run in parallel at startup.
+ *
+ *  With a manifest (-m), a code is accepted only if the manifest lists it.
+ *  Codes appended to its delta file (the manifest path with ".delta") are
+ *  accepted from the next sheet on; see manifest.h. A manifest compiled by
+ *  manifestc stays on disk, with a filter and index in memory limited to
+ *  -M KiB (1024 by default).
+ *
+ *  With -P, accepted codes are multicast to the other boxes at the site in
+ *  the given group, and a code another box has accepted is rejected; see
+ *  peers.h. Propagation delays are reported on exit.
+ *
+ *  Accepted codes are appended to the journal (intake.journal by default),
+ *  chained by hash with periodic checkpoints (see journal.h). On exit, a
+ *  final checkpoint is written, and the root of a Merkle tree over the
+ *  journal records is written to the journal path with ".root" (see
+ *  merkle.h), for publishing at close of polls; journalproof gives
+ *  inclusion proofs against it.
+ *
+ *  Each phase transition of the current sheet is recorded in the state
+ *  file (intake.state by default). If the program is restarted after a
+ *  crash, it finishes the sheet that was under the rollers: a sheet that
+ *  was already counted is ejected into the box without being counted
+ *  again, and a sheet that was not is scanned again.
+ *
+ *  The main loop bumps a heartbeat counter for the supervisor, and status
+ *  changes and decisions are posted on the supervisor's event bus.
+ *
+ *  With -r, every pin change, scanner event, motor and servo command,
+ *  status change, accept decision and config change is recorded to one
+ *  file. -R replays a recording through the same control logic without
+ *  the hardware, as fast as it runs, checking every command against the
+ *  recorded one; see record.h. The journal, state file, status region,
+ *  manifest and peers are not used in replay.
+ *
+ *  Messages on the sheet path are logged through binlog (see binlog.h):
+ *  the main loop only copies their arguments, and a background thread
+ *  formats them to stderr.
+ *
+ * Notes:
+ *  Due to requirements of wiringPi, this program must be run as root.
+ *  The scan program is run from the current directory, as in take_in.py.
+ *
+ * Author:
+ *  Jerry Lue
+ */
+#define _GNU_SOURCE
+#include <stdio.h>
+#include <stdlib.h>
+#include <stddef.h>
+#include <string.h>
+#include <signal.h>
+#include <unistd.h>
+#include <fcntl.h>
+#include <errno.h>
+#include <poll.h>
+#include <pthread.h>
+#include <sys/wait.h>
+#include <wiringPi.h>
+#include <softPwm.h>
+#include "servolib.h"
+#include "boxconf.h"
+#include "manifest.h"
+#include "peers.h"
+#include "bus.h"
+#include "binlog.h"
+#include "bootprof.h"
+#include "status.h"
+#include "journal.h"
+#include "intakestate.h"
+#include "heartbeat.h"
+#include "idlestat.h"
+#include "record.h"
+
+// Output pins
+#define MOTOR_ENABLE 17
+#define MOTOR_FORWARD 22
+#define MOTOR_BACKWARD 27
+
+// Input pins
+#define HALFWAY_TRIGGER 23
+
+#define SCANPROG "./scan"
+#define MAXCODE 4098 // longest code the scan program returns, newline, null
+#define HB_TIMEOUT 1000 // longest time between heartbeats (ms)
+#define HB_PERIOD 100   // heartbeat period while waiting (ms)
+#define CONFIG_BYTES offsetof(struct boxconf, generation) // recorded part
+
+static volatile sig_atomic_t stop;
+static struct boxstatus *boxstatus;
+static struct busregion *bus;       // NULL if not mapped
+static const char *confpath = "intake.conf";
+static const char *statepath = "intake.state";
+static const char *journalpath = "intake.journal";
+static const char *manifestpath;    // NULL to accept any code
+static size_t manifestmem;          // bytes, 0 for default
+static const char *peersaddr;       // NULL for a box on its own
+static struct peers *peers;
+static struct intakestate state;
+static struct hbslot *hb;
+static int continuous;
+static int traypin = -1;
+static int traypipe[2] = { -1, -1 };
+static unsigned int woke_at;        // time idle ended, 0 if not idle
+static unsigned int tray_edge_at;   // time of last tray sensor edge
+static unsigned long pickups;
+static unsigned int pickup_total, pickup_max;
+static struct idlestat idlestats;
+static const char *recpath;         // recording to write, or NULL
+static const char *replaypath;      // recording to replay, or NULL
+
+static const char *phasenames[] = { "idle", "feed", "scan", "accept", "reject" };
+
+static void on_signal(int sig) {
+    stop = 1;
+}
+
+/*
+ * Tray sensor interrupt handler, run on the wiringPi interrupt thread.
+ */
+static void on_tray_edge(void) {
+    char c = 0;
+    tray_edge_at = millis();
+    if (write(traypipe[1], &c, 1) < 0)
+        ; // pipe full: a wakeup is already pending
+}
+
+/*
+ * Broadcast intake status: waiting, pending, accept or reject.
+ */
+static void set_status(const char *status) {
+    BINLOG("Broadcasting status - '%s'\n", status);
+    rec_status(status);
+    if (replaypath)
+        return;
+    status_set(boxstatus, status);
+    bus_post(bus, BUS_STATUS, status, strlen(status));
+}
+
+/*
+ * Wait, beating the heartbeat so the wait is not taken for a stall.
+ *
+ * Params:
+ *  ms      Time to wait in milliseconds
+ */
+static void pause_ms(int ms) {
+    while (ms > 0) {
+        hb_beat(hb);
+        rec_delay(ms < HB_PERIOD ? ms : HB_PERIOD);
+        ms -= HB_PERIOD;
+    }
+    hb_beat(hb);
+}
+
+/*
+ * Config snapshot for the next sheet; in replay, the one in use at this
+ * point of the recording.
+ */
+static const struct boxconf *sheet_config(void) {
+    static struct boxconf replayed;
+
+    if (!replaypath)
+        return rec_config(boxconf_get(), CONFIG_BYTES);
+    memcpy(&replayed, rec_config(NULL, CONFIG_BYTES), CONFIG_BYTES);
+    return &replayed;
+}
+
+/*
+ * Record a phase transition of the current sheet.
+ */
+static void transition(enum intake_phase phase) {
+    state.phase = phase;
+    state.journal_off = journal_size();
+    if (!replaypath)
+        state_commit(&state);
+}
+
+/*
+ * Drive the feed motor.
+ *
+ * Params:
+ *  forward Direction (1: forward, 0: backward)
+ *  duty    Duty cycle in percent
+ */
+static void motor(int forward, int duty) {
+    rec_pwm(MOTOR_ENABLE, duty);
+    rec_write(MOTOR_FORWARD, forward ? HIGH : LOW);
+    rec_write(MOTOR_BACKWARD, forward ? LOW : HIGH);
+}
+
+/*
+ * Move the diverter and wait for it to settle.
+ *
+ * Params:
+ *  pos     Raw PWM position from config snapshot
+ */
+static void divert(const struct boxconf *conf, int pos) {
+    state.diverter = pos;
+    rec_servo(pos);
+    pause_ms(conf->divert_settle_ms);
+    rec_servo(0);
+}
+
+/*
+ * Run the scan program.
+ *
+ * Params:
+ *  code    Buffer for scanned code, empty if none was read
+ *  size    Size of code buffer
+ *
+ * Returns:
+ *  Length of code read, 0 if none was read or the code was truncated
+ */
+static int scan_code(const struct boxconf *conf, char *code, int size) {
+    struct pollfd pfd[2];
+    char cmd[80];
+    FILE *scan;
+    int len = 0, n, status, rawfd, rawpipe;
+
+    code[0] = '\0';
+    if (replaypath) {
+        status = rec_scan(conf->scan_gap_ms, code, size);
+        len = strlen(code);
+        goto done;
+    }
+    // When recording, the scan program also sends its raw input on a pipe
+    rawpipe = rec_scan_pipe(&rawfd);
+    if (rawpipe >= 0)
+        snprintf(cmd, sizeof(cmd), "%s -r %d -g %d %d", SCANPROG, rawpipe,
+                conf->scan_gap_ms, conf->scan_timeout_s);
+    else
+        snprintf(cmd, sizeof(cmd), "%s -g %d %d", SCANPROG, conf->scan_gap_ms,
+                conf->scan_timeout_s);
+    scan = popen(cmd, "r");
+    if (rawpipe >= 0)
+        close(rawpipe);
+    if (!scan) {
+        perror("Cannot run scanner");
+        rec_scan_done(rawfd, "", -1);
+        return 0;
+    }
+    // Scanner has its own heartbeat; keep ours going while it runs
+    pfd[0].fd = fileno(scan);
+    pfd[0].events = POLLIN;
+    pfd[1].fd = rawfd;
+    pfd[1].events = POLLIN;
+    while ((n = poll(pfd, rawfd >= 0 ? 2 : 1, HB_PERIOD)) == 0 ||
+            (n < 0 && errno == EINTR) || (n > 0 && !pfd[0].revents)) {
+        hb_beat(hb);
+        if (n > 0)
+            rec_scan_read(rawfd);
+    }
+    if (fgets(code, size, scan))
+        len = strcspn(code, "\n");
+    code[len] = '\0';
+    n = pclose(scan);
+    status = n != -1 && WIFEXITED(n) ? WEXITSTATUS(n) : -1;
+    rec_scan_done(rawfd, code, status);
+done:
+    // A code longer than the scan program's maximum is never accepted
+    if (status == 2) {
+        BINLOG("Barcode truncated after %d characters\n", len);
+        len = 0;
+    }
+    return len;
+}
+
+/*
+ * Init stages. These are independent of each other and run in parallel.
+ * Each returns NULL on success or an error message.
+ */
+static void *init_gpio(void *arg) {
+    long long t = bootprof_clock();
+
+    wiringPiSetupGpio(); // BCM pin numbering
+    softPwmCreate(MOTOR_ENABLE, 0, 100);
+    pinMode(MOTOR_FORWARD, OUTPUT);
+    pinMode(MOTOR_BACKWARD, OUTPUT);
+    pinMode(HALFWAY_TRIGGER, INPUT);
+    pullUpDnControl(HALFWAY_TRIGGER, PUD_UP);
+    if (traypin >= 0) {
+        pinMode(traypin, INPUT);
+        pullUpDnControl(traypin, PUD_UP);
+        if (pipe2(traypipe, O_NONBLOCK | O_CLOEXEC) ||
+                wiringPiISR(traypin, INT_EDGE_FALLING, on_tray_edge) < 0)
+            return "Cannot set up tray sensor";
+    }
+    servo_init();
+    bootprof_stage("gpio setup", t);
+    return NULL;
+}
+
+static void *init_config(void *arg) {
+    long long t = bootprof_clock();
+
+    if (boxconf_init(confpath))
+        return "Invalid config file";
+    if (boxconf_watch())
+        perror("Cannot watch config file");
+    bootprof_stage("config load", t);
+    return NULL;
+}
+
+static void *init_manifest(void *arg) {
+    long long t = bootprof_clock();
+
+    if (!manifestpath)
+        return NULL;
+    if (manifest_init(manifestpath, manifestmem))
+        return "Cannot load manifest";
+    manifest_report(manifest_get());
+    if (manifest_watch())
+        perror("Cannot watch manifest");
+    bootprof_stage("manifest load", t);
+    return NULL;
+}
+
+static void *init_peers(void *arg) {
+    long long t = bootprof_clock();
+
+    if (!peersaddr)
+        return NULL;
+    if (!(peers = peers_open(peersaddr)) || peers_start(peers))
+        return "Cannot join peer group";
+    bootprof_stage("peer join", t);
+    return NULL;
+}
+
+static void *init_journal(void *arg) {
+    long long t = bootprof_clock();
+
+    if (journal_open(journalpath))
+        return "Cannot open journal";
+    if (state_open(statepath, &state))
+        return "Cannot open state file";
+    bootprof_stage("journal open", t);
+    return NULL;
+}
+
+static void *init_status(void *arg) {
+    long long t = bootprof_clock();
+
+    if (!(boxstatus = status_open(1)))
+        return "Cannot open status region";
+    bus = bus_open(); // optional: events are for the supervisor's log
+    bootprof_stage("status map", t);
+    return NULL;
+}
+
+/*
+ * Run all init stages in parallel.
+ *
+ * Returns:
+ *  0 on success, -1 on error
+ */
+static int setup(void) {
+    void *(*stages[])(void *) = { init_gpio, init_config, init_manifest, init_peers,
+        init_status, init_journal };
+    pthread_t threads[sizeof(stages) / sizeof(stages[0])];
+    int i, n = sizeof(stages) / sizeof(stages[0]), err = 0;
+    void *msg;
+
+    fprintf(stderr, "Running Ballot Diverter V2.\n");
+    if (binlog_start(stderr))
+        fprintf(stderr, "Cannot start log thread; logging directly\n");
+    if (replaypath) {
+        // Nothing to set up: the hardware and config are in the recording
+        if (!rec_config(NULL, CONFIG_BYTES)) {
+            fprintf(stderr, "No config in recording\n");
+            return -1;
+        }
+        n = 0;
+    }
+    for (i = 0; i < n; i++) {
+        if (pthread_create(&threads[i], NULL, stages[i], NULL)) {
+            perror("Cannot start init thread");
+            return -1;
+        }
+    }
+    for (i = 0; i < n; i++) {
+        pthread_join(threads[i], &msg);
+        if (msg) {
+            fprintf(stderr, "%s\n", (char *) msg);
+            err = -1;
+        }
+    }
+    if (!err)
+        set_status("waiting");
+    return err;
+}
+
+/*
+ * Check a code against the manifest, if there is one, and the codes other
+ * boxes have accepted.
+ */
+static int valid_code(const char *code) {
+    if (manifestpath && !manifest_contains(manifest_get(), code)) {
+        BINLOG("Barcode not in manifest: %s\n", code);
+        return 0;
+    }
+    if (peers && peers_seen(peers, code)) {
+        BINLOG("Barcode accepted by another box: %s\n", code);
+        return 0;
+    }
+    return 1;
+}
+
+/*
+ * Decide whether to accept a scanned code: it must be valid and be flushed
+ * to the journal. In replay the recorded decision is taken.
+ */
+static int accept_code(const char *code) {
+    if (replaypath)
+        return rec_verdict(0);
+    return rec_verdict(valid_code(code) && journal_append(code) >= 0);
+}
+
+/*
+ * Slow down motor and scan the sheet to make accept or reject decision.
+ * An accepted code is flushed to the journal before the sheet is diverted
+ * into the box.
+ */
+static void decide(const struct boxconf *conf) {
+    char code[MAXCODE];
+
+    transition(PHASE_SCAN);
+    motor(0, conf->slow_duty);
+    if (scan_code(conf, code, sizeof(code)) && accept_code(code)) {
+        BINLOG("Barcode read: %s\n", code);
+        if (peers)
+            peers_accepted(peers, code);
+        bus_post(bus, BUS_ACCEPT, code, strlen(code));
+        state_set_code(&state, code);
+        state.diverter = conf->divert_down;
+        transition(PHASE_ACCEPT);
+        divert(conf, conf->divert_down);
+        set_status("accept");
+    } else {
+        bus_post(bus, BUS_REJECT, code, strlen(code));
+        state.diverter = conf->divert_up;
+        transition(PHASE_REJECT);
+        divert(conf, conf->divert_up);
+        rec_pwm(MOTOR_ENABLE, 100);
+        pause_ms(conf->reject_eject_ms);
+        rec_pwm(MOTOR_ENABLE, 0);
+        set_status("reject");
+        pause_ms(conf->reject_hold_ms); // allow time for reject message to play
+    }
+}
+
+/*
+ * Roll backward until the halfway trigger is depressed again, leaving no
+ * sheet under the rollers.
+ */
+static void eject(const struct boxconf *conf) {
+    motor(0, conf->feed_duty);
+    while (!rec_read(HALFWAY_TRIGGER))
+        hb_beat(hb);
+    pause_ms(conf->reverse_pause_ms);
+    state_set_code(&state, "");
+    transition(PHASE_IDLE);
+}
+
+/*
+ * Take in one sheet. The config snapshot is held for the whole sheet so
+ * a reload never changes timing partway through.
+ *
+ * Returns:
+ *  1 if a sheet was taken in, 0 if the tray is empty
+ */
+static int take_in(const struct boxconf *conf) {
+    unsigned int timeout;
+    int tray_empty = 0;
+
+    divert(conf, conf->divert_up);
+    timeout = rec_millis() + conf->empty_tray_ms;
+    set_status("pending");
+    transition(PHASE_FEED);
+
+    // Roll forward until the sheet releases the halfway trigger
+    motor(1, conf->feed_duty);
+    while (rec_read(HALFWAY_TRIGGER)) {
+        hb_beat(hb);
+        if ((int) (rec_millis() - timeout) > 0) {
+            BINLOG("Tray is empty.\n");
+            tray_empty = 1;
+            break;
+        }
+    }
+    if (woke_at && !tray_empty) {
+        unsigned int ms = rec_millis() - woke_at;
+        pickups++;
+        pickup_total += ms;
+        if (ms > pickup_max)
+            pickup_max = ms;
+        BINLOG("Picked up sheet %u ms after wakeup.\n", ms);
+    }
+    woke_at = 0;
+
+    pause_ms(conf->reverse_pause_ms);
+    if (!tray_empty)
+        decide(conf);
+    eject(conf);
+    return !tray_empty;
+}
+
+/*
+ * Finish the sheet left under the rollers by a previous run.
+ *
+ * Params:
+ *  last    State recovered from the state file
+ */
+static void resume(const struct boxconf *conf, const struct intakestate *last) {
+    char code[JOURNAL_MAXREC];
+    int phase = last->phase;
+
+    // Crashed after journal write but before the accept transition
+    if (last->seq && phase != PHASE_ACCEPT &&
+            journal_last(last->journal_off, code, sizeof(code)) > 0) {
+        state_set_code(&state, code);
+        phase = PHASE_ACCEPT;
+    }
+    if (phase == PHASE_IDLE)
+        return;
+    BINLOG("Resuming sheet left in phase %s\n", phasenames[phase]);
+
+    switch (phase) {
+        case PHASE_FEED:
+            // Not scanned yet; feeding it again takes it to the scanner
+            return;
+        case PHASE_SCAN:
+            divert(conf, conf->divert_up);
+            decide(conf);
+            break;
+        case PHASE_ACCEPT:
+            // Already counted, just finish putting it in the box
+            state.diverter = conf->divert_down;
+            transition(PHASE_ACCEPT);
+            divert(conf, conf->divert_down);
+            break;
+        case PHASE_REJECT:
+            state.diverter = conf->divert_up;
+            transition(PHASE_REJECT);
+            divert(conf, conf->divert_up);
+            break;
+    }
+    eject(conf);
+}
+
+/*
+ * Idle with the motor off until the next sheet may be in the tray.
+ *
+ * With a tray sensor nothing runs periodically while idle: the soft PWM
+ * thread is stopped, the heartbeat slot is marked idle and the only
+ * wakeup is the sensor edge (or a config file change).
+ */
+static void idle(void) {
+    struct pollfd pfd = { traypipe[0], POLLIN };
+    int ms = 0;
+    char buf[16];
+
+    rec_pwm(MOTOR_ENABLE, 0);
+    rec_write(MOTOR_FORWARD, LOW);
+    rec_write(MOTOR_BACKWARD, LOW);
+    if (!replaypath)
+        softPwmStop(MOTOR_ENABLE); // its thread wakes every 10 ms even at 0 duty
+    set_status("waiting");
+    BINLOG("Idling until next sheet.\n");
+    idlestat_begin(&idlestats);
+
+    if (traypin < 0) {
+        // No tray sensor: probe the tray periodically
+        ms = sheet_config()->idle_probe_ms;
+        while (!rec_stopped(stop) && ms > 0) {
+            hb_beat(hb);
+            rec_delay(ms < HB_PERIOD ? ms : HB_PERIOD);
+            ms -= HB_PERIOD;
+        }
+        woke_at = rec_millis();
+    } else {
+        tray_edge_at = 0;
+        while (read(traypipe[0], buf, sizeof(buf)) > 0)
+            ; // discard edges from the last sheet leaving the tray
+        hb_idle(hb);
+        while (!rec_stopped(stop) && rec_read(traypin) != LOW) {
+            if (rec_poll(&pfd, 1, -1) > 0)
+                while (read(traypipe[0], buf, sizeof(buf)) > 0)
+                    ;
+        }
+        hb_busy(hb);
+        // Measure from the edge if one woke us, so wakeup delay is included
+        woke_at = tray_edge_at ? tray_edge_at : rec_millis();
+        tray_edge_at = 0;
+    }
+    binlog_flush();
+    idlestat_end(&idlestats, "intake", 1);
+    if (!replaypath)
+        softPwmCreate(MOTOR_ENABLE, 0, 100);
+}
+
+/*
+ * Publish the journal's Merkle root beside it, as "<records> <root>" in
+ * hex, for the close of polls. The file is replaced by renaming.
+ */
+static void publish_root(void) {
+    unsigned char root[MERKLE_HASH];
+    char path[4096], tmp[4096 + 4], hex[2 * MERKLE_HASH + 1];
+    unsigned long records;
+    FILE *fp;
+    int i;
+
+    if (journal_root(root, &records))
+        return;
+    for (i = 0; i < MERKLE_HASH; i++)
+        sprintf(hex + 2 * i, "%02x", root[i]);
+    snprintf(path, sizeof(path), "%s.root", journalpath);
+    snprintf(tmp, sizeof(tmp), "%s.tmp", path);
+    if (!(fp = fopen(tmp, "w")) || fprintf(fp, "%lu %s\n", records, hex) < 0 ||
+            fflush(fp) || fsync(fileno(fp)) || fclose(fp) || rename(tmp, path)) {
+        perror("Cannot publish journal root");
+        return;
+    }
+    fprintf(stderr, "Journal root: %lu records, %s\n", records, hex);
+}
+
+/*
+ * Roll backward to open tray, then stop motor.
+ */
+static void clean_up(void) {
+    binlog_flush();
+    fprintf(stderr, "Cleaning up.\n");
+    motor(0, 100);
+    pause_ms(1000);
+    rec_pwm(MOTOR_ENABLE, 0);
+    rec_write(MOTOR_BACKWARD, LOW);
+    if (pickups)
+        fprintf(stderr, "Pickup latency: %lu sheets, avg %lu ms, max %u ms\n",
+                pickups, pickup_total / pickups, pickup_max);
+    if (continuous)
+        idlestat_report(&idlestats, "intake");
+    if (peers)
+        peers_report(peers, "intake");
+    if (!replaypath) {
+        journal_checkpoint();
+        publish_root();
+    }
+    rec_close();
+}
+
+int main(int argc, char *argv[]) {
+    struct intakestate last;
+    int opt;
+
+    while ((opt = getopt(argc, argv, "pct:s:j:m:M:P:r:R:")) != -1) {
+        switch (opt) {
+            case 'p':
+                bootprof_enable();
+                break;
+            case 'c':
+                continuous = 1;
+                break;
+            case 't':
+                traypin = atoi(optarg);
+                break;
+            case 's':
+                statepath = optarg;
+                break;
+            case 'j':
+                journalpath = optarg;
+                break;
+            case 'm':
+                manifestpath = optarg;
+                break;
+            case 'M':
+                manifestmem = (size_t) atol(optarg) * 1024;
+                break;
+            case 'P':
+                peersaddr = optarg;
+                break;
+            case 'r':
+                recpath = optarg;
+                break;
+            case 'R':
+                replaypath = optarg;
+                break;
+            default:
+                fprintf(stderr, "Usage: intake [-p] [-c] [-t tray pin] [-s state file] "
+                        "[-j journal] [-m manifest] [-M manifest KiB] "
+                        "[-P group:port[:interface]] [-r recording] [config file]\n"
+                        "       intake -R recording\n");
+                return 1;
+        }
+    }
+    if (optind < argc)
+        confpath = argv[optind];
+    signal(SIGINT, on_signal);
+    signal(SIGTERM, on_signal);
+    if (recpath && rec_open(recpath, traypin, continuous)) {
+        perror("Cannot open recording");
+        return 1;
+    }
+    if (replaypath && rec_replay(replaypath, &traypin, &continuous, &stop)) {
+        perror("Cannot replay recording");
+        return 1;
+    }
+
+    hb = hb_register("intake", HB_TIMEOUT);
+    if (setup()) {
+        binlog_flush();
+        return 1;
+    }
+    binlog_flush();
+    bootprof_report("intake");
+    last = state;
+    resume(sheet_config(), &last);
+    do {
+        while (!rec_stopped(stop) && take_in(sheet_config())) {
+            boxconf_quiescent(); // between sheets: retire old config snapshots
+            manifest_quiescent();
+            if (peers)
+                peers_quiescent(peers);
+        }
+        boxconf_quiescent();
+        manifest_quiescent();
+        if (peers)
+            peers_quiescent(peers);
+        if (continuous && !rec_stopped(stop))
+            idle();
+    } while (continuous && !rec_stopped(stop));
+    clean_up();
+    hb_release(hb);
+    return 0;
+}
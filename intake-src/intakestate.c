@@ -0,0 +1,112 @@
+/*
+ * intakestate
+ *
+ * The state file holds two slots, each in its own disk sector, in a
+ * shared mapping. A commit writes the slot not holding the newest record,
+ * with a higher sequence number and a fresh checksum. Writes to the shared
+ * mapping survive a crash of the process immediately; writeback to disk
+ * is started asynchronously so power loss costs at most the last
+ * transitions. A torn write damages only the slot being written, and is
+ * caught by the checksum on recovery, which then uses the other slot.
+ *
+ * Author:
+ *  Jerry Lue
+ */
+#include <stdio.h>
+#include <string.h>
+#include <stddef.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <sys/mman.h>
+#include "intakestate.h"
+
+#define SLOTSIZE 512
+
+static unsigned char *region;
+
+static unsigned int crc32(const void *data, size_t len) {
+    const unsigned char *p = data;
+    unsigned int crc = 0xffffffff;
+    int k;
+
+    while (len--) {
+        crc ^= *p++;
+        for (k = 0; k < 8; k++)
+            crc = (crc >> 1) ^ (0xedb88320 & -(crc & 1));
+    }
+    return ~crc;
+}
+
+static int slot_valid(const struct intakestate *st) {
+    return st->crc == crc32(st, offsetof(struct intakestate, crc));
+}
+
+/*
+ * Map the state file, creating it if needed, and recover the last state.
+ *
+ * Params:
+ *  path    State file path
+ *  last    Set to last committed state; zeroed (PHASE_IDLE) if none
+ *
+ * Returns:
+ *  0 on success, -1 on error
+ */
+int state_open(const char *path, struct intakestate *last) {
+    struct intakestate *a, *b;
+    int fd = open(path, O_RDWR | O_CREAT | O_CLOEXEC, 0644);
+
+    if (fd < 0)
+        return -1;
+    if (ftruncate(fd, 2 * SLOTSIZE)) {
+        close(fd);
+        return -1;
+    }
+    region = mmap(NULL, 2 * SLOTSIZE, PROT_READ | PROT_WRITE, MAP_SHARED, fd, 0);
+    close(fd);
+    if (region == MAP_FAILED)
+        return -1;
+
+    a = (struct intakestate *) region;
+    b = (struct intakestate *) (region + SLOTSIZE);
+    memset(last, 0, sizeof(*last));
+    if (slot_valid(a) && (!slot_valid(b) || a->seq > b->seq))
+        *last = *a;
+    else if (slot_valid(b))
+        *last = *b;
+    return 0;
+}
+
+/*
+ * Commit a new state. The sequence number and checksum are filled in.
+ *
+ * Params:
+ *  st      State to commit
+ */
+void state_commit(struct intakestate *st) {
+    unsigned char *slot;
+
+    st->seq++;
+    st->crc = crc32(st, offsetof(struct intakestate, crc));
+    slot = region + (st->seq & 1) * SLOTSIZE;
+    memcpy(slot, st, sizeof(*st));
+    msync(region, 2 * SLOTSIZE, MS_ASYNC);
+}
+
+/*
+ * Set the code of the current sheet, cut to the code field if longer, with
+ * its length and digest. Committed with the next state.
+ *
+ * Params:
+ *  st      State
+ *  code    Code, or "" for none
+ */
+void state_set_code(struct intakestate *st, const char *code) {
+    size_t len = strlen(code);
+
+    snprintf(st->code, sizeof(st->code), "%s", code);
+    st->codelen = len;
+    if (len)
+        sha256(code, len, st->digest);
+    else
+        memset(st->digest, 0, sizeof(st->digest));
+}
@@ -0,0 +1,43 @@
+#ifndef INTAKESTATE_H
+#define INTAKESTATE_H
+
+/*
+ * intakestate
+ *
+ * Crash-consistent record of where the intake controller is in handling
+ * the current sheet. It is written on every phase transition, so after a
+ * crash the controller can finish the sheet under the rollers instead of
+ * guessing whether it was counted.
+ *
+ * A code longer than the code field, as a 2D code can be, is kept as its
+ * start, and its length marks it as cut. The SHA-256 of the whole code is
+ * kept with it, so the code can still be matched against the journal.
+ */
+#include "sha256.h"
+
+#define STATE_CODELEN 64
+
+enum intake_phase {
+    PHASE_IDLE,     // no sheet under the rollers
+    PHASE_FEED,     // feeding a sheet, not yet scanned
+    PHASE_SCAN,     // scanning, not yet counted
+    PHASE_ACCEPT,   // counted in journal, ejecting into box
+    PHASE_REJECT,   // not counted, ejecting back out
+};
+
+struct intakestate {
+    unsigned long long seq;     // write count, selects the newest slot
+    unsigned int phase;         // enum intake_phase
+    int diverter;               // last commanded diverter position
+    long long journal_off;      // journal size when phase was entered
+    char code[STATE_CODELEN];   // code of current sheet, if accepted; its start if longer
+    unsigned int codelen;       // length of the whole code, STATE_CODELEN or more if cut
+    unsigned char digest[SHA256_SIZE]; // SHA-256 of the whole code, zero if none
+    unsigned int crc;           // CRC-32 of all fields above
+};
+
+int state_open(const char *path, struct intakestate *last);
+void state_commit(struct intakestate *st);
+void state_set_code(struct intakestate *st, const char *code);
+
+#endif
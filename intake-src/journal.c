@@ -0,0 +1,237 @@
+/*
+ * journal
+ *
+ * Records are appended with a single write and flushed to disk before the
+ * sheet is diverted, so an accepted sheet is never lost. On open, a torn
+ * final line left by a crash mid-write is cut off, and the record count,
+ * Merkle frontier and chain value are rebuilt in one pass.
+ *
+ * Author:
+ *  Jerry Lue
+ */
+#include <stdio.h>
+#include <string.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <sys/stat.h>
+#include "journal.h"
+
+static int fd = -1;
+static long long size;
+static unsigned long seq;
+static unsigned long checkpointed;     // records up to the last checkpoint
+static struct merkle tree;
+static unsigned char chain[SHA256_SIZE];
+
+/*
+ * Advance a chain value over a record.
+ *
+ * Params:
+ *  chain   Chain value before the record, replaced by the value after it
+ *  rec     Record, without its newline
+ *  len     Record length
+ */
+void journal_chain(unsigned char chain[SHA256_SIZE], const char *rec, size_t len) {
+    struct sha256 ctx;
+
+    sha256_init(&ctx);
+    sha256_update(&ctx, chain, SHA256_SIZE);
+    sha256_update(&ctx, rec, len);
+    sha256_final(&ctx, chain);
+}
+
+/*
+ * Format a checkpoint line, with its newline.
+ *
+ * Returns:
+ *  Line length
+ */
+int journal_format_checkpoint(char *line, unsigned long records, const unsigned char chain[SHA256_SIZE]) {
+    int n = sprintf(line, "@%lu ", records), i;
+
+    for (i = 0; i < SHA256_SIZE; i++)
+        n += sprintf(line + n, "%02x", chain[i]);
+    line[n++] = '\n';
+    line[n] = '\0';
+    return n;
+}
+
+/*
+ * Open the journal, creating it if needed.
+ *
+ * Returns:
+ *  0 on success, -1 on error
+ */
+int journal_open(const char *path) {
+    char buf[4096];
+    unsigned char leaf[MERKLE_HASH];
+    struct sha256 leafctx, chainctx;
+    long long off = 0, end = 0;
+    ssize_t n, i, start;
+    int check = 0;
+
+    fd = open(path, O_RDWR | O_CREAT | O_APPEND | O_CLOEXEC, 0644);
+    if (fd < 0)
+        return -1;
+    // Count complete records, find the end of the last one and hash each
+    // into the tree and the chain, in the same pass. The first byte of a
+    // line tells a checkpoint from a record; records are hashed in pieces
+    // as they are read
+    merkle_init(&tree);
+    memset(chain, 0, sizeof(chain));
+    merkle_leaf_start(&leafctx);
+    sha256_init(&chainctx);
+    sha256_update(&chainctx, chain, sizeof(chain));
+    while ((n = pread(fd, buf, sizeof(buf), off)) > 0) {
+        for (i = start = 0; i < n; i++) {
+            if (off + i == end)
+                check = buf[i] == '@';
+            if (buf[i] != '\n')
+                continue;
+            if (check) {
+                checkpointed = seq;
+            } else {
+                sha256_update(&leafctx, buf + start, i - start);
+                sha256_update(&chainctx, buf + start, i - start);
+                sha256_final(&leafctx, leaf);
+                sha256_final(&chainctx, chain);
+                merkle_add(&tree, leaf);
+                seq++;
+            }
+            merkle_leaf_start(&leafctx);
+            sha256_init(&chainctx);
+            sha256_update(&chainctx, chain, sizeof(chain));
+            start = i + 1;
+            end = off + i + 1;
+        }
+        if (!check) {
+            sha256_update(&leafctx, buf + start, n - start);
+            sha256_update(&chainctx, buf + start, n - start);
+        }
+        off += n;
+    }
+    if (n < 0)
+        return -1;
+    if (end != off) {
+        fprintf(stderr, "journal: discarding %lld byte partial record\n", off - end);
+        if (ftruncate(fd, end))
+            return -1;
+    }
+    size = end;
+    return 0;
+}
+
+/*
+ * Append an accepted code and flush it to disk.
+ *
+ * Returns:
+ *  Journal size after the record, or -1 on error
+ */
+long long journal_append(const char *code) {
+    char rec[JOURNAL_MAXREC + JOURNAL_MAXCHECK];
+    unsigned char leaf[MERKLE_HASH], next[SHA256_SIZE];
+    int n = snprintf(rec, JOURNAL_MAXREC, "%lu %s\n", seq + 1, code), len = n;
+
+    if (n >= JOURNAL_MAXREC) {
+        fprintf(stderr, "journal: record too long\n");
+        return -1;
+    }
+    memcpy(next, chain, sizeof(next));
+    journal_chain(next, rec, n - 1);
+    if ((seq + 1) % JOURNAL_CHECKPOINT == 0)
+        len += journal_format_checkpoint(rec + n, seq + 1, next);
+    if (write(fd, rec, len) != len || fdatasync(fd)) {
+        perror("journal: cannot append record");
+        return -1;
+    }
+    seq++;
+    size += len;
+    if (len > n)
+        checkpointed = seq;
+    memcpy(chain, next, sizeof(chain));
+    merkle_leaf(rec, n - 1, leaf);
+    merkle_add(&tree, leaf);
+    return size;
+}
+
+/*
+ * Write a checkpoint for the records since the last one, if any, e.g.
+ * before exit so that the whole journal is covered.
+ *
+ * Returns:
+ *  0 on success, -1 on error
+ */
+int journal_checkpoint(void) {
+    char line[JOURNAL_MAXCHECK];
+    int n;
+
+    if (fd < 0)
+        return -1;
+    if (checkpointed == seq)
+        return 0;
+    n = journal_format_checkpoint(line, seq, chain);
+    if (write(fd, line, n) != n || fdatasync(fd)) {
+        perror("journal: cannot append checkpoint");
+        return -1;
+    }
+    size += n;
+    checkpointed = seq;
+    return 0;
+}
+
+/*
+ * Get the journal size.
+ */
+long long journal_size(void) {
+    return size;
+}
+
+/*
+ * Read the code of the last record if it ends after a given offset, i.e.
+ * if a record was appended after that offset. A checkpoint written after
+ * the offset is not a record.
+ *
+ * Params:
+ *  off     Journal offset before the record was appended
+ *  code    Buffer for code
+ *  codesize Size of code buffer
+ *
+ * Returns:
+ *  1 if a later record was found, 0 if not, -1 on error
+ */
+int journal_last(long long off, char *code, int codesize) {
+    char rec[JOURNAL_MAXREC], *sp;
+    ssize_t n;
+
+    if (size <= off)
+        return 0;
+    n = pread(fd, rec, size - off < (long long) sizeof(rec) - 1 ?
+            size - off : (long long) sizeof(rec) - 1, off);
+    if (n <= 0)
+        return -1;
+    rec[n] = '\0';
+    if (rec[0] == '@')
+        return 0;
+    rec[strcspn(rec, "\n")] = '\0';
+    sp = strchr(rec, ' ');
+    snprintf(code, codesize, "%s", sp ? sp + 1 : "");
+    return 1;
+}
+
+/*
+ * Get the Merkle tree root of the journal.
+ *
+ * Params:
+ *  root    Set to the root
+ *  records Set to the number of records committed to
+ *
+ * Returns:
+ *  0 on success, -1 if the journal is not open
+ */
+int journal_root(unsigned char root[MERKLE_HASH], unsigned long *records) {
+    if (fd < 0)
+        return -1;
+    merkle_root(&tree, root);
+    *records = tree.n;
+    return 0;
+}
@@ -0,0 +1,42 @@
+#ifndef JOURNAL_H
+#define JOURNAL_H
+
+/*
+ * journal
+ *
+ * Append-only record of accepted ballots. Each accepted sheet adds one
+ * line "<sequence number> <code>". The journal size after a record is
+ * used as the journal offset in the intake state snapshot.
+ *
+ * The journal is committed to by a Merkle tree over its records (see
+ * merkle.h), each record a leaf without its newline. The tree's frontier
+ * is rebuilt when the journal is opened and extended on each append, so
+ * the root is available at any time, e.g. for publishing at close of
+ * polls.
+ *
+ * The records also form a hash chain: chain value 0 is 32 zero bytes and
+ * value i is SHA-256(value i - 1 || record i), the record without its
+ * newline. Every JOURNAL_CHECKPOINT records, and when intake exits, a
+ * checkpoint line "@<records> <chain value>" (in hex) is written after
+ * the record, in the same write. Checkpoints split the journal into
+ * segments that a verifier can check independently, each from the value
+ * at its start to the one at its end (see journalcheck). Checkpoint lines
+ * are not records: they have no sequence number and are not in the tree.
+ */
+#include <stddef.h>
+#include "merkle.h"
+
+#define JOURNAL_MAXREC 4160 // longest record: sequence number, 4096 character code
+#define JOURNAL_CHECKPOINT 1024     // records between checkpoints
+#define JOURNAL_MAXCHECK 96         // longest checkpoint line
+
+int journal_open(const char *path);
+long long journal_append(const char *code);
+long long journal_size(void);
+int journal_last(long long off, char *code, int codesize);
+int journal_root(unsigned char root[MERKLE_HASH], unsigned long *records);
+int journal_checkpoint(void);
+void journal_chain(unsigned char chain[SHA256_SIZE], const char *rec, size_t len);
+int journal_format_checkpoint(char *line, unsigned long records, const unsigned char chain[SHA256_SIZE]);
+
+#endif
@@ -0,0 +1,294 @@
+/*
+ * Usage:
+ *  journalcheck [-v] [-j threads] journal
+ *
+ * Examples:
+ *  Verify a journal's hash chain on all cores
+ *      ./intake-src/journalcheck intake.journal
+ *  Verify on 4 threads, with the work done by each
+ *      ./intake-src/journalcheck -v -j 4 intake.journal
+ *
+ * Description:
+ *  Verifies the hash chain of a journal (see journal.h) in parallel. The
+ *  journal is split into as many byte ranges as threads (by default one
+ *  per core). Each thread starts at the first checkpoint in its range,
+ *  taking the chain value and record count from it, and checks every
+ *  record up to the first checkpoint at or past the end of its range,
+ *  which the next thread starts from; the first thread starts from the
+ *  beginning of the chain. The segments thus link up: each checkpoint a
+ *  thread starts from is checked by the thread before it.
+ *
+ *  A record is bad if it is not "<sequence number> <code>" with the next
+ *  sequence number, and a checkpoint is bad if it is malformed, if its
+ *  record count is wrong or if its chain value is not the one computed
+ *  over the records before it, i.e. a record since the previous checkpoint
+ *  was altered, added or removed. Verification stops at the first bad
+ *  line, which is printed with its offset, and the exit status is 2.
+ *  Otherwise the records, checkpoints and final chain value are printed.
+ *  Either way the time taken, records per second and MB per second are
+ *  printed to standard error.
+ *
+ *  With -v, the records and time of each thread are printed to standard
+ *  error.
+ *
+ * Notes:
+ *  Records after the last checkpoint are checked for sequence, but only
+ *  the final chain value covers them; intake writes a checkpoint on exit.
+ *  A torn final line, left by a crash mid-write, is reported but is not
+ *  bad: intake cuts it off when it opens the journal.
+ *
+ * Author:
+ *  Jerry Lue
+ */
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <stdint.h>
+#include <time.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <pthread.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include "journal.h"
+
+struct part {
+    pthread_t thread;
+    size_t start, end;          // range in which this thread's segments start
+    unsigned long records, checkpoints;
+    long long ns;
+    int last;                   // reached the end of the journal
+    unsigned long seq, tail;    // records, and records after the last checkpoint
+    unsigned char head[SHA256_SIZE];
+    size_t torn;                // bytes of a torn final line
+    size_t bad;                 // offset of the first bad line, or SIZE_MAX
+    char why[160];
+};
+
+static const char *base;
+static size_t size;
+static size_t first_bad = SIZE_MAX;
+
+static long long now_ns(void) {
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return ts.tv_sec * 1000000000LL + ts.tv_nsec;
+}
+
+/*
+ * Parse a checkpoint line "@<records> <chain value>".
+ *
+ * Returns:
+ *  0 on success, -1 if malformed
+ */
+static int parse_checkpoint(const char *p, size_t len, unsigned long *records,
+        unsigned char chain[SHA256_SIZE]) {
+    char line[JOURNAL_MAXCHECK];
+    unsigned long n;
+    int used = 0, i;
+
+    if (len >= sizeof(line))
+        return -1;
+    memcpy(line, p, len);
+    line[len] = '\0';
+    if (sscanf(line, "@%lu %n", &n, &used) != 1 || !used || len - used != 2 * SHA256_SIZE)
+        return -1;
+    for (i = 0; i < SHA256_SIZE; i++)
+        if (sscanf(line + used + 2 * i, "%2hhx", &chain[i]) != 1)
+            return -1;
+    *records = n;
+    return 0;
+}
+
+/*
+ * Check that a record is "<seq> <code>".
+ */
+static int record_ok(const char *p, size_t len, unsigned long seq) {
+    unsigned long n = 0;
+    size_t i;
+
+    for (i = 0; i < len && p[i] >= '0' && p[i] <= '9' && i < 20; i++)
+        n = n * 10 + p[i] - '0';
+    return i > 0 && p[0] != '0' && n == seq && i + 1 < len && p[i] == ' ';
+}
+
+static void fail(struct part *pt, size_t off, const char *fmt, unsigned long a, unsigned long b) {
+    size_t cur = __atomic_load_n(&first_bad, __ATOMIC_RELAXED);
+
+    pt->bad = off;
+    snprintf(pt->why, sizeof(pt->why), fmt, a, b);
+    while (off < cur && !__atomic_compare_exchange_n(&first_bad, &cur, off, 0,
+            __ATOMIC_RELAXED, __ATOMIC_RELAXED))
+        ;
+}
+
+/*
+ * Check the segments that start in a thread's range.
+ */
+static void *verify(void *arg) {
+    struct part *pt = arg;
+    unsigned char chain[SHA256_SIZE] = { 0 }, want[SHA256_SIZE];
+    unsigned long seq = 0, check = 0, n;
+    size_t off = pt->start;
+    long long t = now_ns();
+    const char *p, *e;
+
+    if (off > 0) {
+        // Find the first line in the range, then the first checkpoint
+        if (base[off - 1] != '\n') {
+            if (!(e = memchr(base + off, '\n', size - off)))
+                goto done;
+            off = e - base + 1;
+        }
+        while (off < pt->end && base[off] != '@') {
+            if (!(e = memchr(base + off, '\n', size - off)))
+                goto done;
+            off = e - base + 1;
+        }
+        if (off >= pt->end)
+            goto done;
+        if (!(e = memchr(base + off, '\n', size - off)))
+            goto done;
+        if (parse_checkpoint(base + off, e - base - off, &seq, chain)) {
+            fail(pt, off, "malformed checkpoint", 0, 0);
+            goto done;
+        }
+        check = seq;
+        off = e - base + 1;
+    }
+    while (off < size && off < __atomic_load_n(&first_bad, __ATOMIC_RELAXED)) {
+        p = base + off;
+        if (!(e = memchr(p, '\n', size - off))) {
+            pt->torn = size - off;
+            break;
+        }
+        if (*p == '@') {
+            if (parse_checkpoint(p, e - p, &n, want)) {
+                fail(pt, off, "malformed checkpoint", 0, 0);
+                goto done;
+            }
+            if (n != seq) {
+                fail(pt, off, "checkpoint of %lu records after %lu records", n, seq);
+                goto done;
+            }
+            if (memcmp(want, chain, SHA256_SIZE)) {
+                fail(pt, off, "checkpoint does not match the chain: records %lu to %lu altered",
+                        check + 1, seq);
+                goto done;
+            }
+            pt->checkpoints++;
+            check = seq;
+            if (off >= pt->end)
+                goto done;
+        } else {
+            if (!record_ok(p, e - p, seq + 1)) {
+                fail(pt, off, "record %lu is not \"%lu <code>\"", seq + 1, seq + 1);
+                goto done;
+            }
+            journal_chain(chain, p, e - p);
+            seq++;
+            pt->records++;
+        }
+        off = e - base + 1;
+    }
+    if (off >= size || pt->torn) {
+        pt->last = 1;
+        pt->seq = seq;
+        pt->tail = seq - check;
+        memcpy(pt->head, chain, SHA256_SIZE);
+    }
+done:
+    pt->ns = now_ns() - t;
+    return NULL;
+}
+
+int main(int argc, char *argv[]) {
+    struct part *parts, *last = NULL, *bad = NULL;
+    unsigned long records = 0, checkpoints = 0;
+    int opt, verbose = 0, threads = sysconf(_SC_NPROCESSORS_ONLN), i, fd;
+    struct stat st;
+    long long t;
+    double secs;
+
+    while ((opt = getopt(argc, argv, "vj:")) != -1) {
+        switch (opt) {
+            case 'v':
+                verbose = 1;
+                break;
+            case 'j':
+                threads = atoi(optarg);
+                break;
+            default:
+                goto usage;
+        }
+    }
+    if (optind + 1 != argc)
+        goto usage;
+    if (threads < 1)
+        threads = 1;
+
+    if ((fd = open(argv[optind], O_RDONLY)) < 0 || fstat(fd, &st)) {
+        perror(argv[optind]);
+        return 1;
+    }
+    size = st.st_size;
+    if (size && (base = mmap(NULL, size, PROT_READ, MAP_SHARED, fd, 0)) == MAP_FAILED) {
+        perror(argv[optind]);
+        return 1;
+    }
+    close(fd);
+    if (size)
+        madvise((void *) base, size, MADV_SEQUENTIAL);
+    if (!(parts = calloc(threads, sizeof(*parts)))) {
+        perror("journalcheck");
+        return 1;
+    }
+
+    t = now_ns();
+    for (i = 0; i < threads; i++) {
+        parts[i].start = size * i / threads;
+        parts[i].end = size * (i + 1) / threads;
+        parts[i].bad = SIZE_MAX;
+        if (pthread_create(&parts[i].thread, NULL, verify, &parts[i])) {
+            perror("journalcheck");
+            return 1;
+        }
+    }
+    for (i = 0; i < threads; i++) {
+        pthread_join(parts[i].thread, NULL);
+        records += parts[i].records;
+        checkpoints += parts[i].checkpoints;
+        if (parts[i].bad != SIZE_MAX && parts[i].bad == first_bad)
+            bad = &parts[i];
+        if (parts[i].last)
+            last = &parts[i];
+        if (verbose)
+            fprintf(stderr, "journalcheck: thread %d: %lu records, %lu checkpoints in %.1f ms\n",
+                    i, parts[i].records, parts[i].checkpoints, parts[i].ns / 1e6);
+    }
+    secs = (now_ns() - t) / 1e9;
+    fprintf(stderr, "journalcheck: %.1f MB in %.3f s with %d threads: %.0f records/s, %.1f MB/s\n",
+            size / 1e6, secs, threads, secs > 0 ? records / secs : 0, secs > 0 ? size / 1e6 / secs : 0);
+
+    if (bad) {
+        printf("bad line at offset %zu: %s\n", bad->bad, bad->why);
+        return 2;
+    }
+    if (!last) {
+        printf("bad: end of journal not reached\n");
+        return 2;
+    }
+    printf("ok: %lu records, %lu checkpoints, chain ", last->seq, checkpoints);
+    for (i = 0; i < SHA256_SIZE; i++)
+        printf("%02x", last->head[i]);
+    printf("\n");
+    if (last->tail)
+        fprintf(stderr, "journalcheck: %lu records after the last checkpoint\n", last->tail);
+    if (last->torn)
+        fprintf(stderr, "journalcheck: %zu byte partial record at the end\n", last->torn);
+    return 0;
+
+usage:
+    fprintf(stderr, "Usage: journalcheck [-v] [-j threads] journal\n");
+    return 1;
+}
@@ -0,0 +1,310 @@
+/*
+ * Usage:
+ *  journalproof [-v] journal [code...]
+ *  journalproof [-v] -s journal
+ *  journalproof -c [-r root] [proof]
+ *
+ * Examples:
+ *  Print the journal's Merkle root, to compare with the published one
+ *      ./intake-src/journalproof intake.journal
+ *  Prove that a ballot was counted
+ *      ./intake-src/journalproof intake.journal VB-2016-0042-7F3A9C2E81D4 > proof.txt
+ *  Check a proof against the published root
+ *      ./intake-src/journalproof -c -r $(cut -d' ' -f2 intake.journal.root) proof.txt
+ *
+ * Description:
+ *  Gives inclusion proofs of journal records in the Merkle tree whose root
+ *  intake publishes at close of polls (see merkle.h), so a voter can check
+ *  that their ballot was counted without the rest of the journal.
+ *
+ *  With no codes, the number of records and the root are printed in hex,
+ *  as in the root file intake writes. With codes, a proof is printed for
+ *  each:
+ *
+ *      record <sequence number> <code>
+ *      index <leaf index>
+ *      size <records>
+ *      root <root>
+ *      path <hash>
+ *      ...
+ *      end
+ *
+ *  with the path hashes from the leaf up, or "none <code>" if the code is
+ *  not in the journal (exit status 1). With -s, codes are read from
+ *  standard input, one per line, and each proof is flushed as it is
+ *  written, so one process can serve lookups.
+ *
+ *  With -c, a proof is read from the file given (standard input by
+ *  default) and checked: "ok" is printed if the record is in the tree with
+ *  the proof's root, and that root is the one given by -r if any, and
+ *  "bad" with exit status 2 if not.
+ *
+ *  With -v, the time to build the tree and to give each proof is printed
+ *  to standard error.
+ *
+ * Notes:
+ *  The tree is built once from the journal, about two hashes per record;
+ *  each proof is then a copy of one hash per level.
+ *
+ * Author:
+ *  Jerry Lue
+ */
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <unistd.h>
+#include "merkle.h"
+#include "journal.h"
+
+struct journal_tree {
+    char *text;
+    char **records;                 // each record, newline removed
+    uint32_t *bycode;               // record indexes sorted by code
+    uint64_t n;
+    struct merkle_tree tree;
+};
+
+static long long now_ns(void) {
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return ts.tv_sec * 1000000000LL + ts.tv_nsec;
+}
+
+static const char *record_code(const char *rec) {
+    const char *sp = strchr(rec, ' ');
+    return sp ? sp + 1 : "";
+}
+
+static char **sort_records;
+
+static int cmp_bycode(const void *a, const void *b) {
+    return strcmp(record_code(sort_records[*(const uint32_t *) a]),
+            record_code(sort_records[*(const uint32_t *) b]));
+}
+
+static void hex(const unsigned char h[MERKLE_HASH], char *out) {
+    int i;
+
+    for (i = 0; i < MERKLE_HASH; i++)
+        sprintf(out + 2 * i, "%02x", h[i]);
+}
+
+static int unhex(const char *s, unsigned char h[MERKLE_HASH]) {
+    int i;
+
+    for (i = 0; i < MERKLE_HASH; i++)
+        if (sscanf(s + 2 * i, "%2hhx", &h[i]) != 1)
+            return -1;
+    return s[2 * MERKLE_HASH] && s[2 * MERKLE_HASH] != '\n' ? -1 : 0;
+}
+
+/*
+ * Read a journal and build the tree over its complete records.
+ *
+ * Returns:
+ *  0 on success, -1 on error
+ */
+static int load(struct journal_tree *jt, const char *path) {
+    unsigned char (*leaves)[MERKLE_HASH];
+    FILE *fp = fopen(path, "rb");
+    long size;
+    char *p, *nl;
+    uint64_t i;
+
+    memset(jt, 0, sizeof(*jt));
+    if (!fp || fseek(fp, 0, SEEK_END) || (size = ftell(fp)) < 0 || fseek(fp, 0, SEEK_SET) ||
+            !(jt->text = malloc(size + 1)) || fread(jt->text, 1, size, fp) != (size_t) size) {
+        if (fp)
+            fclose(fp);
+        return -1;
+    }
+    fclose(fp);
+    jt->text[size] = '\0';
+    for (p = jt->text; (nl = strchr(p, '\n')); p = nl + 1)
+        jt->n++;
+    if (!(jt->records = malloc((jt->n + 1) * sizeof(*jt->records))) ||
+            !(jt->bycode = malloc((jt->n + 1) * sizeof(*jt->bycode))) ||
+            !(leaves = malloc((jt->n + 1) * MERKLE_HASH)))
+        return -1;
+    // A torn final record is not committed to, as in journal_open(), nor
+    // are checkpoint lines
+    for (i = 0, p = jt->text; (nl = strchr(p, '\n')); p = nl + 1) {
+        if (*p == '@')
+            continue;
+        *nl = '\0';
+        jt->records[i] = p;
+        jt->bycode[i] = i;
+        merkle_leaf(p, nl - p, leaves[i]);
+        i++;
+    }
+    jt->n = i;
+    sort_records = jt->records;
+    qsort(jt->bycode, jt->n, sizeof(*jt->bycode), cmp_bycode);
+    i = merkle_build(&jt->tree, (const unsigned char (*)[MERKLE_HASH]) leaves, jt->n);
+    free(leaves);
+    return i ? -1 : 0;
+}
+
+static void root(const struct journal_tree *jt, unsigned char out[MERKLE_HASH]) {
+    if (jt->n)
+        memcpy(out, jt->tree.level[jt->tree.levels - 1][0], MERKLE_HASH);
+    else
+        sha256("", 0, out);
+}
+
+/*
+ * Print the proof of the record with a code.
+ *
+ * Returns:
+ *  0 if the code is in the journal, 1 if not
+ */
+static int prove(const struct journal_tree *jt, const char *code) {
+    unsigned char path[MERKLE_DEPTH][MERKLE_HASH], r[MERKLE_HASH];
+    char h[2 * MERKLE_HASH + 1];
+    size_t lo = 0, hi = jt->n;
+    uint32_t index;
+    int len, i;
+
+    while (lo < hi) {
+        size_t mid = lo + (hi - lo) / 2;
+        if (strcmp(record_code(jt->records[jt->bycode[mid]]), code) < 0)
+            lo = mid + 1;
+        else
+            hi = mid;
+    }
+    if (lo == jt->n || strcmp(record_code(jt->records[jt->bycode[lo]]), code)) {
+        printf("none %s\n", code);
+        return 1;
+    }
+    index = jt->bycode[lo];
+    len = merkle_proof(&jt->tree, index, path);
+    root(jt, r);
+    hex(r, h);
+    printf("record %s\nindex %u\nsize %llu\nroot %s\n", jt->records[index], index,
+            (unsigned long long) jt->n, h);
+    for (i = 0; i < len; i++) {
+        hex(path[i], h);
+        printf("path %s\n", h);
+    }
+    printf("end\n");
+    return 0;
+}
+
+/*
+ * Check a proof as printed by prove().
+ *
+ * Returns:
+ *  0 if it holds, 2 if not
+ */
+static int check(FILE *fp, const char *want) {
+    unsigned char path[MERKLE_DEPTH][MERKLE_HASH], r[MERKLE_HASH], w[MERKLE_HASH], leaf[MERKLE_HASH];
+    char line[JOURNAL_MAXREC + 16], rec[sizeof(line)] = "";
+    unsigned long long index = 0, size = 0;
+    int len = 0, have = 0, ended = 0;
+
+    while (fgets(line, sizeof(line), fp)) {
+        if (!strncmp(line, "record ", 7)) {
+            snprintf(rec, sizeof(rec), "%s", line + 7);
+            rec[strcspn(rec, "\n")] = '\0';
+            have |= 1;
+        } else if (sscanf(line, "index %llu", &index) == 1) {
+            have |= 2;
+        } else if (sscanf(line, "size %llu", &size) == 1) {
+            have |= 4;
+        } else if (!strncmp(line, "root ", 5) && !unhex(line + 5, r)) {
+            have |= 8;
+        } else if (!strncmp(line, "path ", 5) && len < MERKLE_DEPTH && !unhex(line + 5, path[len])) {
+            len++;
+        } else if (!strcmp(line, "end\n")) {
+            ended = 1;
+            break;
+        } else {
+            break;
+        }
+    }
+    merkle_leaf(rec, strlen(rec), leaf);
+    if (have != 15 || !ended || (want && (unhex(want, w) || memcmp(w, r, MERKLE_HASH))) ||
+            !merkle_verify(leaf, index, size, (const unsigned char (*)[MERKLE_HASH]) path, len, r)) {
+        printf("bad\n");
+        return 2;
+    }
+    printf("ok\n");
+    return 0;
+}
+
+int main(int argc, char *argv[]) {
+    struct journal_tree jt;
+    unsigned char r[MERKLE_HASH];
+    char h[2 * MERKLE_HASH + 1], code[JOURNAL_MAXREC];
+    const char *want = NULL;
+    int opt, verbose = 0, serve = 0, checking = 0, ret = 0, i;
+    long long t;
+    FILE *fp;
+
+    while ((opt = getopt(argc, argv, "vscr:")) != -1) {
+        switch (opt) {
+            case 'v':
+                verbose = 1;
+                break;
+            case 's':
+                serve = 1;
+                break;
+            case 'c':
+                checking = 1;
+                break;
+            case 'r':
+                want = optarg;
+                break;
+            default:
+                goto usage;
+        }
+    }
+    if (checking) {
+        fp = optind < argc ? fopen(argv[optind], "r") : stdin;
+        if (!fp) {
+            perror(argv[optind]);
+            return 1;
+        }
+        return check(fp, want);
+    }
+    if (optind >= argc)
+        goto usage;
+
+    t = now_ns();
+    if (load(&jt, argv[optind])) {
+        perror(argv[optind]);
+        return 1;
+    }
+    if (verbose)
+        fprintf(stderr, "journalproof: %llu records, tree built in %.1f ms\n",
+                (unsigned long long) jt.n, (now_ns() - t) / 1e6);
+    if (serve) {
+        while (fgets(code, sizeof(code), stdin)) {
+            code[strcspn(code, "\n")] = '\0';
+            t = now_ns();
+            prove(&jt, code);
+            fflush(stdout);
+            if (verbose)
+                fprintf(stderr, "journalproof: proof in %.1f us\n", (now_ns() - t) / 1e3);
+        }
+    } else if (optind + 1 == argc) {
+        root(&jt, r);
+        hex(r, h);
+        printf("%llu %s\n", (unsigned long long) jt.n, h);
+    } else {
+        for (i = optind + 1; i < argc; i++) {
+            t = now_ns();
+            ret |= prove(&jt, argv[i]);
+            if (verbose)
+                fprintf(stderr, "journalproof: proof in %.1f us\n", (now_ns() - t) / 1e3);
+        }
+    }
+    return ret;
+
+usage:
+    fprintf(stderr, "Usage: journalproof [-v] journal [code...]\n"
+            "       journalproof [-v] -s journal\n"
+            "       journalproof -c [-r root] [proof]\n");
+    return 1;
+}
@@ -0,0 +1,753 @@
+/*
+ * manifest
+ *
+ * Loads the manifest of valid codes and follows its delta file.
+ *
+ * Both files have one code per line. The base file is read and sorted
+ * once; the delta file is read from where the last read stopped, up to
+ * its last complete line, each time inotify reports it written, and the
+ * new codes become a run of their own. Replacing the base file, or
+ * truncating or replacing the delta file, rebuilds the index from both.
+ *
+ * Snapshots are published and retired as in boxconf. The watcher thread
+ * is the only writer: it publishes a snapshot with each new run at once,
+ * then merges runs into a further snapshot, so new codes are never held
+ * up behind a merge. Runs shared between snapshots are not owned by any
+ * one snapshot; a run dropped by a merge goes on a retired list of its
+ * own, freed with the snapshots at the reader's next quiescent state.
+ *
+ * A compiled base file is read through once on loading, to build its
+ * fence index and Bloom filter, and after that only block by block.
+ *
+ * Author:
+ *  Jerry Lue
+ */
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+#include <limits.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <libgen.h>
+#include <pthread.h>
+#include <math.h>
+#include <sys/stat.h>
+#include <sys/inotify.h>
+#include "manifest.h"
+
+static char basepath[PATH_MAX], deltapath[PATH_MAX];
+static struct manifest *current;    // published snapshot
+static struct manifest *retired;    // snapshots awaiting reader quiescence
+static struct mrun *retired_runs;   // runs awaiting reader quiescence
+static struct mdisk *retired_disks;
+static unsigned long generation;
+static size_t membudget;            // memory for a compiled base
+static long long deltaoff;          // delta bytes indexed so far
+static ino_t deltaino;
+
+static int cmp_code(const void *a, const void *b) {
+    return strcmp(*(char *const *) a, *(char *const *) b);
+}
+
+static void free_run(struct mrun *run) {
+    if (run) {
+        free(run->codes);
+        free(run->arena);
+        free(run);
+    }
+}
+
+static void free_disk(struct mdisk *d) {
+    if (d) {
+        close(d->fd);
+        free(d->fences);
+        free(d->fencearena);
+        free(d->filter);
+        free(d);
+    }
+}
+
+/*
+ * CRC-32 of a manifest header.
+ */
+uint32_t manifest_crc32(const void *data, size_t len) {
+    const unsigned char *p = data;
+    uint32_t crc = 0xffffffff;
+    int k;
+
+    while (len--) {
+        crc ^= *p++;
+        for (k = 0; k < 8; k++)
+            crc = (crc >> 1) ^ (0xedb88320 & -(crc & 1));
+    }
+    return ~crc;
+}
+
+/*
+ * 64-bit FNV-1a of a code, finished with the splitmix64 mixer so that all
+ * bits depend on all characters.
+ */
+static uint64_t hash_code(const char *code) {
+    uint64_t h = 0xcbf29ce484222325ULL;
+
+    while (*code)
+        h = (h ^ (unsigned char) *code++) * 0x100000001b3ULL;
+    h = (h ^ (h >> 30)) * 0xbf58476d1ce4e5b9ULL;
+    h = (h ^ (h >> 27)) * 0x94d049bb133111ebULL;
+    return h ^ (h >> 31);
+}
+
+/*
+ * Blocked Bloom filter: a code's bits all fall in one 512-bit (cache line)
+ * line, chosen by the top half of its hash, so a test touches one line.
+ * The bit positions are 9-bit fields of a remultiplied hash.
+ */
+static void filter_add(struct mdisk *d, uint64_t h) {
+    uint64_t *line = d->filter + (((h >> 32) * d->nlines) >> 32) * 8;
+    uint64_t x = h * 0x9e3779b97f4a7c15ULL;
+    int i;
+
+    for (i = 0; i < d->k; i++, x >>= 9) {
+        if (i == 7)
+            x = (h ^ (h >> 29)) * 0xc2b2ae3d27d4eb4fULL;
+        line[(x >> 6) & 7] |= 1ULL << (x & 63);
+    }
+}
+
+static int filter_test(const struct mdisk *d, uint64_t h) {
+    const uint64_t *line = d->filter + (((h >> 32) * d->nlines) >> 32) * 8;
+    uint64_t x = h * 0x9e3779b97f4a7c15ULL;
+    int i;
+
+    for (i = 0; i < d->k; i++, x >>= 9) {
+        if (i == 7)
+            x = (h ^ (h >> 29)) * 0xc2b2ae3d27d4eb4fULL;
+        if (!(line[(x >> 6) & 7] & (1ULL << (x & 63))))
+            return 0;
+    }
+    return 1;
+}
+
+/*
+ * Open a compiled manifest and read it through once, checking that its
+ * blocks hold sorted codes, collecting the fences and filling the filter.
+ *
+ * Params:
+ *  fd      Open compiled manifest, owned by the result on success
+ *  budget  Bytes of memory for the fences and filter
+ *
+ * Returns:
+ *  New index, or NULL on error
+ */
+static struct mdisk *disk_open(int fd, size_t budget) {
+    struct manifest_header hdr;
+    struct mdisk *d = calloc(1, sizeof(*d));
+    char *buf = NULL, *prev = NULL, *fp;
+    size_t fences, left;
+    uint32_t b = 0, nb = 0, i;
+    struct stat st;
+    long codes = 0;
+
+    if (!d)
+        return NULL;
+    d->fd = fd;
+    if (pread(fd, &hdr, sizeof(hdr), 0) != sizeof(hdr) || memcmp(hdr.magic, MANIFEST_MAGIC, 8) ||
+            hdr.crc != manifest_crc32(&hdr, offsetof(struct manifest_header, crc)) ||
+            hdr.version != MANIFEST_VERSION || hdr.block != MANIFEST_BLOCK || fstat(fd, &st) ||
+            st.st_size < (off_t) (hdr.nblocks + 1) * MANIFEST_BLOCK ||
+            hdr.fencesize < hdr.nblocks) {
+        fprintf(stderr, "manifest: invalid compiled manifest\n");
+        goto fail;
+    }
+    // The filter gets what the fences leave, in whole lines
+    fences = hdr.fencesize + hdr.nblocks * sizeof(char *);
+    left = budget > fences + sizeof(*d) ? budget - fences - sizeof(*d) : 0;
+    if (left < 64) {
+        fprintf(stderr, "manifest: %zu bytes of fences do not fit a budget of %zu bytes\n",
+                fences, budget);
+        goto fail;
+    }
+    d->nblocks = hdr.nblocks;
+    d->codes = hdr.ncodes;
+    d->budget = budget;
+    d->nlines = left / 64 < 0xffffffff ? left / 64 : 0xffffffff;
+    d->k = hdr.ncodes ? lrint((double) d->nlines * 512 / hdr.ncodes * M_LN2) : 1;
+    d->k = d->k < 1 ? 1 : d->k > 12 ? 12 : d->k;
+    d->memory = fences + (size_t) d->nlines * 64;
+    if (!(d->fences = malloc((hdr.nblocks ? hdr.nblocks : 1) * sizeof(char *))) ||
+            !(d->fencearena = malloc(hdr.fencesize ? hdr.fencesize : 1)) ||
+            !(d->filter = aligned_alloc(64, (size_t) d->nlines * 64)) ||
+            !(buf = malloc(64 * MANIFEST_BLOCK)) || !(prev = calloc(1, MANIFEST_BLOCK)))
+        goto fail;
+    memset(d->filter, 0, (size_t) d->nlines * 64);
+    fp = d->fencearena;
+    // Read 64 blocks at a time; each must be well formed and follow the last
+    while (b < hdr.nblocks) {
+        nb = hdr.nblocks - b < 64 ? hdr.nblocks - b : 64;
+        if (pread(fd, buf, (size_t) nb * MANIFEST_BLOCK, (off_t) (b + 1) * MANIFEST_BLOCK) !=
+                (ssize_t) nb * MANIFEST_BLOCK)
+            goto corrupt;
+        for (i = 0; i < nb; i++, b++) {
+            char *p = buf + (size_t) i * MANIFEST_BLOCK, *end = p + MANIFEST_BLOCK;
+            size_t len;
+            if (!*p || !memchr(p, '\0', MANIFEST_BLOCK) ||
+                    (len = strlen(p) + 1) > hdr.fencesize - (fp - d->fencearena))
+                goto corrupt;
+            d->fences[b] = memcpy(fp, p, len);
+            fp += len;
+            while (p < end && *p) {
+                if (!memchr(p, '\0', end - p) || (codes && strcmp(prev, p) >= 0))
+                    goto corrupt;
+                filter_add(d, hash_code(p));
+                codes++;
+                strcpy(prev, p);
+                p += strlen(p) + 1;
+            }
+        }
+    }
+    if (codes != hdr.ncodes)
+        goto corrupt;
+    free(buf);
+    free(prev);
+    posix_fadvise(fd, 0, 0, POSIX_FADV_RANDOM);
+    return d;
+
+corrupt:
+    fprintf(stderr, "manifest: compiled manifest corrupt at block %u\n", b);
+fail:
+    free(buf);
+    free(prev);
+    free_disk(d);
+    return NULL;
+}
+
+/*
+ * Look a code up in a compiled manifest: the filter, then the block whose
+ * fence is the last at or before the code.
+ */
+static int disk_contains(struct mdisk *d, const char *code) {
+    char buf[MANIFEST_BLOCK], *p;
+    uint32_t lo = 0, hi = d->nblocks;
+
+    if (!filter_test(d, hash_code(code)))
+        return 0;
+    while (lo < hi) {
+        uint32_t mid = lo + (hi - lo) / 2;
+        if (strcmp(d->fences[mid], code) <= 0)
+            lo = mid + 1;
+        else
+            hi = mid;
+    }
+    if (!lo)
+        return 0;
+    __atomic_fetch_add(&d->reads, 1, __ATOMIC_RELAXED);
+    if (pread(d->fd, buf, MANIFEST_BLOCK, (off_t) lo * MANIFEST_BLOCK) != MANIFEST_BLOCK) {
+        perror("manifest: cannot read block");
+        return 0;
+    }
+    for (p = buf; p < buf + MANIFEST_BLOCK && *p; p += strlen(p) + 1) {
+        int c = strcmp(p, code);
+        if (c >= 0)
+            return !c;
+    }
+    return 0;
+}
+
+/*
+ * Read a file from an offset up to its last complete line.
+ *
+ * Params:
+ *  path    File path; a missing file reads as empty
+ *  off     Offset to start at
+ *  len     Set to the number of bytes returned
+ *  ino     Set to the file's inode number
+ *
+ * Returns:
+ *  Newly allocated buffer (possibly empty), or NULL on error
+ */
+static char *read_lines(const char *path, long long off, size_t *len, ino_t *ino) {
+    struct stat st;
+    char *buf;
+    ssize_t n;
+    int fd = open(path, O_RDONLY | O_CLOEXEC);
+
+    *len = 0;
+    *ino = 0;
+    if (fd < 0)
+        return errno == ENOENT ? calloc(1, 1) : NULL;
+    if (fstat(fd, &st) || !(buf = malloc(st.st_size > off ? st.st_size - off + 1 : 1))) {
+        close(fd);
+        return NULL;
+    }
+    *ino = st.st_ino;
+    while (off + (long long) *len < st.st_size &&
+            (n = pread(fd, buf + *len, st.st_size - off - *len, off + *len)) > 0)
+        *len += n;
+    close(fd);
+    while (*len && buf[*len - 1] != '\n')
+        (*len)--;
+    return buf;
+}
+
+/*
+ * Make a sorted run of the codes in a buffer of lines. Blank lines and
+ * surrounding whitespace are ignored, and repeated codes kept once.
+ *
+ * Returns:
+ *  New run, or NULL on error
+ */
+static struct mrun *make_run(const char *text, size_t len) {
+    struct mrun *run = calloc(1, sizeof(*run));
+    size_t i, start;
+    char *sorted;
+    int n = 0, j;
+
+    if (!run || !(run->arena = malloc(len + 1))) {
+        free(run);
+        return NULL;
+    }
+    memcpy(run->arena, text, len);
+    run->arena[len] = '\0';
+    for (i = 0; i < len; i++)
+        n += run->arena[i] == '\n';
+    if (!(run->codes = malloc((n ? n : 1) * sizeof(*run->codes)))) {
+        free_run(run);
+        return NULL;
+    }
+    for (i = start = 0; i < len; i++) {
+        char *code = run->arena + start, *end = run->arena + i;
+        if (run->arena[i] != '\n')
+            continue;
+        start = i + 1;
+        while (end > code && (end[-1] == ' ' || end[-1] == '\t' || end[-1] == '\r'))
+            end--;
+        *end = '\0';
+        while (*code == ' ' || *code == '\t')
+            code++;
+        if (*code)
+            run->codes[run->n++] = code;
+    }
+    qsort(run->codes, run->n, sizeof(*run->codes), cmp_code);
+    for (i = 0, j = 0; i < (size_t) run->n; i++)
+        if (!j || strcmp(run->codes[j - 1], run->codes[i]))
+            run->codes[j++] = run->codes[i];
+    run->n = j;
+    // Lay the codes out in sorted order, so searches touch fewer lines
+    if ((sorted = malloc(len + 1))) {
+        char *p = sorted;
+        for (j = 0; j < run->n; j++) {
+            char *code = run->codes[j];
+            run->codes[j] = p;
+            p = stpcpy(p, code) + 1;
+        }
+        free(run->arena);
+        run->arena = sorted;
+    }
+    run->size = len + 1;
+    return run;
+}
+
+/*
+ * Merge two runs into a new one.
+ *
+ * Returns:
+ *  New run, or NULL on error
+ */
+static struct mrun *merge_runs(const struct mrun *a, const struct mrun *b) {
+    struct mrun *run = calloc(1, sizeof(*run));
+    size_t size = 0;
+    char *p;
+    int i = 0, j = 0, k;
+
+    if (!run)
+        return NULL;
+    for (k = 0; k < a->n; k++)
+        size += strlen(a->codes[k]) + 1;
+    for (k = 0; k < b->n; k++)
+        size += strlen(b->codes[k]) + 1;
+    if (!(run->arena = malloc(size ? size : 1)) ||
+            !(run->codes = malloc((a->n + b->n ? a->n + b->n : 1) * sizeof(*run->codes)))) {
+        free_run(run);
+        return NULL;
+    }
+    run->size = size;
+    p = run->arena;
+    while (i < a->n || j < b->n) {
+        const char *code;
+        int c = i == a->n ? 1 : j == b->n ? -1 : strcmp(a->codes[i], b->codes[j]);
+        code = c <= 0 ? a->codes[i++] : b->codes[j++];
+        if (!c)
+            j++;
+        run->codes[run->n++] = p;
+        p = stpcpy(p, code) + 1;
+    }
+    return run;
+}
+
+/*
+ * Publish a snapshot, retiring the previous one.
+ */
+static void manifest_publish(struct manifest *m) {
+    struct manifest *old;
+    int i;
+
+    m->codes = m->disk ? m->disk->codes : 0;
+    for (i = 0; i < m->nruns; i++)
+        m->codes += m->runs[i]->n;
+    m->generation = ++generation;
+    old = __atomic_exchange_n(&current, m, __ATOMIC_ACQ_REL);
+    if (!old)
+        return;
+    old->next = __atomic_load_n(&retired, __ATOMIC_RELAXED);
+    while (!__atomic_compare_exchange_n(&retired, &old->next, old, 1,
+                __ATOMIC_RELEASE, __ATOMIC_RELAXED))
+        ;
+}
+
+/*
+ * Retire a run no longer in the published snapshot.
+ */
+static void retire_run(struct mrun *run) {
+    run->next = __atomic_load_n(&retired_runs, __ATOMIC_RELAXED);
+    while (!__atomic_compare_exchange_n(&retired_runs, &run->next, run, 1,
+                __ATOMIC_RELEASE, __ATOMIC_RELAXED))
+        ;
+}
+
+static void retire_disk(struct mdisk *d) {
+    d->next = __atomic_load_n(&retired_disks, __ATOMIC_RELAXED);
+    while (!__atomic_compare_exchange_n(&retired_disks, &d->next, d, 1,
+                __ATOMIC_RELEASE, __ATOMIC_RELAXED))
+        ;
+}
+
+/*
+ * Merge the newest runs while the newest is at least half the size of
+ * the one before it, publishing a snapshot after each merge. Run sizes
+ * then at least double from newest to oldest.
+ */
+static void compact(void) {
+    const struct manifest *m;
+
+    while ((m = current)->nruns >= 2 &&
+            2L * m->runs[m->nruns - 1]->n >= m->runs[m->nruns - 2]->n) {
+        struct mrun *a = m->runs[m->nruns - 2], *b = m->runs[m->nruns - 1];
+        struct manifest *next = malloc(sizeof(*next));
+        struct mrun *merged = merge_runs(a, b);
+        if (!next || !merged) {
+            free(next);
+            free_run(merged);
+            fprintf(stderr, "manifest: out of memory merging runs\n");
+            return;
+        }
+        memcpy(next, m, sizeof(*next));
+        next->runs[--next->nruns - 1] = merged;
+        manifest_publish(next);
+        retire_run(a);
+        retire_run(b);
+    }
+}
+
+/*
+ * Add a run of new codes as the newest run.
+ */
+static int add_run(struct mrun *run) {
+    struct manifest *next;
+
+    if (!run->n) {
+        free_run(run);
+        return 0;
+    }
+    if (!(next = malloc(sizeof(*next)))) {
+        free_run(run);
+        return -1;
+    }
+    memcpy(next, current, sizeof(*next));
+    if (next->nruns == MANIFEST_MAXRUNS) {
+        // Cannot happen with the merge rule below 2^31 codes
+        free(next);
+        free_run(run);
+        return -1;
+    }
+    next->runs[next->nruns++] = run;
+    manifest_publish(next);
+    compact();
+    return 0;
+}
+
+/*
+ * Build the index from scratch from the base and delta files, retiring
+ * every run of the current snapshot.
+ *
+ * Returns:
+ *  0 on success, -1 on error
+ */
+static int rebuild(void) {
+    const struct manifest *old = current;
+    struct manifest *m = calloc(1, sizeof(*m));
+    struct mrun *delta;
+    char magic[8];
+    size_t len;
+    ino_t ino;
+    char *text;
+    int i, fd;
+
+    if (!m)
+        return -1;
+    if ((fd = open(basepath, O_RDONLY | O_CLOEXEC)) < 0) {
+        fprintf(stderr, "manifest: cannot read %s\n", basepath);
+        free(m);
+        return -1;
+    }
+    if (read(fd, magic, sizeof(magic)) == sizeof(magic) && !memcmp(magic, MANIFEST_MAGIC, 8)) {
+        if (!(m->disk = disk_open(fd, membudget))) {
+            free(m);
+            return -1;
+        }
+    } else {
+        close(fd);
+        if (!(text = read_lines(basepath, 0, &len, &ino))) {
+            free(m);
+            return -1;
+        }
+        m->runs[m->nruns++] = make_run(text, len);
+        free(text);
+        if (!m->runs[0]) {
+            free(m);
+            return -1;
+        }
+    }
+    if (!(text = read_lines(deltapath, 0, &len, &ino)) || !(delta = make_run(text, len))) {
+        free(text);
+        free_run(m->runs[0]);
+        free_disk(m->disk);
+        free(m);
+        return -1;
+    }
+    free(text);
+    if (delta->n)
+        m->runs[m->nruns++] = delta;
+    else
+        free_run(delta);
+    deltaoff = len;
+    deltaino = ino;
+    manifest_publish(m);
+    for (i = 0; old && i < old->nruns; i++)
+        retire_run(old->runs[i]);
+    if (old && old->disk)
+        retire_disk(old->disk);
+    compact();
+    return 0;
+}
+
+/*
+ * Index codes appended to the delta file since it was last read.
+ */
+static void follow_delta(void) {
+    struct stat st;
+    struct mrun *run;
+    size_t len;
+    ino_t ino;
+    char *text;
+
+    if (stat(deltapath, &st)) {
+        if (errno == ENOENT && deltaoff)
+            rebuild(); // delta removed: back to the base alone
+        return;
+    }
+    if (st.st_ino != deltaino || st.st_size < deltaoff) {
+        rebuild();
+        return;
+    }
+    if (!(text = read_lines(deltapath, deltaoff, &len, &ino)))
+        return;
+    if (ino != deltaino) {
+        free(text);
+        rebuild();
+        return;
+    }
+    if (len && (run = make_run(text, len))) {
+        deltaoff += len;
+        add_run(run);
+    }
+    free(text);
+}
+
+/*
+ * Get the current manifest snapshot. The returned pointer stays valid
+ * until the caller's next call to manifest_quiescent().
+ */
+const struct manifest *manifest_get(void) {
+    return __atomic_load_n(&current, __ATOMIC_ACQUIRE);
+}
+
+/*
+ * Look a code up, newest run first.
+ *
+ * Returns:
+ *  1 if the manifest holds the code, 0 if not
+ */
+int manifest_contains(const struct manifest *m, const char *code) {
+    int r;
+
+    for (r = m->nruns - 1; r >= 0; r--) {
+        char **codes = m->runs[r]->codes;
+        int lo = 0, hi = m->runs[r]->n;
+        while (lo < hi) {
+            int mid = (lo + hi) / 2, c = strcmp(code, codes[mid]);
+            if (!c)
+                return 1;
+            if (c < 0)
+                hi = mid;
+            else
+                lo = mid + 1;
+        }
+    }
+    return m->disk && disk_contains(m->disk, code);
+}
+
+/*
+ * Declare that the reader holds no snapshot pointer, e.g. between sheets.
+ * Frees all snapshots and runs retired since the last quiescent state.
+ */
+void manifest_quiescent(void) {
+    struct manifest *m = __atomic_exchange_n(&retired, NULL, __ATOMIC_ACQUIRE);
+    struct mrun *run = __atomic_exchange_n(&retired_runs, NULL, __ATOMIC_ACQUIRE);
+    struct mdisk *d = __atomic_exchange_n(&retired_disks, NULL, __ATOMIC_ACQUIRE);
+
+    while (m) {
+        struct manifest *next = m->next;
+        free(m);
+        m = next;
+    }
+    while (run) {
+        struct mrun *next = run->next;
+        free_run(run);
+        run = next;
+    }
+    while (d) {
+        struct mdisk *next = d->next;
+        free_disk(d);
+        d = next;
+    }
+}
+
+/*
+ * Print the size and memory use of a manifest snapshot to stderr.
+ */
+void manifest_report(const struct manifest *m) {
+    const struct mdisk *d = m->disk;
+    size_t memory = sizeof(*m);
+    long delta = 0;
+    int i;
+
+    for (i = 0; i < m->nruns; i++) {
+        memory += sizeof(*m->runs[i]) + m->runs[i]->size + m->runs[i]->n * sizeof(char *);
+        delta += m->runs[i]->n;
+    }
+    if (!d) {
+        fprintf(stderr, "manifest: %ld codes in %d runs, %zu KiB in memory\n",
+                m->codes, m->nruns, memory / 1024);
+        return;
+    }
+    fprintf(stderr, "manifest: %ld codes in %u blocks on disk, %zu KiB of %zu KiB budget: "
+            "filter %zu KiB (%.1f bits/code, k %d, ~%.2f%% false positives), "
+            "fences %zu KiB\n",
+            d->codes, d->nblocks, d->memory / 1024, d->budget / 1024,
+            (size_t) d->nlines * 64 / 1024,
+            d->codes ? (double) d->nlines * 512 / d->codes : 0.0, d->k,
+            100 * pow(1 - exp(-(double) d->k * d->codes / ((double) d->nlines * 512)), d->k),
+            (d->memory - (size_t) d->nlines * 64) / 1024);
+    if (m->nruns)
+        fprintf(stderr, "manifest: %ld delta codes in %d runs, %zu KiB in memory\n",
+                delta, m->nruns, memory / 1024);
+}
+
+/*
+ * Load the manifest.
+ *
+ * Params:
+ *  path    Base manifest file, text or compiled; the delta file is path
+ *          with ".delta"
+ *  size    Memory budget in bytes for a compiled base, 0 for the default
+ *
+ * Returns:
+ *  0 on success, -1 on error
+ */
+int manifest_init(const char *path, size_t size) {
+    membudget = size ? size : MANIFEST_BUDGET;
+    if (strlen(path) + sizeof(".delta") > sizeof(deltapath))
+        return -1;
+    strcpy(basepath, path);
+    strcpy(deltapath, path);
+    strcat(deltapath, ".delta");
+    return rebuild();
+}
+
+/*
+ * Watcher thread. Follows appends to the delta file, and rebuilds when
+ * either file is replaced.
+ */
+static void *manifest_watcher(void *arg) {
+    int fd = (int) (long) arg;
+    char buf[4096] __attribute__((aligned(__alignof__(struct inotify_event))));
+    char basebuf[PATH_MAX], deltabuf[PATH_MAX];
+    const char *base, *delta;
+    ssize_t len;
+
+    strcpy(basebuf, basepath);
+    strcpy(deltabuf, deltapath);
+    base = basename(basebuf);
+    delta = basename(deltabuf);
+    while ((len = read(fd, buf, sizeof(buf))) > 0 || (len < 0 && errno == EINTR)) {
+        char *p;
+        int changed = 0, appended = 0;
+        for (p = buf; p < buf + len; ) {
+            struct inotify_event *ev = (struct inotify_event *) p;
+            if (ev->len && !strcmp(ev->name, base) && !(ev->mask & IN_MODIFY))
+                changed = 1;
+            else if (ev->len && !strcmp(ev->name, delta))
+                appended = 1;
+            p += sizeof(*ev) + ev->len;
+        }
+        if (changed) {
+            if (!rebuild()) {
+                fprintf(stderr, "manifest: reloaded %s (generation %lu)\n",
+                        basepath, current->generation);
+                manifest_report(current);
+            }
+        } else if (appended) {
+            follow_delta();
+        }
+    }
+    fprintf(stderr, "manifest: watcher stopped: %s\n", strerror(errno));
+    close(fd);
+    return NULL;
+}
+
+/*
+ * Start following the manifest files. Must be called after
+ * manifest_init().
+ *
+ * Returns:
+ *  0 on success, -1 on error
+ */
+int manifest_watch(void) {
+    char dirbuf[PATH_MAX];
+    pthread_t thread;
+    int fd;
+
+    strcpy(dirbuf, basepath);
+    fd = inotify_init1(IN_CLOEXEC);
+    if (fd < 0)
+        return -1;
+    if (inotify_add_watch(fd, dirname(dirbuf), IN_MODIFY | IN_CLOSE_WRITE | IN_MOVED_TO |
+                IN_DELETE) < 0 ||
+            pthread_create(&thread, NULL, manifest_watcher, (void *) (long) fd)) {
+        close(fd);
+        return -1;
+    }
+    pthread_detach(thread);
+    return 0;
+}
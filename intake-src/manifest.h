@@ -0,0 +1,88 @@
+#ifndef MANIFEST_H
+#define MANIFEST_H
+
+/*
+ * manifest
+ *
+ * Index of valid ballot codes. A code read from a sheet is accepted only
+ * if the manifest holds it. The index is the base manifest file plus the
+ * codes appended since to a delta file (the manifest path with ".delta")
+ * by whatever issues new ballots, picked up while intake runs.
+ *
+ * Codes are held in sorted runs, LSM style: the base, then one small run
+ * per batch of appended codes, merged in the background whenever a run
+ * grows to half the size of the run before it, so there are never more
+ * than a few dozen. The set of runs is an immutable snapshot published by
+ * pointer swap, as for the config: lookups take no lock and never wait
+ * for a merge.
+ *
+ * On boards too small to hold the manifest in memory, the base file may
+ * instead be compiled by manifestc: codes sorted and packed into fixed-size
+ * blocks on disk. Only the first code of each block (the fence) and a
+ * blocked Bloom filter of all codes are kept in memory, the filter getting
+ * whatever the memory budget leaves after the fences. A lookup that passes
+ * the filter reads the one block its fence points to. The delta file is
+ * indexed in memory as above.
+ *
+ *  manifest_header     at offset 0, padded to a block
+ *  blocks              codes in order, each null-terminated, zero padded
+ */
+#include <stddef.h>
+#include <stdint.h>
+
+#define MANIFEST_MAXRUNS 48
+#define MANIFEST_MAGIC "VBMANIFS"
+#define MANIFEST_VERSION 1
+#define MANIFEST_BLOCK 4096
+#define MANIFEST_BUDGET (1 << 20)  // default memory for a compiled manifest
+
+struct manifest_header {
+    char magic[8];
+    uint32_t version;
+    uint32_t block;         // block size
+    uint32_t nblocks;
+    uint32_t ncodes;
+    uint32_t fencesize;     // bytes of fences, null-terminated
+    uint32_t crc;           // CRC-32 of the fields above
+};
+
+struct mrun {
+    int n;                  // codes
+    char **codes;           // sorted, pointing into arena
+    char *arena;
+    size_t size;            // bytes of arena
+    struct mrun *next;      // retired list link
+};
+
+struct mdisk {
+    int fd;
+    uint32_t nblocks;
+    long codes;
+    char **fences;          // first code of each block
+    char *fencearena;
+    uint64_t *filter;       // 512-bit lines
+    uint32_t nlines;
+    int k;                  // bits set per code
+    size_t budget, memory;  // bytes allowed, bytes of filter and fences
+    unsigned long reads;    // blocks read by lookups
+    struct mdisk *next;     // retired list link
+};
+
+struct manifest {
+    int nruns;
+    struct mrun *runs[MANIFEST_MAXRUNS]; // oldest (base) first
+    struct mdisk *disk;     // compiled base, or NULL if base is runs[0]
+    long codes;             // total codes in runs and disk, counting repeats
+    unsigned long generation;
+    struct manifest *next;  // retired list link
+};
+
+int manifest_init(const char *path, size_t budget);
+int manifest_watch(void);
+const struct manifest *manifest_get(void);
+int manifest_contains(const struct manifest *m, const char *code);
+void manifest_quiescent(void);
+void manifest_report(const struct manifest *m);
+uint32_t manifest_crc32(const void *data, size_t len);
+
+#endif
@@ -0,0 +1,271 @@
+/*
+ * Usage:
+ *  manifestc [-v] -o codes.vbm codes.txt
+ *  manifestc -t [-M KiB] [-n lookups] codes.vbm
+ *
+ * Examples:
+ *  Compile a manifest for a small board
+ *      ./intake-src/manifestc -o codes.vbm codes.txt
+ *  Measure lookups in 256 KiB of memory
+ *      ./intake-src/manifestc -t -M 256 codes.vbm
+ *
+ * Description:
+ *  Compiles a text manifest (one code per line) into the block format that
+ *  intake keeps on disk (see manifest.h). Codes are sorted, repeats dropped
+ *  and packed in order into fixed-size blocks. The file is written beside
+ *  the output and renamed into place, so a running intake reloads it whole.
+ *
+ *  With -t, a compiled manifest is loaded as intake loads it, with a memory
+ *  budget of -M KiB (1024 by default), and its memory use is printed. Then
+ *  -n (default 2000) codes from the manifest and as many codes not in it
+ *  are looked up, and the mean, 99th percentile and worst lookup times are
+ *  printed for each, along with the blocks read. Codes in the manifest are
+ *  looked up both with the block in the page cache and, after dropping the
+ *  file from the page cache, as the first read since boot would be.
+ *  The codes not in the manifest are codes from it with a character added,
+ *  so that the filter is all that keeps their block from being read.
+ *
+ * Author:
+ *  Jerry Lue
+ */
+#define _GNU_SOURCE
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+#include <limits.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <time.h>
+#include "manifest.h"
+
+#define LOOKUPS 2000
+
+static int cmp_code(const void *a, const void *b) {
+    return strcmp(*(char *const *) a, *(char *const *) b);
+}
+
+static int cmp_ll(const void *a, const void *b) {
+    long long x = *(const long long *) a, y = *(const long long *) b;
+    return x < y ? -1 : x > y;
+}
+
+static long long now_ns(void) {
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return ts.tv_sec * 1000000000LL + ts.tv_nsec;
+}
+
+/*
+ * Read a text manifest into a sorted array of distinct codes.
+ *
+ * Returns:
+ *  Number of codes, or -1 on error
+ */
+static long read_codes(const char *path, char ***codes) {
+    char *line = NULL, **v = NULL;
+    size_t cap = 0, size = 0;
+    long n = 0, i, j;
+    ssize_t len;
+    FILE *f = fopen(path, "r");
+
+    if (!f)
+        return -1;
+    while ((len = getline(&line, &size, f)) >= 0) {
+        char *code = line, *end = line + len;
+        while (end > code && (end[-1] == '\n' || end[-1] == '\r' || end[-1] == ' ' ||
+                    end[-1] == '\t'))
+            end--;
+        *end = '\0';
+        while (*code == ' ' || *code == '\t')
+            code++;
+        if (!*code)
+            continue;
+        if (end - code >= MANIFEST_BLOCK) {
+            fprintf(stderr, "Code longer than %d characters: %.32s...\n", MANIFEST_BLOCK - 1, code);
+            errno = EINVAL;
+            return -1;
+        }
+        if (n == (long) cap && !(v = realloc(v, (cap = cap ? cap * 2 : 4096) * sizeof(*v))))
+            return -1;
+        if (!(v[n++] = strdup(code)))
+            return -1;
+    }
+    free(line);
+    fclose(f);
+    qsort(v, n, sizeof(*v), cmp_code);
+    for (i = 0, j = 0; i < n; i++)
+        if (!j || strcmp(v[j - 1], v[i]))
+            v[j++] = v[i];
+    *codes = v;
+    return j;
+}
+
+/*
+ * Write codes in blocks to a compiled manifest.
+ *
+ * Returns:
+ *  0 on success, -1 on error
+ */
+static int compile(const char *out, char **codes, long n, int verbose) {
+    struct manifest_header hdr;
+    char tmp[PATH_MAX], block[MANIFEST_BLOCK];
+    size_t used = 0;
+    long i;
+    FILE *f;
+
+    memset(&hdr, 0, sizeof(hdr));
+    memcpy(hdr.magic, MANIFEST_MAGIC, 8);
+    hdr.version = MANIFEST_VERSION;
+    hdr.block = MANIFEST_BLOCK;
+    hdr.ncodes = n;
+    if (snprintf(tmp, sizeof(tmp), "%s.tmp", out) >= (int) sizeof(tmp) ||
+            !(f = fopen(tmp, "wb")) || fseek(f, MANIFEST_BLOCK, SEEK_SET))
+        return -1;
+    memset(block, 0, sizeof(block));
+    for (i = 0; i < n; i++) {
+        size_t len = strlen(codes[i]) + 1;
+        if (used + len > MANIFEST_BLOCK) {
+            if (fwrite(block, MANIFEST_BLOCK, 1, f) != 1)
+                return -1;
+            memset(block, 0, sizeof(block));
+            used = 0;
+        }
+        if (!used) {
+            hdr.nblocks++;
+            hdr.fencesize += len;
+        }
+        memcpy(block + used, codes[i], len);
+        used += len;
+    }
+    if (used && fwrite(block, MANIFEST_BLOCK, 1, f) != 1)
+        return -1;
+    hdr.crc = manifest_crc32(&hdr, offsetof(struct manifest_header, crc));
+    memset(block, 0, sizeof(block));
+    memcpy(block, &hdr, sizeof(hdr));
+    if (fseek(f, 0, SEEK_SET) || fwrite(block, MANIFEST_BLOCK, 1, f) != 1 || fflush(f) ||
+            fdatasync(fileno(f)) || fclose(f) || rename(tmp, out))
+        return -1;
+    if (verbose)
+        fprintf(stderr, "manifestc: %ld codes in %u blocks, %u bytes of fences\n",
+                n, hdr.nblocks, hdr.fencesize);
+    return 0;
+}
+
+/*
+ * Time lookups of a set of codes, printing mean, 99th percentile and worst.
+ */
+static void time_lookups(const char *what, char **codes, int n, int fd, int cold) {
+    long long *t = malloc(n * sizeof(*t)), total = 0;
+    const struct manifest *m = manifest_get();
+    unsigned long reads = m->disk ? m->disk->reads : 0;
+    int i, found = 0;
+
+    for (i = 0; i < n; i++) {
+        long long t0;
+        if (cold)
+            posix_fadvise(fd, 0, 0, POSIX_FADV_DONTNEED);
+        t0 = now_ns();
+        found += manifest_contains(m, codes[i]);
+        t[i] = now_ns() - t0;
+        total += t[i];
+    }
+    qsort(t, n, sizeof(*t), cmp_ll);
+    printf("%-22s %5d found, %5lu blocks read, mean %8.2f us, p99 %8.2f us, worst %8.2f us\n",
+            what, found, (m->disk ? m->disk->reads : 0) - reads,
+            total / 1e3 / n, t[n * 99 / 100] / 1e3, t[n - 1] / 1e3);
+    free(t);
+}
+
+/*
+ * Load a compiled manifest and time lookups of codes in it and not.
+ */
+static int test(const char *path, size_t budget, int n) {
+    struct manifest_header hdr;
+    char block[MANIFEST_BLOCK], **in, **out;
+    int fd, i;
+
+    if (manifest_init(path, budget))
+        return -1;
+    manifest_report(manifest_get());
+    if ((fd = open(path, O_RDONLY)) < 0 || pread(fd, &hdr, sizeof(hdr), 0) != sizeof(hdr) ||
+            !hdr.ncodes)
+        return -1;
+    in = malloc(n * sizeof(*in));
+    out = malloc(n * sizeof(*out));
+    srand(1);
+    // Pick codes at random from random blocks
+    for (i = 0; i < n; i++) {
+        char *p, *inblock[MANIFEST_BLOCK / 2];
+        int k = 0;
+        if (pread(fd, block, MANIFEST_BLOCK,
+                    (off_t) (1 + rand() % hdr.nblocks) * MANIFEST_BLOCK) != MANIFEST_BLOCK)
+            return -1;
+        for (p = block; p < block + MANIFEST_BLOCK && *p; p += strlen(p) + 1)
+            inblock[k++] = p;
+        p = inblock[rand() % k];
+        in[i] = strdup(p);
+        if (!(out[i] = malloc(strlen(p) + 2)))
+            return -1;
+        sprintf(out[i], "%s~", p);
+    }
+    time_lookups("in manifest, cold", in, n, fd, 1);
+    time_lookups("in manifest, cached", in, n, fd, 0);
+    time_lookups("not in manifest", out, n, fd, 0);
+    close(fd);
+    return 0;
+}
+
+int main(int argc, char *argv[]) {
+    const char *out = NULL;
+    size_t budget = 0;
+    int opt, verbose = 0, testing = 0, lookups = LOOKUPS;
+    char **codes;
+    long n;
+
+    while ((opt = getopt(argc, argv, "vto:M:n:")) != -1) {
+        switch (opt) {
+            case 'v':
+                verbose = 1;
+                break;
+            case 't':
+                testing = 1;
+                break;
+            case 'o':
+                out = optarg;
+                break;
+            case 'M':
+                budget = (size_t) atol(optarg) * 1024;
+                break;
+            case 'n':
+                lookups = atoi(optarg);
+                break;
+            default:
+                goto usage;
+        }
+    }
+    if (argc - optind != 1 || (!testing && !out) || lookups < 1)
+        goto usage;
+
+    if (testing) {
+        if (test(argv[optind], budget, lookups)) {
+            fprintf(stderr, "Cannot test %s\n", argv[optind]);
+            return 1;
+        }
+        return 0;
+    }
+    if ((n = read_codes(argv[optind], &codes)) < 0) {
+        perror(argv[optind]);
+        return 1;
+    }
+    if (compile(out, codes, n, verbose)) {
+        perror(out);
+        return 1;
+    }
+    return 0;
+
+usage:
+    fprintf(stderr, "Usage: manifestc [-v] -o codes.vbm codes.txt\n"
+            "       manifestc -t [-M KiB] [-n lookups] codes.vbm\n");
+    return 1;
+}
@@ -0,0 +1,176 @@
+/*
+ * merkle
+ *
+ * Incremental Merkle tree root, and inclusion proofs.
+ *
+ * Author:
+ *  Jerry Lue
+ */
+#include <stdlib.h>
+#include <string.h>
+#include "merkle.h"
+
+/*
+ * Start hashing a leaf whose data is fed in pieces: update ctx with the
+ * data and finish with sha256_final().
+ */
+void merkle_leaf_start(struct sha256 *ctx) {
+    sha256_init(ctx);
+    sha256_update(ctx, "\0", 1);
+}
+
+void merkle_leaf(const void *data, size_t len, unsigned char out[MERKLE_HASH]) {
+    struct sha256 ctx;
+
+    merkle_leaf_start(&ctx);
+    sha256_update(&ctx, data, len);
+    sha256_final(&ctx, out);
+}
+
+void merkle_node(const unsigned char left[MERKLE_HASH], const unsigned char right[MERKLE_HASH],
+        unsigned char out[MERKLE_HASH]) {
+    unsigned char buf[1 + 2 * MERKLE_HASH];
+
+    buf[0] = 1;
+    memcpy(buf + 1, left, MERKLE_HASH);
+    memcpy(buf + 1 + MERKLE_HASH, right, MERKLE_HASH);
+    sha256(buf, sizeof(buf), out);
+}
+
+void merkle_init(struct merkle *m) {
+    m->n = 0;
+}
+
+/*
+ * Append a leaf. Like incrementing a binary counter, the new leaf merges
+ * with the complete subtrees of equal size, one hash per carry: one hash
+ * on average, at most log2(n).
+ */
+void merkle_add(struct merkle *m, const unsigned char leaf[MERKLE_HASH]) {
+    unsigned char h[MERKLE_HASH];
+    int k;
+
+    memcpy(h, leaf, MERKLE_HASH);
+    for (k = 0; m->n >> k & 1; k++)
+        merkle_node(m->frontier[k], h, h);
+    memcpy(m->frontier[k], h, MERKLE_HASH);
+    m->n++;
+}
+
+/*
+ * Get the root: the frontier folded from the smallest subtree up, each
+ * larger subtree on the left. The root of no leaves is the hash of
+ * nothing.
+ */
+void merkle_root(const struct merkle *m, unsigned char root[MERKLE_HASH]) {
+    int k = 0;
+
+    if (!m->n) {
+        sha256("", 0, root);
+        return;
+    }
+    while (!(m->n >> k & 1))
+        k++;
+    memcpy(root, m->frontier[k], MERKLE_HASH);
+    for (k++; k < MERKLE_DEPTH; k++)
+        if (m->n >> k & 1)
+            merkle_node(m->frontier[k], root, root);
+}
+
+/*
+ * Build the full tree over leaf hashes, about 2n hashes in all.
+ *
+ * Returns:
+ *  0 on success, -1 on error
+ */
+int merkle_build(struct merkle_tree *t, const unsigned char (*leaves)[MERKLE_HASH], uint64_t n) {
+    uint64_t len = n, i;
+    int k;
+
+    memset(t, 0, sizeof(*t));
+    t->n = n;
+    if (!n)
+        return 0;
+    if (!(t->level[0] = malloc(n * MERKLE_HASH)))
+        return -1;
+    memcpy(t->level[0], leaves, n * MERKLE_HASH);
+    for (k = 0; len > 1; k++, len = (len + 1) / 2) {
+        if (!(t->level[k + 1] = malloc((len + 1) / 2 * MERKLE_HASH))) {
+            merkle_free(t);
+            return -1;
+        }
+        for (i = 0; i + 1 < len; i += 2)
+            merkle_node(t->level[k][i], t->level[k][i + 1], t->level[k + 1][i / 2]);
+        if (len & 1)
+            memcpy(t->level[k + 1][len / 2], t->level[k][len - 1], MERKLE_HASH);
+    }
+    t->levels = k + 1;
+    return 0;
+}
+
+void merkle_free(struct merkle_tree *t) {
+    int k;
+
+    for (k = 0; k <= MERKLE_DEPTH; k++)
+        free(t->level[k]);
+    memset(t, 0, sizeof(*t));
+}
+
+/*
+ * Get the inclusion proof of a leaf, from the leaf up.
+ *
+ * Params:
+ *  t       Tree
+ *  index   Leaf index, from 0
+ *  path    Room for MERKLE_DEPTH hashes
+ *
+ * Returns:
+ *  Number of hashes, or -1 if there is no such leaf
+ */
+int merkle_proof(const struct merkle_tree *t, uint64_t index, unsigned char path[][MERKLE_HASH]) {
+    uint64_t len = t->n;
+    int k, n = 0;
+
+    if (index >= t->n)
+        return -1;
+    for (k = 0; len > 1; k++, index /= 2, len = (len + 1) / 2)
+        if ((index ^ 1) < len)
+            memcpy(path[n++], t->level[k][index ^ 1], MERKLE_HASH);
+    return n;
+}
+
+/*
+ * Check an inclusion proof against a root.
+ *
+ * Params:
+ *  leaf    Leaf hash
+ *  index   Leaf index, from 0
+ *  n       Leaves in the tree
+ *  path    Proof, from the leaf up
+ *  len     Hashes in the proof
+ *  root    Root of the tree
+ *
+ * Returns:
+ *  1 if the leaf is in the tree, 0 if not
+ */
+int merkle_verify(const unsigned char leaf[MERKLE_HASH], uint64_t index, uint64_t n,
+        const unsigned char path[][MERKLE_HASH], int len, const unsigned char root[MERKLE_HASH]) {
+    unsigned char h[MERKLE_HASH];
+    int i = 0;
+
+    if (index >= n)
+        return 0;
+    memcpy(h, leaf, MERKLE_HASH);
+    for (; n > 1; index /= 2, n = (n + 1) / 2) {
+        if (index & 1) {
+            if (i == len)
+                return 0;
+            merkle_node(path[i++], h, h);
+        } else if (index + 1 < n) {
+            if (i == len)
+                return 0;
+            merkle_node(h, path[i++], h);
+        }
+    }
+    return i == len && !memcmp(h, root, MERKLE_HASH);
+}
@@ -0,0 +1,53 @@
+#ifndef MERKLE_H
+#define MERKLE_H
+
+/*
+ * merkle
+ *
+ * Merkle tree commitment to the journal, as in Certificate Transparency
+ * (RFC 6962): leaves are SHA-256(0x00 || record) and nodes are
+ * SHA-256(0x01 || left || right), the left subtree of each node holding
+ * the largest power of two of its leaves. Appending a leaf to a tree of n
+ * leaves changes only the subtrees on its right edge, so the intake
+ * controller keeps just the frontier, the roots of the complete subtrees
+ * that n is made of (one per set bit of n, at most MERKLE_DEPTH), and
+ * folds them into the root when asked.
+ *
+ * An inclusion proof is the sibling of each node on the path from a leaf
+ * to the root, at most one per level. They are taken from the full tree,
+ * built level by level from the leaves; the odd last node of a level is
+ * carried up unchanged, which gives the same tree.
+ */
+#include <stdint.h>
+#include "sha256.h"
+
+#define MERKLE_HASH SHA256_SIZE
+#define MERKLE_DEPTH 64
+
+struct merkle {
+    uint64_t n;                                         // leaves
+    unsigned char frontier[MERKLE_DEPTH][MERKLE_HASH];  // [k]: subtree of 2^k leaves, if bit k of n is set
+};
+
+struct merkle_tree {
+    uint64_t n;
+    int levels;                                         // leaves are level 0, root is levels - 1
+    unsigned char (*level[MERKLE_DEPTH + 1])[MERKLE_HASH];
+};
+
+void merkle_leaf_start(struct sha256 *ctx);
+void merkle_leaf(const void *data, size_t len, unsigned char out[MERKLE_HASH]);
+void merkle_node(const unsigned char left[MERKLE_HASH], const unsigned char right[MERKLE_HASH],
+        unsigned char out[MERKLE_HASH]);
+
+void merkle_init(struct merkle *m);
+void merkle_add(struct merkle *m, const unsigned char leaf[MERKLE_HASH]);
+void merkle_root(const struct merkle *m, unsigned char root[MERKLE_HASH]);
+
+int merkle_build(struct merkle_tree *t, const unsigned char (*leaves)[MERKLE_HASH], uint64_t n);
+void merkle_free(struct merkle_tree *t);
+int merkle_proof(const struct merkle_tree *t, uint64_t index, unsigned char path[][MERKLE_HASH]);
+int merkle_verify(const unsigned char leaf[MERKLE_HASH], uint64_t index, uint64_t n,
+        const unsigned char path[][MERKLE_HASH], int len, const unsigned char root[MERKLE_HASH]);
+
+#endif
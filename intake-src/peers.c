@@ -0,0 +1,530 @@
+/*
+ * peers
+ *
+ * Sends fingerprints of accepted codes to the other boxes at the site and
+ * keeps the ones they send. One thread batches and sends, another receives
+ * and fills the seen set; the intake loop only queues codes and looks them
+ * up. The receiver thread also takes the fingerprints for resync answers,
+ * as the only thread that may walk the seen set, and a third thread sends
+ * them, paced, so that receiving goes on meanwhile. See peers.h.
+ *
+ * Propagation delay is measured for each fingerprint heard: its age when
+ * sent plus the time in flight, from the sender's clock to ours. Boxes on
+ * the same network should keep their clocks in step (NTP); if they are
+ * not, the time in flight is taken as zero when it comes out negative.
+ *
+ * Author:
+ *  Jerry Lue
+ */
+#define _GNU_SOURCE
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <time.h>
+#include <unistd.h>
+#include <endian.h>
+#include <arpa/inet.h>
+#include <sys/socket.h>
+#include "peers.h"
+
+static long long clock_ns(clockid_t clk) {
+    struct timespec ts;
+    clock_gettime(clk, &ts);
+    return ts.tv_sec * 1000000000LL + ts.tv_nsec;
+}
+
+/*
+ * 64-bit FNV-1a of a code with the splitmix64 finish, top bit set so that
+ * no fingerprint has a zero high half.
+ */
+static uint64_t fingerprint(const char *code) {
+    uint64_t h = 0xcbf29ce484222325ULL;
+
+    while (*code)
+        h = (h ^ (unsigned char) *code++) * 0x100000001b3ULL;
+    h = (h ^ (h >> 30)) * 0xbf58476d1ce4e5b9ULL;
+    h = (h ^ (h >> 27)) * 0x94d049bb133111ebULL;
+    return (h ^ (h >> 31)) | 1ULL << 63;
+}
+
+static struct peerset *set_new(uint32_t slots) {
+    struct peerset *s = calloc(1, sizeof(*s) + slots * sizeof(struct peerslot));
+
+    if (s)
+        s->mask = slots - 1;
+    return s;
+}
+
+/*
+ * Find a fingerprint's slot in a set: the slot holding it, or the empty
+ * slot where it would go.
+ */
+static struct peerslot *set_find(struct peerset *s, uint64_t fp) {
+    uint32_t i = (uint32_t) fp & s->mask, hi;
+
+    while ((hi = __atomic_load_n(&s->slots[i].hi, __ATOMIC_ACQUIRE)) &&
+            (hi != (uint32_t) (fp >> 32) || s->slots[i].lo != (uint32_t) fp))
+        i = (i + 1) & s->mask;
+    return &s->slots[i];
+}
+
+/*
+ * Find a fingerprint's slot in the set of those accepted here, as
+ * set_find(). Caller holds the lock.
+ */
+static uint64_t *own_find(const struct peers *p, uint64_t fp) {
+    uint32_t i = (uint32_t) fp & p->ownmask;
+
+    while (p->own[i] && p->own[i] != fp)
+        i = (i + 1) & p->ownmask;
+    return &p->own[i];
+}
+
+static void set_put(struct peerslot *slot, uint64_t fp) {
+    slot->lo = (uint32_t) fp;
+    __atomic_store_n(&slot->hi, (uint32_t) (fp >> 32), __ATOMIC_RELEASE);
+}
+
+/*
+ * Add a fingerprint to the seen set. Receiver thread only.
+ *
+ * Returns:
+ *  1 if it was new, 0 if already seen, -1 if out of memory
+ */
+static int set_insert(struct peers *p, uint64_t fp) {
+    struct peerset *s = p->set, *grown;
+    struct peerslot *slot = set_find(s, fp);
+    uint32_t i;
+
+    if (slot->hi)
+        return 0;
+    if ((s->count + 1) * 2 > s->mask + 1) {
+        // Keep the load under half: copy into a table twice the size
+        if (!(grown = set_new((s->mask + 1) * 2)))
+            return -1;
+        for (i = 0; i <= s->mask; i++)
+            if (s->slots[i].hi)
+                set_put(set_find(grown, (uint64_t) s->slots[i].hi << 32 | s->slots[i].lo),
+                        (uint64_t) s->slots[i].hi << 32 | s->slots[i].lo);
+        grown->count = s->count;
+        __atomic_store_n(&p->set, grown, __ATOMIC_RELEASE);
+        s->next = __atomic_load_n(&p->retired, __ATOMIC_RELAXED);
+        while (!__atomic_compare_exchange_n(&p->retired, &s->next, s, 1,
+                    __ATOMIC_RELEASE, __ATOMIC_RELAXED))
+            ;
+        s = grown;
+        slot = set_find(s, fp);
+    }
+    set_put(slot, fp);
+    s->count++;
+    return 1;
+}
+
+/*
+ * Fill in the header of a datagram, put it and the fingerprints and ages
+ * in little-endian order, and send it.
+ */
+static void send_datagram(struct peers *p, unsigned char *buf, int count, uint32_t flags) {
+    struct peerhdr *h = (struct peerhdr *) buf;
+    uint64_t *fps = (uint64_t *) (h + 1);
+    uint32_t *ages = (uint32_t *) (fps + count);
+    int i;
+
+    for (i = 0; i < count; i++) {
+        fps[i] = htole64(fps[i]);
+        ages[i] = htole32(ages[i]);
+    }
+    memcpy(h->magic, PEERS_MAGIC, 4);
+    h->version = htole16(PEERS_VERSION);
+    h->count = htole16(count);
+    h->box = htole64(p->box);
+    h->seq = htole32(__atomic_fetch_add(&p->seq, 1, __ATOMIC_RELAXED));
+    h->flags = htole32(flags);
+    h->sent_ns = htole64(clock_ns(CLOCK_REALTIME));
+    if (sendto(p->fd, buf, sizeof(*h) + count * 12, 0, (struct sockaddr *) &p->group,
+                sizeof(p->group)) < 0)
+        perror("peers: cannot send");
+}
+
+/*
+ * Queue an answer to a resync request with every fingerprint known here:
+ * those accepted here, then those seen from other boxes. An answer still
+ * queued is replaced, since this one holds all of it. Receiver thread
+ * only.
+ */
+static void queue_known(struct peers *p) {
+    struct peerset *s = p->set;
+    uint64_t *fps;
+    uint32_t n = 0, i;
+
+    pthread_mutex_lock(&p->lock);
+    if ((fps = malloc(((p->own ? p->nown : 0) + s->count + 1) * sizeof(*fps)))) {
+        for (i = 0; p->own && i <= p->ownmask; i++)
+            if (p->own[i])
+                fps[n++] = p->own[i];
+        for (i = 0; i <= s->mask; i++)
+            if (s->slots[i].hi)
+                fps[n++] = (uint64_t) s->slots[i].hi << 32 | s->slots[i].lo;
+        free(p->answer);
+        p->answer = fps;
+        p->nanswer = n;
+        pthread_cond_signal(&p->answercond);
+    }
+    pthread_mutex_unlock(&p->lock);
+}
+
+/*
+ * Answer thread. Sends the queued resync answers, paced so that the
+ * joining box's socket keeps up.
+ */
+static void *peers_answerer(void *arg) {
+    struct peers *p = arg;
+    unsigned char buf[PEERS_DATAGRAM] __attribute__((aligned(8)));
+    uint64_t *fps = (uint64_t *) ((struct peerhdr *) buf + 1), *answer;
+    uint32_t total, i;
+    int n;
+
+    pthread_mutex_lock(&p->lock);
+    for (;;) {
+        while (!p->answer)
+            pthread_cond_wait(&p->answercond, &p->lock);
+        answer = p->answer;
+        total = p->nanswer;
+        p->answer = NULL;
+        pthread_mutex_unlock(&p->lock);
+
+        for (i = 0; i < total; i += n) {
+            n = total - i < PEERS_MAXCOUNT ? total - i : (int) PEERS_MAXCOUNT;
+            memcpy(fps, answer + i, n * sizeof(*fps));
+            memset(fps + n, 0, n * sizeof(uint32_t));
+            send_datagram(p, buf, n, PEERS_SYNC);
+            usleep(1000);
+        }
+        free(answer);
+        pthread_mutex_lock(&p->lock);
+    }
+    return NULL;
+}
+
+/*
+ * Check whether another box has accepted a code.
+ *
+ * Returns:
+ *  1 if seen, 0 if not
+ */
+int peers_seen(struct peers *p, const char *code) {
+    return set_find(__atomic_load_n(&p->set, __ATOMIC_ACQUIRE), fingerprint(code))->hi != 0;
+}
+
+/*
+ * Add a code to the seen set as if another box had sent it, for tests and
+ * benchmarks. Receiver thread only, or before peers_start().
+ *
+ * Returns:
+ *  1 if it was new, 0 if already seen, -1 if out of memory
+ */
+int peers_heard(struct peers *p, const char *code) {
+    return set_insert(p, fingerprint(code));
+}
+
+/*
+ * Declare that the reader holds no seen set, e.g. between sheets. Frees
+ * sets replaced since the last quiescent state.
+ */
+void peers_quiescent(struct peers *p) {
+    struct peerset *s = __atomic_exchange_n(&p->retired, NULL, __ATOMIC_ACQUIRE);
+
+    while (s) {
+        struct peerset *next = s->next;
+        free(s);
+        s = next;
+    }
+}
+
+/*
+ * Queue an accepted code to be sent to the other boxes, and keep it for
+ * answering resyncs.
+ */
+void peers_accepted(struct peers *p, const char *code) {
+    uint64_t fp = fingerprint(code);
+
+    pthread_mutex_lock(&p->lock);
+    if (p->npending < PEERS_PENDING) {
+        struct peerpend *e = &p->pending[p->npending++];
+        e->fp = fp;
+        e->accepted_ns = clock_ns(CLOCK_MONOTONIC);
+        e->sends = PEERS_REPEAT;
+        pthread_cond_signal(&p->cond);
+    } else {
+        p->dropped++;
+    }
+    if (!p->own || (p->nown + 1) * 2 > p->ownmask + 1) {
+        // Keep the load under half, as for the seen set
+        uint32_t size = p->own ? (p->ownmask + 1) * 2 : PEERS_MINSET, oldmask = p->ownmask, i;
+        uint64_t *own = calloc(size, sizeof(*own)), *old = p->own;
+        if (own) {
+            p->own = own;
+            p->ownmask = size - 1;
+            for (i = 0; old && i <= oldmask; i++)
+                if (old[i])
+                    *own_find(p, old[i]) = old[i];
+            free(old);
+        }
+    }
+    if (p->own && p->nown < p->ownmask) {
+        uint64_t *slot = own_find(p, fp);
+        p->nown += !*slot;
+        *slot = fp;
+    }
+    pthread_mutex_unlock(&p->lock);
+}
+
+/*
+ * Sender thread. Sends the pending fingerprints, oldest first, and drops
+ * each after its last repeat. New fingerprints go out at most once every
+ * PEERS_BATCH_MS, and repeats of old ones PEERS_BATCH_MS after the last
+ * datagram, so repeats never hold up a new code.
+ */
+static void *peers_sender(void *arg) {
+    struct peers *p = arg;
+    unsigned char buf[PEERS_DATAGRAM] __attribute__((aligned(8)));
+    uint64_t *fps = (uint64_t *) ((struct peerhdr *) buf + 1);
+    long long last = 0, lastnew = 0;
+
+    pthread_mutex_lock(&p->lock);
+    for (;;) {
+        uint32_t *ages;
+        long long now, due;
+        int i, j, n, fresh = 0;
+
+        while (!p->npending)
+            pthread_cond_wait(&p->cond, &p->lock);
+        for (i = 0; i < p->npending && !fresh; i++)
+            fresh = p->pending[i].sends == PEERS_REPEAT;
+        due = (fresh ? lastnew : last) + PEERS_BATCH_MS * 1000000LL;
+        now = clock_ns(CLOCK_MONOTONIC);
+        if (now < due) {
+            struct timespec until;
+            until.tv_sec = due / 1000000000LL;
+            until.tv_nsec = due % 1000000000LL;
+            pthread_cond_timedwait(&p->cond, &p->lock, &until);
+            continue;
+        }
+        n = p->npending < (int) PEERS_MAXCOUNT ? p->npending : (int) PEERS_MAXCOUNT;
+        ages = (uint32_t *) (fps + n);
+        for (i = 0; i < n; i++) {
+            long long age = (now - p->pending[i].accepted_ns) / 1000;
+            fps[i] = p->pending[i].fp;
+            ages[i] = age < UINT32_MAX ? age : UINT32_MAX;
+            if (p->pending[i].sends == PEERS_REPEAT)
+                p->sent++;
+            p->pending[i].sends--;
+        }
+        for (i = 0, j = 0; i < p->npending; i++)
+            if (p->pending[i].sends)
+                p->pending[j++] = p->pending[i];
+        p->npending = j;
+        last = now;
+        if (fresh)
+            lastnew = now;
+        pthread_mutex_unlock(&p->lock);
+
+        send_datagram(p, buf, n, 0);
+        pthread_mutex_lock(&p->lock);
+        p->datagrams++;
+    }
+    return NULL;
+}
+
+/*
+ * Receiver thread. Adds fingerprints from other boxes to the seen set and
+ * measures the delay of each new one, and answers resync requests.
+ */
+static void *peers_receiver(void *arg) {
+    struct peers *p = arg;
+    unsigned char buf[PEERS_DATAGRAM] __attribute__((aligned(8)));
+    struct peerhdr *h = (struct peerhdr *) buf;
+    uint64_t *fps = (uint64_t *) (h + 1);
+    ssize_t len;
+
+    while ((len = recv(p->fd, buf, sizeof(buf), 0)) >= 0 || errno == EINTR) {
+        uint32_t *ages;
+        long long flight_us;
+        int i;
+
+        if (len < (ssize_t) sizeof(*h))
+            continue;
+        h->version = le16toh(h->version);
+        h->count = le16toh(h->count);
+        h->box = le64toh(h->box);
+        h->seq = le32toh(h->seq);
+        h->flags = le32toh(h->flags);
+        h->sent_ns = le64toh(h->sent_ns);
+        if (memcmp(h->magic, PEERS_MAGIC, 4) || h->version != PEERS_VERSION ||
+                h->box == p->box || len < (ssize_t) (sizeof(*h) + h->count * 12))
+            continue;
+        ages = (uint32_t *) (fps + h->count);
+        for (i = 0; i < h->count; i++) {
+            fps[i] = le64toh(fps[i]);
+            ages[i] = le32toh(ages[i]);
+        }
+        if (h->flags & PEERS_REQUEST) {
+            long long now = clock_ns(CLOCK_MONOTONIC);
+            if (h->box != p->answered || now - p->answered_ns >= PEERS_SYNC_MS * 1000000LL) {
+                p->answered = h->box;
+                p->answered_ns = now;
+                queue_known(p);
+            }
+            continue;
+        }
+        if (h->flags & PEERS_SYNC) {
+            // Answers hold the codes accepted here too
+            pthread_mutex_lock(&p->lock);
+            for (i = 0; i < h->count; i++)
+                if (fps[i] >> 63 && !(p->own && *own_find(p, fps[i]) == fps[i]) &&
+                        set_insert(p, fps[i]) > 0)
+                    p->resynced++;
+            pthread_mutex_unlock(&p->lock);
+            continue;
+        }
+        flight_us = (clock_ns(CLOCK_REALTIME) - h->sent_ns) / 1000;
+        if (flight_us < 0)
+            flight_us = 0;
+        for (i = 0; i < h->count; i++) {
+            long long delay;
+            if (!(fps[i] >> 63) || set_insert(p, fps[i]) <= 0)
+                continue;
+            delay = ages[i] + flight_us;
+            p->heard++;
+            p->delay_total_us += delay;
+            if (delay > p->delay_max_us)
+                p->delay_max_us = delay;
+            if (delay > PEERS_BOUND_MS * 1000LL)
+                p->late++;
+        }
+    }
+    perror("peers: receiver stopped");
+    return NULL;
+}
+
+/*
+ * Open the peer socket and join the multicast group.
+ *
+ * Params:
+ *  addr    group:port, or group:port:interface to send and receive on the
+ *          interface with that address (e.g. 127.0.0.1 for loopback tests)
+ *
+ * Returns:
+ *  New peer state, or NULL on error
+ */
+struct peers *peers_open(const char *addr) {
+    struct peers *p = calloc(1, sizeof(*p));
+    struct ip_mreq mreq;
+    struct sockaddr_in local;
+    struct in_addr ifaddr = { htonl(INADDR_ANY) };
+    pthread_condattr_t attr;
+    char group[64], *port, *ifname;
+    unsigned char ttl = 1, loop = 1;
+    int one = 1, fd = -1;
+
+    if (!p)
+        return NULL;
+    if (snprintf(group, sizeof(group), "%s", addr) >= (int) sizeof(group) ||
+            !(port = strchr(group, ':')))
+        goto invalid;
+    *port++ = '\0';
+    if ((ifname = strchr(port, ':'))) {
+        *ifname++ = '\0';
+        if (!inet_aton(ifname, &ifaddr))
+            goto invalid;
+    }
+    p->group.sin_family = AF_INET;
+    p->group.sin_port = htons(atoi(port));
+    if (!inet_aton(group, &p->group.sin_addr) || !IN_MULTICAST(ntohl(p->group.sin_addr.s_addr)))
+        goto invalid;
+    memset(&local, 0, sizeof(local));
+    local.sin_family = AF_INET;
+    local.sin_port = p->group.sin_port;
+    local.sin_addr = p->group.sin_addr;
+    mreq.imr_multiaddr = p->group.sin_addr;
+    mreq.imr_interface = ifaddr;
+    // Boxes stay on the local network; several may share a host for tests
+    if ((fd = socket(AF_INET, SOCK_DGRAM | SOCK_CLOEXEC, 0)) < 0 ||
+            setsockopt(fd, SOL_SOCKET, SO_REUSEADDR, &one, sizeof(one)) ||
+            bind(fd, (struct sockaddr *) &local, sizeof(local)) ||
+            setsockopt(fd, IPPROTO_IP, IP_ADD_MEMBERSHIP, &mreq, sizeof(mreq)) ||
+            setsockopt(fd, IPPROTO_IP, IP_MULTICAST_TTL, &ttl, sizeof(ttl)) ||
+            setsockopt(fd, IPPROTO_IP, IP_MULTICAST_LOOP, &loop, sizeof(loop)) ||
+            setsockopt(fd, IPPROTO_IP, IP_MULTICAST_IF, &ifaddr, sizeof(ifaddr)))
+        goto fail;
+    p->fd = fd;
+    if (!(p->set = set_new(PEERS_MINSET)))
+        goto fail;
+    // Random id to tell our own datagrams from other boxes'
+    if ((fd = open("/dev/urandom", O_RDONLY | O_CLOEXEC)) < 0 ||
+            read(fd, &p->box, sizeof(p->box)) != sizeof(p->box)) {
+        if (fd >= 0)
+            close(fd);
+        fd = p->fd;
+        goto fail;
+    }
+    close(fd);
+    pthread_mutex_init(&p->lock, NULL);
+    pthread_condattr_init(&attr);
+    pthread_condattr_setclock(&attr, CLOCK_MONOTONIC);
+    pthread_cond_init(&p->cond, &attr);
+    pthread_condattr_destroy(&attr);
+    pthread_cond_init(&p->answercond, NULL);
+    return p;
+
+invalid:
+    errno = EINVAL;
+fail:
+    if (fd >= 0)
+        close(fd);
+    free(p->set);
+    free(p);
+    return NULL;
+}
+
+/*
+ * Start the sender, receiver and answer threads, and ask the other boxes
+ * for the codes they know.
+ *
+ * Returns:
+ *  0 on success, -1 on error
+ */
+int peers_start(struct peers *p) {
+    unsigned char buf[sizeof(struct peerhdr)] __attribute__((aligned(8)));
+    pthread_t thread;
+    int i;
+
+    if (pthread_create(&thread, NULL, peers_receiver, p))
+        return -1;
+    pthread_detach(thread);
+    if (pthread_create(&thread, NULL, peers_sender, p))
+        return -1;
+    pthread_detach(thread);
+    if (pthread_create(&thread, NULL, peers_answerer, p))
+        return -1;
+    pthread_detach(thread);
+    for (i = 0; i < PEERS_REPEAT; i++)
+        send_datagram(p, buf, 0, PEERS_REQUEST);
+    return 0;
+}
+
+/*
+ * Print codes sent and heard, and the propagation delay of those heard.
+ */
+void peers_report(struct peers *p, const char *prog) {
+    fprintf(stderr, "%s: peers: sent %lu codes in %lu datagrams (%lu dropped), "
+            "resynced %lu, heard %lu", prog, p->sent, p->datagrams, p->dropped,
+            p->resynced, p->heard);
+    if (p->heard)
+        fprintf(stderr, ", delay avg %.1f ms, max %.1f ms, %lu over %d ms",
+                p->delay_total_us / 1e3 / p->heard, p->delay_max_us / 1e3, p->late,
+                PEERS_BOUND_MS);
+    fprintf(stderr, "\n");
+}
@@ -0,0 +1,124 @@
+#ifndef PEERS_H
+#define PEERS_H
+
+/*
+ * peers
+ *
+ * Duplicate detection across the boxes at a site. Each box multicasts a
+ * 64-bit fingerprint of every code it accepts on the local network, and
+ * keeps the fingerprints it hears from other boxes in a seen set that is
+ * checked before accepting a sheet.
+ *
+ * Fingerprints are sent in batches: at once when the link has been quiet
+ * for PEERS_BATCH_MS, otherwise in the next datagram, at most one every
+ * PEERS_BATCH_MS. Each fingerprint goes out in PEERS_REPEAT consecutive
+ * datagrams, so a code reaches the other boxes within PEERS_BATCH_MS plus
+ * network delay, and within PEERS_REPEAT such periods if datagrams are
+ * lost. Two sheets with the same code taken in at two boxes closer
+ * together than that are both accepted.
+ *
+ * A box that starts late, or restarts after a crash, missed the codes
+ * accepted before. On start it asks for them with PEERS_REPEAT request
+ * datagrams, and every box that hears a request answers with all the
+ * fingerprints it knows, its own and those it has seen, at most once per
+ * PEERS_SYNC_MS for a given box. The answers are multicast, so they fill
+ * any other gaps too, and the joining box hears the same codes from every
+ * box, so a datagram lost from one box's answer is made up by the others.
+ * A box's own fingerprints come back to it in the others' answers; they
+ * are kept out of its seen set.
+ *
+ * The seen set is an open-addressing table written only by the receiver
+ * thread. It is grown by copying into a larger table published by pointer
+ * swap, as for the config, so lookups take no lock. Fingerprints have the
+ * top bit set and are stored as two 32-bit halves, the high half last, so
+ * that boards without 64-bit atomics never see half a fingerprint.
+ *
+ * Datagram (little-endian):
+ *  peerhdr
+ *  uint64_t fingerprint[count]
+ *  uint32_t age[count]         microseconds from accept to send, 0 in a
+ *                              resync answer
+ */
+#include <stdint.h>
+#include <pthread.h>
+#include <netinet/in.h>
+
+#define PEERS_MAGIC "VBPR"
+#define PEERS_VERSION 1
+#define PEERS_BATCH_MS 20
+#define PEERS_REPEAT 3
+#define PEERS_BOUND_MS (PEERS_REPEAT * PEERS_BATCH_MS) // delays above are late
+#define PEERS_DATAGRAM 1400         // fits an Ethernet frame
+#define PEERS_MAXCOUNT ((PEERS_DATAGRAM - sizeof(struct peerhdr)) / 12)
+#define PEERS_PENDING 1024          // codes waiting to be sent
+#define PEERS_MINSET 4096
+#define PEERS_SYNC_MS 1000          // least time between answers to one box
+
+// Datagram flags
+#define PEERS_REQUEST 1             // asks for every known fingerprint
+#define PEERS_SYNC 2                // answers a request
+
+struct peerhdr {
+    char magic[4];
+    uint16_t version;
+    uint16_t count;
+    uint64_t box;                   // sender's random id
+    uint32_t seq;
+    uint32_t flags;                 // PEERS_REQUEST, PEERS_SYNC
+    int64_t sent_ns;                // sender's CLOCK_REALTIME
+};
+
+struct peerslot {
+    uint32_t hi, lo;                // fingerprint halves, hi written last
+};
+
+struct peerset {
+    uint32_t mask;                  // slots - 1
+    uint32_t count;
+    struct peerset *next;           // retired list link
+    struct peerslot slots[];        // hi 0 if empty
+};
+
+struct peerpend {
+    uint64_t fp;
+    long long accepted_ns;          // CLOCK_MONOTONIC
+    int sends;                      // datagrams left to send in
+};
+
+struct peers {
+    int fd;
+    struct sockaddr_in group;
+    uint64_t box;
+    uint32_t seq;
+    struct peerset *set;            // published seen set
+    struct peerset *retired;        // sets awaiting reader quiescence
+
+    pthread_mutex_t lock;           // guards pending, own and answer
+    pthread_cond_t cond;
+    pthread_cond_t answercond;
+    struct peerpend pending[PEERS_PENDING];
+    int npending;
+    uint64_t *own;                  // fingerprints accepted here, open addressing, 0 if empty
+    uint32_t nown, ownmask;         // slots - 1, 0 until the first
+
+    uint64_t answered;              // box last answered, receiver thread only
+    long long answered_ns;
+    uint64_t *answer;               // fingerprints of the next resync answer
+    uint32_t nanswer;
+
+    // Statistics
+    unsigned long sent, datagrams, dropped;
+    unsigned long heard, late;           // new fingerprints, and those over bound
+    unsigned long resynced;              // new fingerprints from resync answers
+    long long delay_total_us, delay_max_us;
+};
+
+struct peers *peers_open(const char *addr);
+int peers_start(struct peers *p);
+void peers_accepted(struct peers *p, const char *code);
+int peers_seen(struct peers *p, const char *code);
+int peers_heard(struct peers *p, const char *code);
+void peers_quiescent(struct peers *p);
+void peers_report(struct peers *p, const char *prog);
+
+#endif
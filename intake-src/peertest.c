@@ -0,0 +1,129 @@
+/*
+ * Usage:
+ *  peertest [-l] [-b boxes] [-r rate] [-s seconds] group:port[:interface]
+ *
+ * Examples:
+ *  Run three boxes on this host over loopback
+ *      ./intake-src/peertest 239.255.86.66:8666:127.0.0.1
+ *  Run one box here, against boxes running peertest on other hosts
+ *      ./intake-src/peertest -b 1 239.255.86.66:8666
+ *  Also check that a box started afterwards learns the codes by resync
+ *      ./intake-src/peertest -l 239.255.86.66:8666:127.0.0.1
+ *
+ * Description:
+ *  Tests duplicate detection between boxes (see peers.h). Each of -b boxes
+ *  (default 3), all in this process with their own sockets, accepts -r
+ *  (default 20) new codes a second for -s seconds (default 5) and queues
+ *  them for its peers. Once the last code has had time to propagate, every
+ *  box looks up every code the other boxes in this process accepted, and
+ *  the codes it missed are counted, as are its own codes that it takes for
+ *  another box's. Each box's report gives the codes sent
+ *  and heard and the propagation delay of those heard, average and worst,
+ *  with the number over the bound of PEERS_BOUND_MS.
+ *
+ *  With -l, one more box is started once the codes have propagated, as a
+ *  box booted late or restarted would be, and must find every code the
+ *  others accepted through the resync it asks for at start.
+ *
+ * Author:
+ *  Jerry Lue
+ */
+#include <stdio.h>
+#include <stdlib.h>
+#include <unistd.h>
+#include <time.h>
+#include "peers.h"
+
+#define BOXES 3
+#define MAXBOXES 16
+#define RATE 20
+#define SECONDS 5
+
+static long long now_ns(void) {
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return ts.tv_sec * 1000000000LL + ts.tv_nsec;
+}
+
+int main(int argc, char *argv[]) {
+    struct peers *box[MAXBOXES];
+    int opt, boxes = BOXES, rate = RATE, seconds = SECONDS, late = 0, i, j, k, n;
+    long missed = 0, checked = 0, mine = 0;
+    long long t0, t;
+    char code[32], name[16];
+    unsigned int tag;
+
+    while ((opt = getopt(argc, argv, "lb:r:s:")) != -1) {
+        switch (opt) {
+            case 'l':
+                late = 1;
+                break;
+            case 'b':
+                boxes = atoi(optarg);
+                break;
+            case 'r':
+                rate = atoi(optarg);
+                break;
+            case 's':
+                seconds = atoi(optarg);
+                break;
+            default:
+                goto usage;
+        }
+    }
+    if (argc - optind != 1 || boxes < 1 || boxes + late > MAXBOXES || rate < 1 || seconds < 1)
+        goto usage;
+
+    // Codes differ from run to run, so that hosts running together agree
+    srand(time(NULL) ^ getpid());
+    tag = rand();
+    for (i = 0; i < boxes; i++) {
+        if (!(box[i] = peers_open(argv[optind])) || peers_start(box[i])) {
+            perror(argv[optind]);
+            return 1;
+        }
+    }
+    n = rate * seconds;
+    t0 = now_ns();
+    for (k = 0; k < n; k++) {
+        while ((t = now_ns()) < t0 + k * 1000000000LL / rate)
+            usleep((t0 + k * 1000000000LL / rate - t) / 1000);
+        for (i = 0; i < boxes; i++) {
+            snprintf(code, sizeof(code), "%08x-%d-%d", tag, i, k);
+            peers_accepted(box[i], code);
+        }
+    }
+    usleep(2 * PEERS_BOUND_MS * 1000);
+    if (late) {
+        if (!(box[boxes] = peers_open(argv[optind])) || peers_start(box[boxes])) {
+            perror(argv[optind]);
+            return 1;
+        }
+        // Answers are paced at a datagram a millisecond
+        usleep((n * boxes / PEERS_MAXCOUNT + 1) * boxes * 1000 + 2 * PEERS_BOUND_MS * 1000);
+    }
+
+    for (i = 0; i < boxes + late; i++) {
+        for (j = 0; j < boxes; j++) {
+            for (k = 0; k < n; k++) {
+                snprintf(code, sizeof(code), "%08x-%d-%d", tag, j, k);
+                if (j == i) {
+                    mine += peers_seen(box[i], code);
+                    continue;
+                }
+                missed += !peers_seen(box[i], code);
+                checked++;
+            }
+        }
+        peers_quiescent(box[i]);
+        snprintf(name, sizeof(name), "box %d", i);
+        peers_report(box[i], name);
+    }
+    printf("%d boxes%s, %d codes each: %ld of %ld lookups missed, %ld own codes seen\n",
+            boxes, late ? " and a late one" : "", n, missed, checked, mine);
+    return missed || mine ? 2 : 0;
+
+usage:
+    fprintf(stderr, "Usage: peertest [-l] [-b boxes] [-r rate] [-s seconds] group:port[:interface]\n");
+    return 1;
+}
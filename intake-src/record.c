@@ -0,0 +1,796 @@
+/*
+ * record
+ *
+ * A record is its type (one byte), the time since the previous record in
+ * microseconds and its fields, all numbers as LEB128 varints (signed ones
+ * zigzag encoded); see enum rec_type for the fields. Key event times are
+ * deltas from the previous scanner event of the same scan.
+ *
+ * Replay reads the whole recording into memory first. Each kind of input
+ * (pins, commands, scans, decisions, config) has its own cursor into it.
+ *
+ * Author:
+ *  Jerry Lue
+ */
+#define _GNU_SOURCE
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <linux/input.h>
+#include <wiringPi.h>
+#include <softPwm.h>
+#include "servolib.h"
+#include "decode.h"
+#include "record.h"
+
+#ifndef input_event_sec
+#define input_event_sec time.tv_sec
+#define input_event_usec time.tv_usec
+#endif
+
+#define MAXEVENTS 64        // key events decoded per batch, as in scan
+
+enum { OFF, RECORD, REPLAY };
+
+struct recitem {
+    int64_t t;              // us since the recording started
+    int type;
+    int a, b;               // pin and value, position, count or exit status
+    int64_t v;              // time of the first scanner event or bytes
+    const unsigned char *data;
+    int len;
+};
+
+static int mode;
+
+// Recording
+static FILE *out;
+static long long last_us;
+static int pinlast[REC_PINS];
+static unsigned char *lastconf;
+static int lastconflen = -1;
+static unsigned char *chunkbuf;
+static size_t chunklen, chunkcap;
+static long long keyprev;
+static int stopseen;
+
+// Replay
+static unsigned char *file;
+static struct recitem *items;
+static int nitems;
+static int gpiocur, outcur, scancur, verdictcur, confscan, confcur = -1;
+static long long vnow, vend, wallstart;
+static int pinval[REC_PINS];
+static volatile sig_atomic_t *stopflag;
+static int stopitem = -1, stopcmd, stopscan, stopverdict; // cursors to reach first
+static int ended;
+static unsigned long matched, diverged;
+
+static const char *typenames[] = { "none", "gpio", "pwm", "write", "servo", "status",
+    "config", "keys", "bytes", "gap end", "scan", "verdict", "end", "stop" };
+
+static long long now_us(void) {
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return ts.tv_sec * 1000000LL + ts.tv_nsec / 1000;
+}
+
+static uint64_t zigzag(int64_t v) {
+    return ((uint64_t) v << 1) ^ (uint64_t) (v >> 63);
+}
+
+static int64_t unzigzag(uint64_t v) {
+    return (int64_t) (v >> 1) ^ -(int64_t) (v & 1);
+}
+
+static void put_varint(uint64_t v) {
+    while (v >= 0x80) {
+        putc((v & 0x7f) | 0x80, out);
+        v >>= 7;
+    }
+    putc(v, out);
+}
+
+static void put_head(int type) {
+    long long t = now_us();
+
+    putc(type, out);
+    put_varint(t - last_us);
+    last_us = t;
+}
+
+static int get_varint(const unsigned char **p, const unsigned char *end, uint64_t *v) {
+    int shift;
+
+    *v = 0;
+    for (shift = 0; *p < end && shift < 64; shift += 7) {
+        unsigned char c = *(*p)++;
+        *v |= (uint64_t) (c & 0x7f) << shift;
+        if (!(c & 0x80))
+            return 0;
+    }
+    return -1;
+}
+
+/*
+ * Start recording.
+ *
+ * Params:
+ *  path        Recording file, replaced
+ *  traypin     Tray sensor pin, -1 for none
+ *  continuous  Continuous mode
+ *
+ * Returns:
+ *  0 on success, -1 on error
+ */
+int rec_open(const char *path, int traypin, int continuous) {
+    struct rec_header h;
+    int i;
+
+    if (!(out = fopen(path, "we")))
+        return -1;
+    memset(&h, 0, sizeof(h));
+    memcpy(h.magic, REC_MAGIC, sizeof(h.magic));
+    h.version = REC_VERSION;
+    h.traypin = traypin;
+    h.continuous = continuous;
+    h.started = time(NULL);
+    if (fwrite(&h, sizeof(h), 1, out) != 1) {
+        fclose(out);
+        return -1;
+    }
+    for (i = 0; i < REC_PINS; i++)
+        pinlast[i] = -1;
+    last_us = now_us();
+    mode = RECORD;
+    return 0;
+}
+
+static int add_item(const struct recitem *it) {
+    static int cap;
+
+    if (nitems == cap) {
+        struct recitem *more = realloc(items, (cap ? cap * 2 : 4096) * sizeof(*items));
+        if (!more)
+            return -1;
+        items = more;
+        cap = cap ? cap * 2 : 4096;
+    }
+    items[nitems++] = *it;
+    return 0;
+}
+
+/*
+ * Split a recording into items.
+ *
+ * Returns:
+ *  0 on success, -1 if it is truncated or corrupt; the items before that
+ *  are kept
+ */
+static int parse(const unsigned char *p, const unsigned char *end) {
+    long long t = 0, key = 0;
+    uint64_t dt, a, b, c, d;
+    int seen[REC_PINS] = { 0 }, i;
+
+    for (i = 0; i < REC_PINS; i++)
+        pinval[i] = HIGH;
+    while (p < end) {
+        struct recitem it;
+        memset(&it, 0, sizeof(it));
+        it.type = *p++;
+        if (get_varint(&p, end, &dt))
+            return -1;
+        it.t = t += dt;
+        switch (it.type) {
+            case REC_GPIO:
+            case REC_PWM:
+            case REC_WRITE:
+                if (get_varint(&p, end, &a) || get_varint(&p, end, &b) || a >= REC_PINS)
+                    return -1;
+                it.a = a;
+                it.b = b;
+                if (it.type == REC_GPIO && !seen[a]++)
+                    pinval[a] = b; // as first read
+                break;
+            case REC_SERVO:
+            case REC_VERDICT:
+                if (get_varint(&p, end, &a))
+                    return -1;
+                it.a = a;
+                break;
+            case REC_SCAN:
+                if (get_varint(&p, end, &a))
+                    return -1;
+                it.a = unzigzag(a);
+                key = 0;
+                // fall through: code
+            case REC_STATUS:
+            case REC_CONFIG:
+                if (get_varint(&p, end, &b) || b > (uint64_t) (end - p))
+                    return -1;
+                it.data = p;
+                it.len = b;
+                p += b;
+                break;
+            case REC_KEYS:
+                if (get_varint(&p, end, &a))
+                    return -1;
+                it.a = a;
+                it.v = key;
+                it.data = p;
+                for (; a > 0; a--) {
+                    if (get_varint(&p, end, &b) || get_varint(&p, end, &c) ||
+                            get_varint(&p, end, &d) || get_varint(&p, end, &d))
+                        return -1;
+                    key += unzigzag(b);
+                }
+                it.len = p - it.data;
+                break;
+            case REC_BYTES:
+                if (get_varint(&p, end, &a) || get_varint(&p, end, &b) ||
+                        b > (uint64_t) (end - p))
+                    return -1;
+                it.v = key += unzigzag(a);
+                it.data = p;
+                it.len = b;
+                p += b;
+                break;
+            case REC_GAPEND:
+            case REC_END:
+            case REC_STOP:
+                break;
+            default:
+                return -1;
+        }
+        if (it.type == REC_CONFIG) {
+            // Own copy, aligned for the config struct
+            unsigned char *copy = malloc(it.len ? it.len : 1);
+            if (!copy)
+                return -1;
+            memcpy(copy, it.data, it.len);
+            it.data = copy;
+        }
+        if (add_item(&it))
+            return -1;
+        vend = t;
+    }
+    return 0;
+}
+
+static int is_command(int type) {
+    return type == REC_PWM || type == REC_WRITE || type == REC_SERVO || type == REC_STATUS;
+}
+
+/*
+ * Start replaying a recording.
+ *
+ * Params:
+ *  path        Recording file
+ *  traypin     Set to the tray sensor pin of the recording
+ *  continuous  Set to the mode of the recording
+ *  stop        Set when the recording ends
+ *
+ * Returns:
+ *  0 on success, -1 on error
+ */
+int rec_replay(const char *path, int *traypin, int *continuous, volatile sig_atomic_t *stop) {
+    struct rec_header h;
+    FILE *f = fopen(path, "re");
+    long size;
+    int i;
+
+    if (!f)
+        return -1;
+    if (fseek(f, 0, SEEK_END) || (size = ftell(f)) < (long) sizeof(h) ||
+            fseek(f, 0, SEEK_SET) || !(file = malloc(size)) ||
+            fread(file, 1, size, f) != (size_t) size) {
+        fclose(f);
+        return -1;
+    }
+    fclose(f);
+    memcpy(&h, file, sizeof(h));
+    if (memcmp(h.magic, REC_MAGIC, sizeof(h.magic)) || h.version != REC_VERSION) {
+        fprintf(stderr, "%s: not a recording\n", path);
+        return -1;
+    }
+    // A box that lost power leaves the last record cut short
+    if (parse(file + sizeof(h), file + size))
+        fprintf(stderr, "%s: corrupt or cut short after %d records\n", path, nitems);
+    for (i = 0; i < nitems && stopitem < 0; i++) {
+        if (items[i].type == REC_STOP)
+            stopitem = i;
+        else if (is_command(items[i].type))
+            stopcmd = i + 1;
+        else if (items[i].type == REC_SCAN)
+            stopscan = i + 1;
+        else if (items[i].type == REC_VERDICT)
+            stopverdict = i + 1;
+    }
+    *traypin = h.traypin;
+    *continuous = h.continuous;
+    stopflag = stop;
+    wallstart = now_us();
+    mode = REPLAY;
+    return 0;
+}
+
+int rec_replaying(void) {
+    return mode == REPLAY;
+}
+
+static void end_replay(void) {
+    int i;
+
+    if (ended++)
+        return;
+    for (i = 0; i < REC_PINS; i++)
+        pinval[i] = HIGH;
+    *stopflag = 1;
+}
+
+/*
+ * Apply the pin changes recorded up to the replay clock.
+ */
+static void advance(void) {
+    for (; gpiocur < nitems && items[gpiocur].t <= vnow; gpiocur++)
+        if (items[gpiocur].type == REC_GPIO && !ended)
+            pinval[items[gpiocur].a] = items[gpiocur].b;
+    if (vnow > vend)
+        end_replay();
+}
+
+/*
+ * Pull the replay clock forward to a recorded time.
+ */
+static void catch_up(long long t) {
+    if (t > vnow) {
+        vnow = t;
+        advance();
+    }
+}
+
+static void describe(char *buf, size_t size, int type, int a, int b, const void *text, int len) {
+    switch (type) {
+        case REC_PWM:
+        case REC_WRITE:
+            snprintf(buf, size, "%s %d=%d", typenames[type], a, b);
+            break;
+        case REC_SERVO:
+            snprintf(buf, size, "servo %d", a);
+            break;
+        case REC_STATUS:
+        case REC_SCAN:
+            snprintf(buf, size, "%s '%.*s'", typenames[type], len, (const char *) text);
+            break;
+        default:
+            snprintf(buf, size, "%s", typenames[type]);
+    }
+}
+
+static void differ(long long t, const char *want, const char *got) {
+    if (++diverged <= REC_SHOWN)
+        fprintf(stderr, "replay: at %.3f s expected %s, got %s\n", t / 1e6, want, got);
+}
+
+/*
+ * Check a command given in replay against the next recorded one.
+ */
+static void check(int type, int a, int b, const char *text) {
+    const struct recitem *it;
+    char want[96], got[96];
+    int len = text ? (int) strlen(text) : 0;
+
+    while (outcur < nitems && !is_command(items[outcur].type))
+        outcur++;
+    if (outcur == nitems)
+        return; // past the end of the recording
+    it = &items[outcur++];
+    catch_up(it->t);
+    if (it->type == type && it->a == a && it->b == b && it->len == len &&
+            (!len || !memcmp(it->data, text, len))) {
+        matched++;
+        return;
+    }
+    describe(want, sizeof(want), it->type, it->a, it->b, it->data, it->len);
+    describe(got, sizeof(got), type, a, b, text, len);
+    differ(it->t, want, got);
+}
+
+/*
+ * Stop recording, or report on the replay.
+ */
+void rec_close(void) {
+    int left = 0;
+
+    if (mode == RECORD) {
+        put_head(REC_END);
+        if (fclose(out))
+            perror("record: cannot write recording");
+    } else if (mode == REPLAY) {
+        for (; outcur < nitems; outcur++)
+            left += is_command(items[outcur].type);
+        fprintf(stderr, "replay: %d records over %.1f s replayed in %.3f s, "
+                "%lu commands and scans matched, %lu differed, %d not reached\n",
+                nitems, vend / 1e6, (now_us() - wallstart) / 1e6, matched, diverged, left);
+    }
+    mode = OFF;
+}
+
+/*
+ * Check the stop flag, set by a signal. See record.h.
+ *
+ * Params:
+ *  stop    Stop flag
+ *
+ * Returns:
+ *  Nonzero to stop
+ */
+int rec_stopped(int stop) {
+    if (mode == RECORD && stop && !stopseen++)
+        put_head(REC_STOP);
+    if (mode == REPLAY && !stop && stopitem >= 0 && outcur >= stopcmd &&
+            scancur >= stopscan && verdictcur >= stopverdict) {
+        catch_up(items[stopitem].t);
+        stop = *stopflag = 1;
+    }
+    return stop;
+}
+
+/*
+ * Read a GPIO pin (digitalRead).
+ */
+int rec_read(int pin) {
+    int v;
+
+    if (mode == REPLAY) {
+        vnow += REC_POLL_US;
+        advance();
+        return pin >= 0 && pin < REC_PINS ? pinval[pin] : HIGH;
+    }
+    v = digitalRead(pin);
+    if (mode == RECORD && pin >= 0 && pin < REC_PINS && v != pinlast[pin]) {
+        pinlast[pin] = v;
+        put_head(REC_GPIO);
+        put_varint(pin);
+        put_varint(v);
+    }
+    return v;
+}
+
+/*
+ * Milliseconds on the wiringPi clock (millis), or on the replay clock.
+ */
+unsigned int rec_millis(void) {
+    return mode == REPLAY ? 1000 + vnow / 1000 : millis();
+}
+
+void rec_delay(unsigned int ms) {
+    if (mode != REPLAY) {
+        delay(ms);
+        return;
+    }
+    vnow += ms * 1000LL;
+    advance();
+}
+
+/*
+ * Wait for a tray sensor wakeup (poll). In replay, moves the clock to the
+ * next recorded pin change and returns 0.
+ */
+int rec_poll(struct pollfd *fds, int n, int timeout) {
+    int i;
+
+    if (mode != REPLAY)
+        return poll(fds, n, timeout);
+    for (i = gpiocur; i < nitems && items[i].type != REC_GPIO; i++)
+        ;
+    if (i == nitems)
+        end_replay();
+    else
+        catch_up(items[i].t);
+    return 0;
+}
+
+void rec_pwm(int pin, int duty) {
+    if (mode == REPLAY) {
+        check(REC_PWM, pin, duty, NULL);
+        return;
+    }
+    softPwmWrite(pin, duty);
+    if (mode == RECORD) {
+        put_head(REC_PWM);
+        put_varint(pin);
+        put_varint(duty);
+    }
+}
+
+void rec_write(int pin, int value) {
+    if (mode == REPLAY) {
+        check(REC_WRITE, pin, value, NULL);
+        return;
+    }
+    digitalWrite(pin, value);
+    if (mode == RECORD) {
+        put_head(REC_WRITE);
+        put_varint(pin);
+        put_varint(value);
+    }
+}
+
+void rec_servo(int pos) {
+    if (mode == REPLAY) {
+        check(REC_SERVO, pos, 0, NULL);
+        return;
+    }
+    servo_move(pos);
+    if (mode == RECORD) {
+        put_head(REC_SERVO);
+        put_varint(pos);
+    }
+}
+
+/*
+ * Note a status change. The recording is flushed on each, so a crash
+ * loses at most part of a sheet.
+ */
+void rec_status(const char *status) {
+    size_t len = strlen(status);
+
+    if (mode == REPLAY) {
+        check(REC_STATUS, 0, 0, status);
+    } else if (mode == RECORD) {
+        put_head(REC_STATUS);
+        put_varint(len);
+        fwrite(status, 1, len, out);
+        fflush(out);
+    }
+}
+
+/*
+ * Config snapshot for the next sheet.
+ *
+ * Params:
+ *  live    Snapshot in use; recorded if it changed. Unused in replay.
+ *  len     Bytes of it to record
+ *
+ * Returns:
+ *  live, or in replay the snapshot in use at this point of the recording
+ *  (NULL if there is none of that length)
+ */
+const void *rec_config(const void *live, int len) {
+    if (mode == RECORD && (len != lastconflen || memcmp(live, lastconf, len))) {
+        unsigned char *copy = realloc(lastconf, len ? len : 1);
+        put_head(REC_CONFIG);
+        put_varint(len);
+        fwrite(live, 1, len, out);
+        if (copy) {
+            memcpy(copy, live, len);
+            lastconf = copy;
+            lastconflen = len;
+        }
+    }
+    if (mode != REPLAY)
+        return live;
+    for (; confscan < nitems && (items[confscan].t <= vnow || confcur < 0); confscan++)
+        if (items[confscan].type == REC_CONFIG && items[confscan].len == len)
+            confcur = confscan;
+    return confcur < 0 ? NULL : items[confcur].data;
+}
+
+/*
+ * Accept decision for a scanned code.
+ *
+ * Returns:
+ *  accepted, or in replay the recorded decision
+ */
+int rec_verdict(int accepted) {
+    if (mode == RECORD) {
+        put_head(REC_VERDICT);
+        put_varint(accepted != 0);
+    }
+    if (mode != REPLAY)
+        return accepted;
+    while (verdictcur < nitems && items[verdictcur].type != REC_VERDICT)
+        verdictcur++;
+    if (verdictcur == nitems) {
+        end_replay();
+        return 0;
+    }
+    return items[verdictcur++].a;
+}
+
+/*
+ * Set up the pipe the scan program sends its raw input on (scan -r).
+ *
+ * Params:
+ *  readfd  Set to the end to read, -1 if not recording
+ *
+ * Returns:
+ *  End for the scan program to write, or -1 if not recording
+ */
+int rec_scan_pipe(int *readfd) {
+    int fds[2];
+
+    *readfd = -1;
+    if (mode != RECORD || pipe(fds))
+        return -1;
+    fcntl(fds[0], F_SETFD, FD_CLOEXEC);
+    fcntl(fds[0], F_SETFL, O_NONBLOCK);
+    chunklen = 0;
+    keyprev = 0;
+    *readfd = fds[0];
+    return fds[1];
+}
+
+static void put_chunk(const struct rec_chunk *c, const unsigned char *data) {
+    struct input_event ev;
+    uint32_t i, n = c->len / sizeof(ev);
+
+    switch (c->type) {
+        case REC_KEYS:
+            put_head(REC_KEYS);
+            put_varint(n);
+            for (i = 0; i < n; i++) {
+                long long t;
+                memcpy(&ev, data + i * sizeof(ev), sizeof(ev));
+                t = ev.input_event_sec * 1000000LL + ev.input_event_usec;
+                put_varint(zigzag(t - keyprev));
+                put_varint(ev.type);
+                put_varint(ev.code);
+                put_varint(zigzag(ev.value));
+                keyprev = t;
+            }
+            break;
+        case REC_BYTES:
+            put_head(REC_BYTES);
+            put_varint(zigzag(c->time_us - keyprev));
+            put_varint(c->len);
+            fwrite(data, 1, c->len, out);
+            keyprev = c->time_us;
+            break;
+        case REC_GAPEND:
+            put_head(REC_GAPEND);
+            break;
+    }
+}
+
+/*
+ * Record the raw scanner input available on the pipe.
+ */
+void rec_scan_read(int readfd) {
+    struct rec_chunk c;
+    size_t off = 0;
+    ssize_t n;
+
+    if (readfd < 0)
+        return;
+    for (;;) {
+        if (chunkcap - chunklen < 4096) {
+            unsigned char *more = realloc(chunkbuf, chunkcap ? chunkcap * 2 : 65536);
+            if (!more)
+                break;
+            chunkbuf = more;
+            chunkcap = chunkcap ? chunkcap * 2 : 65536;
+        }
+        if ((n = read(readfd, chunkbuf + chunklen, chunkcap - chunklen)) <= 0)
+            break;
+        chunklen += n;
+    }
+    while (chunklen - off >= sizeof(c)) {
+        memcpy(&c, chunkbuf + off, sizeof(c));
+        if (chunklen - off - sizeof(c) < c.len)
+            break;
+        put_chunk(&c, chunkbuf + off + sizeof(c));
+        off += sizeof(c) + c.len;
+    }
+    memmove(chunkbuf, chunkbuf + off, chunklen - off);
+    chunklen -= off;
+}
+
+/*
+ * Record the result of a scan, after the rest of its raw input.
+ *
+ * Params:
+ *  readfd  Pipe from rec_scan_pipe(), closed here
+ *  code    Code read, empty if none
+ *  status  Exit status of the scan program, -1 if it did not exit
+ */
+void rec_scan_done(int readfd, const char *code, int status) {
+    size_t len = strlen(code);
+
+    if (readfd >= 0) {
+        fcntl(readfd, F_SETFL, 0); // the scan program has exited: read to EOF
+        rec_scan_read(readfd);
+        close(readfd);
+    }
+    if (mode != RECORD)
+        return;
+    put_head(REC_SCAN);
+    put_varint(zigzag(status));
+    put_varint(len);
+    fwrite(code, 1, len, out);
+}
+
+static int replay_keys(struct decoder *dec, const struct recitem *it) {
+    struct input_event ev[MAXEVENTS];
+    const unsigned char *p = it->data, *end = p + it->len;
+    long long t = it->v;
+    uint64_t dt, type, code, value;
+    int n = 0, left = it->a, done = -1;
+
+    memset(ev, 0, sizeof(ev));
+    while (left-- > 0 && done < 0) {
+        get_varint(&p, end, &dt);   // checked when loaded
+        get_varint(&p, end, &type);
+        get_varint(&p, end, &code);
+        get_varint(&p, end, &value);
+        t += unzigzag(dt);
+        ev[n].input_event_sec = t / 1000000;
+        ev[n].input_event_usec = t % 1000000;
+        ev[n].type = type;
+        ev[n].code = code;
+        ev[n].value = unzigzag(value);
+        if (++n == MAXEVENTS || !left) {
+            done = decode_events(dec, ev, n);
+            n = 0;
+        }
+    }
+    return done;
+}
+
+/*
+ * Replay a scan: decode the recorded scanner input again and check the
+ * code against the recorded one.
+ *
+ * Params:
+ *  gap_ms  Inter-key gap that ends a code
+ *  code    Set to the recorded code, empty if none
+ *  size    Size of code
+ *
+ * Returns:
+ *  Recorded exit status of the scan program
+ */
+int rec_scan(int gap_ms, char *code, int size) {
+    struct decoder dec;
+    const struct recitem *it;
+    char want[96], got[96];
+    int i, done = -1, len;
+
+    code[0] = '\0';
+    for (i = scancur; i < nitems && items[i].type != REC_SCAN; i++)
+        ;
+    if (i == nitems) {
+        end_replay();
+        return 0;
+    }
+    decoder_init(&dec, CODE_LIMIT, gap_ms * 1000L);
+    for (; scancur < i && done < 0; scancur++) {
+        it = &items[scancur];
+        if (it->type == REC_KEYS)
+            done = replay_keys(&dec, it);
+        else if (it->type == REC_BYTES)
+            done = decode_bytes(&dec, (const char *) it->data, it->len, it->v);
+        else if (it->type == REC_GAPEND)
+            decoder_finish(&dec), done = 0;
+    }
+    it = &items[i];
+    scancur = i + 1;
+    catch_up(it->t);
+    len = done >= 0 ? (int) strlen(dec.code) : 0;
+    if (len == it->len && !memcmp(dec.code, it->data, len) &&
+            (done >= 0 && dec.truncated) == (it->a == 2)) {
+        matched++;
+    } else {
+        describe(want, sizeof(want), REC_SCAN, 0, 0, it->data, it->len);
+        describe(got, sizeof(got), REC_SCAN, 0, 0, dec.code, len);
+        differ(it->t, want, got);
+    }
+    decoder_free(&dec);
+    len = it->len < size - 1 ? it->len : size - 1;
+    memcpy(code, it->data, len);
+    code[len] = '\0';
+    return it->a;
+}
@@ -0,0 +1,104 @@
+#ifndef RECORD_H
+#define RECORD_H
+
+/*
+ * record
+ *
+ * Whole-box recording and replay. The intake controller goes through the
+ * rec_* calls for everything it reads from or drives on the hardware:
+ * GPIO reads, motor and servo commands, status changes, scanner results,
+ * accept decisions and config snapshots. With no recording open they are
+ * plain calls to wiringPi.
+ *
+ * Recording writes all of it, timestamped, to one file. Inputs are kept
+ * compact: a GPIO pin is written only when its value changes, and the raw
+ * scanner events (evdev key events or tty bytes), which the scan program
+ * sends over a pipe (scan -r), are delta encoded.
+ *
+ * Replay drives the same control logic from a recording, without the
+ * hardware and on a virtual clock: pins change at their recorded times,
+ * waits return at once after advancing the clock, scans are decoded
+ * again from the recorded scanner events, and accept decisions and config
+ * come from the recording. Each command the logic gives is checked
+ * against the recorded one; differences are reported. The clock advances
+ * by the logic's own waits and by REC_POLL_US for each pin read, and is
+ * pulled forward to the recorded time at each command, scan and idle
+ * wakeup, so replays are deterministic and stay in step with the
+ * recording. Replay ends at the end of the recording: the stop flag is
+ * set and pins read high (released) from then on.
+ *
+ * The stop flag, set by a signal, is read through rec_stopped(). The
+ * first time it is seen set while recording, a stop item is recorded, and
+ * replay raises the flag at the first check made after every command,
+ * scan and decision recorded before that item. The logic gave nothing in
+ * between in the recording, so the replay gives the same commands.
+ */
+#include <stdint.h>
+#include <signal.h>
+#include <poll.h>
+
+#define REC_MAGIC "VBRECORD"
+#define REC_VERSION 1
+#define REC_POLL_US 100             // replay time per pin read
+#define REC_PINS 64                 // BCM pin numbers
+#define REC_SHOWN 10                // divergences reported one by one
+
+enum rec_type {
+    REC_GPIO = 1,                   // pin, value: a pin read changed
+    REC_PWM,                        // pin, duty: soft PWM command
+    REC_WRITE,                      // pin, value: digital output command
+    REC_SERVO,                      // position: diverter servo command
+    REC_STATUS,                     // text: status change
+    REC_CONFIG,                     // bytes: config snapshot in use
+    REC_KEYS,                       // count, events: scanner key events
+    REC_BYTES,                      // time, bytes: serial scanner bytes
+    REC_GAPEND,                     // scanner code ended by the gap
+    REC_SCAN,                       // exit status, code: scan result
+    REC_VERDICT,                    // accepted: accept decision
+    REC_END,                        // recording closed
+    REC_STOP,                       // stop flag first seen set
+};
+
+struct rec_header {
+    char magic[8];
+    uint32_t version;
+    int32_t traypin;                // -1 for none
+    int32_t continuous;
+    int32_t reserved;
+    int64_t started;                // wall clock time (s)
+};
+
+/*
+ * Chunk of raw scanner input, sent by the scan program over its -r pipe:
+ * REC_KEYS (struct input_event array), REC_BYTES or REC_GAPEND.
+ */
+struct rec_chunk {
+    uint32_t type;
+    uint32_t len;                   // bytes following
+    int64_t time_us;                // REC_BYTES: when read, on the event clock
+};
+
+int rec_open(const char *path, int traypin, int continuous);
+int rec_replay(const char *path, int *traypin, int *continuous, volatile sig_atomic_t *stop);
+int rec_replaying(void);
+void rec_close(void);
+int rec_stopped(int stop);
+
+int rec_read(int pin);
+unsigned int rec_millis(void);
+void rec_delay(unsigned int ms);
+int rec_poll(struct pollfd *fds, int n, int timeout);
+
+void rec_pwm(int pin, int duty);
+void rec_write(int pin, int value);
+void rec_servo(int pos);
+void rec_status(const char *status);
+
+const void *rec_config(const void *live, int len);
+int rec_verdict(int accepted);
+int rec_scan_pipe(int *readfd);
+void rec_scan_read(int readfd);
+void rec_scan_done(int readfd, const char *code, int status);
+int rec_scan(int gap_ms, char *code, int size);
+
+#endif
@@ -0,0 +1,112 @@
+/*
+ * sha256
+ *
+ * Plain C implementation; one 64-byte block is compressed at a time, with
+ * the message schedule computed in place in a 16-word ring.
+ *
+ * Author:
+ *  Jerry Lue
+ */
+#include <string.h>
+#include "sha256.h"
+
+static const uint32_t k[64] = {
+    0x428a2f98, 0x71374491, 0xb5c0fbcf, 0xe9b5dba5, 0x3956c25b, 0x59f111f1, 0x923f82a4, 0xab1c5ed5,
+    0xd807aa98, 0x12835b01, 0x243185be, 0x550c7dc3, 0x72be5d74, 0x80deb1fe, 0x9bdc06a7, 0xc19bf174,
+    0xe49b69c1, 0xefbe4786, 0x0fc19dc6, 0x240ca1cc, 0x2de92c6f, 0x4a7484aa, 0x5cb0a9dc, 0x76f988da,
+    0x983e5152, 0xa831c66d, 0xb00327c8, 0xbf597fc7, 0xc6e00bf3, 0xd5a79147, 0x06ca6351, 0x14292967,
+    0x27b70a85, 0x2e1b2138, 0x4d2c6dfc, 0x53380d13, 0x650a7354, 0x766a0abb, 0x81c2c92e, 0x92722c85,
+    0xa2bfe8a1, 0xa81a664b, 0xc24b8b70, 0xc76c51a3, 0xd192e819, 0xd6990624, 0xf40e3585, 0x106aa070,
+    0x19a4c116, 0x1e376c08, 0x2748774c, 0x34b0bcb5, 0x391c0cb3, 0x4ed8aa4a, 0x5b9cca4f, 0x682e6ff3,
+    0x748f82ee, 0x78a5636f, 0x84c87814, 0x8cc70208, 0x90befffa, 0xa4506ceb, 0xbef9a3f7, 0xc67178f2,
+};
+
+#define ROR(x, n) ((x) >> (n) | (x) << (32 - (n)))
+
+static void compress(uint32_t h[8], const unsigned char *p) {
+    uint32_t w[16], a = h[0], b = h[1], c = h[2], d = h[3], e = h[4], f = h[5], g = h[6], hh = h[7];
+    int i;
+
+    for (i = 0; i < 64; i++) {
+        uint32_t t1, t2;
+        if (i < 16) {
+            w[i] = (uint32_t) p[4 * i] << 24 | p[4 * i + 1] << 16 | p[4 * i + 2] << 8 | p[4 * i + 3];
+        } else {
+            uint32_t w15 = w[(i - 15) & 15], w2 = w[(i - 2) & 15];
+            w[i & 15] += (ROR(w15, 7) ^ ROR(w15, 18) ^ w15 >> 3) + w[(i - 7) & 15] +
+                    (ROR(w2, 17) ^ ROR(w2, 19) ^ w2 >> 10);
+        }
+        t1 = hh + (ROR(e, 6) ^ ROR(e, 11) ^ ROR(e, 25)) + ((e & f) ^ (~e & g)) + k[i] + w[i & 15];
+        t2 = (ROR(a, 2) ^ ROR(a, 13) ^ ROR(a, 22)) + ((a & b) ^ (a & c) ^ (b & c));
+        hh = g;
+        g = f;
+        f = e;
+        e = d + t1;
+        d = c;
+        c = b;
+        b = a;
+        a = t1 + t2;
+    }
+    h[0] += a;
+    h[1] += b;
+    h[2] += c;
+    h[3] += d;
+    h[4] += e;
+    h[5] += f;
+    h[6] += g;
+    h[7] += hh;
+}
+
+void sha256_init(struct sha256 *ctx) {
+    static const uint32_t iv[8] = {
+        0x6a09e667, 0xbb67ae85, 0x3c6ef372, 0xa54ff53a, 0x510e527f, 0x9b05688c, 0x1f83d9ab, 0x5be0cd19,
+    };
+
+    memcpy(ctx->h, iv, sizeof(iv));
+    ctx->len = 0;
+}
+
+void sha256_update(struct sha256 *ctx, const void *data, size_t len) {
+    const unsigned char *p = data;
+    size_t fill = ctx->len % 64;
+
+    ctx->len += len;
+    if (fill) {
+        size_t n = len < 64 - fill ? len : 64 - fill;
+        memcpy(ctx->buf + fill, p, n);
+        p += n;
+        len -= n;
+        if (fill + n < 64)
+            return;
+        compress(ctx->h, ctx->buf);
+    }
+    for (; len >= 64; p += 64, len -= 64)
+        compress(ctx->h, p);
+    memcpy(ctx->buf, p, len);
+}
+
+void sha256_final(struct sha256 *ctx, unsigned char out[SHA256_SIZE]) {
+    static const unsigned char pad[64] = { 0x80 };
+    uint64_t bits = ctx->len * 8;
+    unsigned char len[8];
+    int i;
+
+    for (i = 0; i < 8; i++)
+        len[i] = bits >> (56 - 8 * i);
+    sha256_update(ctx, pad, 1 + (119 - ctx->len % 64) % 64);
+    sha256_update(ctx, len, 8);
+    for (i = 0; i < 8; i++) {
+        out[4 * i] = ctx->h[i] >> 24;
+        out[4 * i + 1] = ctx->h[i] >> 16;
+        out[4 * i + 2] = ctx->h[i] >> 8;
+        out[4 * i + 3] = ctx->h[i];
+    }
+}
+
+void sha256(const void *data, size_t len, unsigned char out[SHA256_SIZE]) {
+    struct sha256 ctx;
+
+    sha256_init(&ctx);
+    sha256_update(&ctx, data, len);
+    sha256_final(&ctx, out);
+}
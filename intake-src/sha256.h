@@ -0,0 +1,26 @@
+#ifndef SHA256_H
+#define SHA256_H
+
+/*
+ * sha256
+ *
+ * SHA-256 (FIPS 180-4), for commitments to the journal. Data can be
+ * hashed in one call or fed in pieces through a context.
+ */
+#include <stdint.h>
+#include <stddef.h>
+
+#define SHA256_SIZE 32
+
+struct sha256 {
+    uint32_t h[8];
+    uint64_t len;                   // bytes hashed
+    unsigned char buf[64];
+};
+
+void sha256_init(struct sha256 *ctx);
+void sha256_update(struct sha256 *ctx, const void *data, size_t len);
+void sha256_final(struct sha256 *ctx, unsigned char out[SHA256_SIZE]);
+void sha256(const void *data, size_t len, unsigned char out[SHA256_SIZE]);
+
+#endif
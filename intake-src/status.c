@@ -0,0 +1,86 @@
+/*
+ * status
+ *
+ * Shared memory status region with a single writer sequence lock. The
+ * intake controller is the only writer.
+ *
+ * Author:
+ *  Jerry Lue
+ */
+#include <stdio.h>
+#include <string.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <sys/mman.h>
+#include "status.h"
+
+/*
+ * Map the shared status region, creating it if needed. A writer that died
+ * in the middle of an update leaves the sequence odd, which would hold off
+ * readers for good and make the next update look finished while it is
+ * still being written, so the writer brings it back to even.
+ *
+ * Params:
+ *  writer  Nonzero for the writer
+ *
+ * Returns:
+ *  Pointer to status region, or NULL on error
+ */
+struct boxstatus *status_open(int writer) {
+    struct boxstatus *st;
+    int fd = shm_open(STATUS_SHM, O_RDWR | O_CREAT, 0644);
+
+    if (fd < 0)
+        return NULL;
+    if (ftruncate(fd, sizeof(*st))) {
+        close(fd);
+        return NULL;
+    }
+    st = mmap(NULL, sizeof(*st), PROT_READ | PROT_WRITE, MAP_SHARED, fd, 0);
+    close(fd);
+    if (st == MAP_FAILED)
+        return NULL;
+    if (writer && __atomic_load_n(&st->seq, __ATOMIC_RELAXED) & 1)
+        __atomic_add_fetch(&st->seq, 1, __ATOMIC_RELEASE);
+    return st;
+}
+
+/*
+ * Publish a new status. Accept and reject also count the sheet.
+ *
+ * Params:
+ *  status  waiting, pending, accept or reject
+ */
+void status_set(struct boxstatus *st, const char *status) {
+    unsigned int seq = __atomic_load_n(&st->seq, __ATOMIC_RELAXED);
+
+    __atomic_store_n(&st->seq, seq + 1, __ATOMIC_RELAXED);
+    __atomic_thread_fence(__ATOMIC_RELEASE);
+    strncpy(st->status, status, STATUS_LEN - 1);
+    if (!strcmp(status, "accept")) {
+        st->sheets++;
+        st->accepted++;
+    } else if (!strcmp(status, "reject")) {
+        st->sheets++;
+    }
+    __atomic_store_n(&st->seq, seq + 2, __ATOMIC_RELEASE);
+}
+
+/*
+ * Take a consistent copy of the status, retrying if an update was in
+ * progress.
+ *
+ * Params:
+ *  copy    Destination for status copy
+ */
+void status_read(const struct boxstatus *st, struct boxstatus *copy) {
+    unsigned int seq;
+
+    do {
+        while ((seq = __atomic_load_n(&st->seq, __ATOMIC_ACQUIRE)) & 1)
+            ;
+        memcpy(copy, st, sizeof(*copy));
+        __atomic_thread_fence(__ATOMIC_ACQUIRE);
+    } while (__atomic_load_n(&st->seq, __ATOMIC_RELAXED) != seq);
+    copy->status[STATUS_LEN - 1] = '\0';
+}
@@ -0,0 +1,27 @@
+#ifndef STATUS_H
+#define STATUS_H
+
+/*
+ * status
+ *
+ * Intake status shared between the intake controller (writer) and the
+ * status server (reader) through a shared memory region. Updates are
+ * published with a sequence lock, so the writer never waits for readers
+ * and readers never see a torn update.
+ */
+
+#define STATUS_SHM "/votebox-status"
+#define STATUS_LEN 16
+
+struct boxstatus {
+    unsigned int seq;           // odd while an update is in progress
+    char status[STATUS_LEN];    // waiting, pending, accept or reject
+    unsigned long sheets;       // sheets taken in
+    unsigned long accepted;     // sheets accepted
+};
+
+struct boxstatus *status_open(int writer);
+void status_set(struct boxstatus *st, const char *status);
+void status_read(const struct boxstatus *st, struct boxstatus *copy);
+
+#endif
@@ -0,0 +1,180 @@
+/*
+ * Usage:
+ *  statusd [-p] [port]
+ *
+ * Examples:
+ *  Serve status on port 80
+ *      sudo ./intake-src/statusd
+ *  Serve status on port 8080 and print startup profile
+ *      ./intake-src/statusd -p 8080
+ *
+ * Description:
+ *  Native replacement for status_server.py. Serves the intake status
+ *  published by the intake controller at GET /status, in the same format
+ *  as the Python server. Runs independently of the intake controller, so
+ *  it keeps serving while intake restarts.
+ *
+ *  Between requests the server blocks in poll() with no timeout and its
+ *  heartbeat slot is marked idle, so it only wakes for client
+ *  connections. Idle wakeups and CPU time are printed on SIGUSR1 and on
+ *  exit.
+ *
+ * Author:
+ *  Jerry Lue
+ */
+#define _GNU_SOURCE
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <errno.h>
+#include <signal.h>
+#include <poll.h>
+#include <sys/socket.h>
+#include <sys/time.h>
+#include <netinet/in.h>
+#include "bootprof.h"
+#include "status.h"
+#include "heartbeat.h"
+#include "idlestat.h"
+
+#define MAXREQ 1024
+#define HB_TIMEOUT 2000 // longest time to serve a request (ms)
+
+static volatile sig_atomic_t stop, report;
+
+static void on_signal(int sig) {
+    if (sig == SIGUSR1)
+        report = 1;
+    else
+        stop = 1;
+}
+
+/*
+ * Open the listening socket.
+ *
+ * Returns:
+ *  Socket descriptor, or -1 on error
+ */
+static int listen_on(int port) {
+    struct sockaddr_in addr;
+    int one = 1, fd = socket(AF_INET, SOCK_STREAM | SOCK_CLOEXEC, 0);
+
+    if (fd < 0)
+        return -1;
+    memset(&addr, 0, sizeof(addr));
+    addr.sin_family = AF_INET;
+    addr.sin_addr.s_addr = htonl(INADDR_ANY);
+    addr.sin_port = htons(port);
+    setsockopt(fd, SOL_SOCKET, SO_REUSEADDR, &one, sizeof(one));
+    if (bind(fd, (struct sockaddr *) &addr, sizeof(addr)) || listen(fd, 16)) {
+        close(fd);
+        return -1;
+    }
+    return fd;
+}
+
+/*
+ * Answer one HTTP request.
+ *
+ * Params:
+ *  fd      Client connection
+ */
+static void serve_client(const struct boxstatus *st, int fd) {
+    char req[MAXREQ], resp[256];
+    struct timeval tv = { 1, 0 };
+    struct boxstatus copy;
+    int len = 0, n;
+
+    // Don't let a stalled client hold up the server
+    setsockopt(fd, SOL_SOCKET, SO_RCVTIMEO, &tv, sizeof(tv));
+    while (len < MAXREQ - 1 &&
+            (n = read(fd, req + len, MAXREQ - 1 - len)) > 0) {
+        len += n;
+        req[len] = '\0';
+        if (strstr(req, "\r\n\r\n") || strstr(req, "\n\n"))
+            break;
+    }
+    req[len] = '\0';
+    if (!strncmp(req, "GET /status ", 12) || !strncmp(req, "GET /status\r", 12)) {
+        status_read(st, &copy);
+        n = snprintf(resp, sizeof(resp),
+                "HTTP/1.0 200 OK\r\n"
+                "Access-Control-Allow-Origin: *\r\n"
+                "Content-type: text/html\r\n"
+                "\r\n"
+                "%s", copy.status);
+    } else {
+        n = snprintf(resp, sizeof(resp), "HTTP/1.0 404 Not Found\r\n\r\n");
+    }
+    if (write(fd, resp, n) < 0)
+        perror("Error writing response");
+}
+
+int main(int argc, char *argv[]) {
+    struct boxstatus *st;
+    struct hbslot *hb;
+    struct pollfd pfd;
+    struct idlestat idle;
+    struct sigaction sa;
+    long long t;
+    int port = 80, fd, client, n;
+
+    if (argc > 1 && !strcmp(argv[1], "-p")) {
+        bootprof_enable();
+        argc--;
+        argv++;
+    }
+    if (argc > 1)
+        port = atoi(argv[1]);
+    signal(SIGPIPE, SIG_IGN);
+    memset(&sa, 0, sizeof(sa));
+    sa.sa_handler = on_signal;
+    sigaction(SIGINT, &sa, NULL);
+    sigaction(SIGTERM, &sa, NULL);
+    sigaction(SIGUSR1, &sa, NULL);
+    memset(&idle, 0, sizeof(idle));
+
+    t = bootprof_clock();
+    if (!(st = status_open(0))) {
+        perror("Cannot open status region");
+        return 1;
+    }
+    bootprof_stage("status map", t);
+    t = bootprof_clock();
+    if ((fd = listen_on(port)) < 0) {
+        perror("Cannot listen");
+        return 1;
+    }
+    bootprof_stage("http listen", t);
+    bootprof_report("statusd");
+    hb = hb_register("statusd", HB_TIMEOUT);
+
+    pfd.fd = fd;
+    pfd.events = POLLIN;
+    while (!stop) {
+        hb_idle(hb);
+        idlestat_begin(&idle);
+        n = poll(&pfd, 1, -1);
+        idlestat_end(&idle, "statusd", 0);
+        hb_busy(hb);
+        if (report) {
+            idlestat_report(&idle, "statusd");
+            report = 0;
+        }
+        if (n <= 0)
+            continue;
+        client = accept4(fd, NULL, NULL, SOCK_CLOEXEC);
+        if (client < 0) {
+            if (errno == EINTR || errno == ECONNABORTED)
+                continue;
+            perror("Error accepting connection");
+            return 1;
+        }
+        serve_client(st, client);
+        close(client);
+    }
+    idlestat_report(&idle, "statusd");
+    hb_release(hb);
+    return 0;
+}
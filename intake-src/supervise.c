@@ -0,0 +1,317 @@
+/*
+ * Usage:
+ *  supervise [-e] command...
+ *
+ * Examples:
+ *  Run status server and intake controller under supervision
+ *      sudo ./intake-src/supervise ./intake-src/statusd ./intake-src/intake
+ *  Same, printing each event the components post
+ *      sudo ./intake-src/supervise -e ./intake-src/statusd ./intake-src/intake
+ *
+ * Description:
+ *  Starts each command (run with /bin/sh) and watches the heartbeat of
+ *  every registered component. A component whose heartbeat stops for
+ *  longer than its declared timeout is killed; if it is one of the
+ *  supervised commands it is restarted, and other components (such as the
+ *  scan program run by intake) are restarted by their owner. A command
+ *  that exits is restarted as well. Other components are never
+ *  interrupted.
+ *
+ *  For every restart, the recovery time from detection to the first
+ *  heartbeat of the new instance is printed, and a summary is printed on
+ *  exit.
+ *
+ *  Stalls are checked every CHECK_MS only while some component is busy.
+ *  When every component is idle (blocked on external events), the
+ *  supervisor sleeps on the heartbeat region's futex with no timeout until
+ *  a component becomes busy, posts an event or a child exits.
+ *
+ *  Events posted by the components on the event bus (see bus.h) are taken
+ *  in batches on every check, counted by type and, with -e, printed. The
+ *  counts are printed on exit with the events lost to a full bus.
+ *
+ * Author:
+ *  Jerry Lue
+ */
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <signal.h>
+#include <errno.h>
+#include <time.h>
+#include <unistd.h>
+#include <sys/wait.h>
+#include "heartbeat.h"
+#include "idlestat.h"
+#include "bus.h"
+
+#define CHECK_MS 100        // stall detection granularity
+#define BACKOFF_MS 1000     // delay before restarting a command that died at once
+#define MAXCMDS 8
+#define EVENT_BATCH 32      // events taken from the bus at a time
+
+struct command {
+    const char *cmd;
+    char exec[256];         // shell command line, exec'd so pid is the component's
+    pid_t pid;
+    long long started;      // time of last start
+    long long failed;       // time of stall or exit, 0 when running normally
+    unsigned long restarts, recoveries;
+    long long recovery_total, recovery_max;
+};
+
+struct watch {
+    int pid;
+    unsigned long beats;
+    long long changed;      // time beats last changed
+};
+
+static struct command cmds[MAXCMDS];
+static int ncmds;
+static volatile sig_atomic_t stop;
+static struct busregion *bus;
+static struct busreader reader;
+static unsigned long events[BUS_TEST + 1];
+static int showevents;
+
+/*
+ * Note the signal and wake the main loop if it sleeps in hb_wait(); a flag
+ * alone would be missed if it came just before the futex wait.
+ */
+static void on_signal(int sig) {
+    int saved = errno;
+
+    if (sig != SIGCHLD)
+        stop = 1;
+    hb_notify();
+    errno = saved;
+}
+
+/*
+ * Get current monotonic time in milliseconds.
+ */
+static long long now_ms(void) {
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return ts.tv_sec * 1000LL + ts.tv_nsec / 1000000;
+}
+
+static void start(struct command *c) {
+    pid_t pid = fork();
+
+    if (pid == 0) {
+        setpgid(0, 0); // own process group, so its children die with it
+        execl("/bin/sh", "sh", "-c", c->exec, (char *) NULL);
+        _exit(127);
+    }
+    if (pid < 0) {
+        perror("supervise: cannot fork");
+        return;
+    }
+    setpgid(pid, pid);
+    if (c->failed)
+        c->restarts++;
+    c->pid = pid;
+    c->started = now_ms();
+    fprintf(stderr, "supervise: started %s (pid %d)\n", c->cmd, pid);
+}
+
+static struct command *find_command(int pid) {
+    int i;
+    for (i = 0; i < ncmds; i++)
+        if (cmds[i].pid == pid)
+            return &cmds[i];
+    return NULL;
+}
+
+/*
+ * Record the recovery of a command once its new instance beats.
+ */
+static void recovered(struct command *c, long long now) {
+    long long ms = now - c->failed;
+
+    c->recoveries++;
+    c->recovery_total += ms;
+    if (ms > c->recovery_max)
+        c->recovery_max = ms;
+    c->failed = 0;
+    fprintf(stderr, "supervise: %s recovered in %lld ms\n", c->cmd, ms);
+}
+
+/*
+ * Check all heartbeat slots for stalls.
+ *
+ * Returns:
+ *  Number of busy slots, which need checking again after CHECK_MS
+ */
+static int check_slots(struct hbslot *slots, struct watch *w, long long now) {
+    int i, busy = 0;
+
+    for (i = 0; i < HB_SLOTS; i++) {
+        struct hbslot *s = &slots[i];
+        int pid = __atomic_load_n(&s->pid, __ATOMIC_ACQUIRE);
+        int timeout = __atomic_load_n(&s->timeout_ms, __ATOMIC_ACQUIRE);
+        unsigned long beats = __atomic_load_n(&s->beats, __ATOMIC_RELAXED);
+        struct command *c;
+
+        if (!pid || !timeout)
+            continue;
+        // Owner died without releasing its slot
+        if (kill(pid, 0) && errno == ESRCH) {
+            hb_release(s);
+            continue;
+        }
+        if (__atomic_load_n(&s->idle, __ATOMIC_ACQUIRE)) {
+            w[i].changed = now; // timeout starts over when it leaves idle
+            continue;
+        }
+        busy++;
+        if (pid != w[i].pid || beats != w[i].beats) {
+            c = find_command(pid);
+            if (c && c->failed && beats)
+                recovered(c, now);
+            w[i].pid = pid;
+            w[i].beats = beats;
+            w[i].changed = now;
+        } else if (now - w[i].changed > timeout) {
+            fprintf(stderr, "supervise: %s (pid %d) stalled for %lld ms, killing\n",
+                    s->name, pid, now - w[i].changed);
+            c = find_command(pid);
+            if (c) {
+                c->failed = now;
+                kill(-pid, SIGKILL);
+            } else {
+                kill(pid, SIGKILL); // owner starts a new instance
+            }
+            hb_release(s);
+        }
+    }
+    return busy;
+}
+
+/*
+ * Restart commands that have exited.
+ *
+ * Returns:
+ *  Number of commands waiting to be restarted
+ */
+static int reap(long long now) {
+    int status, i, pending = 0;
+    pid_t pid;
+
+    while ((pid = waitpid(-1, &status, WNOHANG)) > 0) {
+        struct command *c = find_command(pid);
+        if (!c)
+            continue;
+        if (!c->failed) {
+            fprintf(stderr, "supervise: %s exited with status %d\n",
+                    c->cmd, WIFEXITED(status) ? WEXITSTATUS(status) : -1);
+            c->failed = now;
+        }
+        c->pid = 0;
+    }
+    for (i = 0; i < ncmds; i++) {
+        struct command *c = &cmds[i];
+        if (!c->pid && !stop && now - c->started >= BACKOFF_MS)
+            start(c);
+        if (!c->pid)
+            pending++;
+    }
+    return pending;
+}
+
+/*
+ * Take all events posted on the bus.
+ */
+static void take_events(void) {
+    struct busevent ev[EVENT_BATCH];
+    int i, n;
+
+    if (!bus)
+        return;
+    while ((n = bus_take(bus, &reader, ev, EVENT_BATCH)) > 0) {
+        for (i = 0; i < n; i++) {
+            if (ev[i].type <= BUS_TEST)
+                events[ev[i].type]++;
+            if (showevents)
+                fprintf(stderr, "supervise: pid %d %s %.*s\n", ev[i].pid,
+                        bus_typename(ev[i].type), ev[i].len, ev[i].data);
+        }
+    }
+}
+
+int main(int argc, char *argv[]) {
+    struct watch watch[HB_SLOTS];
+    struct timespec tick = { 0, CHECK_MS * 1000000L };
+    struct hbregion *region;
+    struct idlestat idle;
+    struct sigaction sa;
+    int i, opt;
+
+    while ((opt = getopt(argc, argv, "+e")) != -1) {
+        if (opt != 'e')
+            goto usage;
+        showevents = 1;
+    }
+    if (argc - optind < 1 || argc - optind > MAXCMDS)
+        goto usage;
+    if (!(region = hb_open())) {
+        perror("Cannot open heartbeat region");
+        return 1;
+    }
+    if (!(bus = bus_open()))
+        perror("Cannot open event bus");
+    memset(watch, 0, sizeof(watch));
+    memset(&idle, 0, sizeof(idle));
+    // No SA_RESTART, so a child exit interrupts an idle futex wait
+    memset(&sa, 0, sizeof(sa));
+    sa.sa_handler = on_signal;
+    sigaction(SIGINT, &sa, NULL);
+    sigaction(SIGTERM, &sa, NULL);
+    sigaction(SIGCHLD, &sa, NULL);
+
+    for (i = optind; i < argc; i++) {
+        cmds[ncmds].cmd = argv[i];
+        snprintf(cmds[ncmds].exec, sizeof(cmds[ncmds].exec), "exec %s", argv[i]);
+        start(&cmds[ncmds++]);
+    }
+    while (!stop) {
+        // Read the wake word before looking for work, so that anything
+        // after this (a signal, an event, a busy slot) ends hb_wait() at once
+        unsigned int wake = __atomic_load_n(&region->wake, __ATOMIC_ACQUIRE);
+        long long now = now_ms();
+        int pending = reap(now);
+        take_events();
+        if (check_slots(region->slot, watch, now) || pending) {
+            nanosleep(&tick, NULL);
+        } else if (!stop) {
+            idlestat_begin(&idle);
+            hb_wait(region, wake);
+            idlestat_end(&idle, "supervise", 0);
+        }
+    }
+
+    for (i = 0; i < ncmds; i++) {
+        struct command *c = &cmds[i];
+        if (c->pid)
+            kill(-c->pid, SIGTERM);
+        fprintf(stderr, "supervise: %s: %lu restarts", c->cmd, c->restarts);
+        if (c->recoveries)
+            fprintf(stderr, ", recovery avg %lld ms, max %lld ms",
+                    c->recovery_total / c->recoveries, c->recovery_max);
+        fprintf(stderr, "\n");
+    }
+    take_events();
+    if (bus)
+        fprintf(stderr, "supervise: events: %lu status, %lu accept, %lu reject, "
+                "%u dropped, %u skipped\n", events[BUS_STATUS], events[BUS_ACCEPT],
+                events[BUS_REJECT], bus->dropped, bus->skipped);
+    idlestat_report(&idle, "supervise");
+    while (wait(NULL) > 0)
+        ;
+    return 0;
+
+usage:
+    fprintf(stderr, "Usage: supervise [-e] command...\n");
+    return 1;
+}
@@ -0,0 +1,327 @@
+/*
+ * decode
+ *
+ * Key event decoding for the scan program, kept separate so the decoding
+ * kernels can be benchmarked without scanner hardware.
+ *
+ * Codes of any length up to an explicit maximum are supported. They are
+ * decoded into an inline buffer first; a code that outgrows it moves to an
+ * arena reserved once for the maximum length, whose pages are only
+ * committed as they are written. Short codes never touch the arena, and
+ * the per-character capacity check is the same one the fixed buffer
+ * needed. Characters past the maximum are dropped and the code is marked
+ * truncated, but decoding still runs to the end of the code.
+ *
+ * A code ends at ENTER or, if a gap is set, at the first key press that
+ * comes more than the gap after the previous one. Gaps are measured on the
+ * kernel's event timestamps, so they are unaffected by how late the events
+ * are read. A code whose last character is followed by silence is ended by
+ * the caller once decoder_deadline() has passed.
+ *
+ * Author:
+ *  Jerry Lue
+ */
+#include <string.h>
+#include <sys/mman.h>
+#include "decode.h"
+
+// Timestamp fields, for kernel headers older than 4.16
+#ifndef input_event_sec
+#define input_event_sec time.tv_sec
+#define input_event_usec time.tv_usec
+#endif
+
+/* 
+ * Map linux keycodes to ASCII characters
+ * 
+ * Params:
+ *  code    Linux keycode (from input.h)
+ *  shift   Case flag (0: lowercase, 1: uppercase)
+ *
+ * Returns:
+ *  ASCII character corresponding to keycode and shiftkey state
+ */
+char keymap(int code, int shift) {
+    if (shift) {
+        switch (code) {
+            case KEY_1: return '!';
+            case KEY_2: return '@';
+            case KEY_3: return '#';
+            case KEY_4: return '$';
+            case KEY_5: return '%';
+            case KEY_6: return '^';
+            case KEY_7: return '&';
+            case KEY_8: return '*';
+            case KEY_9: return '(';
+            case KEY_0: return ')';
+            case KEY_MINUS: return '_';
+            case KEY_EQUAL: return '+';
+            case KEY_Q: return 'Q';
+            case KEY_W: return 'W';
+            case KEY_E: return 'E';
+            case KEY_R: return 'R';
+            case KEY_T: return 'T';
+            case KEY_Y: return 'Y';
+            case KEY_U: return 'U';
+            case KEY_I: return 'I';
+            case KEY_O: return 'O';
+            case KEY_P: return 'P';
+            case KEY_LEFTBRACE: return '{';
+            case KEY_RIGHTBRACE: return '}';
+            case KEY_A: return 'A';
+            case KEY_S: return 'S';
+            case KEY_D: return 'D';
+            case KEY_F: return 'F';
+            case KEY_G: return 'G';
+            case KEY_H: return 'H';
+            case KEY_J: return 'J';
+            case KEY_K: return 'K';
+            case KEY_L: return 'L';
+            case KEY_SEMICOLON: return ':';
+            case KEY_APOSTROPHE: return '\"';
+            case KEY_GRAVE: return '~';
+            case KEY_BACKSLASH: return '|';
+            case KEY_Z: return 'Z';
+            case KEY_X: return 'X';
+            case KEY_C: return 'C';
+            case KEY_V: return 'V';
+            case KEY_B: return 'B';
+            case KEY_N: return 'N';
+            case KEY_M: return 'M';
+            case KEY_COMMA: return '<';
+            case KEY_DOT: return '>';
+            case KEY_SLASH: return '\?';
+            case KEY_SPACE: return ' ';
+            default: return 0;
+        }
+    } else {
+        switch (code) {
+            case KEY_1: return '1';
+            case KEY_2: return '2';
+            case KEY_3: return '3';
+            case KEY_4: return '4';
+            case KEY_5: return '5';
+            case KEY_6: return '6';
+            case KEY_7: return '7';
+            case KEY_8: return '8';
+            case KEY_9: return '9';
+            case KEY_0: return '0';
+            case KEY_MINUS: return '-';
+            case KEY_EQUAL: return '=';
+            case KEY_Q: return 'q';
+            case KEY_W: return 'w';
+            case KEY_E: return 'e';
+            case KEY_R: return 'r';
+            case KEY_T: return 't';
+            case KEY_Y: return 'y';
+            case KEY_U: return 'u';
+            case KEY_I: return 'i';
+            case KEY_O: return 'o';
+            case KEY_P: return 'p';
+            case KEY_LEFTBRACE: return '[';
+            case KEY_RIGHTBRACE: return ']';
+            case KEY_A: return 'a';
+            case KEY_S: return 's';
+            case KEY_D: return 'd';
+            case KEY_F: return 'f';
+            case KEY_G: return 'g';
+            case KEY_H: return 'h';
+            case KEY_J: return 'j';
+            case KEY_K: return 'k';
+            case KEY_L: return 'l';
+            case KEY_SEMICOLON: return ';';
+            case KEY_APOSTROPHE: return '\'';
+            case KEY_GRAVE: return '`';
+            case KEY_BACKSLASH: return '\\';
+            case KEY_Z: return 'z';
+            case KEY_X: return 'x';
+            case KEY_C: return 'c';
+            case KEY_V: return 'v';
+            case KEY_B: return 'b';
+            case KEY_N: return 'n';
+            case KEY_M: return 'm';
+            case KEY_COMMA: return ',';
+            case KEY_DOT: return '.';
+            case KEY_SLASH: return '/';
+            case KEY_SPACE: return ' ';
+            default: return 0;
+        }
+    }
+}
+
+/*
+ * Initialize a decoder.
+ *
+ * Params:
+ *  max     Maximum code length
+ *  gap_us  Inter-key gap that ends a code (us), 0 to end codes at ENTER only
+ */
+void decoder_init(struct decoder *dec, int max, long gap_us) {
+    dec->max = max;
+    dec->gap_us = gap_us;
+    dec->arena = NULL;
+    decoder_reset(dec);
+}
+
+void decoder_free(struct decoder *dec) {
+    if (dec->arena)
+        munmap(dec->arena, dec->max + 1);
+    dec->arena = NULL;
+}
+
+/*
+ * Prepare to decode a new code.
+ */
+void decoder_reset(struct decoder *dec) {
+    dec->shift = 0;
+    dec->len = 0;
+    dec->truncated = 0;
+    dec->code = dec->buf;
+    dec->cap = dec->max < MAXCODE - 1 ? dec->max : MAXCODE - 1;
+}
+
+/*
+ * Make room for one more character.
+ *
+ * Returns:
+ *  1 if there is room, 0 if the code has reached the maximum length
+ */
+static int decoder_grow(struct decoder *dec) {
+    if (dec->cap == dec->max)
+        return 0;
+    if (!dec->arena) {
+        dec->arena = mmap(NULL, dec->max + 1, PROT_READ | PROT_WRITE,
+                MAP_PRIVATE | MAP_ANONYMOUS | MAP_NORESERVE, -1, 0);
+        if (dec->arena == MAP_FAILED) {
+            dec->arena = NULL;
+            return 0;
+        }
+    }
+    memcpy(dec->arena, dec->code, dec->len);
+    dec->code = dec->arena;
+    dec->cap = dec->max;
+    return 1;
+}
+
+/*
+ * Append a character to the code in progress, or mark the code truncated
+ * if it is full.
+ */
+static inline void decoder_put(struct decoder *dec, char c) {
+    if (dec->len == dec->cap && !decoder_grow(dec))
+        dec->truncated = 1;
+    else
+        dec->code[dec->len++] = c;
+}
+
+/*
+ * Decode a batch of input events.
+ *
+ * Params:
+ *  dec     Decoder state, carried across batches
+ *  ev      Events read from scanner
+ *  n       Number of events
+ *
+ * Returns:
+ *  Number of events consumed if a code was completed (code in dec->code,
+ *  dec->truncated set if it was cut short), -1 if all events were consumed
+ *  without completing a code. A code ended by a gap does not consume the
+ *  key press after the gap.
+ */
+int decode_events(struct decoder *dec, const struct input_event *ev, int n) {
+    long long t;
+    int i;
+    char c;
+
+    for (i = 0; i < n; i++) {
+        if (ev[i].type != EV_KEY) // Keyboard events only
+            continue;
+        // Shift key up
+        if (ev[i].value == 0 &&
+                (ev[i].code == KEY_LEFTSHIFT || ev[i].code == KEY_RIGHTSHIFT)) {
+            dec->shift = 0;
+        // Key press
+        } else if (ev[i].value == 1) {
+            // Pause since last key press ends the code
+            if (dec->gap_us) {
+                t = ev[i].input_event_sec * 1000000LL + ev[i].input_event_usec;
+                if (dec->len && t - dec->last_us > dec->gap_us) {
+                    decoder_finish(dec);
+                    return i;
+                }
+                dec->last_us = t;
+            }
+            // Scan complete, stop scanning
+            if (ev[i].code == KEY_ENTER) {
+                dec->code[dec->len] = '\0';
+                return i + 1;
+            }
+            // Shift key down
+            if (ev[i].code == KEY_LEFTSHIFT || ev[i].code == KEY_RIGHTSHIFT) {
+                dec->shift = 1;
+            // Convert a recognized keycode to ascii char
+            } else if ((c = keymap(ev[i].code, dec->shift)) != 0) {
+                decoder_put(dec, c);
+            }
+        }
+    }
+    return -1;
+}
+
+/*
+ * Decode a batch of bytes from a serial scanner. A code ends at CR or LF
+ * (an empty line, such as the LF of CR LF, is skipped) or at the gap, and
+ * only the same characters as decode_events() produces are kept.
+ *
+ * Params:
+ *  dec     Decoder state, carried across batches
+ *  buf     Bytes read from scanner
+ *  n       Number of bytes
+ *  t       Time the bytes were read (us), on the clock used for deadlines
+ *
+ * Returns:
+ *  Number of bytes consumed if a code was completed, -1 if all bytes were
+ *  consumed without completing a code
+ */
+int decode_bytes(struct decoder *dec, const char *buf, int n, long long t) {
+    int i;
+
+    if (dec->gap_us && n) {
+        if (dec->len && t - dec->last_us > dec->gap_us) {
+            decoder_finish(dec);
+            return 0;
+        }
+        dec->last_us = t;
+    }
+    for (i = 0; i < n; i++) {
+        if (buf[i] == '\r' || buf[i] == '\n') {
+            if (dec->len || dec->truncated) {
+                decoder_finish(dec);
+                return i + 1;
+            }
+        } else if (buf[i] >= ' ' && buf[i] <= '~') {
+            decoder_put(dec, buf[i]);
+        }
+    }
+    return -1;
+}
+
+/*
+ * Get the time at which a partly decoded code ends if no more keys are
+ * pressed, on the clock of the event timestamps.
+ *
+ * Returns:
+ *  Deadline (us), or -1 if no code is in progress or no gap is set
+ */
+long long decoder_deadline(const struct decoder *dec) {
+    if (!dec->gap_us || !dec->len)
+        return -1;
+    return dec->last_us + dec->gap_us;
+}
+
+/*
+ * End the code in progress, e.g. when its deadline has passed.
+ */
+void decoder_finish(struct decoder *dec) {
+    dec->code[dec->len] = '\0';
+}
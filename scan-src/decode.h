@@ -0,0 +1,40 @@
+#ifndef DECODE_H
+#define DECODE_H
+
+/*
+ * decode
+ *
+ * Decoding of barcode scanner key events into codes. The scanner acts as
+ * a keyboard, typing each code followed by ENTER. A code can also be ended
+ * by a pause in typing longer than a set gap, for scanners configured
+ * without an ENTER suffix. Serial scanners send the same characters as
+ * bytes, followed by CR and/or LF.
+ */
+#include <linux/input.h>
+
+#define MAXCODE 64          // inline buffer size, enough for linear codes
+#define CODE_LIMIT 4096     // default maximum code length
+
+struct decoder {
+    int shift;              // shift key held
+    int len;                // characters decoded so far
+    int cap;                // characters that fit in current buffer
+    int max;                // maximum code length
+    int truncated;          // code was longer than max, excess dropped
+    long gap_us;            // inter-key gap that ends a code, 0 for ENTER only
+    long long last_us;      // event timestamp of last key press (us)
+    char *code;             // decoded code, null terminated when complete
+    char *arena;            // reserved space for long codes, or NULL
+    char buf[MAXCODE];      // inline buffer for short codes
+};
+
+char keymap(int code, int shift);
+void decoder_init(struct decoder *dec, int max, long gap_us);
+void decoder_free(struct decoder *dec);
+void decoder_reset(struct decoder *dec);
+int decode_events(struct decoder *dec, const struct input_event *ev, int n);
+int decode_bytes(struct decoder *dec, const char *buf, int n, long long t);
+long long decoder_deadline(const struct decoder *dec);
+void decoder_finish(struct decoder *dec);
+
+#endif
@@ -1,29 +1,62 @@
 /*
  * Usage:
- *  scan [timeout in seconds]
+ *  scan [-m max length] [-g gap in ms] [-d device] [-b baud] [-r fd] [timeout in seconds]
  * 
  * Examples:
  *  Scan code, no timeout
  *      sudo ./scan
  *  Scan code, 5 second timeout
  *      sudo ./scan 5
+ *  Scan code of up to 16384 characters, 5 second timeout
+ *      sudo ./scan -m 16384 5
+ *  Scan code from a scanner that sends no ENTER, ending codes on a 20ms pause
+ *      sudo ./scan -g 20 5
+ *  Scan code from a USB serial scanner at 115200 baud, 5 second timeout
+ *      sudo ./scan -d /dev/ttyACM0 5
  * 
  * Description:
  *  Scans a code using the barcode scanner on pin 25. Continues
  *  until code is successfully read or an error occurs. Valid code
  *  is printed to standard output. All printable non-whitespace characters
  *  of ASCII are supported.
+ *
+ *  Codes may be of any length up to the maximum (4096 by default). A code
+ *  longer than the maximum is printed cut short and the program exits with
+ *  status 2, so a truncated read is never mistaken for a complete one.
+ *
+ *  A code ends at ENTER or when no key follows its last character within
+ *  the gap (50ms by default, -g 0 to wait for ENTER only). The gap is
+ *  timed from the kernel timestamp of the last key event, so the code is
+ *  printed as soon as the gap has passed rather than at the next poll
+ *  timeout. Set the gap well above the scanner's typing interval.
+ *
+ *  The scanner is read either as a keyboard (evdev key events, the default
+ *  device) or, if the device is a tty, as a serial port sending each code
+ *  as a line of text. The tty is put in raw mode at the given baud rate
+ *  (115200 by default; CDC-ACM devices ignore it) and read as soon as any
+ *  byte arrives. Both produce the same output, and gaps on a tty are timed
+ *  from when the bytes were read, on the same clock.
  * 
+ *  With -r, the raw input (key events, or bytes with the time they were
+ *  read) and each code ended by the gap are also written to the given file
+ *  descriptor, for intake's recordings (see intake-src/record.h).
+ *
+ *  While scanning, the program bumps a heartbeat counter (see
+ *  intake-src/heartbeat.h) so that a supervisor can kill it if it hangs.
+ *
  * Notes:
  *  To compile, include argument -lwiringPi, e.g.
- *      gcc scan.c -o scan -lwiringPi
+ *      gcc scan.c decode.c ../intake-src/heartbeat.c -I../intake-src -o scan -lwiringPi -lrt
  *
  *  Due to requirements of wiringPi, this program must be run as root.
  *
  * Author:
  *  Jerry Lue
  */
+#define _GNU_SOURCE
 #include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
 #include <poll.h>
 #include <unistd.h>
 #include <errno.h>
@@ -35,196 +68,231 @@
 #include <fcntl.h>
 #include <linux/input.h>
 #include <limits.h>
+#include <time.h>
+#include <termios.h>
+#include <sys/uio.h>
+#include "heartbeat.h"
+#include "decode.h"
+#include "record.h"
 
-#define MAXCODE 64 // scan buffer size
 #define SCANPIN 25 // gpio pin controlling scanner on/off
+#define HB_TIMEOUT 2000 // longest time between heartbeats (ms)
+#define MAXEVENTS 64 // events read per batch
+#define GAP_MS 50 // default inter-key gap that ends a code
+#define MAXBYTES 256 // bytes read per batch from a serial scanner
 
 // key event device of scanner
 char *device = "/dev/input/by-id/usb-WIT_Electron_Company_WIT_122-UFS_V2.03-event-kbd";
 
-/* 
- * Map linux keycodes to ASCII characters
- * 
+struct hbslot *hb;
+clockid_t evclock = CLOCK_REALTIME; // clock of event timestamps
+int tty; // scanner is a serial tty rather than an input device
+int recfd = -1; // raw input is also written here (-r), or -1
+
+/*
+ * Get the current time on evclock in microseconds.
+ */
+long long now_us(void) {
+    struct timespec ts;
+    clock_gettime(evclock, &ts);
+    return ts.tv_sec * 1000000LL + ts.tv_nsec / 1000;
+}
+
+/*
+ * Write raw scanner input to the recording pipe, if any.
+ *
  * Params:
- *  code    Linux keycode (from input.h)
- *  shift   Case flag (0: lowercase, 1: uppercase)
+ *  type    REC_KEYS, REC_BYTES or REC_GAPEND
+ *  data    Events or bytes
+ *  len     Bytes of data
+ *  t       Time the bytes were read, on evclock (us)
+ */
+void send_raw(int type, const void *data, int len, long long t) {
+    struct rec_chunk c = { type, len, t };
+    struct iovec iov[2] = { { &c, sizeof(c) }, { (void *) data, len } };
+
+    if (recfd >= 0 && writev(recfd, iov, 2) < 0)
+        recfd = -1; // no longer recorded; carry on scanning
+}
+
+/*
+ * Convert a baud rate to its termios speed.
  *
  * Returns:
- *  ASCII character corresponding to keycode and shiftkey state
+ *  Speed constant, or B0 if the rate is not supported
  */
-char keymap(int code, int shift) {
-    if (shift) {
-        switch (code) {
-            case KEY_1: return '!';
-            case KEY_2: return '@';
-            case KEY_3: return '#';
-            case KEY_4: return '$';
-            case KEY_5: return '%';
-            case KEY_6: return '^';
-            case KEY_7: return '&';
-            case KEY_8: return '*';
-            case KEY_9: return '(';
-            case KEY_0: return ')';
-            case KEY_MINUS: return '_';
-            case KEY_EQUAL: return '+';
-            case KEY_Q: return 'Q';
-            case KEY_W: return 'W';
-            case KEY_E: return 'E';
-            case KEY_R: return 'R';
-            case KEY_T: return 'T';
-            case KEY_Y: return 'Y';
-            case KEY_U: return 'U';
-            case KEY_I: return 'I';
-            case KEY_O: return 'O';
-            case KEY_P: return 'P';
-            case KEY_LEFTBRACE: return '{';
-            case KEY_RIGHTBRACE: return '}';
-            case KEY_A: return 'A';
-            case KEY_S: return 'S';
-            case KEY_D: return 'D';
-            case KEY_F: return 'F';
-            case KEY_G: return 'G';
-            case KEY_H: return 'H';
-            case KEY_J: return 'J';
-            case KEY_K: return 'K';
-            case KEY_L: return 'L';
-            case KEY_SEMICOLON: return ':';
-            case KEY_APOSTROPHE: return '\"';
-            case KEY_GRAVE: return '~';
-            case KEY_BACKSLASH: return '|';
-            case KEY_Z: return 'Z';
-            case KEY_X: return 'X';
-            case KEY_C: return 'C';
-            case KEY_V: return 'V';
-            case KEY_B: return 'B';
-            case KEY_N: return 'N';
-            case KEY_M: return 'M';
-            case KEY_COMMA: return '<';
-            case KEY_DOT: return '>';
-            case KEY_SLASH: return '\?';
-            case KEY_SPACE: return ' ';
-            default: return 0;
-        }
-    } else {
-        switch (code) {
-            case KEY_1: return '1';
-            case KEY_2: return '2';
-            case KEY_3: return '3';
-            case KEY_4: return '4';
-            case KEY_5: return '5';
-            case KEY_6: return '6';
-            case KEY_7: return '7';
-            case KEY_8: return '8';
-            case KEY_9: return '9';
-            case KEY_0: return '0';
-            case KEY_MINUS: return '-';
-            case KEY_EQUAL: return '=';
-            case KEY_Q: return 'q';
-            case KEY_W: return 'w';
-            case KEY_E: return 'e';
-            case KEY_R: return 'r';
-            case KEY_T: return 't';
-            case KEY_Y: return 'y';
-            case KEY_U: return 'u';
-            case KEY_I: return 'i';
-            case KEY_O: return 'o';
-            case KEY_P: return 'p';
-            case KEY_LEFTBRACE: return '[';
-            case KEY_RIGHTBRACE: return ']';
-            case KEY_A: return 'a';
-            case KEY_S: return 's';
-            case KEY_D: return 'd';
-            case KEY_F: return 'f';
-            case KEY_G: return 'g';
-            case KEY_H: return 'h';
-            case KEY_J: return 'j';
-            case KEY_K: return 'k';
-            case KEY_L: return 'l';
-            case KEY_SEMICOLON: return ';';
-            case KEY_APOSTROPHE: return '\'';
-            case KEY_GRAVE: return '`';
-            case KEY_BACKSLASH: return '\\';
-            case KEY_Z: return 'z';
-            case KEY_X: return 'x';
-            case KEY_C: return 'c';
-            case KEY_V: return 'v';
-            case KEY_B: return 'b';
-            case KEY_N: return 'n';
-            case KEY_M: return 'm';
-            case KEY_COMMA: return ',';
-            case KEY_DOT: return '.';
-            case KEY_SLASH: return '/';
-            case KEY_SPACE: return ' ';
-            default: return 0;
-        }
+speed_t baud_speed(int baud) {
+    switch (baud) {
+        case 9600: return B9600;
+        case 19200: return B19200;
+        case 38400: return B38400;
+        case 57600: return B57600;
+        case 115200: return B115200;
+        case 230400: return B230400;
+        case 460800: return B460800;
+        case 921600: return B921600;
+        default: return B0;
     }
 }
 
+/*
+ * Put a serial scanner in raw mode. Reads are only made once poll reports
+ * input, and VMIN 1 with VTIME 0 returns whatever has arrived at once
+ * rather than waiting for a full buffer or an inter-byte timer.
+ *
+ * Params:
+ *  fd      Scanner tty
+ *  baud    Baud rate
+ *
+ * Returns:
+ *  0 on success, -1 on error
+ */
+int setup_tty(int fd, int baud) {
+    struct termios tio;
+
+    if (tcgetattr(fd, &tio))
+        return -1;
+    cfmakeraw(&tio);
+    tio.c_cflag |= CLOCAL | CREAD;
+    tio.c_cc[VMIN] = 1;
+    tio.c_cc[VTIME] = 0;
+    if (cfsetispeed(&tio, baud_speed(baud)) || cfsetospeed(&tio, baud_speed(baud)) ||
+            tcsetattr(fd, TCSANOW, &tio))
+        return -1;
+    tcflush(fd, TCIFLUSH); // drop anything sent before the scan started
+    return 0;
+}
+
+/*
+ * Wait for scanner events until a deadline.
+ *
+ * Params:
+ *  pfd         Scanner poll descriptor
+ *  deadline    Deadline on evclock (us)
+ *
+ * Returns:
+ *  Number of ready descriptors, 0 if the deadline passed, -1 on error
+ */
+int wait_events(struct pollfd *pfd, long long deadline) {
+    struct timespec ts;
+    long long now = now_us();
+
+    if (deadline <= now)
+        return 0;
+    ts.tv_sec = (deadline - now) / 1000000;
+    ts.tv_nsec = (deadline - now) % 1000000 * 1000;
+    return ppoll(pfd, 1, &ts, NULL);
+}
+
 /*
  * Scan barcode.
  *
  * Params:
  *  tries   Number of tries (each try = 1 second) to attempt scan
+ *  maxlen  Maximum code length
+ *  gap_ms  Inter-key gap that ends a code, 0 to end codes at ENTER only
+ *  baud    Baud rate of a serial scanner
  *
  * Returns:
- *  0 on success, -1 on error
+ *  0 on success, 2 if the code was truncated, -1 on error
  */
-int scan(const int tries) { 
-    char code[MAXCODE];
-    int scanfd = open(device, O_RDONLY); 
-    int err = 0, readstatus = 0, codecounter = 0, trycount = 0, shift = 0;
-    FILE *scanst = fdopen(scanfd, "r");
-    struct input_event keyevent;
+int scan(const int tries, const int maxlen, const int gap_ms, const int baud) { 
+    struct decoder dec;
+    int scanfd = open(device, O_RDONLY | O_NONBLOCK | O_NOCTTY); 
+    int err = 0, readstatus = 0, trycount = 0, done = -1, timedout = 0;
+    int clock = CLOCK_MONOTONIC;
+    long long scan_end, deadline;
+    struct input_event events[MAXEVENTS];
+    char bytes[MAXBYTES];
     struct pollfd mypoll = { scanfd, POLLIN|POLLPRI };
 
-    ioctl(scanfd, EVIOCGRAB, (void *) 1); // get exclusive access to scanner
+    if (scanfd < 0) {
+        fprintf(stderr, "Cannot open %s: %s\n", device, strerror(errno));
+        return -1;
+    }
+    if ((tty = isatty(scanfd))) {
+        if (setup_tty(scanfd, baud)) {
+            fprintf(stderr, "Cannot set up %s: %s\n", device, strerror(errno));
+            return -1;
+        }
+        evclock = CLOCK_MONOTONIC;
+    } else {
+        ioctl(scanfd, EVIOCGRAB, (void *) 1); // get exclusive access to scanner
+        // Timestamp events on the monotonic clock, so gaps survive clock steps
+        if (!ioctl(scanfd, EVIOCSCLOCKID, &clock))
+            evclock = CLOCK_MONOTONIC;
+    }
     wiringPiSetupGpio(); // BCM pin numbering
     pinMode(SCANPIN, OUTPUT);
+    decoder_init(&dec, maxlen, gap_ms * 1000L);
+    // Never wait for the rest of a code past the time allowed for the scan
+    scan_end = now_us() + tries * 1000000LL;
     // Loop until code read or error occurs
     while (trycount < tries && !err) {
+        hb_beat(hb);
         // Turn on scanner
         digitalWrite(SCANPIN, HIGH);
         // Wait for scan for 800mss before restarting scanner
         if(err = poll(&mypoll, 1, 800)) {
-            while ((readstatus = read(scanfd, &keyevent, sizeof(keyevent))) >= 0) {
-                #ifdef DEBUG
-                printf("Read returned: %d; ", readstatus);
-                printf("Event type: %u; ", keyevent.type);
-                printf("Event code: %u; ", keyevent.code);
-                printf("Event value: %u\n", keyevent.value);
-                #endif
-
-                if (keyevent.type == EV_KEY) { // Keyboard event
-                    // Shift key up
-                    if (keyevent.value == 0 &&
-                            (keyevent.code == KEY_LEFTSHIFT ||
-                             keyevent.code == KEY_RIGHTSHIFT)) {
-                        shift = 0;
-                    // Key press
-                    } else if (keyevent.value == 1) {
-                        // Scan complete or buffer filled, stop scanning
-                        if (codecounter == MAXCODE - 1 || keyevent.code == KEY_ENTER) {
-                            code[codecounter] = '\0';
-                            break;
-                        }
-                        // Shift key down
-                        if (keyevent.code == KEY_LEFTSHIFT || 
-                                keyevent.code == KEY_RIGHTSHIFT) {
-                            shift = 1;
-                        // Convert a recognized keycode to ascii char
-                        } else if (keymap(keyevent.code, shift) != 0) {
-                            code[codecounter] = keymap(keyevent.code, shift);
-                            codecounter++;
-                        }
+            // Read all pending events at once and decode them as a batch,
+            // until ENTER or the gap after the last key ends the code
+            while (done < 0) {
+                if (tty) {
+                    readstatus = read(scanfd, bytes, sizeof(bytes));
+                    if (readstatus > 0) {
+                        long long t = now_us();
+                        hb_beat(hb);
+                        send_raw(REC_BYTES, bytes, readstatus, t);
+                        done = decode_bytes(&dec, bytes, readstatus, t);
+                        continue;
                     }
+                } else if ((readstatus = read(scanfd, events, sizeof(events))) > 0) {
+                    hb_beat(hb);
+                    #ifdef DEBUG
+                    int i;
+                    for (i = 0; i < readstatus / (int) sizeof(events[0]); i++) {
+                        printf("Event type: %u; ", events[i].type);
+                        printf("Event code: %u; ", events[i].code);
+                        printf("Event value: %u\n", events[i].value);
+                    }
+                    #endif
+                    send_raw(REC_KEYS, events, readstatus, 0);
+                    done = decode_events(&dec, events, readstatus / sizeof(events[0]));
+                    continue;
+                }
+                if (readstatus == 0 || errno != EAGAIN)
+                    break;
+                deadline = decoder_deadline(&dec);
+                if (deadline < 0 || deadline > scan_end)
+                    deadline = scan_end;
+                readstatus = wait_events(&mypoll, deadline);
+                if (readstatus == 0 && deadline == scan_end) {
+                    timedout = 1;
+                    break;
+                } else if (readstatus == 0) {
+                    send_raw(REC_GAPEND, NULL, 0, 0);
+                    decoder_finish(&dec);
+                    done = 0;
+                } else if (readstatus < 0 && errno != EINTR) {
+                    break;
                 }
             }
-            if (readstatus < sizeof(keyevent)) {
+            if (timedout) {
+                // Scan timed out with no code, or only part of one
+                digitalWrite(SCANPIN, LOW);
+                break;
+            }
+            if (done < 0) {
                 fprintf(stderr, "Error occurred scanning: %s", strerror(errno));
                 digitalWrite(SCANPIN, LOW);
                 return -1;
             }
-            printf("%s\n", code);
+            printf("%s\n", dec.code);
+            fflush(stdout); // deliver now, not after the scanner reset below
+            if (dec.truncated) {
+                fprintf(stderr, "Code truncated to %d characters\n", maxlen);
+                err = 2;
+            }
         } else if (err < 0) {
             fprintf(stderr, "Error occurred polling: %s", strerror(errno));
             digitalWrite(SCANPIN, LOW);
@@ -239,16 +307,53 @@ int scan(const int tries) {
         usleep(200000);
         trycount ++;
     }
-    return 0;
+    decoder_free(&dec);
+    return err == 2 ? 2 : 0;
 }
 
 int main(int argc, char *argv[]) {
-    switch (argc) {
-        case 1:
-            return scan(INT_MAX);
-        case 2:
-            return scan(atoi(argv[1]));
-        default:
-            return scan(INT_MAX);
+    int ret, opt, maxlen = CODE_LIMIT, gap_ms = GAP_MS, baud = 115200;
+    while ((opt = getopt(argc, argv, "m:g:d:b:r:")) != -1) {
+        switch (opt) {
+            case 'm':
+                maxlen = atoi(optarg);
+                if (maxlen < 1) {
+                    fprintf(stderr, "Invalid maximum length %s\n", optarg);
+                    return 1;
+                }
+                break;
+            case 'g':
+                gap_ms = atoi(optarg);
+                if (gap_ms < 0) {
+                    fprintf(stderr, "Invalid gap %s\n", optarg);
+                    return 1;
+                }
+                break;
+            case 'd':
+                device = optarg;
+                break;
+            case 'b':
+                baud = atoi(optarg);
+                if (baud_speed(baud) == B0) {
+                    fprintf(stderr, "Unsupported baud rate %s\n", optarg);
+                    return 1;
+                }
+                break;
+            case 'r':
+                recfd = atoi(optarg);
+                signal(SIGPIPE, SIG_IGN); // a write error just ends the raw copy
+                break;
+            default:
+                fprintf(stderr, "Usage: scan [-m max length] [-g gap in ms] "
+                        "[-d device] [-b baud] [-r fd] [timeout]\n");
+                return 1;
+        }
     }
+    hb = hb_register("scan", HB_TIMEOUT);
+    if (optind < argc)
+        ret = scan(atoi(argv[optind]), maxlen, gap_ms, baud);
+    else
+        ret = scan(INT_MAX, maxlen, gap_ms, baud);
+    hb_release(hb);
+    return ret;
 }
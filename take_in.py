@@ -102,7 +102,11 @@ def slow_motor(pwm):
     # call(["./scan", "3"])
     # scan = Popen(["./scan", "3"], stdout=PIPE)
     # output, err = p.communicate()
-    barcode = subprocess.check_output(["./scan", "5"])
+    try:
+        barcode = subprocess.check_output(["./scan", "5"])
+    except subprocess.CalledProcessError:
+        # Scan error, or code longer than scan allows (exit status 2)
+        barcode = None
 
     if barcode:
         logging.info('Barcode read. Drawbridge down.')